@@ -49,7 +49,8 @@ extern "C" {
 //@{
 /**
  * Allocate memory from inside a transaction.  Allocated memory is
- * implicitly freed upon abort.
+ * implicitly freed upon abort.  With NV_SLAB, small blocks come from
+ * the slabs of the thread and do not carry type_num.
  *
  * @param size
  *   Number of bytes to allocate.
@@ -60,6 +61,24 @@ void *stm_malloc(size_t size, uint64_t type_num, PMEMobjpool *pool);
 void *stm_malloc_tx(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *pool);
 //@}
 
+//@{
+/**
+ * Allocate memory from inside a transaction, in the same page as
+ * another block if possible (see stm_slab_alloc_near()).  Only small
+ * blocks can be placed: large blocks are allocated as with
+ * stm_malloc().
+ *
+ * @param size
+ *   Number of bytes to allocate.
+ * @param hint
+ *   Offset of a block accessed together with the new one (0 for none).
+ * @return
+ *   Pointer to the allocated memory block.
+ */
+void *stm_malloc_near(size_t size, uint64_t type_num, PMEMobjpool *pool, nv_ptr hint);
+void *stm_malloc_near_tx(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *pool, nv_ptr hint);
+//@}
+
 //@{
 /**
  * Allocate initialized memory from inside a transaction.  Allocated
@@ -119,7 +138,11 @@ void stm_free2_tx(struct stm_tx *tx, void *addr, size_t idx, size_t size);
  *
  * @param gc
  *   True (non-zero) to enable epoch-based garbage collector when
- *   freeing memory in transactions.
+ *   freeing memory in transactions (EPOCH_GC only).  Persistent frees
+ *   are then published in batches after the commit, once no transaction
+ *   can still read the blocks; a crash in between leaks the blocks.
+ *   Blocks of the slabs are freed at that point by the next transaction
+ *   of the thread that allocates or frees memory.
  */
 void mod_mem_init(int gc);
 
@@ -0,0 +1,60 @@
+/*
+ * File:
+ *   mod_tune.h
+ * Description:
+ *   Module for tuning the lock array at runtime.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This program has a dual license and can also be distributed
+ * under the terms of the MIT license.
+ */
+
+/**
+ * @file
+ *   Module for tuning the lock array at runtime.  This module
+ *   periodically samples the throughput and the aborts of all threads
+ *   and hill-climbs over the lock granularity ("lock_shift_extra") and
+ *   the number of locks in use ("lock_array_log_size"), as proposed in
+ *   [PPoPP-08].  A move that lowers the throughput is undone and the
+ *   search continues in the other direction, then along the other
+ *   parameter.  Each change blocks all threads outside of transactions
+ *   for a short time.  The STM library must be compiled with
+ *   LOCK_TUNING.
+ * @date
+ *   2026
+ */
+
+#ifndef _MOD_TUNE_H_
+# define _MOD_TUNE_H_
+
+# include "stm.h"
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Initialize the module.  This function must be called once, from the
+ * main thread, after initializing the STM library and before
+ * performing any transactional operation.
+ *
+ * @param period
+ *   Time between two tuning steps in milliseconds (0 for the default
+ *   of 100 ms).
+ */
+void mod_tune_init(unsigned long period);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif /* _MOD_TUNE_H_ */
@@ -129,6 +129,12 @@ struct stm_tx *stm_current_tx(void) _CALLCONV;
 typedef uintptr_t stm_word_t;
 typedef uint64_t nv_ptr;
 
+/**
+ * Persistent pool opened by the library, with its own log, page table
+ * and slabs.
+ */
+typedef struct stm_pool stm_pool_t;
+
 /**
  * Transaction attributes specified by the application.
  */
@@ -171,6 +177,16 @@ typedef union stm_tx_attr {
    * mechanism. (Working only with UNIT_TX)
    */
   unsigned int no_extend : 1;
+  /**
+   * Indicates that the transaction reads a consistent snapshot of the
+   * durable NVM image taken at the last reproduced commit, without
+   * locks, shadow pages or read set.  Pages touched by more recent
+   * commits cause a restart on a fresher snapshot; after a few such
+   * restarts, the flag is cleared and the transaction runs as a
+   * regular read-only one.  A write aborts it and restarts it in
+   * read-write mode.  (Working only with WRITE_THROUGH)
+   */
+  unsigned int snapshot : 1;
   /**
    * Indicates that the transaction is irrevocable.
    * 1 is simple irrevocable and 3 is serial irrevocable.
@@ -244,6 +260,10 @@ enum {
    * Abort upon commit due to failed validation.
    */
   STM_ABORT_VALIDATE = (1 << 6) | (0x07 << 8),
+  /**
+   * Abort upon writing in a snapshot transaction.
+   */
+  STM_ABORT_RO_WRITE = (1 << 6) | (0x08 << 8),
   /**
    * Abort upon deferring to an irrevocable transaction.
    */
@@ -271,12 +291,88 @@ enum {
  * ################################################################### */
 
 // persist func
+/**
+ * Address of a persistent pointer.  An nv_ptr holds the id of its pool
+ * in its upper bits and the offset of the word in that pool below: the
+ * offsets of the first pool (id 0) are nv_ptr as they are.
+ */
 void *nv_to_ptr(nv_ptr nv_addr) _CALLCONV;
 
+/**
+ * Persistent pointer of an address in an open pool, 0 for NULL.
+ */
 nv_ptr ptr_to_nv(void *ptr) _CALLCONV;
 
+/**
+ * Create or open a pool.  Each pool has its own log ring, reproducer,
+ * page table and DRAM page cache (2^DRAM_LENGTH bytes per pool), and
+ * its own emulated device with NV_EMULATE, so the bandwidth of the log
+ * adds up over the pools.  A transaction may write several pools: its
+ * record is written in the log of each of them and it is durable once
+ * the pool of highest id has published it.  The id of a pool is given
+ * when the pool is created, the lowest one not open then, and kept in
+ * the pool; it is part of the nv_ptr of the pool, which may be stored in
+ * the other pools.  The pools of an application must therefore be
+ * created by the same process.  If the last record of the pool is part
+ * of a transaction whose decisive pool is not open, the pool waits for
+ * that pool to be opened: it cannot be mapped before.  Pools opened
+ * after page_map_init() are mapped at once.
+ *
+ * @param path
+ *   Path of the pool file, created if it does not exist.
+ * @return
+ *   The pool, or NULL if it cannot be created or opened (errno is then
+ *   EEXIST if a pool of the same id is open, EMFILE if NV_POOL_MAX pools
+ *   are open).
+ */
+stm_pool_t *stm_pool_open(const char *path) _CALLCONV;
+
+/**
+ * Reproduce the log of a pool, save its set of mapped pages and close
+ * it.  No transaction may use the pool meanwhile.  stm_exit() closes
+ * the pools left open.
+ *
+ * @param pool
+ *   Pool returned by stm_pool_open().
+ * @return
+ *   0, or -1 if the reconciler or a checkpoint runs (errno is then
+ *   EBUSY).
+ */
+int stm_pool_close(stm_pool_t *pool) _CALLCONV;
+
+/**
+ * Pool of libpmemobj of an open pool, for its allocations.
+ */
+PMEMobjpool *stm_pool_pmem(stm_pool_t *pool) _CALLCONV;
+
+/**
+ * Open pool of a pool of libpmemobj, NULL if the library did not open
+ * it.
+ */
+stm_pool_t *stm_pool_by_pmem(PMEMobjpool *pop) _CALLCONV;
+
+/**
+ * Create or open a pool as with stm_pool_open(), for applications using
+ * a single pool.
+ *
+ * @param pool_path
+ *   Path of the pool file, created if it does not exist.
+ * @return
+ *   The pool of libpmemobj, or NULL if it cannot be created or opened.
+ */
 PMEMobjpool *pool_init(char *pool_path) _CALLCONV;
 
+/**
+ * Map the pages of the open pools to DRAM before any transaction runs.
+ * If a pool was used before, only the pages mapped then are mapped, most
+ * recently written first.  Otherwise all pages are mapped when DRAM
+ * holds the whole pool, none when it is smaller (make DRAM=<n>).  Other
+ * pages are mapped when first used.  The pages are copied from several
+ * threads.  The set of mapped pages is saved in the pool when it is
+ * closed, and every $NV_HOT_PERIOD ms if set.  Call it once, after
+ * opening the pools.  The process exits if a pool still waits for
+ * another one.
+ */
 void page_map_init() _CALLCONV;
 
 /**
@@ -409,6 +505,280 @@ void stm_store2(volatile stm_word_t *addr, stm_word_t value, stm_word_t mask) _C
 void stm_store2_tx(struct stm_tx *tx, volatile stm_word_t *addr, stm_word_t value, stm_word_t mask) _CALLCONV;
 //@}
 
+//@{
+/**
+ * Transactional load of a range of words.  Read the specified number
+ * of bytes from a word-aligned memory location in the context of the
+ * current transaction.  The range is copied page by page instead of
+ * word by word when no other transaction is writing it.  Upon
+ * conflict, the transaction may abort while reading the memory.
+ *
+ * @param addr
+ *   Address of the memory location (word-aligned).
+ * @param buf
+ *   Buffer for storing the read bytes.
+ * @param size
+ *   Number of bytes to read (multiple of the word size).
+ */
+void stm_load_range(volatile stm_word_t *addr, void *buf, size_t size) _CALLCONV;
+void stm_load_range_tx(struct stm_tx *tx, volatile stm_word_t *addr, void *buf, size_t size) _CALLCONV;
+//@}
+
+//@{
+/**
+ * Transactional store of a range of words.  Write the specified number
+ * of bytes to a word-aligned memory location in the context of the
+ * current transaction.  The range is copied page by page, each lock
+ * being acquired once, and consecutive words are written as a single
+ * range record in the persistent log.  Upon conflict, the transaction
+ * may abort while writing to the memory.
+ *
+ * @param addr
+ *   Address of the memory location (word-aligned).
+ * @param buf
+ *   Buffer with the bytes to write.
+ * @param size
+ *   Number of bytes to write (multiple of the word size).
+ */
+void stm_store_range(volatile stm_word_t *addr, const void *buf, size_t size) _CALLCONV;
+void stm_store_range_tx(struct stm_tx *tx, volatile stm_word_t *addr, const void *buf, size_t size) _CALLCONV;
+//@}
+
+//@{
+/**
+ * Declare a memory block allocated by the current transaction and not
+ * reachable by other transactions before it commits.  Stores to the
+ * block bypass locks and the redo log: they are written directly to
+ * the durable image and persisted once before the commit record.  The
+ * declaration only lasts for the current execution of the transaction.
+ * (Working only with WRITE_THROUGH)
+ *
+ * @param addr
+ *   Address of the memory block.
+ * @param size
+ *   Size of the memory block in bytes.
+ */
+void stm_alloc_range(nv_ptr addr, size_t size) _CALLCONV;
+void stm_alloc_range_tx(struct stm_tx *tx, nv_ptr addr, size_t size) _CALLCONV;
+//@}
+
+//@{
+/**
+ * Allocate a small block from the per-thread slabs of the persistent
+ * heap.  The allocation bit is set by a transactional store, hence the
+ * block is allocated if and only if the current transaction commits.
+ * Slabs are carved from the pool by libpmemobj, which is not called
+ * on the fast path.  The block is taken from the first pool opened.
+ * (Working only with NV_SLAB)
+ *
+ * @param size
+ *   Size of the block in bytes.
+ * @return
+ *   Offset of the block in the pool, or 0 if the block is too large
+ *   for the slabs or no slab can be allocated.
+ */
+nv_ptr stm_slab_alloc(size_t size) _CALLCONV;
+nv_ptr stm_slab_alloc_tx(struct stm_tx *tx, size_t size) _CALLCONV;
+//@}
+
+//@{
+/**
+ * Allocate a small block from the slabs of a given pool, as with
+ * stm_slab_alloc().  (Working only with NV_SLAB)
+ *
+ * @param pool
+ *   Pool returned by stm_pool_open().
+ * @param size
+ *   Size of the block in bytes.
+ * @return
+ *   Pointer of the block, tagged with the pool, or 0 if the block is
+ *   too large for the slabs or no slab can be allocated.
+ */
+nv_ptr stm_slab_alloc_pool(stm_pool_t *pool, size_t size) _CALLCONV;
+nv_ptr stm_slab_alloc_pool_tx(struct stm_tx *tx, stm_pool_t *pool, size_t size) _CALLCONV;
+//@}
+
+//@{
+/**
+ * Allocate a small block from the slabs, in the same page as another
+ * block if possible.  Objects accessed together (e.g., list neighbours
+ * or parent and child in a tree) then share pages of the persistent
+ * heap and of the DRAM page cache.  The block is taken from the slab
+ * of hint if it has the size class of the block, even if another
+ * thread owns that slab; otherwise, or if the page is full, it is
+ * allocated as with stm_slab_alloc_pool() from the pool of hint.
+ * (Working only with NV_SLAB)
+ *
+ * @param size
+ *   Size of the block in bytes.
+ * @param hint
+ *   Offset of a block allocated from the slabs (0 for none).
+ * @return
+ *   Offset of the block in the pool, or 0 if the block is too large
+ *   for the slabs or no slab can be allocated.
+ */
+nv_ptr stm_slab_alloc_near(size_t size, nv_ptr hint) _CALLCONV;
+nv_ptr stm_slab_alloc_near_tx(struct stm_tx *tx, size_t size, nv_ptr hint) _CALLCONV;
+//@}
+
+//@{
+/**
+ * Free a block in the current transaction if it was allocated from the
+ * slabs.  The block is released if and only if the transaction commits.
+ *
+ * @param addr
+ *   Offset of the block in the pool.
+ * @return
+ *   1 if the block comes from a slab and is freed, 0 otherwise.
+ */
+int stm_slab_free(nv_ptr addr) _CALLCONV;
+int stm_slab_free_tx(struct stm_tx *tx, nv_ptr addr) _CALLCONV;
+//@}
+
+/**
+ * Check whether a block was allocated from the slabs, e.g., to defer
+ * stm_slab_free() to a later transaction.  (Working only with NV_SLAB)
+ *
+ * @param addr
+ *   Offset of the block in the pool.
+ * @return
+ *   1 if the block comes from a slab, 0 otherwise.
+ */
+int stm_slab_block(nv_ptr addr) _CALLCONV;
+
+//@{
+/**
+ * Declare a memory block freed by the current transaction.  The
+ * declaration only matters while the reconciler runs: a block freed by
+ * a transaction, even one that aborts later, is never reclaimed by the
+ * reconciler.  Memory modules must call it for every block they free.
+ *
+ * @param addr
+ *   Address of the memory block.
+ */
+void stm_free_range(nv_ptr addr) _CALLCONV;
+void stm_free_range_tx(struct stm_tx *tx, nv_ptr addr) _CALLCONV;
+//@}
+
+/**
+ * Register the persistent pointers of an object type for the
+ * reconciler.  Objects of registered types are the only ones the
+ * reconciler may free; objects of other types are scanned word by
+ * word.  This function must be called before stm_reclaim_start().
+ *
+ * @param type_num
+ *   Type number given to libpmemobj when allocating the objects.
+ * @param offsets
+ *   Offsets of the pointer (nv_ptr) fields in the objects.
+ * @param nb
+ *   Number of pointer fields.
+ * @return
+ *   1 on success, 0 if too many types are registered.
+ */
+int stm_reclaim_type(uint64_t type_num, const size_t *offsets, unsigned int nb) _CALLCONV;
+
+/**
+ * Start the reconciler, which frees the objects of registered types
+ * that are not reachable from the root anymore, e.g., objects leaked by
+ * a crash between their allocation and their linking.  The objects of
+ * the pool are listed by the caller, then a background thread marks the
+ * reachable objects with short read-only transactions and frees the
+ * others in batches.  Only the last rescan of the objects written
+ * during the marking runs alone.  Pointers must hold the offset of the
+ * start of an object.  This function must be called once after
+ * recovery and before any other transaction; afterwards, objects must
+ * only be allocated and freed by transactions (stm_malloc() and
+ * stm_free()) until the reconciler completes.  stm_exit() stops the
+ * reconciler if it still runs.
+ *
+ * @param batch
+ *   Objects read by one transaction and objects freed at once (0 for
+ *   the default of 64).
+ * @param pause
+ *   Pause between two transactions in microseconds (0 for the default
+ *   of 100).
+ * @return
+ *   1 if the reconciler started, 0 if no type is registered or the
+ *   last pass is still running.
+ */
+int stm_reclaim_start(unsigned int batch, unsigned int pause) _CALLCONV;
+
+/**
+ * Write a consistent image of the pool to a file while the other
+ * threads keep running transactions.  The image is the pool as of the
+ * last transaction reproduced at the fence: transactions wait while
+ * the log is reproduced, then run while the pages are copied, a page
+ * being copied first if its home is written meanwhile.  Once written,
+ * the image is opened as a pool by pool_init(), in another process or
+ * after stm_exit().  Blocks allocated by libpmemobj during the copy
+ * may be allocated in the image without being reachable
+ * (stm_reclaim_start() frees them); blocks freed during the copy are
+ * only freed afterwards.  This function must be called outside of a
+ * transaction, by a thread initialized with stm_init_thread(), one
+ * checkpoint at a time.
+ *
+ * @param path
+ *   Image file, created if it does not exist.  The image is written
+ *   to path with ".tmp" appended and renamed to path once synced: a
+ *   crash or an error during the copy leaves the last image intact.
+ * @param since
+ *   Timestamp of the last image written by the process to the same
+ *   file: the last image is copied, then only the pages changed since
+ *   are written over it.  Any other value
+ *   (e.g., 0) copies all pages, as does a change of the allocation
+ *   metadata of libpmemobj since the last image.
+ * @param rate
+ *   Maximum copy bandwidth in MB/s (0 for no limit).  Pages copied
+ *   because their home is written are not limited.
+ * @param timestamp
+ *   Set to the timestamp of the image, the since of the next one.
+ * @return
+ *   Number of pages copied, or -1 on error (errno is set, EBUSY if
+ *   another checkpoint runs).
+ */
+int stm_checkpoint(const char *path, uint64_t since, unsigned int rate, uint64_t *timestamp) _CALLCONV;
+
+/**
+ * Write a consistent image of a given pool, as with stm_checkpoint()
+ * for the first pool opened.  The image keeps the id of the pool, so
+ * it cannot be opened while the pool is.  The images of several pools
+ * are taken at different timestamps: a transaction that wrote to two
+ * pools may be in one image and not in the other.
+ *
+ * @param pool
+ *   Pool returned by stm_pool_open().
+ * @return
+ *   As stm_checkpoint().
+ */
+int stm_checkpoint_pool(stm_pool_t *pool, const char *path, uint64_t since, unsigned int rate, uint64_t *timestamp) _CALLCONV;
+
+/**
+ * Check if a checkpoint is being written.
+ *
+ * @return
+ *   True (non-zero) while stm_checkpoint() copies pages.
+ */
+int stm_checkpoint_active(void) _CALLCONV;
+
+/**
+ * Publish actions of libpmemobj (pmemobj_publish()) of which the last
+ * ones are deferred frees.  Memory modules publish the deferred frees
+ * of committed transactions with this function: while a checkpoint is
+ * being written they are held and published once the image is written,
+ * the other actions being published at once.  Otherwise all actions
+ * are published together.
+ *
+ * @param pool
+ *   Pool of the actions.
+ * @param acts
+ *   Actions, the deferred frees last.
+ * @param nb
+ *   Number of actions.
+ * @param nb_free
+ *   Number of deferred frees at the end of the actions.
+ */
+void stm_checkpoint_publish(PMEMobjpool *pool, struct pobj_action *acts, size_t nb, size_t nb_free) _CALLCONV;
+
 //@{
 /**
  * Check if the current transaction is still active.
@@ -488,7 +858,18 @@ stm_tx_attr_t stm_get_attributes_tx(struct stm_tx *tx) _CALLCONV;
 //@{
 /**
  * Get various statistics about the current thread/transaction.  See the
- * source code (stm.c) for a list of supported statistics.
+ * source code (stm.c) for a list of supported statistics.  With
+ * NV_STATISTICS, the persistence layer is described by 64-bit
+ * (uint64_t) statistics: per thread, "nv_log_commits", "nv_log_bytes",
+ * "nv_log_stalls", "page_hits", "page_misses", "page_evictions" and
+ * "page_stalls"; for the whole library, "nv_log_flushes",
+ * "nv_log_drains", "nv_log_reproduced", "nv_log_entries" (occupancy of
+ * the log rings), "nv_log_capacity", "nv_log_lag" (persist_timestamp -
+ * reproduce_timestamp) and "page_capacity", summed over the open pools.
+ * The per-thread statistics prefixed with "total_" (e.g.
+ * "total_nv_log_commits") are summed over all threads, including those
+ * that exited.  Statistics of the whole library can also be read by a
+ * thread that is not registered to the library, e.g. to monitor it.
  *
  * @param name
  *   Name of the statistics.
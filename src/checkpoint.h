@@ -0,0 +1,306 @@
+# ifndef _CHECKPOINT_H_
+# define _CHECKPOINT_H_
+
+# include "stm_internal.h"
+# include <errno.h>
+# include <fcntl.h>
+# include <sys/stat.h>
+# include <unistd.h>
+
+# define CHECKPOINT_CHUNK   64              // pages copied between two checks of the bandwidth
+# define CHECKPOINT_PAGES   (POOL_SIZE >> PAGE_LENGTH)
+# define CHECKPOINT_WORDS   ((CHECKPOINT_PAGES + 63) / 64)
+
+// The image is the pool as of the reproduce_timestamp of the fence. At the fence no tx runs and
+// the log is reproduced: home holds all committed txs. Afterwards a page is copied before its home
+// is written again, by the reproducer or by the allocation of a block freed after the fence. One
+// pool is copied at a time, writes to the other pools go on
+typedef struct checkpoint_held {            // deferred free published once the image is written
+    PMEMobjpool *pool;
+    struct pobj_action act;
+} checkpoint_held_t;
+
+static struct {
+    pthread_mutex_t lock;                   // one page copy at a time, held frees
+    pthread_rwlock_t publish;               // frees being published, taken to start or end a checkpoint
+    int running;
+    stm_pool_t *pool;                       // pool being copied, valid while _tinystm.addition.checkpoint is set
+    uint64_t id;                            // its id
+    int fd;                                 // image being written
+    int error;
+    uint64_t *pending;                      // pages still to copy, one bit per page
+    uint64_t copied;                        // pages written to the image
+    uint64_t timestamp[NV_POOL_MAX];        // reproduce_timestamp of the last image of each pool
+    uint64_t nb[NV_POOL_MAX];               // images of each pool written by the process
+    volatile int heap[NV_POOL_MAX];         // libpmemobj of the pool allocated or freed since the last fence
+    checkpoint_held_t *held;
+    uint64_t held_nb, held_size;
+} checkpoint = { .lock = PTHREAD_MUTEX_INITIALIZER, .publish = PTHREAD_RWLOCK_INITIALIZER };
+
+
+static inline int checkpoint_pending(uint64_t VPN) {
+    return (ATOMIC_LOAD(&checkpoint.pending[VPN >> 6]) & ((uint64_t)1 << (VPN & 63))) != 0;
+}
+
+// copy the page to the image if it is still pending, lock held
+static void checkpoint_page(uint64_t VPN) {
+    void *page = (void *)((VPN << PAGE_LENGTH) + checkpoint.pool->base);
+
+    if (!checkpoint_pending(VPN)) return;
+    nv_read(page, PAGE_SIZE);
+    if (pwrite(checkpoint.fd, page, PAGE_SIZE, VPN << PAGE_LENGTH) != PAGE_SIZE) checkpoint.error = errno;
+    ATOMIC_STORE(&checkpoint.pending[VPN >> 6], checkpoint.pending[VPN >> 6] & ~((uint64_t)1 << (VPN & 63)));
+    checkpoint.copied ++;
+}
+
+// called before home of [nv_addr, nv_addr + size) is written while a checkpoint runs
+void checkpoint_save(nv_ptr nv_addr, uint64_t size) {
+    if (NV_POOL_ID(nv_addr) != ATOMIC_LOAD(&checkpoint.id)) return;
+    nv_addr = NV_OFF(nv_addr);
+    for (uint64_t VPN = nv_addr >> PAGE_LENGTH; VPN <= (nv_addr + size - 1) >> PAGE_LENGTH; VPN++) {
+        if (!checkpoint_pending(VPN)) continue;
+        pthread_mutex_lock(&checkpoint.lock);
+        if (_tinystm.addition.checkpoint) checkpoint_page(VPN);
+        pthread_mutex_unlock(&checkpoint.lock);
+    }
+}
+
+// the metadata of libpmemobj is not followed by touch id: the next image of the pool is a full copy
+void checkpoint_heap(uint64_t id) {
+    if (!checkpoint.heap[id]) checkpoint.heap[id] = 1;
+}
+
+// a block is allocated or freed, libpmemobj metadata changes unless it comes from a slab
+static inline void checkpoint_block(nv_ptr nv_addr) {
+# ifdef NV_SLAB
+    if (slab_find(nv_addr) != NULL) return;
+# endif /* NV_SLAB */
+    checkpoint_heap(NV_POOL_ID(nv_addr));
+}
+
+// publish actions of libpmemobj, the nb_free last ones are deferred frees: they are published after
+// the image is written if a checkpoint of the pool runs, the image may still copy metadata where the
+// blocks are allocated. Otherwise all actions are published at once
+void checkpoint_publish(PMEMobjpool *pool, struct pobj_action *acts, uint64_t nb, uint64_t nb_free) {
+    stm_pool_t *owner;
+
+    if (nb_free == 0) {
+        if (nb != 0) pmemobj_publish(pool, acts, nb);
+        return;
+    }
+    owner = stm_pool_by_pmem(pool);
+    // a checkpoint does not start or end while the frees are published
+    pthread_rwlock_rdlock(&checkpoint.publish);
+    if (_tinystm.addition.checkpoint && owner == checkpoint.pool) {
+        pthread_mutex_lock(&checkpoint.lock);
+        if (checkpoint.held_nb + nb_free > checkpoint.held_size) {
+            checkpoint.held_size = checkpoint.held_size == 0 ? CHECKPOINT_CHUNK : 2 * checkpoint.held_size;
+            if (checkpoint.held_size < checkpoint.held_nb + nb_free) checkpoint.held_size = checkpoint.held_nb + nb_free;
+            checkpoint.held = (checkpoint_held_t *)realloc(checkpoint.held, checkpoint.held_size * sizeof(checkpoint_held_t));
+        }
+        for (uint64_t i = nb - nb_free; i < nb; i++) {
+            checkpoint.held[checkpoint.held_nb].pool = pool;
+            checkpoint.held[checkpoint.held_nb++].act = acts[i];
+        }
+        pthread_mutex_unlock(&checkpoint.lock);
+        nb -= nb_free;
+    }
+    else if (owner != NULL) checkpoint_heap(owner->id);
+    if (nb != 0) pmemobj_publish(pool, acts, nb);
+    pthread_rwlock_unlock(&checkpoint.publish);
+}
+
+// free a block of libpmemobj outside of a tx, after the image is written if a checkpoint runs
+void checkpoint_free(PMEMobjpool *pool, PMEMoid oid) {
+    struct pobj_action act;
+
+    if (pmemobj_defer_free(pool, oid, &act) == 0) checkpoint_publish(pool, &act, 1, 1);
+}
+
+// publish the frees held during the copy, consecutive frees of a pool at once
+static void checkpoint_release(checkpoint_held_t *held, uint64_t nb) {
+    struct pobj_action *acts = (struct pobj_action *)malloc(nb * sizeof(struct pobj_action));
+    uint64_t first = 0;
+
+    for (uint64_t i = 0; i < nb; i++) {
+        acts[i] = held[i].act;
+        if (i + 1 == nb || held[i + 1].pool != held[first].pool) {
+            pmemobj_publish(held[first].pool, acts + first, i + 1 - first);
+            first = i + 1;
+        }
+    }
+    free(acts);
+    checkpoint_heap(checkpoint.id);
+}
+
+// no tx runs and the log is reproduced, choose the pages to copy, return if the copy is full
+static int checkpoint_fence(stm_pool_t *pool, uint64_t since, int full) {
+    struct root *root = pool->root;
+
+    while (ATOMIC_LOAD_ACQ(&pool->nv_log->commit_timestamp) != root->reproduce_timestamp) nv_log_replay(pool);
+    // touch ids start at 0 when the pool is opened
+    full = full || checkpoint.heap[pool->id] || checkpoint.nb[pool->id] == 0 || since != checkpoint.timestamp[pool->id];
+    checkpoint.heap[pool->id] = 0;
+    for (uint64_t VPN = 0; VPN < CHECKPOINT_PAGES; VPN++) {
+        if (full || pool->page->page_table[VPN].touch_id > since) checkpoint.pending[VPN >> 6] |= (uint64_t)1 << (VPN & 63);
+    }
+    checkpoint.timestamp[pool->id] = root->reproduce_timestamp;
+    return full;
+}
+
+// sleep until rate MB/s is respected since start
+static void checkpoint_throttle(struct timespec *start, uint64_t bytes, unsigned int rate) {
+    struct timespec now, wait;
+    uint64_t elapsed, expected = bytes * 1000000000ULL / ((uint64_t)rate * 1048576);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start->tv_sec) * 1000000000 + now.tv_nsec - start->tv_nsec;
+    if (expected <= elapsed) return;
+    wait.tv_sec = (expected - elapsed) / 1000000000;
+    wait.tv_nsec = (expected - elapsed) % 1000000000;
+    nanosleep(&wait, NULL);
+}
+
+// copy the last image to the file being written, before the fence: the pages of an incremental
+// image are written over it, written counts the bytes for the bandwidth. Return 0 or -1
+static int checkpoint_copy(int from, int to, struct timespec *start, unsigned int rate, uint64_t *written) {
+    char *buf = (char *)malloc(CHECKPOINT_CHUNK * PAGE_SIZE);
+    uint64_t off;
+    ssize_t n = 0;
+
+    for (off = 0; off < POOL_SIZE; off += n) {
+        n = pread(from, buf, CHECKPOINT_CHUNK * PAGE_SIZE, off);
+        if (n <= 0 || pwrite(to, buf, n, off) != n) break;
+        *written += n;
+        if (rate != 0) checkpoint_throttle(start, *written, rate);
+    }
+    free(buf);
+    return off < POOL_SIZE ? -1 : 0;
+}
+
+// the image replaces the last one once complete: make the rename durable
+static int checkpoint_sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY), result = -1;
+
+    free(dir);
+    if (fd >= 0) {
+        result = fsync(fd);
+        close(fd);
+    }
+    return result;
+}
+
+// write the image of the pool to path, the pages changed since the last image of the pool written
+// by the process if since is its timestamp, return the pages copied or -1. The image is written to
+// path.tmp and renamed to path once synced: a crash or an error leaves the last image as it was
+int checkpoint_run(stm_tx_t *tx, stm_pool_t *pool, const char *path, uint64_t since, unsigned int rate, uint64_t *timestamp) {
+    struct root root;
+    struct timespec start;
+    struct stat st;
+    checkpoint_held_t *held;
+    uint64_t held_nb, copied, nb = 0, written = 0;
+    int full, error, last;
+    char *tmp;
+
+    if (tx == NULL || IS_ACTIVE(tx->status) || pool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&checkpoint.lock);
+    if (checkpoint.running) {
+        pthread_mutex_unlock(&checkpoint.lock);
+        errno = EBUSY;
+        return -1;
+    }
+    checkpoint.running = 1;
+    pthread_mutex_unlock(&checkpoint.lock);
+
+    tmp = (char *)malloc(strlen(path) + sizeof(".tmp"));
+    sprintf(tmp, "%s.tmp", path);
+    checkpoint.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (checkpoint.fd < 0) {
+        error = errno;
+        free(tmp);
+        checkpoint.running = 0;
+        errno = error;
+        return -1;
+    }
+    // an incremental image starts from the last one, the fence may still decide on a full copy
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    full = checkpoint.heap[pool->id] || checkpoint.nb[pool->id] == 0 || since != checkpoint.timestamp[pool->id];
+    if (!full) {
+        last = open(path, O_RDONLY);
+        full = last < 0 || fstat(last, &st) != 0 || st.st_size != POOL_SIZE || checkpoint_copy(last, checkpoint.fd, &start, rate, &written) != 0;
+        if (last >= 0) close(last);
+    }
+    // kept for the process: home writes may still look at it once the checkpoint is over
+    if (checkpoint.pending == NULL) checkpoint.pending = (uint64_t *)calloc(CHECKPOINT_WORDS, sizeof(uint64_t));
+    checkpoint.copied = 0;
+    checkpoint.error = 0;
+
+    // fence: the other txs wait, the reproducer too
+    stm_quiesce(tx, 1);
+    pthread_spin_lock(&pool->nv_log->reproduce_lock);
+    full = checkpoint_fence(pool, since, full);
+    memcpy(&root, pool->root, sizeof(root));
+    // the commit callbacks of finished txs may still publish frees
+    pthread_rwlock_wrlock(&checkpoint.publish);
+    pthread_mutex_lock(&checkpoint.lock);
+    checkpoint.pool = pool;
+    ATOMIC_STORE(&checkpoint.id, pool->id);
+    ATOMIC_STORE_REL(&_tinystm.addition.checkpoint, 1);
+    pthread_mutex_unlock(&checkpoint.lock);
+    pthread_rwlock_unlock(&checkpoint.publish);
+    pthread_spin_unlock(&pool->nv_log->reproduce_lock);
+    stm_quiesce_release(tx);
+
+    if (full && ftruncate(checkpoint.fd, POOL_SIZE) != 0) checkpoint.error = errno;
+    for (uint64_t VPN = 0; VPN < CHECKPOINT_PAGES && checkpoint.error == 0; VPN++) {
+        if (!checkpoint_pending(VPN)) continue;
+        pthread_mutex_lock(&checkpoint.lock);
+        checkpoint_page(VPN);
+        pthread_mutex_unlock(&checkpoint.lock);
+        if (rate != 0 && ++nb % CHECKPOINT_CHUNK == 0) checkpoint_throttle(&start, written + nb * PAGE_SIZE, rate);
+    }
+
+    pthread_rwlock_wrlock(&checkpoint.publish);
+    pthread_mutex_lock(&checkpoint.lock);
+    ATOMIC_STORE_REL(&_tinystm.addition.checkpoint, 0);
+    held = checkpoint.held;
+    held_nb = checkpoint.held_nb;
+    checkpoint.held = NULL;
+    checkpoint.held_nb = checkpoint.held_size = 0;
+    copied = checkpoint.copied;
+    // pages left by an error
+    memset(checkpoint.pending, 0, CHECKPOINT_WORDS * sizeof(uint64_t));
+    pthread_mutex_unlock(&checkpoint.lock);
+    pthread_rwlock_unlock(&checkpoint.publish);
+
+    // the root of the fence: persist_* and reproduce_* are equal, there is nothing to recover
+    if (checkpoint.error == 0 && pwrite(checkpoint.fd, &root, sizeof(root), (uint64_t)pool->root - pool->base) != sizeof(root))
+        checkpoint.error = errno;
+    if (checkpoint.error == 0 && fsync(checkpoint.fd) != 0) checkpoint.error = errno;
+    close(checkpoint.fd);
+    if (checkpoint.error == 0 && (rename(tmp, path) != 0 || checkpoint_sync_dir(path) != 0)) checkpoint.error = errno;
+    if (checkpoint.error != 0) unlink(tmp);
+    free(tmp);
+
+    if (held_nb != 0) checkpoint_release(held, held_nb);
+    free(held);
+
+    error = checkpoint.error;
+    if (error == 0) {
+        checkpoint.nb[pool->id] ++;
+        *timestamp = checkpoint.timestamp[pool->id];
+    }
+    else checkpoint.nb[pool->id] = 0;
+    checkpoint.running = 0;
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return (int)copied;
+}
+# endif /* _CHECKPOINT_H_ */
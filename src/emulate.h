@@ -0,0 +1,132 @@
+# ifndef _EMULATE_H_
+# define _EMULATE_H_
+
+# include "stm_internal.h"
+
+// With NV_EMULATE, flushes, drains and reads of nv memory spin as long as they would take on NVM,
+// so that a pool on DRAM or tmpfs shows the costs of the real device. Defaults are about one
+// first generation Optane DIMM, 0 disables a delay
+# define EMULATE_CALIBRATION 10000000           // nanoseconds spent calibrating the tick counter
+# define EMULATE_LINE        64                 // bytes of a cache line
+# define EMULATE_WRITE_NS    "NV_WRITE_NS"      // environment: nanoseconds per cache line flushed
+# define EMULATE_DRAIN_NS    "NV_DRAIN_NS"      // environment: nanoseconds per drain
+# define EMULATE_READ_NS     "NV_READ_NS"       // environment: nanoseconds per cache line read
+# define EMULATE_BANDWIDTH   "NV_BANDWIDTH"     // environment: MB/s written to a pool by all threads together
+# define EMULATE_WRITE_NS_DEFAULT  30
+# define EMULATE_DRAIN_NS_DEFAULT  100
+# define EMULATE_READ_NS_DEFAULT   10
+# define EMULATE_BANDWIDTH_DEFAULT 2000
+
+
+
+void init_emulate(); // use before the log is recovered
+
+void nv_flush(stm_pool_t *pool, const void *addr, size_t size); // pmemobj_flush() at the write latency and bandwidth of NVM
+
+void nv_drain(stm_pool_t *pool); // pmemobj_drain() at the drain latency of NVM
+
+void nv_read(const void *addr, size_t size); // wait as long as reading from NVM, the data is read by the caller
+
+# ifndef NV_DECLARE_ONLY
+# ifdef NV_EMULATE
+static inline uint64_t emulate_ticks() {
+#  if defined(__x86_64__) || defined(__i386__)
+    uint32_t a, d;
+    __asm__ __volatile__("rdtsc" : "=a" (a), "=d" (d));
+    return ((uint64_t)d << 32) | a;
+#  else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#  endif
+}
+
+static uint64_t emulate_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void emulate_spin(uint64_t end) {
+    while ((int64_t)(emulate_ticks() - end) < 0) {
+#  if defined(__x86_64__) || defined(__i386__)
+        __asm__ __volatile__("pause");
+#  endif
+    }
+}
+
+static inline uint64_t emulate_lines(const void *addr, size_t size) {
+    return ((uint64_t)addr + size + EMULATE_LINE - 1) / EMULATE_LINE - (uint64_t)addr / EMULATE_LINE;
+}
+
+static uint64_t emulate_param(const char *name, uint64_t value) {
+    char *s = getenv(name);
+    return s != NULL ? (uint64_t)strtoull(s, NULL, 10) : value;
+}
+# endif /* NV_EMULATE */
+
+void init_emulate() {
+    #ifdef NV_EMULATE
+    global_emulate_t *emulate = &_tinystm.addition.global_emulate;
+    uint64_t ns, ticks, ticks_per_ns;
+
+    ns = emulate_ns();
+    ticks = emulate_ticks();
+    while (emulate_ns() - ns < EMULATE_CALIBRATION);
+    ns = emulate_ns() - ns;
+    ticks = emulate_ticks() - ticks;
+    ticks_per_ns = (ticks << 32) / ns; // 32.32 fixed point
+
+    emulate->write_ns = emulate_param(EMULATE_WRITE_NS, EMULATE_WRITE_NS_DEFAULT);
+    emulate->drain_ns = emulate_param(EMULATE_DRAIN_NS, EMULATE_DRAIN_NS_DEFAULT);
+    emulate->read_ns = emulate_param(EMULATE_READ_NS, EMULATE_READ_NS_DEFAULT);
+    emulate->bandwidth = emulate_param(EMULATE_BANDWIDTH, EMULATE_BANDWIDTH_DEFAULT);
+    emulate->write = (emulate->write_ns * ticks_per_ns) >> 32;
+    emulate->drain = (emulate->drain_ns * ticks_per_ns) >> 32;
+    emulate->read = (emulate->read_ns * ticks_per_ns) >> 32;
+    // a byte takes 1000 / bandwidth ns
+    emulate->byte = emulate->bandwidth == 0 ? 0 : ticks_per_ns * 1000 / emulate->bandwidth;
+    #endif
+}
+
+// each pool is on its own device: its flushes share the bandwidth of that device only
+void nv_flush(stm_pool_t *pool, const void *addr, size_t size) {
+    #ifdef NV_EMULATE
+    global_emulate_t *emulate = &_tinystm.addition.global_emulate;
+    uint64_t lines = emulate_lines(addr, size), now, end, start, next, cost;
+
+    pmemobj_flush(pool->pop, addr, size);
+    now = emulate_ticks();
+    end = now + lines * emulate->write;
+    if (emulate->byte != 0) {
+        // the device writes one flush after the other: take the next slot of its bandwidth
+        cost = (lines * EMULATE_LINE * emulate->byte) >> 32;
+        do {
+            next = ATOMIC_LOAD(&pool->emulate_next);
+            start = (int64_t)(next - now) > 0 ? next : now;
+        } while (ATOMIC_CAS_FULL(&pool->emulate_next, next, start + cost) == 0);
+        if ((int64_t)(start + cost - end) > 0) end = start + cost;
+    }
+    emulate_spin(end);
+    #else
+    pmemobj_flush(pool->pop, addr, size);
+    #endif
+}
+
+void nv_drain(stm_pool_t *pool) {
+    pmemobj_drain(pool->pop);
+    #ifdef NV_EMULATE
+    if (_tinystm.addition.global_emulate.drain != 0)
+        emulate_spin(emulate_ticks() + _tinystm.addition.global_emulate.drain);
+    #endif
+}
+
+void nv_read(const void *addr, size_t size) {
+    #ifdef NV_EMULATE
+    if (_tinystm.addition.global_emulate.read != 0)
+        emulate_spin(emulate_ticks() + emulate_lines(addr, size) * _tinystm.addition.global_emulate.read);
+    #endif
+}
+# endif /* NV_DECLARE_ONLY */
+
+# endif /* _EMULATE_H_ */
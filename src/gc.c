@@ -26,8 +26,10 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <pthread.h>
+#include <libpmemobj.h>
 
 #include "tls.h"
 #include "gc.h"
@@ -50,6 +52,10 @@
 # endif /* ! CLEANUP_FREQUENCY */
 #endif /* ! NO_PERIODIC_CLEANUP */
 
+#ifndef PMEM_BATCH_SIZE
+# define PMEM_BATCH_SIZE                64  /* Pending persistent frees before cleanup */
+#endif /* ! PMEM_BATCH_SIZE */
+
 #ifdef DEBUG
 /* Note: stdio is thread-safe */
 # define IO_FLUSH                       fflush(NULL)
@@ -77,6 +83,11 @@ typedef struct gc_block {               /* Block of allocated memory */
 
 typedef struct gc_region {              /* A list of allocated memory blocks */
   struct gc_block *blocks;              /* Memory blocks */
+  struct pobj_action *acts;             /* Deferred frees of persistent blocks */
+  unsigned int nb_acts;                 /* Number of deferred frees */
+  unsigned int size_acts;               /* Size of deferred free array */
+  PMEMobjpool **pools;                  /* Pool of each deferred free */
+  struct gc_block *slabs;               /* Slab blocks, cleared by a transaction */
   gc_word_t ts;                         /* Deallocation timestamp */
   struct gc_region *next;               /* Next region */
 } gc_region_t;
@@ -88,9 +99,11 @@ typedef struct gc_thread {              /* Descriptor of an active thread */
       gc_word_t ts;                     /* Start timestamp */
       gc_region_t *head;                /* First memory region(s) assigned to thread */
       gc_region_t *tail;                /* Last memory region(s) assigned to thread */
+      gc_block_t *expired;              /* Slab blocks no transaction can read */
 #ifndef NO_PERIODIC_CLEANUP
       unsigned int frees;               /* How many blocks have been freed? */
 #endif /* ! NO_PERIODIC_CLEANUP */
+      unsigned int pmem_frees;          /* How many persistent frees are pending? */
     };
     char padding[CACHELINE_SIZE];       /* Padding (should be at least a cache line) */
   };
@@ -167,6 +180,72 @@ static inline void gc_clean_blocks(gc_block_t *mb)
   }
 }
 
+/*
+ * Drop a list of slab blocks: they stay allocated.
+ */
+static inline void gc_drop_slabs(gc_block_t *mb)
+{
+  gc_block_t *next_mb;
+
+  while (mb != NULL) {
+    next_mb = mb->next;
+    xfree(mb);
+    mb = next_mb;
+  }
+}
+
+/*
+ * Hand the slab blocks of an expired region to the next transaction of
+ * the thread.
+ */
+static inline void gc_expire_slabs(int idx, gc_region_t *mr)
+{
+  gc_block_t *mb;
+
+  while ((mb = mr->slabs) != NULL) {
+    mr->slabs = mb->next;
+    mb->next = gc_threads.slots[idx].expired;
+    gc_threads.slots[idx].expired = mb;
+  }
+}
+
+/*
+ * Publish deferred frees of persistent blocks.  Frees of consecutive
+ * regions are published in a single batch per run of frees of the same
+ * pool, once the checkpoint being written, if any, is over.
+ */
+static inline void gc_clean_actions(PMEMobjpool **pools, struct pobj_action *acts, unsigned int nb)
+{
+  unsigned int i, first = 0;
+
+  for (i = 1; i <= nb; i++) {
+    if (i == nb || pools[i] != pools[first]) {
+      PRINT_DEBUG("==> pmemobj_publish(%d,n=%u)\n", gc_get_idx(), i - first);
+      stm_checkpoint_publish(pools[first], acts + first, i - first, i - first);
+      first = i;
+    }
+  }
+}
+
+/*
+ * Move deferred frees of a region to a batch that can hold all pending
+ * frees of the thread.
+ */
+static inline void gc_batch_actions(gc_region_t *mr, gc_region_t *batch, unsigned int pending)
+{
+  if (mr->nb_acts == 0)
+    return;
+  if (batch->acts == NULL) {
+    batch->size_acts = pending;
+    batch->acts = (struct pobj_action *)xmalloc(batch->size_acts * sizeof(struct pobj_action));
+    batch->pools = (PMEMobjpool **)xmalloc(batch->size_acts * sizeof(PMEMobjpool *));
+  }
+  assert(batch->nb_acts + mr->nb_acts <= batch->size_acts);
+  memcpy(batch->acts + batch->nb_acts, mr->acts, mr->nb_acts * sizeof(struct pobj_action));
+  memcpy(batch->pools + batch->nb_acts, mr->pools, mr->nb_acts * sizeof(PMEMobjpool *));
+  batch->nb_acts += mr->nb_acts;
+}
+
 /*
  * Free region list.
  */
@@ -176,6 +255,10 @@ static inline void gc_clean_regions(gc_region_t *mr)
 
   while (mr != NULL) {
     gc_clean_blocks(mr->blocks);
+    gc_clean_actions(mr->pools, mr->acts, mr->nb_acts);
+    gc_drop_slabs(mr->slabs);
+    xfree(mr->acts);
+    xfree(mr->pools);
     next_mr = mr->next;
     xfree(mr);
     mr = next_mr;
@@ -188,6 +271,7 @@ static inline void gc_clean_regions(gc_region_t *mr)
 void gc_cleanup_thread(int idx, gc_word_t min)
 {
   gc_region_t *mr;
+  gc_region_t batch;
 
   PRINT_DEBUG("==> gc_cleanup_thread(%d,m=%lu)\n", idx, (unsigned long)min);
 
@@ -196,8 +280,16 @@ void gc_cleanup_thread(int idx, gc_word_t min)
     return;
   }
 
+  batch.acts = NULL;
+  batch.nb_acts = batch.size_acts = 0;
+  batch.pools = NULL;
   while (min > gc_threads.slots[idx].head->ts) {
     gc_clean_blocks(gc_threads.slots[idx].head->blocks);
+    gc_batch_actions(gc_threads.slots[idx].head, &batch, gc_threads.slots[idx].pmem_frees);
+    gc_threads.slots[idx].pmem_frees -= gc_threads.slots[idx].head->nb_acts;
+    gc_expire_slabs(idx, gc_threads.slots[idx].head);
+    xfree(gc_threads.slots[idx].head->acts);
+    xfree(gc_threads.slots[idx].head->pools);
     mr = gc_threads.slots[idx].head->next;
     xfree(gc_threads.slots[idx].head);
     gc_threads.slots[idx].head = mr;
@@ -207,6 +299,10 @@ void gc_cleanup_thread(int idx, gc_word_t min)
       break;
     }
   }
+  /* Blocks of all expired regions become free at once */
+  gc_clean_actions(batch.pools, batch.acts, batch.nb_acts);
+  xfree(batch.acts);
+  xfree(batch.pools);
 }
 
 /* ################################################################### *
@@ -228,9 +324,11 @@ void gc_init(gc_word_t (*epoch)(void))
     gc_threads.slots[i].used = GC_NULL;
     gc_threads.slots[i].ts = EPOCH_MAX;
     gc_threads.slots[i].head = gc_threads.slots[i].tail = NULL;
+    gc_threads.slots[i].expired = NULL;
 #ifndef NO_PERIODIC_CLEANUP
     gc_threads.slots[i].frees = 0;
 #endif /* ! NO_PERIODIC_CLEANUP */
+    gc_threads.slots[i].pmem_frees = 0;
   }
   gc_threads.nb_active = 0;
 }
@@ -250,8 +348,10 @@ void gc_exit(void)
     exit(1);
   }
   /* Clean up memory */
-  for (i = 0; i < MAX_GC_THREADS; i++)
+  for (i = 0; i < MAX_GC_THREADS; i++) {
     gc_clean_regions(gc_threads.slots[i].head);
+    gc_drop_slabs(gc_threads.slots[i].expired);
+  }
 
   xfree((void *)gc_threads.slots);
 }
@@ -332,15 +432,11 @@ void gc_set_epoch(gc_word_t epoch)
 }
 
 /*
- * Free memory (the thread must indicate the current timestamp).
+ * Get the region of the CURRENT thread for an epoch.
  */
-void gc_free(void *addr, gc_word_t epoch)
+static inline gc_region_t *gc_get_region(int idx, gc_word_t epoch)
 {
   gc_region_t *mr;
-  gc_block_t *mb;
-  int idx = gc_get_idx();
-
-  PRINT_DEBUG("==> gc_free(%d,%lu)\n", idx, (unsigned long)epoch);
 
   /* Function must be called with non-decreasing epoch numbers for any given thread! */
   if (gc_threads.slots[idx].head == NULL || gc_threads.slots[idx].tail->ts < epoch) {
@@ -348,6 +444,10 @@ void gc_free(void *addr, gc_word_t epoch)
     mr = (gc_region_t *)xmalloc(sizeof(gc_region_t));
     mr->ts = epoch;
     mr->blocks = NULL;
+    mr->acts = NULL;
+    mr->nb_acts = mr->size_acts = 0;
+    mr->pools = NULL;
+    mr->slabs = NULL;
     mr->next = NULL;
     if (gc_threads.slots[idx].head == NULL) {
       gc_threads.slots[idx].head = gc_threads.slots[idx].tail = mr;
@@ -361,6 +461,22 @@ void gc_free(void *addr, gc_word_t epoch)
     mr = gc_threads.slots[idx].tail;
   }
 
+  return mr;
+}
+
+/*
+ * Free memory (the thread must indicate the current timestamp).
+ */
+void gc_free(void *addr, gc_word_t epoch)
+{
+  gc_region_t *mr;
+  gc_block_t *mb;
+  int idx = gc_get_idx();
+
+  PRINT_DEBUG("==> gc_free(%d,%lu)\n", idx, (unsigned long)epoch);
+
+  mr = gc_get_region(idx, epoch);
+
   /* Allocate block */
   mb = (gc_block_t *)xmalloc(sizeof(gc_block_t));
   mb->addr = addr;
@@ -374,6 +490,81 @@ void gc_free(void *addr, gc_word_t epoch)
 #endif /* ! NO_PERIODIC_CLEANUP */
 }
 
+/*
+ * Free a persistent block (the thread must indicate the current
+ * timestamp).  The free is deferred with libpmemobj and published
+ * together with other frees once no transaction can access the block.
+ * The blocks of a region may come from several pools.
+ */
+void gc_free_pmem(PMEMobjpool *pool, PMEMoid oid, gc_word_t epoch)
+{
+  gc_region_t *mr;
+  int idx = gc_get_idx();
+
+  PRINT_DEBUG("==> gc_free_pmem(%d,%lu)\n", idx, (unsigned long)epoch);
+
+  mr = gc_get_region(idx, epoch);
+
+  if (mr->nb_acts == mr->size_acts) {
+    mr->size_acts = (mr->size_acts == 0 ? 4 : mr->size_acts * 2);
+    mr->acts = (struct pobj_action *)xrealloc(mr->acts, mr->size_acts * sizeof(struct pobj_action));
+    mr->pools = (PMEMobjpool **)xrealloc(mr->pools, mr->size_acts * sizeof(PMEMobjpool *));
+  }
+  mr->pools[mr->nb_acts] = pool;
+  pmemobj_defer_free(pool, oid, &mr->acts[mr->nb_acts++]);
+
+  /* Amortize the cost of publishing over many frees */
+  if (++gc_threads.slots[idx].pmem_frees % PMEM_BATCH_SIZE == 0)
+    gc_cleanup();
+}
+
+/*
+ * Free a block of the slabs (the thread must indicate the current
+ * timestamp).  Its allocation bit can only be cleared by a transaction:
+ * once no transaction can access the block, it is returned by
+ * gc_expired_slab() to the thread owning the slot.
+ */
+void gc_free_slab(void *addr, gc_word_t epoch)
+{
+  gc_region_t *mr;
+  gc_block_t *mb;
+  int idx = gc_get_idx();
+
+  PRINT_DEBUG("==> gc_free_slab(%d,%lu)\n", idx, (unsigned long)epoch);
+
+  mr = gc_get_region(idx, epoch);
+
+  mb = (gc_block_t *)xmalloc(sizeof(gc_block_t));
+  mb->addr = addr;
+  mb->next = mr->slabs;
+  mr->slabs = mb;
+
+#ifndef NO_PERIODIC_CLEANUP
+  gc_threads.slots[idx].frees++;
+  if (gc_threads.slots[idx].frees % CLEANUP_FREQUENCY == 0)
+    gc_cleanup();
+#endif /* ! NO_PERIODIC_CLEANUP */
+}
+
+/*
+ * Take a slab block that no transaction can access anymore (NULL if
+ * none).  The caller clears its allocation bit.
+ */
+void *gc_expired_slab(void)
+{
+  gc_block_t *mb;
+  void *addr;
+  int idx = gc_get_idx();
+
+  if ((mb = gc_threads.slots[idx].expired) == NULL)
+    return NULL;
+  gc_threads.slots[idx].expired = mb->next;
+  addr = mb->addr;
+  xfree(mb);
+
+  return addr;
+}
+
 /*
  * Garbage-collect old data associated with the current thread (should
  * be called periodically).
@@ -427,17 +618,22 @@ void gc_cleanup_all(void)
 void gc_reset(void)
 {
   int i;
+  gc_region_t *mr;
 
   PRINT_DEBUG("==> gc_reset()\n");
 
   for (i = 0; i < MAX_GC_THREADS; i++) {
     if (gc_threads.slots[i].used == GC_NULL)
       break;
+    /* No transaction is running: all slab blocks are expired */
+    for (mr = gc_threads.slots[i].head; mr != NULL; mr = mr->next)
+      gc_expire_slabs(i, mr);
     gc_clean_regions(gc_threads.slots[i].head);
     gc_threads.slots[i].ts = EPOCH_MAX;
     gc_threads.slots[i].head = gc_threads.slots[i].tail = NULL;
 #ifndef NO_PERIODIC_CLEANUP
     gc_threads.slots[i].frees = 0;
 #endif /* ! NO_PERIODIC_CLEANUP */
+    gc_threads.slots[i].pmem_frees = 0;
   }
 }
@@ -28,6 +28,7 @@
 
 # include <stdlib.h>
 # include <stdint.h>
+# include <libpmemobj.h>
 
 # ifdef __cplusplus
 extern "C" {
@@ -45,6 +46,12 @@ void gc_set_epoch(gc_word_t epoch);
 
 void gc_free(void *addr, gc_word_t epoch);
 
+void gc_free_pmem(PMEMobjpool *pool, PMEMoid oid, gc_word_t epoch);
+
+void gc_free_slab(void *addr, gc_word_t epoch);
+
+void *gc_expired_slab(void);
+
 void gc_cleanup(void);
 
 void gc_cleanup_all(void);
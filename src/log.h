@@ -2,15 +2,25 @@
 # define _LOG_H_
 
 # include "stm_internal.h"
-# define V_LOG_LENGTH 15
+# include <errno.h>
+# include <sys/mman.h>
+# include <signal.h>
+# include <unistd.h>
+# define V_LOG_INIT_SIZE 1024             // entries of a new v_log, doubled when full
+# define V_LOG_HUGE_SIZE (2 * 1024 * 1024)  // v_logs from this many bytes are backed by huge pages
 // # define V_LOG_NUM 1024
 
 # define NV_LOG_LENGTH 63
+# define ALLOC_RANGE_SIZE 16
 # define TYPE_NV_LOG_BLOCK 1
 
 # define NV_LOG_BLOCK_NUM 1024
 # define BEGIN_SIG 0xffffffffffffffff
 # define END_SIG 0xfffffffffffffffe
+# define RANGE_SIG 0xfffffffffffffffd
+# define PART_SIG 0xfffffffffffffffc        // {PART_SIG, id}: first entry of a part of a tx decided by pool id
+# define NV_LOG_RANGE_MIN 5                 // shorter runs take less space as word entries
+# define V_LOG_HOLE 0                       // nv_addr of the v_log of a w_set entry that only locks
 
 # define LAYOUT_NAME "dudetm"
 # ifndef SMALL_POOL
@@ -22,6 +32,8 @@
 
 typedef uint64_t nv_ptr;
 
+# define NV_SLAB_CLASSES 10                 // size classes of the slab allocator
+
 struct root {
     nv_ptr obj_root[127];
     uint64_t root_num;
@@ -32,6 +44,11 @@ struct root {
     uint64_t reproduce_offset;
     uint64_t persist_timestamp;
     uint64_t reproduce_timestamp;
+
+    nv_ptr slab_head[NV_SLAB_CLASSES];      // linked slabs of each size class
+    nv_ptr hot_set;                         // nv_hot_t of page.h, 0 until first saved
+    uint64_t pool_id;                       // id of the pool in its nv_ptrs, given when created
+    uint64_t peer_timestamp[NV_POOL_MAX];   // last tx decided here that wrote pool i too
 };
 
 typedef struct nv_log_entry {
@@ -50,7 +67,24 @@ struct nv_log_block {
 TOID_DECLARE_ROOT(struct root);
 TOID_DECLARE(struct nv_log_block, TYPE_NV_LOG_BLOCK);
 
-PMEMobjpool *pmem_init(char *pool_path); // use to init pmem area
+stm_pool_t *pmem_init(const char *pool_path); // use to open a pool, pool_lock held
+
+// with NV_CRASH, the process kills itself the n-th time it passes the point set by
+// $NV_CRASH as "point:n", leaving the log as a crash there would
+# define NV_CRASH_ENV "NV_CRASH"
+enum {
+    NV_CRASH_LOG_FLUSH,                 // a part of the tx is flushed to the log
+    NV_CRASH_LOG_DRAIN,                 // the tx is in the log, persist_* not yet published
+    NV_CRASH_LOG_PUBLISH,               // persist_* published
+    NV_CRASH_REPRODUCE,                 // a tx is written home, reproduce_* not yet published
+    NV_CRASH_RECOVERY,                  // a tx is reproduced by recovery
+    NV_CRASH_NB
+};
+# ifdef NV_CRASH
+#  define NV_CRASH_POINT(point)         nv_crash(point)
+# else
+#  define NV_CRASH_POINT(point)
+# endif
 
 struct nv_log {
     nv_ptr write_block;
@@ -58,7 +92,20 @@ struct nv_log {
     uint64_t write_offset;
     uint64_t read_offset;
     uint64_t last_timestamp;
-
+    uint64_t commit_timestamp;          // last time_commit of the log that is committed, replayed up to it
+    uint64_t begin_off;                 // entries of write_block not flushed yet begin here
+    pthread_spinlock_t record_lock;     // serialize writers of the log ring
+    pthread_spinlock_t reproduce_lock;  // serialize readers of the log ring
+    uint64_t recovery_txs;              // txs reproduced when the pool was opened
+    uint64_t recovery_entries;
+    uint64_t recovery_ns;
+# ifdef NV_STATISTICS
+    uint64_t stat_appended;             // entries written, record_lock held
+    uint64_t stat_flushes;
+    uint64_t stat_drains;
+    uint64_t stat_read;                 // entries reproduced, reproduce_lock held
+    uint64_t stat_reproduced;           // txs reproduced
+# endif
 };
 
 typedef struct v_log_entry {
@@ -66,11 +113,10 @@ typedef struct v_log_entry {
     uint64_t data;
 } v_log_entry_t;
 
-struct v_log_block {
-    uint64_t num;                       // only vaild in first entry
-    struct v_log_block *next;
-    v_log_entry_t v_logs[V_LOG_LENGTH];
-};
+typedef struct alloc_range {          // block allocated by the tx, initialized without v_log
+    nv_ptr nv_addr;
+    uint64_t size;
+} alloc_range_t;
 
 // typedef struct v_log_pool {
 //     uint64_t num;
@@ -100,28 +146,42 @@ void v_log_init(stm_tx_t *tx); // use when init tx thread
 
 void v_log_reset(stm_tx_t *tx); // use when exit tx 
 
-void nv_log_init(); // use when init stm
+void v_log_exit(stm_tx_t *tx); // use when exit tx thread
+
+void alloc_range_insert(stm_tx_t *tx, uint64_t nv_addr, uint64_t size); // use when tx allocates a block
+
+alloc_range_t *alloc_range_find(stm_tx_t *tx, uint64_t nv_addr); // get the block allocated by tx holding addr
+
+void nv_log_init(stm_pool_t *pool); // use when open pool
 
 int nv_log_record(stm_tx_t *tx, uint64_t commit_timestamp); // use when commit
 
-int nv_log_reproduce(); // use after commit
+int nv_log_reproduce(stm_pool_t *pool); // use after commit
 
-void nv_log_save(); // save all log to nv_heap
+void nv_log_reproduce_pools(uint64_t pools); // reproduce the pools of a mask of ids
 
+void nv_log_save(stm_pool_t *pool); // save all log to nv_heap and close pool
+
+# ifndef NV_DECLARE_ONLY
 
-static void v_log_expand(stm_tx_t *tx) {
-    v_log_block_t *node = tx->addition.v_log_block, *prev = NULL;
 
-    while (node != NULL) {
-        prev = node;
-        node = node->next;
+// double the v_log, entries in use are copied once: appends stay O(1) amortized
+static void v_log_expand(stm_tx_t *tx) {
+    v_log_t *v_log = &tx->addition.v_log;
+    uint64_t size = v_log->size == 0 ? V_LOG_INIT_SIZE : 2 * v_log->size;
+    uint64_t bytes = size * sizeof(v_log_entry_t);
+    v_log_entry_t *v_logs;
+
+    if (bytes >= V_LOG_HUGE_SIZE) {
+        v_logs = (v_log_entry_t *)aligned_alloc(V_LOG_HUGE_SIZE, bytes);
+        madvise(v_logs, bytes, MADV_HUGEPAGE);
     }
+    else v_logs = (v_log_entry_t *)aligned_alloc(CACHELINE_SIZE, bytes);
 
-    node = (v_log_block_t *)malloc(sizeof(v_log_block_t));
-    node->num = 0;
-    node->next = NULL;
-    if (prev != NULL) prev->next = node;
-    else tx->addition.v_log_block = node;
+    if (v_log->num != 0) memcpy(v_logs, v_log->v_logs, v_log->num * sizeof(v_log_entry_t));
+    free(v_log->v_logs);
+    v_log->v_logs = v_logs;
+    v_log->size = size;
 }
 
 // void v_log_pool_init() {
@@ -142,51 +202,82 @@ static void v_log_expand(stm_tx_t *tx) {
 // }
 
 void v_log_init(stm_tx_t *tx) {
+    tx->addition.v_log.num = 0;
+    tx->addition.v_log.size = 0;
+    tx->addition.v_log.v_logs = NULL;
     v_log_expand(tx);
+    tx->addition.alloc_range = (alloc_range_t *)malloc(ALLOC_RANGE_SIZE * sizeof(alloc_range_t));
+    tx->addition.alloc_size = ALLOC_RANGE_SIZE;
+    tx->addition.alloc_nb = 0;
 }
 
 void v_log_insert_exist(stm_tx_t *tx, uint64_t nv_addr, uint64_t data, uint64_t nb) {
-    v_log_block_t *node = tx->addition.v_log_block;
+    // w_set and v_log are in step: entry nb of w_set has a v_log, a hole at least
+    assert(nb < tx->addition.v_log.num);
+    if (nv_addr != V_LOG_HOLE) tx->addition.log_pools |= (uint64_t)1 << NV_POOL_ID(nv_addr);
+    tx->addition.v_log.v_logs[nb].nv_addr = nv_addr;
+    tx->addition.v_log.v_logs[nb].data = data;
+}
 
-    while (nb > V_LOG_LENGTH - 1) {
-        nb -= V_LOG_LENGTH;
-        node = node->next;
-    }
+void v_log_insert(stm_tx_t *tx, uint64_t nv_addr, uint64_t data) {
+    v_log_t *v_log = &tx->addition.v_log;
 
-    node->v_logs[nb].nv_addr = nv_addr;
-    node->v_logs[nb].data = data;
+    if (v_log->num == v_log->size) v_log_expand(tx);
+    if (nv_addr != V_LOG_HOLE) tx->addition.log_pools |= (uint64_t)1 << NV_POOL_ID(nv_addr);
+    v_log->v_logs[v_log->num].nv_addr = nv_addr;
+    v_log->v_logs[v_log->num].data = data;
+    v_log->num ++;
 }
 
-void v_log_insert(stm_tx_t *tx, uint64_t nv_addr, uint64_t data) {
-    v_log_block_t *node = tx->addition.v_log_block;
-    unsigned int nb = node->num;
+void v_log_reset(stm_tx_t *tx) {
+    tx->addition.v_log.num = 0;
+    tx->addition.alloc_nb = 0;
+    tx->addition.log_pools = 0;
+}
 
-    while (nb > V_LOG_LENGTH - 1) {
-        nb -= V_LOG_LENGTH;
-        if (node ->next == NULL) v_log_expand(tx);
-        node = node->next;
+void v_log_exit(stm_tx_t *tx) {
+    free(tx->addition.v_log.v_logs);
+    free(tx->addition.alloc_range);
+}
+
+void alloc_range_insert(stm_tx_t *tx, uint64_t nv_addr, uint64_t size) {
+    // logs written before the block was freed must not be reproduced over the new data
+    stm_pool_t *pool = NV_POOL(nv_addr);
+    uint64_t commit_timestamp = ATOMIC_LOAD_ACQ(&pool->nv_log->commit_timestamp);
+    while (pool->root->reproduce_timestamp < commit_timestamp) {
+        nv_log_reproduce(pool);
     }
+    // the tx touches the pages of the block: the pool takes part in its commit
+    tx->addition.log_pools |= (uint64_t)1 << pool->id;
+    if (unlikely(_tinystm.addition.reclaim)) reclaim_note(nv_addr, size, 0);
 
-    node->v_logs[nb].nv_addr = nv_addr;
-    node->v_logs[nb].data = data;
-    tx->addition.v_log_block->num ++;
+    if (tx->addition.alloc_nb == tx->addition.alloc_size) {
+        tx->addition.alloc_size *= 2;
+        tx->addition.alloc_range = (alloc_range_t *)realloc(tx->addition.alloc_range, tx->addition.alloc_size * sizeof(alloc_range_t));
+    }
+    tx->addition.alloc_range[tx->addition.alloc_nb].nv_addr = nv_addr;
+    tx->addition.alloc_range[tx->addition.alloc_nb].size = size;
+    tx->addition.alloc_nb ++;
 }
 
-void v_log_reset(stm_tx_t *tx) {
-    tx->addition.v_log_block->num = 0;
+alloc_range_t *alloc_range_find(stm_tx_t *tx, uint64_t nv_addr) {
+    for (unsigned int i = 0; i < tx->addition.alloc_nb; i++) {
+        if (nv_addr - tx->addition.alloc_range[i].nv_addr < tx->addition.alloc_range[i].size) return &tx->addition.alloc_range[i];
+    }
+    return NULL;
 }
 
 // persist log operation
 
-static void nv_log_alloc() {
+static void nv_log_alloc(stm_pool_t *pool) {
     PMEMoid Temp, Next;
     struct nv_log_block *temp, *next;
-    TX_BEGIN(_tinystm.addition.pool) {
-        pmemobj_tx_add_range_direct(&_tinystm.addition.root->persist_block, 2 * sizeof(nv_ptr));
+    TX_BEGIN(pool->pop) {
+        pmemobj_tx_add_range_direct(&pool->root->persist_block, 2 * sizeof(nv_ptr));
         Temp = pmemobj_tx_zalloc(sizeof(struct nv_log_block), TYPE_NV_LOG_BLOCK);
         temp = pmemobj_direct(Temp);
-        _tinystm.addition.root->persist_block = Temp.off;
-        _tinystm.addition.root->reproduce_block = Temp.off;
+        pool->root->persist_block = Temp.off;
+        pool->root->reproduce_block = Temp.off;
 
         for (int i = 0; i < NV_LOG_BLOCK_NUM - 1; i++) {
             Next = pmemobj_tx_zalloc(sizeof(struct nv_log_block), TYPE_NV_LOG_BLOCK);
@@ -196,198 +287,544 @@ static void nv_log_alloc() {
             Temp = Next;
             temp = next;
         }
-        temp->next = _tinystm.addition.root->persist_block;
+        temp->next = pool->root->persist_block;
 
     }TX_END
 }
 
-static void nv_log_get(v_log_entry_t *entry) {
+static void nv_log_get(stm_pool_t *pool, v_log_entry_t *entry) {
+    nv_log_t *nv_log = pool->nv_log;
     struct nv_log_block *temp;
-    temp = (struct nv_log_block *)(_tinystm.addition.nv_log->read_block + _tinystm.addition.base);
+    temp = (struct nv_log_block *)(nv_log->read_block + pool->base);
+
+    // the entries are read in order: wait once per cache line
+    if (nv_log->read_offset == 0 || (uint64_t)&temp->logs[nv_log->read_offset] % EMULATE_LINE == 0)
+        nv_read(&temp->logs[nv_log->read_offset], sizeof(temp->logs[0]));
+    entry->nv_addr = temp->logs[nv_log->read_offset].nv_addr;
+    entry->data = temp->logs[nv_log->read_offset++].data;
+    NV_STAT_ADD(nv_log, stat_read, 1);
+
+    if (nv_log->read_offset == NV_LOG_LENGTH) {
+        nv_log->read_block = temp->next;
+        nv_log->read_offset = 0;
+    }
+}
+
+# ifdef NV_CRASH
+static const char *nv_crash_names[NV_CRASH_NB] = {"log_flush", "log_drain", "log_publish", "reproduce", "recovery"};
 
-    entry->nv_addr = temp->logs[_tinystm.addition.nv_log->read_offset].nv_addr;
-    entry->data = temp->logs[_tinystm.addition.nv_log->read_offset++].data;
+// the passes are counted over all pools
+static struct {
+    int point;
+    volatile stm_word_t count;          // passes left before the crash
+} nv_crash_state = { .point = NV_CRASH_NB };
 
-    if (_tinystm.addition.nv_log->read_offset == NV_LOG_LENGTH) {
-        _tinystm.addition.nv_log->read_block = temp->next;
-        _tinystm.addition.nv_log->read_offset = 0;
+static void nv_crash_init() {
+    char *s = getenv(NV_CRASH_ENV), *count;
+
+    if (s == NULL || (count = strchr(s, ':')) == NULL) return;
+    for (int i = 0; i < NV_CRASH_NB; i++) {
+        if (strncmp(s, nv_crash_names[i], count - s) == 0 && nv_crash_names[i][count - s] == '\0') {
+            nv_crash_state.point = i;
+            nv_crash_state.count = strtoul(count + 1, NULL, 10);
+        }
     }
 }
 
-static int nv_log_insert(uint64_t *entry, int state) { //state mean 
+static inline void nv_crash(int point) {
+    if (point == nv_crash_state.point && ATOMIC_FETCH_DEC_FULL(&nv_crash_state.count) == 1)
+        kill(getpid(), SIGKILL);
+}
+# endif /* NV_CRASH */
+
+static int nv_log_insert(stm_pool_t *pool, uint64_t *entry, int state) { //state mean 
+    nv_log_t *nv_log = pool->nv_log;
     struct nv_log_block *temp;
-    static uint64_t begin_off;
     if (state == 0) 
-        begin_off = _tinystm.addition.nv_log->write_offset;
-
-    temp = (struct nv_log_block *)(_tinystm.addition.nv_log->write_block + _tinystm.addition.base);
-
-    temp->logs[_tinystm.addition.nv_log->write_offset].nv_addr = *entry;
-    temp->logs[_tinystm.addition.nv_log->write_offset].data = *(entry + 1);
-    // pmemobj_flush(_tinystm.addition.pool, &temp->logs[_tinystm.addition.nv_log->write_offset], 2 * sizeof(uint64_t)); // flush
-    _tinystm.addition.nv_log->write_offset ++;
-
-    if (_tinystm.addition.nv_log->write_offset == NV_LOG_LENGTH) {
-        if (temp->next == _tinystm.addition.nv_log->read_block) return -1;
-        collect_before_log_flush(NV_LOG_LENGTH - begin_off);
-        pmemobj_flush(_tinystm.addition.pool, &temp->logs[begin_off], 2 * (NV_LOG_LENGTH - begin_off) * sizeof(uint64_t)); // flush
-        //if (temp->next == _tinystm.addition.nv_log->read_block) return -1;
-        // pmemobj_flush(_tinystm.addition.pool, (void *)(_tinystm.addition.nv_log->write_block), 2 *sizeof(uint64_t)); // flush
-        _tinystm.addition.nv_log->write_block = temp->next;
-        _tinystm.addition.nv_log->write_offset = 0;
-        begin_off = 0;
+        nv_log->begin_off = nv_log->write_offset;
+
+    temp = (struct nv_log_block *)(nv_log->write_block + pool->base);
+
+    temp->logs[nv_log->write_offset].nv_addr = *entry;
+    temp->logs[nv_log->write_offset].data = *(entry + 1);
+    nv_log->write_offset ++;
+
+    if (nv_log->write_offset == NV_LOG_LENGTH) {
+        if (temp->next == nv_log->read_block) return -1;
+        collect_before_log_flush(NV_LOG_LENGTH - nv_log->begin_off);
+        NV_STAT_ADD(nv_log, stat_flushes, 1);
+        nv_flush(pool, &temp->logs[nv_log->begin_off], 2 * (NV_LOG_LENGTH - nv_log->begin_off) * sizeof(uint64_t)); // flush
+        NV_CRASH_POINT(NV_CRASH_LOG_FLUSH);
+        nv_log->write_block = temp->next;
+        nv_log->write_offset = 0;
+        nv_log->begin_off = 0;
         return 0;
     }
     else if (state == 2) {
-        collect_before_log_flush(_tinystm.addition.nv_log->write_offset - begin_off);
-        pmemobj_flush(_tinystm.addition.pool, &temp->logs[begin_off], 2 * (_tinystm.addition.nv_log->write_offset - begin_off) * sizeof(uint64_t));
+        collect_before_log_flush(nv_log->write_offset - nv_log->begin_off);
+        NV_STAT_ADD(nv_log, stat_flushes, 1);
+        nv_flush(pool, &temp->logs[nv_log->begin_off], 2 * (nv_log->write_offset - nv_log->begin_off) * sizeof(uint64_t));
+        NV_CRASH_POINT(NV_CRASH_LOG_FLUSH);
     }
     return 0;
 }
 
-static void nv_log_recovery() {
-    while (_tinystm.addition.root->persist_timestamp > _tinystm.addition.root->reproduce_timestamp) {
-        nv_log_reproduce();
+static uint64_t nv_log_replay(stm_pool_t *pool);
+
+// publish the records written up to the write pointer. The pool of highest id of a tx spanning pools
+// decides it: it also keeps the tx in peer_timestamp of the other pools of peers
+static void nv_log_publish(stm_pool_t *pool, uint64_t commit_timestamp, uint64_t peers) {
+    struct pobj_action act[3 + NV_POOL_MAX];
+    unsigned int nb = 3;
+
+    pmemobj_set_value(pool->pop, &act[0], &pool->root->persist_block, pool->nv_log->write_block);
+    pmemobj_set_value(pool->pop, &act[1], &pool->root->persist_offset, pool->nv_log->write_offset);
+    pmemobj_set_value(pool->pop, &act[2], &pool->root->persist_timestamp, commit_timestamp);
+    for (peers &= ~((uint64_t)1 << pool->id); peers != 0; peers &= peers - 1)
+        pmemobj_set_value(pool->pop, &act[nb++], &pool->root->peer_timestamp[__builtin_ctzll(peers)], commit_timestamp);
+    pmemobj_publish(pool->pop, act, nb);
+    NV_CRASH_POINT(NV_CRASH_LOG_PUBLISH);
+}
+
+// look at the next record before recovery replays it: 1 to replay it, 0 if it waits for the pool
+// deciding it, -1 if it was dropped. Only the last record may be a part of a tx that its decisive
+// pool did not publish: writers of the pool wait until the parts of a tx are all published
+static int nv_log_decide(stm_pool_t *pool) {
+    nv_log_t *nv_log = pool->nv_log;
+    struct root *root = pool->root;
+    uint64_t read_block = nv_log->read_block, read_offset = nv_log->read_offset, length, decisive;
+    v_log_entry_t temp;
+
+    nv_log_get(pool, &temp);
+    length = temp.data;
+    nv_log_get(pool, &temp);
+    decisive = temp.data;
+    if (length != 0 && temp.nv_addr == PART_SIG) {
+        for (uint64_t i = 1; i <= length; i++) nv_log_get(pool, &temp);
+    }
+    nv_log->read_block = read_block;
+    nv_log->read_offset = read_offset;
+    if (length == 0 || temp.nv_addr != END_SIG || temp.data != root->persist_timestamp) return 1;
+
+    if (decisive >= NV_POOL_MAX || _tinystm.addition.pools[decisive] == NULL) {
+        pool->pending = decisive;
+        return 0;
+    }
+    pool->pending = -1;
+    if (_tinystm.addition.pools[decisive]->root->peer_timestamp[pool->id] >= temp.data) return 1;
+
+    // the tx did not commit: the part is cut from the log
+    nv_log->write_block = read_block;
+    nv_log->write_offset = read_offset;
+    nv_log_publish(pool, root->reproduce_timestamp, 0);
+    return -1;
+}
+
+// reproduce the txs left in the log, no other thread uses the pool. Records up to commit_timestamp
+// are known to be committed, the others are checked by nv_log_decide()
+static void nv_log_recovery(stm_pool_t *pool) {
+    nv_log_t *nv_log = pool->nv_log;
+    struct root *root = pool->root;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (root->persist_timestamp > root->reproduce_timestamp) {
+        if (root->reproduce_timestamp >= nv_log->commit_timestamp && nv_log_decide(pool) <= 0) break;
+        nv_log->recovery_entries += nv_log_replay(pool);
+        nv_log->recovery_txs ++;
+        NV_CRASH_POINT(NV_CRASH_RECOVERY);
     }
+    if (pool->pending < 0) nv_log->commit_timestamp = root->persist_timestamp;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    nv_log->recovery_ns += (end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+# ifdef NV_STATISTICS
+    // the ring is empty again: entries of the last run were never counted as appended
+    nv_log->stat_read = 0;
+# endif
 }
 
-void nv_log_init() {
-    if (_tinystm.addition.root->persist_block == 0) {
-        nv_log_alloc();
-        _tinystm.addition.nv_log->read_block = _tinystm.addition.root->persist_block;
-        _tinystm.addition.nv_log->write_block = _tinystm.addition.root->reproduce_block;
+void nv_log_init(stm_pool_t *pool) {
+    nv_log_t *nv_log = pool->nv_log;
+    struct root *root = pool->root;
+
+    pthread_spin_init(&nv_log->record_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_spin_init(&nv_log->reproduce_lock, PTHREAD_PROCESS_PRIVATE);
+    if (root->persist_block == 0) {
+        nv_log_alloc(pool);
+        nv_log->read_block = root->persist_block;
+        nv_log->write_block = root->reproduce_block;
     }
     else {
-        _tinystm.addition.nv_log->read_block = _tinystm.addition.root->reproduce_block;
-        _tinystm.addition.nv_log->write_block = _tinystm.addition.root->persist_block;
-        _tinystm.addition.nv_log->read_offset = _tinystm.addition.root->reproduce_offset;
-        _tinystm.addition.nv_log->write_offset = _tinystm.addition.root->persist_offset;
-        _tinystm.addition.nv_log->last_timestamp = _tinystm.addition.root->persist_timestamp;
-        nv_log_recovery();
+        nv_log->read_block = root->reproduce_block;
+        nv_log->write_block = root->persist_block;
+        nv_log->read_offset = root->reproduce_offset;
+        nv_log->write_offset = root->persist_offset;
+        nv_log->last_timestamp = root->persist_timestamp;
+        nv_log->commit_timestamp = root->reproduce_timestamp;
+        nv_log_recovery(pool);
     }
 }
 
-int nv_log_record(stm_tx_t *tx, uint64_t commit_timestamp) {
-    if(tx->addition.v_log_block->num == 0) return 0;
-    nv_log_begin_t begin_block = {.begin_flag = BEGIN_SIG, .length = tx->addition.v_log_block->num};
-    nv_log_end_t end_block = {.end_flag = END_SIG, .time_commit = commit_timestamp + _tinystm.addition.nv_log->last_timestamp};
+// time_commit must strictly increase in log order: nv_log_reproduce() and
+// page_map_() compare it with reproduce_timestamp, while the stm clock may
+// hand the same timestamp to several txs or be reset by rollover_clock()
+static uint64_t nv_log_timestamp(stm_pool_t *pool, uint64_t commit_timestamp) {
+    uint64_t time_commit = commit_timestamp + pool->nv_log->last_timestamp;
+
+    if (time_commit <= pool->nv_log->commit_timestamp)
+        time_commit = pool->nv_log->commit_timestamp + 1;
+    return time_commit;
+}
+
+// number of v_logs from record_num on that write consecutive words
+static uint64_t v_log_run(v_log_t *v_log, uint64_t record_num) {
+    uint64_t nv_addr = v_log->v_logs[record_num].nv_addr, run = 1;
+
+    while (record_num + run < v_log->num && v_log->v_logs[record_num + run].nv_addr == nv_addr + run * sizeof(uint64_t))
+        run ++;
+    return run;
+}
+
+// number of nv_log entries of the tx in the pool: a run of at least NV_LOG_RANGE_MIN words is written as
+// {RANGE_SIG, run}, {nv_addr, data[0]}, {data[1], data[2]}, ... instead of one entry per word
+static uint64_t nv_log_length(stm_tx_t *tx, stm_pool_t *pool) {
+    v_log_t *v_log = &tx->addition.v_log;
+    uint64_t length = 0, run;
+
+    for (uint64_t record_num = 0; record_num < v_log->num; record_num += run) {
+        run = v_log_run(v_log, record_num);
+        if (v_log->v_logs[record_num].nv_addr == V_LOG_HOLE || NV_POOL_ID(v_log->v_logs[record_num].nv_addr) != pool->id) continue;
+        length += run >= NV_LOG_RANGE_MIN ? 2 + run / 2 : run;
+    }
+    return length;
+}
+
+// the log keeps offsets in the pool, not nv_ptrs
+static int nv_log_insert_run(stm_pool_t *pool, v_log_t *v_log, uint64_t record_num, uint64_t run) {
+    uint64_t entry[2] = {RANGE_SIG, run};
+    v_log_entry_t *v_log_entry;
+    int result = 0;
+
+    if (run >= NV_LOG_RANGE_MIN) result = nv_log_insert(pool, entry, 1);
+    for (uint64_t i = 0; i < run && result == 0; i++) {
+        v_log_entry = &v_log->v_logs[record_num + i];
+        if (run < NV_LOG_RANGE_MIN || i == 0) {
+            entry[0] = NV_OFF(v_log_entry->nv_addr);
+            entry[1] = v_log_entry->data;
+            result = nv_log_insert(pool, entry, 1);
+        } else if (i % 2 == 1) {
+            entry[0] = v_log_entry->data;
+            entry[1] = 0;
+            if (i == run - 1) result = nv_log_insert(pool, entry, 1);
+        } else {
+            entry[1] = v_log_entry->data;
+            result = nv_log_insert(pool, entry, 1);
+        }
+    }
+    return result;
+}
+
+// write and flush the record of the tx in the log of the pool, with a {PART_SIG, decisive} entry first
+// if another pool decides the tx (decisive >= 0). The write pointer is restored if the ring is full
+static int nv_log_write(stm_tx_t *tx, stm_pool_t *pool, uint64_t commit_timestamp, int decisive) {
+    nv_log_begin_t begin_block = {.begin_flag = BEGIN_SIG, .length = nv_log_length(tx, pool) + (decisive >= 0)};
+    nv_log_end_t end_block = {.end_flag = END_SIG, .time_commit = commit_timestamp};
+    uint64_t part[2] = {PART_SIG, (uint64_t)decisive};
     // backup of write ptr
-    uint64_t write_offset = _tinystm.addition.nv_log->write_offset;
-    uint64_t write_block = _tinystm.addition.nv_log->write_block;
-    v_log_block_t  *v_log = tx->addition.v_log_block;
+    uint64_t write_offset = pool->nv_log->write_offset;
+    uint64_t write_block = pool->nv_log->write_block;
+    v_log_t *v_log = &tx->addition.v_log;
+    uint64_t run;
     int result = 0;
     
     // insert begin block
-    result = nv_log_insert((uint64_t *)&begin_block, 0);
-    if (result != 0) {
-        _tinystm.addition.nv_log->write_offset = write_offset;
-        _tinystm.addition.nv_log->write_block = write_block;
-        return result;
-    }
+    result = nv_log_insert(pool, (uint64_t *)&begin_block, 0);
+    if (result == 0 && decisive >= 0) result = nv_log_insert(pool, part, 1);
     
     // insert main logs
-    for (int record_num = 0; record_num < tx->addition.v_log_block->num; record_num++) {
-        if (record_num != 0 && record_num % V_LOG_LENGTH == 0) v_log = v_log->next;
-        result = nv_log_insert((uint64_t *)(&(v_log->v_logs[record_num % V_LOG_LENGTH])), 1);
-        if (result != 0) {
-            _tinystm.addition.nv_log->write_offset = write_offset;
-            _tinystm.addition.nv_log->write_block = write_block;
-            return result;
-        }
-        // if (record_num != 0 && record_num % V_LOG_LENGTH == 0) v_log = v_log->next;
+    for (uint64_t record_num = 0; record_num < v_log->num && result == 0; record_num += run) {
+        run = v_log_run(v_log, record_num);
+        if (v_log->v_logs[record_num].nv_addr == V_LOG_HOLE || NV_POOL_ID(v_log->v_logs[record_num].nv_addr) != pool->id) continue;
+        result = nv_log_insert_run(pool, v_log, record_num, run);
     }
 
     // insert end block
-    result = nv_log_insert((uint64_t *)&end_block, 2);
+    if (result == 0) result = nv_log_insert(pool, (uint64_t *)&end_block, 2);
     if (result != 0) {
-        _tinystm.addition.nv_log->write_offset = write_offset;
-        _tinystm.addition.nv_log->write_block = write_block;
+        pool->nv_log->write_offset = write_offset;
+        pool->nv_log->write_block = write_block;
         return result;
     }
+    NV_TRACE_POINT(tx, log_flushed, begin_block.length + 2);
+    NV_STAT_ADD(pool->nv_log, stat_appended, begin_block.length + 2);
+    NV_STAT_ADD(&tx->addition.stat, log_bytes, (begin_block.length + 2) * sizeof(nv_log_entry_t));
+    return 0;
+}
+
+// raise touch id before the log can be reproduced, snapshot readers rely on it
+static void nv_log_touch(stm_tx_t *tx, uint64_t commit_timestamp) {
+    v_log_t *v_log = &tx->addition.v_log;
 
-    //if (_tinystm.addition.nv_log->write_offset != 0) 
-    //    pmemobj_flush(_tinystm.addition.pool, (void *)_tinystm.addition.nv_log->write_block, sizeof(struct nv_log_block)); // flush
+    for (uint64_t record_num = 0; record_num < v_log->num; record_num++) {
+        if (v_log->v_logs[record_num].nv_addr == V_LOG_HOLE) continue;
+        page_touch(v_log->v_logs[record_num].nv_addr, commit_timestamp);
+    }
+    // blocks allocated by the tx were written home without log, incremental checkpoints copy them
+    for (unsigned int i = 0; i < tx->addition.alloc_nb; i++)
+        page_touch_range(tx->addition.alloc_range[i].nv_addr, tx->addition.alloc_range[i].size, commit_timestamp);
+}
+
+static int nv_log_append(stm_tx_t *tx, stm_pool_t *pool, uint64_t commit_timestamp) {
+    int result;
+
+    commit_timestamp = nv_log_timestamp(pool, commit_timestamp);
+    result = nv_log_write(tx, pool, commit_timestamp, -1);
+    if (result != 0) return result;
     
-    pmemobj_drain(_tinystm.addition.pool);
+    nv_drain(pool);
+    NV_STAT_ADD(pool->nv_log, stat_drains, 1);
+    NV_CRASH_POINT(NV_CRASH_LOG_DRAIN);
+    NV_TRACE_POINT(tx, log_drained, commit_timestamp);
+    NV_STAT_ADD(&tx->addition.stat, log_commits, 1);
+
+    nv_log_touch(tx, commit_timestamp);
     
     // persist log inf in root
-    struct pobj_action act[3];
-    pmemobj_set_value(_tinystm.addition.pool, &act[0], &_tinystm.addition.root->persist_block, _tinystm.addition.nv_log->write_block);
-    pmemobj_set_value(_tinystm.addition.pool, &act[1], &_tinystm.addition.root->persist_offset, _tinystm.addition.nv_log->write_offset);
-    pmemobj_set_value(_tinystm.addition.pool, &act[2], &_tinystm.addition.root->persist_timestamp, commit_timestamp + _tinystm.addition.nv_log->last_timestamp);
-    pmemobj_publish(_tinystm.addition.pool, act, 3);
+    nv_log_publish(pool, commit_timestamp, 0);
+    NV_TRACE_POINT(tx, log_published, commit_timestamp);
+    ATOMIC_STORE_REL(&pool->nv_log->commit_timestamp, commit_timestamp);
+    tx->addition.log_timestamp = commit_timestamp;
+    return 0;
+}
 
-    //tx->addition.v_log_block->num = 0; // delete v_log
+// a tx writing several pools writes a part in each of their logs, under the record locks taken in
+// the order of the ids, and with the largest time_commit of the pools. The parts are published in
+// that order: the tx is durable once the last pool, which decides it, has published it. Reproducers
+// replay the parts once commit_timestamp of every pool is set
+static int nv_log_append_parts(stm_tx_t *tx, uint64_t commit_timestamp) {
+    stm_pool_t *parts[NV_POOL_MAX];
+    uint64_t write_block[NV_POOL_MAX], write_offset[NV_POOL_MAX], time_commit = 0, t;
+    unsigned int nb = 0, i, j;
+    int decisive, result = 0;
+
+    for (uint64_t pools = tx->addition.log_pools; pools != 0; pools &= pools - 1)
+        parts[nb++] = _tinystm.addition.pools[__builtin_ctzll(pools)];
+    decisive = parts[nb - 1]->id;
+    for (i = 0; i < nb; i++) {
+        pthread_spin_lock(&parts[i]->nv_log->record_lock);
+        t = nv_log_timestamp(parts[i], commit_timestamp);
+        if (t > time_commit) time_commit = t;
+    }
+    NV_TRACE_POINT(tx, log_locked, tx->addition.v_log.num);
+
+    for (i = 0; i < nb && result == 0; i++) {
+        write_block[i] = parts[i]->nv_log->write_block;
+        write_offset[i] = parts[i]->nv_log->write_offset;
+        result = nv_log_write(tx, parts[i], time_commit, i + 1 < nb ? decisive : -1);
+    }
+    if (result != 0) {
+        // the caller reproduces the full log and retries: no part is left
+        tx->addition.log_full = parts[i - 1];
+        for (j = 0; j < i; j++) {
+            parts[j]->nv_log->write_block = write_block[j];
+            parts[j]->nv_log->write_offset = write_offset[j];
+        }
+        for (j = nb; j > 0; j--) pthread_spin_unlock(&parts[j - 1]->nv_log->record_lock);
+        return result;
+    }
+
+    for (i = 0; i < nb; i++) {
+        nv_drain(parts[i]);
+        NV_STAT_ADD(parts[i]->nv_log, stat_drains, 1);
+    }
+    NV_CRASH_POINT(NV_CRASH_LOG_DRAIN);
+    NV_TRACE_POINT(tx, log_drained, time_commit);
+    NV_STAT_ADD(&tx->addition.stat, log_commits, 1);
+
+    nv_log_touch(tx, time_commit);
+
+    for (i = 0; i < nb; i++)
+        nv_log_publish(parts[i], time_commit, i + 1 < nb ? 0 : tx->addition.log_pools);
+    NV_TRACE_POINT(tx, log_published, time_commit);
+    for (i = 0; i < nb; i++)
+        ATOMIC_STORE_REL(&parts[i]->nv_log->commit_timestamp, time_commit);
+    tx->addition.log_timestamp = time_commit;
+    for (j = nb; j > 0; j--) pthread_spin_unlock(&parts[j - 1]->nv_log->record_lock);
     return 0;
 }
 
-int nv_log_reproduce() {
-    if (_tinystm.addition.root->persist_timestamp == _tinystm.addition.root->reproduce_timestamp) return 0;
+int nv_log_record(stm_tx_t *tx, uint64_t commit_timestamp) {
+    uint64_t pools = tx->addition.log_pools;
+    stm_pool_t *pool;
+    int result;
+
+    // a tx that only locked has no record
+    if (tx->addition.v_log.num == 0 || pools == 0) return 0;
+    if ((pools & (pools - 1)) != 0) {
+        result = nv_log_append_parts(tx, commit_timestamp);
+    }
+    else {
+        pool = _tinystm.addition.pools[__builtin_ctzll(pools)];
+        pthread_spin_lock(&pool->nv_log->record_lock);
+        NV_TRACE_POINT(tx, log_locked, tx->addition.v_log.num);
+        result = nv_log_append(tx, pool, commit_timestamp);
+        pthread_spin_unlock(&pool->nv_log->record_lock);
+        if (result < 0) tx->addition.log_full = pool;
+    }
+    if (result < 0) NV_STAT_ADD(&tx->addition.stat, log_stalls, 1);
+    return result;
+}
+
+// reproduce a range record after its {RANGE_SIG, run} entry, return the entries read
+static uint64_t nv_log_replay_range(stm_pool_t *pool, uint64_t run) {
+    v_log_entry_t temp;
+    uint64_t *data;
+
+    nv_log_get(pool, &temp);
+    if (unlikely(_tinystm.addition.checkpoint)) checkpoint_save(NV_PTR(pool->id, temp.nv_addr), run * sizeof(uint64_t));
+    data = (uint64_t *)(temp.nv_addr + pool->base);
+    data[0] = temp.data;
+    for (uint64_t i = 1; i < run; i += 2) {
+        nv_log_get(pool, &temp);
+        data[i] = temp.nv_addr;
+        if (i + 1 < run) data[i + 1] = temp.data;
+    }
+    nv_flush(pool, data, run * sizeof(uint64_t));
+    return 1 + run / 2;
+}
 
-    // uint64_t read_offset = _tinystm.addition.nv_log->read_offset;
-    // uint64_t read_block = _tinystm.addition.nv_log->read_block;
+// reproduce the oldest tx of the log, return its number of entries
+static uint64_t nv_log_replay(stm_pool_t *pool) {
     v_log_entry_t temp;
     uint64_t log_length, commit_timestamp;
 
     // read begin block and get log length
-    nv_log_get(&temp);
-    //if (temp.nv_addr != BEGIN_SIG) return -1; // not the begin block
+    nv_log_get(pool, &temp);
     assert(temp.nv_addr == BEGIN_SIG);
     log_length = temp.data;
 
     // read log and persist real data
-    for (int i = 0; i < log_length; i ++) {
-        nv_log_get(&temp);
-        *((uint64_t *)(temp.nv_addr + _tinystm.addition.base)) = temp.data;
-        pmemobj_flush(_tinystm.addition.pool, (void *)(temp.nv_addr + _tinystm.addition.base), sizeof(uint64_t));
+    for (uint64_t i = 0; i < log_length; i ++) {
+        nv_log_get(pool, &temp);
+        if (temp.nv_addr == RANGE_SIG) {
+            i += nv_log_replay_range(pool, temp.data);
+            continue;
+        }
+        if (temp.nv_addr == PART_SIG) continue;
+        if (unlikely(_tinystm.addition.checkpoint)) checkpoint_save(NV_PTR(pool->id, temp.nv_addr), sizeof(uint64_t));
+        *((uint64_t *)(temp.nv_addr + pool->base)) = temp.data;
+        nv_flush(pool, (void *)(temp.nv_addr + pool->base), sizeof(uint64_t));
     }
     
-    pmemobj_drain(_tinystm.addition.pool);
+    nv_drain(pool);
     // read end block and persist metadata in root
-    nv_log_get(&temp);
-    //if (temp.nv_addr != END_SIG) return -1; // not the begin block
+    nv_log_get(pool, &temp);
     assert(temp.nv_addr == END_SIG);
     commit_timestamp = temp.data;
+    NV_CRASH_POINT(NV_CRASH_REPRODUCE);
 
     struct pobj_action act[3];
-    pmemobj_set_value(_tinystm.addition.pool, &act[0], &_tinystm.addition.root->reproduce_block, _tinystm.addition.nv_log->read_block);
-    pmemobj_set_value(_tinystm.addition.pool, &act[1], &_tinystm.addition.root->reproduce_offset, _tinystm.addition.nv_log->read_offset);
-    pmemobj_set_value(_tinystm.addition.pool, &act[2], &_tinystm.addition.root->reproduce_timestamp, commit_timestamp);
-    pmemobj_publish(_tinystm.addition.pool, act, 3);
+    pmemobj_set_value(pool->pop, &act[0], &pool->root->reproduce_block, pool->nv_log->read_block);
+    pmemobj_set_value(pool->pop, &act[1], &pool->root->reproduce_offset, pool->nv_log->read_offset);
+    pmemobj_set_value(pool->pop, &act[2], &pool->root->reproduce_timestamp, commit_timestamp);
+    pmemobj_publish(pool->pop, act, 3);
+    NV_STAT_ADD(pool->nv_log, stat_reproduced, 1);
+    return log_length;
+}
 
+// replay up to commit_timestamp, not persist_timestamp: the part of a tx spanning pools is not
+// replayed before the tx is published by all its pools
+int nv_log_reproduce(stm_pool_t *pool) {
+    nv_log_t *nv_log = pool->nv_log;
+
+    while (ATOMIC_LOAD_ACQ(&nv_log->commit_timestamp) != pool->root->reproduce_timestamp) {
+        // another thread is reproducing, it checks again for our log after unlock
+        if (pthread_spin_trylock(&nv_log->reproduce_lock) != 0) return 0;
+        NV_TRACE_POINT(tls_get_tx(), reproduce_start, pool->root->reproduce_timestamp);
+        while (ATOMIC_LOAD_ACQ(&nv_log->commit_timestamp) != pool->root->reproduce_timestamp)
+            nv_log_replay(pool);
+        NV_TRACE_POINT(tls_get_tx(), reproduce_end, pool->root->reproduce_timestamp);
+        pthread_spin_unlock(&nv_log->reproduce_lock);
+    }
     return 0;
 }
 
-void nv_log_save() {
-    nv_log_recovery();
-    pmemobj_close(_tinystm.addition.pool);
+void nv_log_reproduce_pools(uint64_t pools) {
+    for (; pools != 0; pools &= pools - 1)
+        nv_log_reproduce(_tinystm.addition.pools[__builtin_ctzll(pools)]);
+}
+
+void nv_log_save(stm_pool_t *pool) {
+    nv_log_recovery(pool);
+    pmemobj_close(pool->pop);
+    _tinystm.addition.pools[pool->id] = NULL;
+    while (_tinystm.addition.pool_nb > 0 && _tinystm.addition.pools[_tinystm.addition.pool_nb - 1] == NULL)
+        _tinystm.addition.pool_nb --;
+    free(pool->nv_log);
+    free(pool);
 }
 
 
-PMEMobjpool *pmem_init(char *pool_path) {
+stm_pool_t *pmem_init(const char *pool_path) {
     FILE *r = fopen(pool_path, "r");
+    PMEMobjpool *pop;
     PMEMoid Root;
+    struct root *root;
+    stm_pool_t *pool;
+    uint64_t id;
+
+    if (!_tinystm.addition.opened) {
+        init_emulate();
+# ifdef NV_CRASH
+        nv_crash_init();
+# endif
+    }
 
     if (r == NULL) {
-        PMEMobjpool *pop = pmemobj_create(pool_path, LAYOUT_NAME, POOL_SIZE, 0666);
-        _tinystm.addition.pool = pop;
+        // a new pool takes the lowest id not open
+        for (id = 0; id < NV_POOL_MAX && _tinystm.addition.pools[id] != NULL; id++);
+        if (id == NV_POOL_MAX) {
+            errno = EMFILE;
+            return NULL;
+        }
+        pop = pmemobj_create(pool_path, LAYOUT_NAME, POOL_SIZE, 0666);
+        if (pop == NULL) return NULL;
         Root = pmemobj_root(pop, sizeof(struct root));
-        _tinystm.addition.root = pmemobj_direct(Root);
-        _tinystm.addition.base = (uint64_t)_tinystm.addition.root - Root.off;
-        _tinystm.addition.nv_log = calloc(1, sizeof(nv_log_t));
-        nv_log_init();
+        root = pmemobj_direct(Root);
+        root->pool_id = id;
+        pmemobj_persist(pop, &root->pool_id, sizeof(root->pool_id));
     }
     else {
         fclose(r);
-        PMEMobjpool *pop = pmemobj_open(pool_path, LAYOUT_NAME);
-        _tinystm.addition.pool = pop;
+        pop = pmemobj_open(pool_path, LAYOUT_NAME);
+        if (pop == NULL) return NULL;
         Root = pmemobj_root(pop, sizeof(struct root));
-        _tinystm.addition.root = pmemobj_direct(Root);
-        _tinystm.addition.base = (uint64_t)_tinystm.addition.root - Root.off;
-        _tinystm.addition.nv_log = calloc(1, sizeof(nv_log_t));
-        nv_log_init();
+        root = pmemobj_direct(Root);
+        id = root->pool_id;
+        // the nv_ptrs of the pool, and those of other pools to it, hold its id
+        if (id >= NV_POOL_MAX || _tinystm.addition.pools[id] != NULL) {
+            pmemobj_close(pop);
+            errno = id >= NV_POOL_MAX ? EINVAL : EEXIST;
+            return NULL;
+        }
+    }
+
+    pool = (stm_pool_t *)calloc(1, sizeof(stm_pool_t));
+    pool->pop = pop;
+    pool->root = root;
+    pool->base = (uint64_t)root - Root.off;
+    pool->id = id;
+    pool->pending = -1;
+    pool->nv_log = calloc(1, sizeof(nv_log_t));
+    _tinystm.addition.pools[id] = pool;
+    if (id >= _tinystm.addition.pool_nb) _tinystm.addition.pool_nb = id + 1;
+    nv_log_init(pool);
+    // the pools whose last record waits for this one are decided now
+    for (unsigned int i = 0; i < _tinystm.addition.pool_nb; i++) {
+        if (_tinystm.addition.pools[i] != NULL && _tinystm.addition.pools[i]->pending == (int)id)
+            nv_log_recovery(_tinystm.addition.pools[i]);
     }
-    init_measure();
-    return _tinystm.addition.pool;
+    return pool;
 }
-# endif /* _LOG_H_ */
\ No newline at end of file
+# endif /* NV_DECLARE_ONLY */
+# endif /* _LOG_H_ */
@@ -2,6 +2,13 @@
 # define _MEASURE_H_
 
 # include "stm_internal.h"
+# include "tls.h"
+
+# define MEASURE_CALIBRATION 10000000           // nanoseconds spent calibrating the tick counter
+# define MEASURE_FILE        "MEASURE_FILE"     // environment: path of the results
+# define MEASURE_FILE_DEFAULT "./result.json"
+# define MEASURE_PERIOD      "MEASURE_PERIOD"   // environment: milliseconds between two snapshots
+# define MEASURE_VERSION     1
 
 
 
@@ -21,80 +28,221 @@ void collect_before_commit(stm_tx_t *tx, int if_flush, uint64_t commit_size); //
 
 void result_output(); //write result to file
 
+# ifndef NV_DECLARE_ONLY
+# ifdef ENABLE_MEASURE
+static const char *measure_names[MEASURE_NB] = {"v_log_size", "group_size", "group_commit", "flush_size", "delay_ns", "log_delay_ns"};
+
+// cycle counter where available: reading it costs a few ns and no system call
+static inline uint64_t measure_ticks() {
+#  if defined(__x86_64__) || defined(__i386__)
+    uint32_t a, d;
+    __asm__ __volatile__("rdtsc" : "=a" (a), "=d" (d));
+    return ((uint64_t)d << 32) | a;
+#  else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#  endif
+}
+
+static uint64_t measure_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t measure_ticks_to_ns(uint64_t ticks) {
+    return (uint64_t)(((unsigned __int128)ticks * _tinystm.addition.global_measure.ns_per_tick) >> 32);
+}
+
+// values below MEASURE_SUB are exact, larger ones keep MEASURE_SUB_BITS bits after the leading one
+static inline unsigned int measure_index(uint64_t value) {
+    unsigned int shift;
+
+    if (value < MEASURE_SUB) return value;
+    shift = 63 - __builtin_clzll(value) - MEASURE_SUB_BITS;
+    return (shift + 1) * MEASURE_SUB + (value >> shift) - MEASURE_SUB;
+}
+
+static inline void measure_record(stm_tx_t *tx, int hist, uint64_t value) {
+    tx->addition.tx_measure.measure->hist[hist][measure_index(value)] ++;
+}
+
+static uint64_t measure_value(unsigned int index) {
+    if (index < MEASURE_SUB) return index;
+    return (uint64_t)(MEASURE_SUB + index % MEASURE_SUB) << (index / MEASURE_SUB - 1);
+}
+
+// non-empty buckets as [lowest value, count] pairs
+static void measure_write_hist(FILE *f, const char *name, const uint64_t *hist) {
+    int first = 1;
+
+    fprintf(f, ", \"%s\": [", name);
+    for (unsigned int i = 0; i < MEASURE_BUCKETS; i++) {
+        if (hist[i] == 0) continue;
+        fprintf(f, "%s[%lu, %lu]", first ? "" : ", ", (unsigned long)measure_value(i), (unsigned long)hist[i]);
+        first = 0;
+    }
+    fprintf(f, "]");
+}
+
+// one line per thread and one for all threads, counters of running threads are read without lock
+static void measure_write(int final) {
+    global_measure_t *global = &_tinystm.addition.global_measure;
+    uint64_t (*hist)[MEASURE_BUCKETS] = calloc(MEASURE_NB, sizeof(*hist));
+    uint64_t *copy = malloc(MEASURE_BUCKETS * sizeof(uint64_t));
+    double time = (measure_ns() - global->start) / 1000000.0;
+    measure_thread_t *measure;
+    unsigned int threads = 0;
+
+    pthread_mutex_lock(&global->lock);
+    for (measure = global->threads; measure != NULL; measure = measure->next) {
+        fprintf(global->file, "{\"type\": \"thread\", \"time_ms\": %.3f, \"final\": %d, \"thread\": %lu", time, final, (unsigned long)measure->thread_nb);
+        for (int i = 0; i < MEASURE_NB; i++) {
+            for (int j = 0; j < MEASURE_BUCKETS; j++) {
+                copy[j] = ATOMIC_LOAD(&measure->hist[i][j]);
+                hist[i][j] += copy[j];
+            }
+            measure_write_hist(global->file, measure_names[i], copy);
+        }
+        fprintf(global->file, "}\n");
+        threads ++;
+    }
+    pthread_mutex_unlock(&global->lock);
+
+    fprintf(global->file, "{\"type\": \"total\", \"time_ms\": %.3f, \"final\": %d, \"threads\": %u", time, final, threads);
+    for (int i = 0; i < MEASURE_NB; i++) measure_write_hist(global->file, measure_names[i], hist[i]);
+    fprintf(global->file, "}\n");
+    fflush(global->file);
+    free(copy);
+    free(hist);
+}
+
+static void *measure_snapshot(void *arg) {
+    global_measure_t *global = &_tinystm.addition.global_measure;
+    struct timespec period = {global->period / 1000, (global->period % 1000) * 1000000L};
+
+    while (1) {
+        nanosleep(&period, NULL);
+        if (global->stop) break;
+        measure_write(0);
+    }
+    return NULL;
+}
+# endif /* ENABLE_MEASURE */
+
 void init_measure() {
     #ifdef ENABLE_MEASURE
-    memset(&_tinystm.addition.global_measure, 0, sizeof(global_measure_t));
+    global_measure_t *global = &_tinystm.addition.global_measure;
+    const char *flags;
+    uint64_t ns, ticks;
+    char *s;
+
+    pthread_mutex_init(&global->lock, NULL);
+    global->threads = NULL;
+
+    ns = measure_ns();
+    ticks = measure_ticks();
+    while (measure_ns() - ns < MEASURE_CALIBRATION);
+    ns = measure_ns() - ns;
+    ticks = measure_ticks() - ticks;
+    global->ns_per_tick = (ns << 32) / (ticks == 0 ? 1 : ticks);
+    global->start = measure_ns();
+
+    // the first line describes the run and the histograms
+    s = getenv(MEASURE_FILE);
+    global->file = fopen(s != NULL ? s : MEASURE_FILE_DEFAULT, "w");
+    if (global->file == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    if (!stm_get_parameter("compile_flags", &flags)) flags = "";
+    fprintf(global->file, "{\"type\": \"config\", \"version\": %d, \"compile_flags\": \"", MEASURE_VERSION);
+    for (; *flags != '\0'; flags++) {
+        if (*flags == '"' || *flags == '\\') fputc('\\', global->file);
+        fputc(*flags, global->file);
+    }
+    fprintf(global->file, "\", \"ns_per_tick\": %.6f, \"histograms\": [", global->ns_per_tick / 4294967296.0);
+    for (int i = 0; i < MEASURE_NB; i++) fprintf(global->file, "%s\"%s\"", i == 0 ? "" : ", ", measure_names[i]);
+    fprintf(global->file, "]");
+    #ifdef NV_EMULATE
+    // init_emulate() runs first
+    fprintf(global->file, ", \"emulate\": {\"write_ns\": %lu, \"drain_ns\": %lu, \"read_ns\": %lu, \"bandwidth\": %lu}",
+            (unsigned long)_tinystm.addition.global_emulate.write_ns, (unsigned long)_tinystm.addition.global_emulate.drain_ns,
+            (unsigned long)_tinystm.addition.global_emulate.read_ns, (unsigned long)_tinystm.addition.global_emulate.bandwidth);
+    #endif
+    fprintf(global->file, "}\n");
+
+    s = getenv(MEASURE_PERIOD);
+    global->period = s != NULL ? (unsigned int)strtol(s, NULL, 10) : 0;
+    global->stop = 0;
+    if (global->period != 0 && pthread_create(&global->snapshot, NULL, measure_snapshot, NULL) != 0) global->period = 0;
     #endif
 }
 
 void tx_init_measure(stm_tx_t *tx) {
     #ifdef ENABLE_MEASURE
+    global_measure_t *global = &_tinystm.addition.global_measure;
+    measure_thread_t *measure = (measure_thread_t *)calloc(1, sizeof(measure_thread_t));
+
     memset(&tx->addition.tx_measure, 0, sizeof(tx_measure_t));
+    measure->thread_nb = tx->addition.thread_nb;
+    tx->addition.tx_measure.measure = measure;
+    // kept after the thread exits, until the results are written
+    pthread_mutex_lock(&global->lock);
+    measure->next = global->threads;
+    global->threads = measure;
+    pthread_mutex_unlock(&global->lock);
     #endif
 }
 
 void collect_after_tx_start(stm_tx_t *tx) {
     #ifdef ENABLE_MEASURE
     if (!tx->attr.read_only) {
-        gettimeofday(&tx->addition.tx_measure.start_time[tx->addition.tx_measure.group_size ++], NULL);
+        tx->addition.tx_measure.start_time[tx->addition.tx_measure.group_size ++] = measure_ticks();
     }
     #endif
 }
 
 void collect_before_log_combine(stm_tx_t *tx) {
     #ifdef ENABLE_MEASURE
-    uint64_t v_log_num = tx->addition.v_log_block->num;
+    uint64_t v_log_num = tx->addition.v_log.num;
     if(v_log_num == 0) {
         tx->addition.tx_measure.group_size --;
         return;
     }
-    if (v_log_num < V_LOG_COLLECT_MAX) _tinystm.addition.global_measure.v_log_size_collect[v_log_num] ++;
-    else _tinystm.addition.global_measure.v_log_size_collect[V_LOG_COLLECT_MAX] ++;
+    measure_record(tx, MEASURE_V_LOG_SIZE, v_log_num);
     #endif
 }
 
 void collect_before_log_start(stm_tx_t *tx) {
     #ifdef ENABLE_MEASURE
-    gettimeofday(&tx->addition.tx_measure.log_start_time, NULL);
+    tx->addition.tx_measure.log_start_time = measure_ticks();
     #endif
 }
 
 void collect_before_log_flush(uint64_t flush_size) {
     #ifdef ENABLE_MEASURE
-    if (flush_size < FLUSH_COLLECT_MAX) _tinystm.addition.global_measure.flush_size_collect[flush_size] ++;
-    else _tinystm.addition.global_measure.flush_size_collect[FLUSH_COLLECT_MAX] ++;
+    // flushed by the committing thread, or by stm_exit without a tx
+    stm_tx_t *tx = tls_get_tx();
+    if (tx != NULL) measure_record(tx, MEASURE_FLUSH_SIZE, flush_size);
     #endif
 }
 
 void collect_before_commit(stm_tx_t *tx, int if_flush, uint64_t commit_size) {
     #ifdef ENABLE_MEASURE
-    struct timeval now_val;
-    uint64_t delay, group_size, log_delay;
+    uint64_t now;
 
     if (if_flush) {
         if(commit_size != 0) {
-            gettimeofday(&now_val, NULL);
+            now = measure_ticks();
 
             for(uint64_t i = 0; i < tx->addition.tx_measure.group_size; i ++) {
-                delay = 1000000 * (now_val.tv_sec - tx->addition.tx_measure.start_time[i].tv_sec) + \
-                now_val.tv_usec - tx->addition.tx_measure.start_time[i].tv_usec;
-                
-                if (delay < DELAY_COLLECT_MAX) _tinystm.addition.global_measure.delay_time_collect[delay] ++;
-                else _tinystm.addition.global_measure.delay_time_collect[DELAY_COLLECT_MAX] ++;
+                measure_record(tx, MEASURE_DELAY, measure_ticks_to_ns(now - tx->addition.tx_measure.start_time[i]));
             }
-
-            log_delay = 1000000 * (now_val.tv_sec - tx->addition.tx_measure.log_start_time.tv_sec) + \
-            now_val.tv_usec - tx->addition.tx_measure.log_start_time.tv_usec;
-            
-            if (log_delay < DELAY_COLLECT_MAX) _tinystm.addition.global_measure.log_delay_time_collect[log_delay] ++;
-            else _tinystm.addition.global_measure.log_delay_time_collect[DELAY_COLLECT_MAX] ++;
-
-            if(commit_size < GROUP_COLLECT_MAX) _tinystm.addition.global_measure.group_size_collect[commit_size] ++;
-            else _tinystm.addition.global_measure.group_size_collect[GROUP_COLLECT_MAX] ++;
-
-            group_size = tx->addition.tx_measure.group_size;
-            if(group_size < GROUP_COMMIT_MAX) _tinystm.addition.global_measure.group_commit_collect[group_size] ++;
-            else _tinystm.addition.global_measure.group_commit_collect[GROUP_COMMIT_MAX] ++;
+            measure_record(tx, MEASURE_LOG_DELAY, measure_ticks_to_ns(now - tx->addition.tx_measure.log_start_time));
+            measure_record(tx, MEASURE_GROUP_SIZE, commit_size);
+            measure_record(tx, MEASURE_GROUP_COMMIT, tx->addition.tx_measure.group_size);
         }
 
         tx->addition.tx_measure.group_size = 0;
@@ -102,12 +250,27 @@ void collect_before_commit(stm_tx_t *tx, int if_flush, uint64_t commit_size) {
     #endif
 }
 
+// last snapshot, then release the histograms of all threads
 void result_output() {
     #ifdef ENABLE_MEASURE
-    FILE *f = fopen("./result.bin", "wb");
-    fwrite(&_tinystm.addition.global_measure, sizeof(global_measure_t), 1, f);
-    fclose(f);
+    global_measure_t *global = &_tinystm.addition.global_measure;
+    measure_thread_t *measure;
+
+    if (global->period != 0) {
+        global->stop = 1;
+        pthread_join(global->snapshot, NULL);
+    }
+    measure_write(1);
+    fclose(global->file);
+
+    pthread_mutex_lock(&global->lock);
+    while ((measure = global->threads) != NULL) {
+        global->threads = measure->next;
+        free(measure);
+    }
+    pthread_mutex_unlock(&global->lock);
     #endif
 }
+# endif /* NV_DECLARE_ONLY */
 
-# endif /* _MEASURE_H_ */
\ No newline at end of file
+# endif /* _MEASURE_H_ */
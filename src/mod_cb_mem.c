@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libpmemobj.h>
 
 #include "mod_cb.h"
@@ -41,6 +42,7 @@
  * TYPES
  * ################################################################### */
 #define DEFAULT_CB_SIZE                 16
+#define DEFAULT_ACT_SIZE                16
 
 typedef struct mod_cb_entry {           /* Callback entry */
   void (*f)(void *);                    /* Function */
@@ -54,14 +56,24 @@ typedef struct mod_cb_info {
   unsigned short abort_size;            /* Array size for abort callbacks */
   unsigned short abort_nb;              /* Number of abort callbacks */
   mod_cb_entry_t *abort;                /* Abort callback entries */
+  size_t act_size;                      /* Array size for pmemobj actions */
+  size_t act_nb;                        /* Number of pmemobj actions */
+  struct pobj_action *act;              /* Reservations of the transaction */
+  PMEMobjpool **act_pools;              /* Pool of each reservation */
+  size_t free_size;                     /* Array size for deferred frees */
+  size_t free_nb;                       /* Number of deferred frees */
+  struct pobj_action *free;             /* Deferred frees, published after the reservations */
+  PMEMobjpool **free_pools;             /* Pool of each deferred free */
+  PMEMobjpool *act_pool;                /* Pool of the first action */
+  int act_mixed;                        /* Actions in several pools */
+  size_t split_size;                    /* Array size for the actions of one pool */
+  struct pobj_action *split;            /* Actions of one pool, when in several pools */
+  size_t slab_size;                     /* Array size for expired slab blocks */
+  size_t slab_nb;                       /* Number of expired slab blocks */
+  void **slab;                          /* Expired slab blocks, kept until freed by a commit */
+  int slab_tx;                          /* Expired slab blocks freed by the transaction */
 } mod_cb_info_t;
 
-typedef struct func_arg {
-  PMEMobjpool *pool;
-  struct pobj_action act;
-  PMEMoid oid;
-} func_arg_t;
-
 /* TODO: to avoid false sharing, this should be in a dedicated cacheline.
  * Unfortunately this will cost one cache line for each module. Probably
  * mod_cb_mem could be included always in mainline stm since allocation is
@@ -138,26 +150,204 @@ int stm_on_commit(void (*on_commit)(void *arg), void *arg)
  * MEMORY ALLOCATION FUNCTIONS
  * ################################################################### */
 
-// TODO: will init on alloced memory hurt consistence of page map structure?
-void act_on_commit(void *arg) {
-  func_arg_t *commit_arg = arg;
-  pmemobj_publish(commit_arg->pool, &commit_arg->act, 1);
-  free(commit_arg);
+/*
+ * Grow the reservations to hold size actions, with the pool of each.
+ */
+static INLINE void
+mod_cb_act_grow(mod_cb_info_t *icb, size_t size)
+{
+  if (size <= icb->act_size)
+    return;
+  icb->act_size = size;
+  icb->act = xrealloc(icb->act, sizeof(struct pobj_action) * icb->act_size);
+  icb->act_pools = xrealloc(icb->act_pools, sizeof(PMEMobjpool *) * icb->act_size);
 }
 
-void act_on_abort(void *arg) {
-  func_arg_t *abort_arg = arg;
-  pmemobj_cancel(abort_arg->pool, &abort_arg->act, 1);
-  free(abort_arg);
+/*
+ * Move the actions of a pool to the split array from index at, keeping
+ * the others in order.  Return the number of actions moved.
+ */
+static INLINE size_t
+mod_cb_act_split(mod_cb_info_t *icb, struct pobj_action *act, PMEMobjpool **pools, size_t *nb, PMEMobjpool *pool, size_t at)
+{
+  size_t i, n = 0, left = 0;
+
+  for (i = 0; i < *nb; i++) {
+    if (pools[i] == pool) {
+      icb->split[at + n++] = act[i];
+    } else {
+      act[left] = act[i];
+      pools[left++] = pools[i];
+    }
+  }
+  *nb = left;
+  return n;
+}
+
+/*
+ * Publish the actions of a transaction that allocated or freed in
+ * several pools: one redo log per pool.  The transaction is already
+ * durable in all of them.
+ */
+static void
+mod_cb_act_publish_split(mod_cb_info_t *icb)
+{
+  PMEMobjpool *pool;
+  size_t n, f;
+
+  if (unlikely(icb->act_nb + icb->free_nb > icb->split_size)) {
+    icb->split_size = icb->act_nb + icb->free_nb;
+    icb->split = xrealloc(icb->split, sizeof(struct pobj_action) * icb->split_size);
+  }
+  while (icb->act_nb + icb->free_nb > 0) {
+    pool = icb->act_nb > 0 ? icb->act_pools[0] : icb->free_pools[0];
+    n = mod_cb_act_split(icb, icb->act, icb->act_pools, &icb->act_nb, pool, 0);
+    f = mod_cb_act_split(icb, icb->free, icb->free_pools, &icb->free_nb, pool, n);
+    if (f > 0)
+      stm_checkpoint_publish(pool, icb->split, n + f, f);
+    else
+      pmemobj_publish(pool, icb->split, n);
+  }
+  icb->act_mixed = 0;
 }
 
+/*
+ * Publish all reservations and deferred frees of the transaction at once
+ * (a single redo log in libpmemobj).  The frees are held while a
+ * checkpoint is being written.
+ */
+static INLINE void
+mod_cb_act_publish(mod_cb_info_t *icb)
+{
+  if (unlikely(icb->act_mixed)) {
+    mod_cb_act_publish_split(icb);
+    return;
+  }
+  if (icb->free_nb > 0) {
+    mod_cb_act_grow(icb, icb->act_nb + icb->free_nb);
+    memcpy(icb->act + icb->act_nb, icb->free, sizeof(struct pobj_action) * icb->free_nb);
+    stm_checkpoint_publish(icb->act_pool, icb->act, icb->act_nb + icb->free_nb, icb->free_nb);
+  } else if (icb->act_nb > 0) {
+    pmemobj_publish(icb->act_pool, icb->act, icb->act_nb);
+  }
+  icb->act_nb = icb->free_nb = 0;
+}
+
+static INLINE void
+mod_cb_act_cancel(mod_cb_info_t *icb)
+{
+  size_t i;
+
+  if (unlikely(icb->act_mixed)) {
+    for (i = 0; i < icb->act_nb; i++)
+      pmemobj_cancel(icb->act_pools[i], &icb->act[i], 1);
+    for (i = 0; i < icb->free_nb; i++)
+      pmemobj_cancel(icb->free_pools[i], &icb->free[i], 1);
+    icb->act_nb = icb->free_nb = 0;
+    icb->act_mixed = 0;
+  }
+  if (icb->act_nb > 0) {
+    pmemobj_cancel(icb->act_pool, icb->act, icb->act_nb);
+    icb->act_nb = 0;
+  }
+  if (icb->free_nb > 0) {
+    pmemobj_cancel(icb->act_pool, icb->free, icb->free_nb);
+    icb->free_nb = 0;
+  }
+}
+
+/*
+ * Note the pool of a new action: the actions of a transaction are
+ * published at once if they are all in the same pool.
+ */
+static INLINE void
+mod_cb_act_pool(mod_cb_info_t *icb, PMEMobjpool *pool)
+{
+  if (icb->act_nb == 0 && icb->free_nb == 0)
+    icb->act_pool = pool;
+  else if (icb->act_pool != pool)
+    icb->act_mixed = 1;
+}
+
+/*
+ * Get a new action slot for the transaction.
+ */
+static INLINE struct pobj_action *
+mod_cb_act_add(mod_cb_info_t *icb, PMEMobjpool *pool)
+{
+  if (unlikely(icb->act_nb >= icb->act_size))
+    mod_cb_act_grow(icb, icb->act_size * 2);
+  mod_cb_act_pool(icb, pool);
+  icb->act_pools[icb->act_nb] = pool;
+  return &icb->act[icb->act_nb++];
+}
+
+/*
+ * Get a new deferred free slot for the transaction.
+ */
+static INLINE struct pobj_action *
+mod_cb_free_add(mod_cb_info_t *icb, PMEMobjpool *pool)
+{
+  if (unlikely(icb->free_nb >= icb->free_size)) {
+    icb->free_size *= 2;
+    icb->free = xrealloc(icb->free, sizeof(struct pobj_action) * icb->free_size);
+    icb->free_pools = xrealloc(icb->free_pools, sizeof(PMEMobjpool *) * icb->free_size);
+  }
+  mod_cb_act_pool(icb, pool);
+  icb->free_pools[icb->free_nb] = pool;
+  return &icb->free[icb->free_nb++];
+}
+
+#ifdef EPOCH_GC
+static void
+epoch_free(void *addr)
+{
+  /* TODO use tx->end could be also used */
+  stm_word_t t = stm_get_clock();
+  gc_free_pmem(pmemobj_pool_by_ptr(addr), pmemobj_oid(addr), t);
+}
+
+static void
+epoch_free_slab(void *addr)
+{
+  stm_word_t t = stm_get_clock();
+  gc_free_slab(addr, t);
+}
+
+/*
+ * Free in the transaction the slab blocks that no transaction can read
+ * anymore.  They are kept until a transaction freeing them commits.
+ */
+static INLINE void
+mod_cb_slab_expired(struct stm_tx *tx, mod_cb_info_t *icb)
+{
+  void *addr;
+  size_t i;
+
+  if (icb->slab_tx)
+    return;
+  while ((addr = gc_expired_slab()) != NULL) {
+    if (unlikely(icb->slab_nb >= icb->slab_size)) {
+      icb->slab_size = (icb->slab_size == 0 ? DEFAULT_ACT_SIZE : icb->slab_size * 2);
+      icb->slab = xrealloc(icb->slab, sizeof(void *) * icb->slab_size);
+    }
+    icb->slab[icb->slab_nb++] = addr;
+  }
+  for (i = 0; i < icb->slab_nb; i++)
+    stm_slab_free_tx(tx, ptr_to_nv(icb->slab[i]));
+  icb->slab_tx = 1;
+}
+#endif /* EPOCH_GC */
+
+// TODO: will init on alloced memory hurt consistence of page map structure?
 static INLINE void *
-int_stm_malloc(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *pool)
+int_stm_malloc(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *pool, nv_ptr hint)
 {
   /* Memory will be freed upon abort */
   mod_cb_info_t *icb;
   void *addr;
-  func_arg_t *arg = xmalloc(sizeof(func_arg_t));
+  nv_ptr nv_addr;
+  PMEMoid oid;
 
   assert(mod_cb.key >= 0);
   icb = (mod_cb_info_t *)stm_get_specific(mod_cb.key);
@@ -170,12 +360,28 @@ int_stm_malloc(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *p
     size = (size + 7) & ~(size_t)0x07;
   }
 
-  arg->pool = pool;
-  arg->oid = pmemobj_reserve(pool, &arg->act, size, type_num);
-  addr = pmemobj_direct(arg->oid);
+#ifdef EPOCH_GC
+  if (mod_cb.use_gc)
+    mod_cb_slab_expired(tx, icb);
+#endif /* EPOCH_GC */
+  /* Small blocks come from the slabs of the pool: the allocation is part of the transaction */
+  if (hint != 0 && pmemobj_pool_by_ptr(nv_to_ptr(hint)) == pool)
+    nv_addr = stm_slab_alloc_near_tx(tx, size, hint);
+  else
+    nv_addr = stm_slab_alloc_pool_tx(tx, stm_pool_by_pmem(pool), size);
+  if (nv_addr != 0) {
+    stm_alloc_range_tx(tx, nv_addr, size);
+    return nv_to_ptr(nv_addr);
+  }
 
-  mod_cb_add_on_abort(icb, act_on_abort, arg);
-  mod_cb_add_on_commit(icb, act_on_commit, arg);
+  /* Reservation is published upon commit and cancelled upon abort */
+  oid = pmemobj_reserve(pool, mod_cb_act_add(icb, pool), size, type_num);
+  addr = pmemobj_direct(oid);
+  /* Reserved block is invisible until publish: initialize it without log */
+  if (addr != NULL)
+    stm_alloc_range_tx(tx, ptr_to_nv(addr), size);
+  else
+    icb->act_nb--;
 
   return addr;
 }
@@ -186,12 +392,26 @@ int_stm_malloc(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *p
 void *stm_malloc(size_t size, uint64_t type_num, PMEMobjpool *pool)
 {
   struct stm_tx *tx = stm_current_tx();
-  return int_stm_malloc(tx, size, type_num, pool);
+  return int_stm_malloc(tx, size, type_num, pool, 0);
 }
 
 void *stm_malloc_tx(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *pool)
 {
-  return int_stm_malloc(tx, size, type_num, pool);
+  return int_stm_malloc(tx, size, type_num, pool, 0);
+}
+
+/*
+ * Called by the CURRENT thread to allocate memory close to a block within a transaction.
+ */
+void *stm_malloc_near(size_t size, uint64_t type_num, PMEMobjpool *pool, nv_ptr hint)
+{
+  struct stm_tx *tx = stm_current_tx();
+  return int_stm_malloc(tx, size, type_num, pool, hint);
+}
+
+void *stm_malloc_near_tx(struct stm_tx *tx, size_t size, uint64_t type_num, PMEMobjpool *pool, nv_ptr hint)
+{
+  return int_stm_malloc(tx, size, type_num, pool, hint);
 }
 
 static inline
@@ -233,20 +453,6 @@ void *stm_calloc_tx(struct stm_tx *tx, size_t nm, size_t size)
   return int_stm_calloc(tx, nm, size);
 }
 
-#ifdef EPOCH_GC
-static void
-epoch_free(void *addr)
-{
-  if (mod_cb.use_gc) {
-    /* TODO use tx->end could be also used */
-    stm_word_t t = stm_get_clock();
-    gc_free(addr, t);
-  } else {
-    xfree(addr);
-  }
-}
-#endif /* EPOCH_GC */
-
 static inline
 void int_stm_free2(struct stm_tx *tx, void *addr, size_t idx, size_t size, PMEMobjpool *pool)
 {
@@ -256,7 +462,6 @@ void int_stm_free2(struct stm_tx *tx, void *addr, size_t idx, size_t size, PMEMo
   assert(mod_cb.key >= 0);
   icb = (mod_cb_info_t *)stm_get_specific(mod_cb.key);
   assert(icb != NULL);
-  func_arg_t *arg = xmalloc(sizeof(func_arg_t));
 
   /* TODO: if block allocated in same transaction => no need to overwrite */
   if (size > 0) {
@@ -276,17 +481,24 @@ void int_stm_free2(struct stm_tx *tx, void *addr, size_t idx, size_t size, PMEMo
     }
   }
 
-  arg->pool = pool;
-  arg->oid = pmemobj_oid(addr);
-  pmemobj_defer_free(pool, arg->oid, &arg->act);
+  stm_free_range_tx(tx, ptr_to_nv(addr));
 
   /* Schedule for removal */
 #ifdef EPOCH_GC
-  mod_cb_add_on_commit(icb, epoch_free, addr);
-#else /* ! EPOCH_GC */
-  mod_cb_add_on_abort(icb, act_on_abort, arg);
-  mod_cb_add_on_commit(icb, act_on_commit, arg);
-#endif /* ! EPOCH_GC */
+  if (mod_cb.use_gc) {
+    mod_cb_slab_expired(tx, icb);
+    /* Published, or freed by a later transaction for blocks of the
+     * slabs, once transactions that may still read the block are over */
+    mod_cb_add_on_commit(icb, stm_slab_block(ptr_to_nv(addr)) ? epoch_free_slab : epoch_free, addr);
+    return;
+  }
+#endif /* EPOCH_GC */
+  /* Blocks of the slabs are released by the transaction itself */
+  if (stm_slab_free_tx(tx, ptr_to_nv(addr)))
+    return;
+  /* Deferred free is published upon commit together with the reservations */
+  if (pmemobj_defer_free(pool, pmemobj_oid(addr), mod_cb_free_add(icb, pool)) != 0)
+    icb->free_nb--;
 }
 
 /*
@@ -328,6 +540,13 @@ static void mod_cb_on_commit(void *arg)
   icb = (mod_cb_info_t *)stm_get_specific(mod_cb.key);
   assert(icb != NULL);
 
+  /* Publish allocations and frees */
+  mod_cb_act_publish(icb);
+  /* Expired slab blocks are free */
+  if (icb->slab_tx) {
+    icb->slab_nb = 0;
+    icb->slab_tx = 0;
+  }
   /* Call commit callback */
   while (icb->commit_nb > 0) {
     icb->commit_nb--;
@@ -347,6 +566,10 @@ static void mod_cb_on_abort(void *arg)
   icb = (mod_cb_info_t *)stm_get_specific(mod_cb.key);
   assert(icb != NULL);
 
+  /* Release reservations */
+  mod_cb_act_cancel(icb);
+  /* Expired slab blocks are freed again by the next transaction */
+  icb->slab_tx = 0;
   /* Call abort callback */
   while (icb->abort_nb > 0) {
     icb->abort_nb--;
@@ -368,6 +591,21 @@ static void mod_cb_on_thread_init(void *arg)
   icb->commit_size = icb->abort_size = DEFAULT_CB_SIZE;
   icb->commit = xmalloc(sizeof(mod_cb_entry_t) * icb->commit_size);
   icb->abort = xmalloc(sizeof(mod_cb_entry_t) * icb->abort_size);
+  icb->act_nb = 0;
+  icb->act_size = DEFAULT_ACT_SIZE;
+  icb->act = xmalloc(sizeof(struct pobj_action) * icb->act_size);
+  icb->act_pools = xmalloc(sizeof(PMEMobjpool *) * icb->act_size);
+  icb->free_nb = 0;
+  icb->free_size = DEFAULT_ACT_SIZE;
+  icb->free = xmalloc(sizeof(struct pobj_action) * icb->free_size);
+  icb->free_pools = xmalloc(sizeof(PMEMobjpool *) * icb->free_size);
+  icb->act_pool = NULL;
+  icb->act_mixed = 0;
+  icb->split_size = 0;
+  icb->split = NULL;
+  icb->slab_size = icb->slab_nb = 0;
+  icb->slab = NULL;
+  icb->slab_tx = 0;
 
   stm_set_specific(mod_cb.key, icb);
 }
@@ -382,6 +620,17 @@ static void mod_cb_on_thread_exit(void *arg)
   icb = (mod_cb_info_t *)stm_get_specific(mod_cb.key);
   assert(icb != NULL);
 
+#ifdef EPOCH_GC
+  /* Expired slab blocks not freed yet go to the next thread of the slot */
+  while (icb->slab_nb > 0)
+    epoch_free_slab(icb->slab[--icb->slab_nb]);
+#endif /* EPOCH_GC */
+  xfree(icb->slab);
+  xfree(icb->split);
+  xfree(icb->free_pools);
+  xfree(icb->free);
+  xfree(icb->act_pools);
+  xfree(icb->act);
   xfree(icb->abort);
   xfree(icb->commit);
   xfree(icb);
@@ -0,0 +1,292 @@
+/*
+ * File:
+ *   mod_tune.c
+ * Description:
+ *   Module for tuning the lock array at runtime.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This program has a dual license and can also be distributed
+ * under the terms of the MIT license.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "mod_tune.h"
+
+#include "atomic.h"
+#include "stm.h"
+#include "utils.h"
+
+/* ################################################################### *
+ * TYPES
+ * ################################################################### */
+
+#define PERIOD_DEFAULT                  100                 /* Milliseconds between two steps */
+#define FLUSH_PERIOD                    256                 /* Commits between two updates of global counters */
+#define TOLERANCE                       0.05                /* Loss of throughput considered as noise */
+#define CONFLICT_RATIO                  0.3                 /* Abort ratio above which conflicts guide the search */
+
+enum {
+  DIM_SHIFT = 0,                        /* Lock granularity */
+  DIM_SIZE = 1                          /* Number of locks */
+};
+
+typedef struct mod_tune_data {          /* Per-thread counters */
+  unsigned long commits;                /* Commits since last flush */
+  unsigned long aborts;                 /* Aborts since last flush */
+  unsigned long locked;                 /* Aborts on locked data (cumulative, if known) */
+  unsigned long locked_flushed;         /* Aborts on locked data at last flush */
+} mod_tune_data_t;
+
+typedef struct mod_tune_state {         /* Search state */
+  unsigned long commits;                /* Flushed commits */
+  unsigned long aborts;                 /* Flushed aborts */
+  unsigned long locked;                 /* Flushed aborts on locked data */
+  volatile stm_word_t busy;             /* Is a thread performing a step? */
+  uint64_t last;                        /* Time of last step (microseconds) */
+  unsigned long last_commits;
+  unsigned long last_aborts;
+  unsigned long last_locked;
+  double best;                          /* Throughput of the last kept configuration */
+  int param[2];                         /* Current configuration */
+  int dim;                              /* Parameter being explored */
+  int dir;                              /* Direction of the moves (+1/-1) */
+  int moved;                            /* Was the configuration changed at last step? */
+  int failed;                           /* Number of undone moves along current parameter */
+} mod_tune_state_t;
+
+static const char *mod_tune_names[2] = { "lock_shift_extra", "lock_array_log_size" };
+
+static int mod_tune_key;
+static int mod_tune_initialized = 0;
+static uint64_t mod_tune_period;
+
+static mod_tune_state_t mod_tune;
+
+/* ################################################################### *
+ * FUNCTIONS
+ * ################################################################### */
+
+/*
+ * Returns the current time in microseconds.
+ */
+static inline uint64_t get_time(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Preferred direction along a parameter.  Under heavy conflicts on
+ * locked data, try finer locks and more locks first (less false
+ * sharing); otherwise try coarser locks and fewer locks first (fewer
+ * lock acquisitions, smaller cache footprint).
+ */
+static int mod_tune_direction(int dim, int conflicts)
+{
+  if (dim == DIM_SHIFT)
+    return conflicts ? -1 : 1;
+  return conflicts ? 1 : -1;
+}
+
+/*
+ * Change one parameter (returns 0 if not possible).
+ */
+static int mod_tune_set(int dim, int value)
+{
+  if (!stm_set_parameter(mod_tune_names[dim], &value))
+    return 0;
+  mod_tune.param[dim] = value;
+  return 1;
+}
+
+/*
+ * Perform one step of hill-climbing (called by a single thread).
+ */
+static void mod_tune_step(uint64_t now)
+{
+  unsigned long commits, aborts, locked;
+  double throughput;
+  int conflicts, tries;
+
+  commits = ATOMIC_LOAD(&mod_tune.commits) - mod_tune.last_commits;
+  aborts = ATOMIC_LOAD(&mod_tune.aborts) - mod_tune.last_aborts;
+  locked = ATOMIC_LOAD(&mod_tune.locked) - mod_tune.last_locked;
+  mod_tune.last_commits += commits;
+  mod_tune.last_aborts += aborts;
+  mod_tune.last_locked += locked;
+  throughput = (double)commits * 1000000 / (now - mod_tune.last);
+  /* Without abort reasons, consider that all aborts are conflicts on locked data */
+  conflicts = aborts > CONFLICT_RATIO * (commits + aborts) && (locked == 0 || 2 * locked > aborts);
+
+  if (mod_tune.moved && throughput < mod_tune.best * (1 - TOLERANCE)) {
+    /* Worse: undo the move and measure again before exploring the other direction */
+    mod_tune_set(mod_tune.dim, mod_tune.param[mod_tune.dim] - mod_tune.dir);
+    mod_tune.moved = 0;
+    mod_tune.dir = -mod_tune.dir;
+    if (++mod_tune.failed >= 2) {
+      /* Both directions failed: explore the other parameter */
+      mod_tune.dim = 1 - mod_tune.dim;
+      mod_tune.dir = mod_tune_direction(mod_tune.dim, conflicts);
+      mod_tune.failed = 0;
+    }
+    goto end;
+  }
+
+  /* Keep the configuration and move further */
+  if (mod_tune.moved)
+    mod_tune.failed = 0;
+  mod_tune.best = throughput;
+  mod_tune.moved = 0;
+  for (tries = 0; tries < 4 && !mod_tune.moved; tries++) {
+    if (mod_tune_set(mod_tune.dim, mod_tune.param[mod_tune.dim] + mod_tune.dir)) {
+      mod_tune.moved = 1;
+    } else if (tries & 1) {
+      /* Out of range in both directions */
+      mod_tune.dim = 1 - mod_tune.dim;
+      mod_tune.dir = mod_tune_direction(mod_tune.dim, conflicts);
+    } else {
+      mod_tune.dir = -mod_tune.dir;
+    }
+  }
+
+ end:
+  /* Do not count the time spent changing the configuration */
+  mod_tune.last = get_time();
+}
+
+/*
+ * Add local counters to global counters and perform a step if needed.
+ */
+static void mod_tune_flush(mod_tune_data_t *data, int step)
+{
+  unsigned int r, w;
+  uint64_t now;
+
+  ATOMIC_FETCH_ADD_FULL(&mod_tune.commits, data->commits);
+  ATOMIC_FETCH_ADD_FULL(&mod_tune.aborts, data->aborts);
+  data->commits = data->aborts = 0;
+  /* Abort reasons are only known with TM_STATISTICS2 */
+  if (stm_get_stats("nb_aborts_locked_read", &r) && stm_get_stats("nb_aborts_locked_write", &w)) {
+    data->locked = (unsigned long)r + w;
+    ATOMIC_FETCH_ADD_FULL(&mod_tune.locked, data->locked - data->locked_flushed);
+    data->locked_flushed = data->locked;
+  }
+
+  if (!step)
+    return;
+  now = get_time();
+  if (now - ATOMIC_LOAD(&mod_tune.last) < mod_tune_period)
+    return;
+  if (ATOMIC_CAS_FULL(&mod_tune.busy, 0, 1) == 0)
+    return;
+  /* Check again as another thread may have just performed a step */
+  if (now - ATOMIC_LOAD(&mod_tune.last) >= mod_tune_period)
+    mod_tune_step(now);
+  ATOMIC_STORE_REL(&mod_tune.busy, 0);
+}
+
+/*
+ * Called upon thread creation.
+ */
+static void mod_tune_on_thread_init(void *arg)
+{
+  mod_tune_data_t *data;
+
+  data = (mod_tune_data_t *)xmalloc(sizeof(mod_tune_data_t));
+  data->commits = 0;
+  data->aborts = 0;
+  data->locked = 0;
+  data->locked_flushed = 0;
+
+  stm_set_specific(mod_tune_key, data);
+}
+
+/*
+ * Called upon thread deletion.
+ */
+static void mod_tune_on_thread_exit(void *arg)
+{
+  mod_tune_data_t *data;
+
+  data = (mod_tune_data_t *)stm_get_specific(mod_tune_key);
+  assert(data != NULL);
+
+  mod_tune_flush(data, 0);
+
+  xfree(data);
+}
+
+/*
+ * Called upon transaction commit.
+ */
+static void mod_tune_on_commit(void *arg)
+{
+  mod_tune_data_t *data;
+
+  data = (mod_tune_data_t *)stm_get_specific(mod_tune_key);
+  assert(data != NULL);
+
+  /* The transaction is not active anymore: the lock array can be changed */
+  if (++data->commits >= FLUSH_PERIOD)
+    mod_tune_flush(data, 1);
+}
+
+/*
+ * Called upon transaction abort.
+ */
+static void mod_tune_on_abort(void *arg)
+{
+  mod_tune_data_t *data;
+
+  data = (mod_tune_data_t *)stm_get_specific(mod_tune_key);
+  assert(data != NULL);
+
+  data->aborts++;
+}
+
+/*
+ * Initialize module.
+ */
+void mod_tune_init(unsigned long period)
+{
+  int supported;
+
+  if (mod_tune_initialized)
+    return;
+
+  if (!stm_get_parameter("lock_tuning", &supported)) {
+    fprintf(stderr, "Lock tuning not supported (compile with LOCK_TUNING)\n");
+    exit(1);
+  }
+  if (!stm_register(mod_tune_on_thread_init, mod_tune_on_thread_exit, NULL, NULL, mod_tune_on_commit, mod_tune_on_abort, NULL)) {
+    fprintf(stderr, "Cannot register callbacks\n");
+    exit(1);
+  }
+  mod_tune_key = stm_create_specific();
+  if (mod_tune_key < 0) {
+    fprintf(stderr, "Cannot create specific key\n");
+    exit(1);
+  }
+
+  mod_tune_period = (uint64_t)(period == 0 ? PERIOD_DEFAULT : period) * 1000;
+  stm_get_parameter(mod_tune_names[DIM_SHIFT], &mod_tune.param[DIM_SHIFT]);
+  stm_get_parameter(mod_tune_names[DIM_SIZE], &mod_tune.param[DIM_SIZE]);
+  mod_tune.dim = DIM_SHIFT;
+  mod_tune.dir = 1;
+  mod_tune.last = get_time();
+  mod_tune_initialized = 1;
+}
@@ -2,24 +2,42 @@
 # define _PAGE_H_
 
 # include "stm_internal.h"
+# if defined(__SSE2__) && defined(__x86_64__)
+# include <emmintrin.h>
+# define PAGE_STREAM_STORE                                  // non-temporal stores to nv_page
+# endif
+# define PAGE_MOVNT_THRESHOLD   256                         // smaller blocks use stores and flush, as in libpmem
 
 # define PAGE_LENGTH    12
 # define PAGE_SIZE      (1 << PAGE_LENGTH)                  // 4K
 
-// NVM and DRAM size
+// NVM and DRAM size. DRAM_LENGTH may be set smaller (make DRAM=<n>): the v_pages are then a cache
+// of the nv_pages, a page is replaced when another one is mapped
 # ifndef SMALL_POOL
 # define NVM_LENGTH     30
-# define DRAM_LENGTH    30
 # else
 # define NVM_LENGTH     27
-# define DRAM_LENGTH    27
+# endif
+# ifndef DRAM_LENGTH
+# define DRAM_LENGTH    NVM_LENGTH
+# endif
+# if DRAM_LENGTH > NVM_LENGTH || DRAM_LENGTH < PAGE_LENGTH + 8
+#  error "DRAM_LENGTH must be at most NVM_LENGTH and leave at least 256 v_pages"
 # endif
 
 # define VPN_NUM        (1 << (NVM_LENGTH - PAGE_LENGTH))   // 64k
 # define PPN_LENGTH     (DRAM_LENGTH - PAGE_LENGTH)         // 18
 # define VPN_LENGTH     (NVM_LENGTH - PAGE_LENGTH)          // 18
 # define PPN_NUM        (1 << (DRAM_LENGTH - PAGE_LENGTH))  // 64k
-# define MAP_INIT
+# if DRAM_LENGTH == NVM_LENGTH
+# define MAP_INIT                                           // every nv_page has a v_page, a mapped page is never replaced
+# endif
+
+# define TYPE_NV_HOT        2049                            // pmemobj type of the hot set
+# define PAGE_HOT_PERIOD    "NV_HOT_PERIOD"                 // environment: milliseconds between two saves of the hot set
+# define PAGE_HOT_THREADS   8                               // threads copying the pages mapped at start
+# define PAGE_HOT_CHUNK     64                              // pages copied by a thread at once
+# define PAGE_PIN_SIZE      64                              // initial number of pages pinned by a tx
 
 typedef union v_page_inf { // 页表有效信息放在易失页表项可以利用CAS操作，替换与映射将操作同一变量
     struct {
@@ -40,21 +58,61 @@ struct free_page_head {
     uint32_t free_num;
     pthread_spinlock_t lock;
     free_page_entry_t *head;
-} free_page_head;
+};
 
 typedef struct page_entry {
     uint64_t touch_id;
     free_page_entry_t *free_page;
 } page_entry_t;
 
-
-void page_init();
+// page table and v_pages of a pool, indexed by the VPN of the offset in the pool. The table is
+// allocated when the pool is opened, the v_pages when it is mapped
+struct page_pool {
+    struct free_page_head free_page_head;
+    page_entry_t page_table[VPN_NUM];
+};
+
+// persistent, VPNs mapped to v_pages when the pool was last used, most recently written first.
+// Only a hint: page_init() checks the VPNs, a set torn by a crash is at worst partly empty. Its
+// size is the PPN_NUM of the run that allocated it, DRAM= may differ from one run to the next
+typedef struct nv_hot {
+    uint64_t nb;                        // 0 while the set is written
+    uint64_t timestamp;                 // reproduce_timestamp when the set was saved
+    uint64_t size;                      // VPNs the set can hold
+    uint32_t VPN[];
+} nv_hot_t;
+
+
+void page_open(stm_pool_t *pool);
+void page_init(stm_pool_t *pool);
+void page_map_pools();
+void page_exit(stm_pool_t *pool);
+void tx_init_page(stm_tx_t *tx);
+void tx_exit_page(stm_tx_t *tx);
 uint64_t *page_use(stm_tx_t *tx, uint64_t nv_addr);
 void page_free(stm_tx_t *tx, uint64_t nv_addr, uint64_t commit_timestamp);
+void page_unpin(stm_tx_t *tx);
+void page_touch(uint64_t nv_addr, uint64_t commit_timestamp);
+int page_read_home(uint64_t nv_addr, uint64_t timestamp, uint64_t *value);
+void page_write_alloc(stm_tx_t *tx, alloc_range_t *range, uint64_t nv_addr, uint64_t value, uint64_t mask);
+void page_persist_alloc(stm_tx_t *tx);
+void page_hot_save(stm_pool_t *pool);
+void page_hot_exit();
 
 # include "stm_internal.h"
-// global
-page_entry_t page_table[VPN_NUM];
+
+# ifndef NV_DECLARE_ONLY
+static struct {
+    pthread_mutex_t lock;               // one save at a time, stop
+    pthread_cond_t cond;
+    pthread_t thread;
+    unsigned int period;                // ms, 0 if no thread saves the set
+    int stop;
+    stm_pool_t *pool;                   // pool mapped by page_init()
+    free_page_entry_t **nodes;          // v_pages mapped by page_init(), copied by the threads
+    uint64_t nodes_nb;
+    volatile stm_word_t next;           // next node to copy
+} page_hot = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
 
 static inline uint64_t v_page_alloc() {
     return (uint64_t)aligned_alloc(PAGE_SIZE, PAGE_SIZE) >> PAGE_LENGTH;
@@ -64,117 +122,283 @@ static inline uint64_t *addr_nv_2_v(uint64_t PPN, uint64_t nv_addr) {
     return (uint64_t *)((PPN << PAGE_LENGTH) | ((PAGE_SIZE - 1) & nv_addr));
 }
 
+// entry of the page table of the pool of nv_addr
+static inline page_entry_t *page_entry_of(uint64_t nv_addr) {
+    return &NV_POOL(nv_addr)->page->page_table[NV_OFF(nv_addr) >> PAGE_LENGTH];
+}
+
 // move a node from tail to head
-static inline void free_page_roll() {
-    free_page_head.head = free_page_head.head->next;
+static inline void free_page_roll(struct free_page_head *free_page_head) {
+    free_page_head->head = free_page_head->head->next;
 }
 
 // cp nvpage to vpage
-static inline void page_cp(uint64_t PPN, uint64_t VPN) {
-    memcpy((void *)(PPN << PAGE_LENGTH), (void *)((VPN << PAGE_LENGTH) + _tinystm.addition.base), PAGE_SIZE);
+static inline void page_cp(stm_pool_t *pool, uint64_t PPN, uint64_t VPN) {
+    nv_read((void *)((VPN << PAGE_LENGTH) + pool->base), PAGE_SIZE);
+    memcpy((void *)(PPN << PAGE_LENGTH), (void *)((VPN << PAGE_LENGTH) + pool->base), PAGE_SIZE);
+}
+
+// the v_page is pinned by the tx: note it to release it at commit or abort, by nv_addr >> PAGE_LENGTH
+// which keeps the pool
+static inline void page_pin_note(stm_tx_t *tx, uint64_t VPN) {
+# ifndef MAP_INIT
+    if (tx->addition.pin_nb == tx->addition.pin_size) {
+        tx->addition.pin_size *= 2;
+        tx->addition.pin = (uint64_t *)realloc(tx->addition.pin, tx->addition.pin_size * sizeof(uint64_t));
+    }
+    tx->addition.pin[tx->addition.pin_nb++] = VPN;
+# endif
+}
+
+// clear the bit of the thread in the v_page, it can then be replaced
+static inline void page_release(stm_tx_t *tx, free_page_entry_t *page_entry) {
+    v_page_inf_t old_v, new_v;
+
+    do {
+        old_v = page_entry->page_inf;
+        if ((old_v.used & (1 << tx->addition.thread_nb)) == 0) break;
+        new_v = page_entry->page_inf;
+        new_v.used &= ~(1 << tx->addition.thread_nb);
+    } while (ATOMIC_CAS_FULL(&page_entry->page_inf.v_page_inf, old_v.v_page_inf, new_v.v_page_inf) == 0);
 }
 
 static int page_map_(stm_tx_t *tx, uint64_t nv_addr) {
-    pthread_spin_lock(&free_page_head.lock);
+    stm_pool_t *pool = NV_POOL(nv_addr);
+    struct free_page_head *free_page_head = &pool->page->free_page_head;
+    page_entry_t *page_table = pool->page->page_table;
+    pthread_spin_lock(&free_page_head->lock);
 
     // check if other thread has mapped the nv_page
-    uint64_t VPN = nv_addr >> PAGE_LENGTH;
-    if (page_table[VPN].free_page != NULL && page_table[VPN].free_page->VPN == VPN && page_table[VPN].free_page->page_inf.vaild) {
-        pthread_spin_unlock(&free_page_head.lock);
+    uint64_t VPN = NV_OFF(nv_addr) >> PAGE_LENGTH;
+    free_page_entry_t *page_entry = page_table[VPN].free_page;
+    if (page_entry != NULL && page_entry->VPN == VPN && page_entry->page_inf.vaild) {
+        v_page_inf_t old_v, new_v;
+
+        // pin it as a new mapping would be, no replacement runs while the lock is held
+        do {
+            old_v = page_entry->page_inf;
+            new_v = old_v;
+            new_v.used |= 1 << tx->addition.thread_nb;
+        } while (ATOMIC_CAS_FULL(&page_entry->page_inf.v_page_inf, old_v.v_page_inf, new_v.v_page_inf) == 0);
+        if ((old_v.used & (1 << tx->addition.thread_nb)) == 0) page_pin_note(tx, nv_addr >> PAGE_LENGTH);
+        pthread_spin_unlock(&free_page_head->lock);
         return 0;
     }
     
     // check if touchid is bigger than reproduce timestamp
-    if (page_table[VPN].touch_id > _tinystm.addition.root->reproduce_timestamp) {
-        pthread_spin_unlock(&free_page_head.lock);
+    if (page_table[VPN].touch_id > pool->root->reproduce_timestamp) {
+        pthread_spin_unlock(&free_page_head->lock);
         return -1;
     }
 
     v_page_inf_t old_v, new_v;
     
     while (1) {
-        old_v = free_page_head.head->page_inf;
+        old_v = free_page_head->head->page_inf;
         new_v.v_page_inf = 0;
 
         // v_page in used
-        if (old_v.used != 0 || ATOMIC_CAS_FULL(&free_page_head.head->page_inf.v_page_inf, old_v.v_page_inf, new_v.v_page_inf) == 0) {
-            free_page_roll();
+        if (old_v.used != 0 || ATOMIC_CAS_FULL(&free_page_head->head->page_inf.v_page_inf, old_v.v_page_inf, new_v.v_page_inf) == 0) {
+            free_page_roll(free_page_head);
             continue;
         }
         
         // not used but mapped, clean the old page_table entry
         if (old_v.vaild == 1) {
-            page_table[free_page_head.head->VPN].free_page = NULL;
+            page_table[free_page_head->head->VPN].free_page = NULL;
+            NV_STAT_ADD(&tx->addition.stat, page_evictions, 1);
         }
 
         // map to new nv_page 
-        free_page_head.head->VPN = VPN;
+        free_page_head->head->VPN = VPN;
         new_v.vaild = 1;
         new_v.used = 1 << tx->addition.thread_nb;
-        page_cp(free_page_head.head->PPN, free_page_head.head->VPN);
+        page_cp(pool, free_page_head->head->PPN, free_page_head->head->VPN);
+        NV_TRACE_POINT(tx, page_map_copied, nv_addr >> PAGE_LENGTH);
         // update page_inf before page is usable
         ATOMIC_MB_WRITE;
-        free_page_head.head->page_inf = new_v;
-        page_table[VPN].free_page = free_page_head.head;
+        free_page_head->head->page_inf = new_v;
+        page_table[VPN].free_page = free_page_head->head;
+        page_pin_note(tx, nv_addr >> PAGE_LENGTH);
 
-        free_page_roll();
+        free_page_roll(free_page_head);
         break;
     }
     
-    pthread_spin_unlock(&free_page_head.lock);
+    pthread_spin_unlock(&free_page_head->lock);
     return 0;
 }
 
 static void page_map(stm_tx_t *tx, uint64_t nv_addr) {
+    NV_STAT_ADD(&tx->addition.stat, page_misses, 1);
+    NV_TRACE_POINT(tx, page_map_start, nv_addr >> PAGE_LENGTH);
     while (page_map_(tx,nv_addr) < 0) {
-        nv_log_reproduce();
+        NV_STAT_ADD(&tx->addition.stat, page_stalls, 1);
+        nv_log_reproduce(NV_POOL(nv_addr));
     }
+    NV_TRACE_POINT(tx, page_map_end, nv_addr >> PAGE_LENGTH);
 }
 
-void page_init() {
-    free_page_entry_t *node;
+static void *page_hot_copy(void *arg) {
+    uint64_t first;
 
-    free_page_head.free_num = PPN_NUM;
-    pthread_spin_init(&free_page_head.lock, 0);
+    while ((first = ATOMIC_FETCH_ADD_FULL(&page_hot.next, PAGE_HOT_CHUNK)) < page_hot.nodes_nb) {
+        for (uint64_t i = first; i < first + PAGE_HOT_CHUNK && i < page_hot.nodes_nb; i++)
+            page_cp(page_hot.pool, page_hot.nodes[i]->PPN, page_hot.nodes[i]->VPN);
+    }
+    return NULL;
+}
 
-    // init page table
-    for (uint64_t i = 0; i < VPN_NUM; i ++) {
-        page_table[i].free_page = NULL;
-        page_table[i].touch_id = 0;
+static void *page_hot_run(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&page_hot.lock);
+    while (!page_hot.stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += page_hot.period / 1000;
+        deadline.tv_nsec += (page_hot.period % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec ++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&page_hot.cond, &page_hot.lock, &deadline) != ETIMEDOUT) continue;
+        pthread_mutex_unlock(&page_hot.lock);
+        // the pools are not closed meanwhile
+        pthread_mutex_lock(&_tinystm.addition.pool_lock);
+        for (unsigned int i = 0; i < _tinystm.addition.pool_nb; i++) {
+            if (_tinystm.addition.pools[i] != NULL) page_hot_save(_tinystm.addition.pools[i]);
+        }
+        pthread_mutex_unlock(&_tinystm.addition.pool_lock);
+        pthread_mutex_lock(&page_hot.lock);
     }
+    pthread_mutex_unlock(&page_hot.lock);
+    return NULL;
+}
+
+// map the VPN to the next v_page of nodes, if it is a page of the pool not mapped yet
+static void page_hot_map(uint64_t VPN) {
+    page_entry_t *page_table = page_hot.pool->page->page_table;
+    free_page_entry_t *node;
+
+    if (VPN >= VPN_NUM || page_table[VPN].free_page != NULL || page_hot.nodes_nb == PPN_NUM) return;
+    node = page_hot.nodes[page_hot.nodes_nb++];
+    page_table[VPN].free_page = node;
+    node->page_inf.vaild = 1;
+    node->VPN = VPN;
+}
 
-    //node = free_page_head.head;
+// allocate the page table of the pool, no page is mapped
+void page_open(stm_pool_t *pool) {
+    pool->page = (struct page_pool *)calloc(1, sizeof(struct page_pool));
+    pool->page->free_page_head.free_num = PPN_NUM;
+    pthread_spin_init(&pool->page->free_page_head.lock, 0);
+}
+
+// map the hot set of the pool if it was saved, otherwise with MAP_INIT all pages, and copy them
+// from several threads before any tx uses the pool. The other pages are mapped when they are used.
+// Each pool has its own PPN_NUM v_pages
+void page_init(stm_pool_t *pool) {
+    struct free_page_head *free_page_head = &pool->page->free_page_head;
+    nv_ptr hot_set = pool->root->hot_set;
+    nv_hot_t *hot = hot_set == 0 ? NULL : (nv_hot_t *)(hot_set + pool->base);
+    pthread_t threads[PAGE_HOT_THREADS];
+    free_page_entry_t *node;
+    uint64_t hot_nb = 0;
+    long cpus;
+    int nb;
+    char *s;
+
+    page_hot.pool = pool;
+    page_hot.nodes = (free_page_entry_t **)malloc(PPN_NUM * sizeof(free_page_entry_t *));
+    page_hot.nodes_nb = 0;
     for (uint64_t i = 0; i < PPN_NUM; i++) {
         node = malloc(sizeof(free_page_entry_t));
         node->PPN = v_page_alloc();
         node->VPN = 0;
         node->page_inf.v_page_inf = 0;
+        page_hot.nodes[i] = node;
+    }
+    if (hot != NULL) {
+        nv_read(hot, sizeof(nv_hot_t));
+        hot_nb = hot->nb < hot->size ? hot->nb : hot->size;
+        if (hot_nb > PPN_NUM) hot_nb = PPN_NUM;
+        nv_read(hot->VPN, hot_nb * sizeof(uint32_t));
+        for (uint64_t i = 0; i < hot_nb; i++) page_hot_map(hot->VPN[i]);
+    }
 # ifdef MAP_INIT
-        // map vpage to nvpage before start
-        page_table[i].free_page = node;
-        node->page_inf.vaild = 1;
-        node->VPN = i;
-        page_cp(node->PPN, node->VPN);
+    // map vpage to nvpage before start
+    if (page_hot.nodes_nb == 0) {
+        for (uint64_t VPN = 0; VPN < VPN_NUM; VPN++) page_hot_map(VPN);
+    }
 # endif
-        if (i == 0) free_page_head.head = node;
-        if (i != PPN_NUM - 1) node = node->next;
+
+    // the unmapped v_pages, then the mapped ones from the coldest are replaced first
+    for (uint64_t i = PPN_NUM - 1; i > 0; i--) page_hot.nodes[i]->next = page_hot.nodes[i - 1];
+    page_hot.nodes[0]->next = page_hot.nodes[PPN_NUM - 1];
+    free_page_head->head = page_hot.nodes[PPN_NUM - 1];
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nb = cpus < 1 ? 1 : (cpus < PAGE_HOT_THREADS ? (int)cpus : PAGE_HOT_THREADS);
+    page_hot.next = 0;
+    for (int i = 1; i < nb; i++) {
+        if (pthread_create(&threads[i], NULL, page_hot_copy, NULL) != 0) nb = i;
+    }
+    page_hot_copy(NULL);
+    for (int i = 1; i < nb; i++) pthread_join(threads[i], NULL);
+    free(page_hot.nodes);
+    page_hot.nodes = NULL;
+    page_hot.pool = NULL;
+
+    // one thread saves the hot sets of all pools
+    if (page_hot.period == 0) {
+        s = getenv(PAGE_HOT_PERIOD);
+        page_hot.period = s != NULL ? (unsigned int)strtol(s, NULL, 10) : 0;
+        page_hot.stop = 0;
+        if (page_hot.period != 0 && pthread_create(&page_hot.thread, NULL, page_hot_run, NULL) != 0) page_hot.period = 0;
     }
-    node->next = free_page_head.head;
+}
+
+// map the open pools not mapped yet, but those whose log waits for another pool, pool_lock held
+void page_map_pools() {
+    stm_pool_t *pool;
+
+    for (unsigned int i = 0; i < _tinystm.addition.pool_nb; i++) {
+        pool = _tinystm.addition.pools[i];
+        if (pool != NULL && pool->pending < 0 && pool->page->free_page_head.head == NULL) page_init(pool);
+    }
+}
+
+// free the v_pages and the page table of a pool being closed
+void page_exit(stm_pool_t *pool) {
+    free_page_entry_t *head = pool->page->free_page_head.head, *node, *next;
+
+    if (head != NULL) {
+        node = head;
+        do {
+            next = node->next;
+            free((void *)(node->PPN << PAGE_LENGTH));
+            free(node);
+            node = next;
+        } while (node != head);
+    }
+    free(pool->page);
+    pool->page = NULL;
 }
 
 // map the page and set write set; if page has mapped, return directly
 uint64_t *page_use(stm_tx_t *tx, uint64_t nv_addr) {
-    uint64_t VPN = nv_addr >> PAGE_LENGTH;
-    free_page_entry_t *page_entry = page_table[VPN].free_page;
+    page_entry_t *entry = page_entry_of(nv_addr);
+    free_page_entry_t *page_entry = entry->free_page;
     v_page_inf_t old_v, new_v, fail_v;
     
     // nv_page not mapped to v_page
     if (page_entry == NULL || page_entry->page_inf.vaild == 0) {
         page_map(tx,nv_addr);
-        return addr_nv_2_v(page_table[VPN].free_page->PPN, nv_addr);
+        return addr_nv_2_v(entry->free_page->PPN, nv_addr);
     }
         
     // in write set, return directly
+    NV_STAT_ADD(&tx->addition.stat, page_hits, 1);
     old_v = page_entry->page_inf;
     if ((old_v.used & (1 << tx->addition.thread_nb)) != 0) return addr_nv_2_v(page_entry->PPN, nv_addr);
 
@@ -188,12 +412,12 @@ uint64_t *page_use(stm_tx_t *tx, uint64_t nv_addr) {
         // page unmapped
         if (fail_v.vaild == 0) {
             page_map(tx,nv_addr);
-            return addr_nv_2_v(page_table[VPN].free_page->PPN, nv_addr);
+            return addr_nv_2_v(entry->free_page->PPN, nv_addr);
         }
 
-        if (page_table[VPN].free_page == NULL) {
+        if (entry->free_page == NULL) {
             page_map(tx,nv_addr);
-            return addr_nv_2_v(page_table[VPN].free_page->PPN, nv_addr);
+            return addr_nv_2_v(entry->free_page->PPN, nv_addr);
         }
 
         // other tx has changed the write set
@@ -202,27 +426,234 @@ uint64_t *page_use(stm_tx_t *tx, uint64_t nv_addr) {
         new_v.used |= 1 << tx->addition.thread_nb;
     }
 
+# ifndef MAP_INIT
+    // replaced and mapped to another nv_page before the pin
+    if (page_entry->VPN != NV_OFF(nv_addr) >> PAGE_LENGTH) {
+        page_release(tx, page_entry);
+        page_map(tx,nv_addr);
+        return addr_nv_2_v(entry->free_page->PPN, nv_addr);
+    }
+    page_pin_note(tx, nv_addr >> PAGE_LENGTH);
+# endif
     return addr_nv_2_v(page_entry->PPN, nv_addr);
 }
 
 // remove tx from write set when tx committed or abort and update touvh id
 void page_free(stm_tx_t *tx, uint64_t nv_addr, uint64_t commit_timestamp) {
-    uint64_t VPN = nv_addr >> PAGE_LENGTH;
-    free_page_entry_t *page_entry = page_table[VPN].free_page;
-    v_page_inf_t old_v, new_v;
-    uint64_t new_timestamp = commit_timestamp, old_timestamp;
+    free_page_entry_t *page_entry = page_entry_of(nv_addr)->free_page;
+
+    // update touch id while the page is still pinned so it cannot be remapped from a stale nv_page.
+    // commit_timestamp is of the pools the tx logged: a pool it only locked is not touched
+    if (tx->addition.log_pools & ((uint64_t)1 << NV_POOL_ID(nv_addr))) page_touch(nv_addr, commit_timestamp);
+
+    // CAS modify write set, an entry of mask 0 may not have used the page
+    if (page_entry != NULL) page_release(tx, page_entry);
+}
+
+// release the v_pages pinned by the tx, after page_free() of the pages it wrote. With MAP_INIT no
+// page is replaced: the pins of a thread are kept, a page is then used again without CAS
+void page_unpin(stm_tx_t *tx) {
+# ifndef MAP_INIT
+    free_page_entry_t *page_entry;
+
+    for (unsigned int i = 0; i < tx->addition.pin_nb; i++) {
+        page_entry = page_entry_of(tx->addition.pin[i] << PAGE_LENGTH)->free_page;
+        if (page_entry != NULL) page_release(tx, page_entry);
+    }
+    tx->addition.pin_nb = 0;
+# endif
+}
+
+void tx_init_page(stm_tx_t *tx) {
+    tx->addition.pin_nb = 0;
+# ifndef MAP_INIT
+    tx->addition.pin_size = PAGE_PIN_SIZE;
+    tx->addition.pin = (uint64_t *)malloc(PAGE_PIN_SIZE * sizeof(uint64_t));
+# else
+    tx->addition.pin_size = 0;
+    tx->addition.pin = NULL;
+# endif
+}
+
+void tx_exit_page(stm_tx_t *tx) {
+    free(tx->addition.pin);
+    tx->addition.pin = NULL;
+}
+
+// raise touch id to commit_timestamp, never lower it
+void page_touch(uint64_t nv_addr, uint64_t commit_timestamp) {
+    page_entry_t *entry = page_entry_of(nv_addr);
+    uint64_t old_timestamp;
 
-    // CAS modify write set
     do {
-        old_v = page_entry->page_inf;
-        if ((old_v.used & (1 << tx->addition.thread_nb)) == 0) break;
-        new_v = page_entry->page_inf;
-        new_v.used &= ~(1 << tx->addition.thread_nb);
-    } while (ATOMIC_CAS_FULL(&page_entry->page_inf.v_page_inf, old_v.v_page_inf, new_v.v_page_inf) == 0);
+        old_timestamp = entry->touch_id;
+        if (commit_timestamp <= old_timestamp || commit_timestamp == 0) break;
+    } while (ATOMIC_CAS_FULL(&entry->touch_id, old_timestamp, commit_timestamp) == 0);
+}
+
+void page_touch_range(uint64_t nv_addr, uint64_t size, uint64_t commit_timestamp) {
+    if (size == 0) return;
+    for (uint64_t VPN = nv_addr >> PAGE_LENGTH; VPN <= (nv_addr + size - 1) >> PAGE_LENGTH; VPN++)
+        page_touch(VPN << PAGE_LENGTH, commit_timestamp);
+}
+
+// read a word of the nv_page as of timestamp, return -1 if a later tx touched the page.
+// nv_log_append() raises touch id before the record can be reproduced, so a touch id
+// not bigger than timestamp on both sides of the read means the word is not being replayed
+int page_read_home(uint64_t nv_addr, uint64_t timestamp, uint64_t *value) {
+    volatile uint64_t *touch_id = (volatile uint64_t *)&page_entry_of(nv_addr)->touch_id;
+    uint64_t addr = NV_POOL(nv_addr)->base + NV_OFF(nv_addr);
+
+    if (ATOMIC_LOAD_ACQ(touch_id) > timestamp) return -1;
+    nv_read((void *)addr, sizeof(uint64_t));
+    *value = ATOMIC_LOAD((volatile uint64_t *)addr);
+    ATOMIC_MB_READ;
+    if (ATOMIC_LOAD_ACQ(touch_id) > timestamp) return -1;
+    return 0;
+}
+
+// write a word of a block allocated by tx without lock and v_log: no other tx can reach
+// the block before commit. nv_page is written first so that a concurrent page_map_() copies it
+void page_write_alloc(stm_tx_t *tx, alloc_range_t *range, uint64_t nv_addr, uint64_t value, uint64_t mask) {
+    uint64_t *nv_word = (uint64_t *)(NV_POOL(nv_addr)->base + NV_OFF(nv_addr));
+    free_page_entry_t *page_entry = page_entry_of(nv_addr)->free_page;
+    int pinned;
+
+    if (mask == 0) return;
+    if (mask != ~(uint64_t)0) value = (*nv_word & ~mask) | (value & mask);
+    if (unlikely(_tinystm.addition.checkpoint)) checkpoint_save(nv_addr, sizeof(uint64_t));
+# ifdef PAGE_STREAM_STORE
+    if (range->size >= PAGE_MOVNT_THRESHOLD) _mm_stream_si64((long long *)nv_word, (long long)value);
+    else *nv_word = value;
+# else
+    *nv_word = value;
+# endif
+
+    // keep the v_page in step
+# ifdef MAP_INIT
+    // a mapped page is never replaced, a page not mapped yet is mapped below
+    if (page_entry != NULL && page_entry->page_inf.vaild) {
+        ATOMIC_STORE(addr_nv_2_v(page_entry->PPN, nv_addr), value);
+        return;
+    }
+# endif
+    // pin it while writing, unless the tx also has logged writes on it
+    pinned = page_entry != NULL && page_entry->page_inf.vaild && (page_entry->page_inf.used & (1 << tx->addition.thread_nb)) != 0;
+    ATOMIC_STORE(page_use(tx, nv_addr), value);
+    if (!pinned) page_free(tx, nv_addr, 0);
+}
+
+// persist blocks written by page_write_alloc(), use before the commit record
+void page_persist_alloc(stm_tx_t *tx) {
+    alloc_range_t *range;
+    uint64_t pools = 0;
+
+    for (unsigned int i = 0; i < tx->addition.alloc_nb; i++) {
+        range = &tx->addition.alloc_range[i];
+        pools |= (uint64_t)1 << NV_POOL_ID(range->nv_addr);
+# ifdef PAGE_STREAM_STORE
+        if (range->size >= PAGE_MOVNT_THRESHOLD) continue;
+# endif
+        nv_flush(NV_POOL(range->nv_addr), (void *)(NV_POOL(range->nv_addr)->base + NV_OFF(range->nv_addr)), range->size);
+    }
+    for (; pools != 0; pools &= pools - 1) nv_drain(_tinystm.addition.pools[__builtin_ctzll(pools)]);
+}
 
+typedef struct page_hot_entry {
+    uint64_t touch_id;
+    uint64_t order;                     // position in the ring from the next page to replace
+    uint32_t VPN;
+} page_hot_entry_t;
+
+static int page_hot_compare(const void *a, const void *b) {
+    const page_hot_entry_t *x = (const page_hot_entry_t *)a, *y = (const page_hot_entry_t *)b;
+
+    if (x->touch_id != y->touch_id) return x->touch_id < y->touch_id ? 1 : -1;
+    return x->order < y->order ? 1 : (x->order > y->order ? -1 : 0);
+}
+
+// allocate a hot set of PPN_NUM VPNs and link it to the root at once, in place of the set saved
+// with another size if any
+static nv_hot_t *page_hot_alloc(stm_pool_t *pool) {
+    struct pobj_action act[3];
+    nv_hot_t *hot;
+    PMEMoid Hot;
+    uint64_t nb = 2;
+
+    Hot = pmemobj_reserve(pool->pop, &act[0], sizeof(nv_hot_t) + PPN_NUM * sizeof(uint32_t), TYPE_NV_HOT);
+    if (OID_IS_NULL(Hot)) return NULL;
+    hot = (nv_hot_t *)pmemobj_direct(Hot);
+    hot->nb = 0;
+    hot->size = PPN_NUM;
+    nv_flush(pool, hot, sizeof(nv_hot_t));
+    nv_drain(pool);
+    pmemobj_set_value(pool->pop, &act[1], &pool->root->hot_set, Hot.off);
+    if (pool->root->hot_set != 0)
+        pmemobj_defer_free(pool->pop, pmemobj_oid((void *)(pool->root->hot_set + pool->base)), &act[nb++]);
+    checkpoint_publish(pool->pop, act, nb, nb - 2);
+    checkpoint_heap(pool->id);
+    return hot;
+}
+
+// save the VPNs mapped to v_pages, most recently written first, then the most recently mapped.
+// Reads the ring without lock while txs run: a page mapped or replaced meanwhile may be missed
+void page_hot_save(stm_pool_t *pool) {
+    struct root *root = pool->root;
+    free_page_entry_t *head = pool->page->free_page_head.head, *node;
+    page_entry_t *page_table = pool->page->page_table;
+    page_hot_entry_t *entries;
+    v_page_inf_t page_inf;
+    nv_hot_t *hot;
+    uint64_t nb = 0, VPN;
+
+    if (head == NULL) return;
+    pthread_mutex_lock(&page_hot.lock);
+    hot = root->hot_set == 0 ? NULL : (nv_hot_t *)(root->hot_set + pool->base);
+    if (hot == NULL || hot->size != PPN_NUM) hot = page_hot_alloc(pool);
+    if (hot == NULL) {
+        pthread_mutex_unlock(&page_hot.lock);
+        return;
+    }
+
+    entries = (page_hot_entry_t *)malloc(PPN_NUM * sizeof(page_hot_entry_t));
+    node = head;
     do {
-        old_timestamp = page_table[VPN].touch_id;
-        if (new_timestamp <= old_timestamp || new_timestamp == 0) break;
-    } while (ATOMIC_CAS_FULL(&page_table[VPN].touch_id, old_timestamp, new_timestamp) == 0);
+        page_inf.v_page_inf = ATOMIC_LOAD(&node->page_inf.v_page_inf);
+        VPN = ATOMIC_LOAD(&node->VPN);
+        if (page_inf.vaild && VPN < VPN_NUM && page_table[VPN].free_page == node) {
+            entries[nb].touch_id = ATOMIC_LOAD(&page_table[VPN].touch_id);
+            entries[nb].order = nb;
+            entries[nb].VPN = (uint32_t)VPN;
+            nb ++;
+        }
+        node = node->next;
+    } while (node != head && nb < PPN_NUM);
+    qsort(entries, nb, sizeof(page_hot_entry_t), page_hot_compare);
+
+    hot->nb = 0;
+    nv_flush(pool, &hot->nb, sizeof(uint64_t));
+    nv_drain(pool);
+    for (uint64_t i = 0; i < nb; i++) hot->VPN[i] = entries[i].VPN;
+    hot->timestamp = root->reproduce_timestamp;
+    nv_flush(pool, &hot->timestamp, sizeof(uint64_t) + nb * sizeof(uint32_t));
+    nv_drain(pool);
+    hot->nb = nb;
+    nv_flush(pool, &hot->nb, sizeof(uint64_t));
+    nv_drain(pool);
+    free(entries);
+    pthread_mutex_unlock(&page_hot.lock);
+}
+
+// stop saving the hot sets in the background, stm_pool_close() saves the set of each pool
+void page_hot_exit() {
+    if (page_hot.period != 0) {
+        pthread_mutex_lock(&page_hot.lock);
+        page_hot.stop = 1;
+        pthread_cond_signal(&page_hot.cond);
+        pthread_mutex_unlock(&page_hot.lock);
+        pthread_join(page_hot.thread, NULL);
+        page_hot.period = 0;
+    }
 }
+# endif /* NV_DECLARE_ONLY */
 # endif /* _PAGE_H_ */
\ No newline at end of file
@@ -0,0 +1,390 @@
+# ifndef _RECLAIM_H_
+# define _RECLAIM_H_
+
+# include "stm_internal.h"
+# include <unistd.h>
+
+# define RECLAIM_TYPES      64              // registered object types
+# define RECLAIM_ROUNDS     8               // concurrent rescans of dirty objects before the serial one
+# define RECLAIM_BATCH      64              // default objects read by one transaction
+# define RECLAIM_PAUSE      100             // default microseconds between two transactions
+# define RECLAIM_INIT_SIZE  4096
+
+# define RECLAIM_MARKED     1               // reachable
+# define RECLAIM_CANDIDATE  2               // registered type, allocated before the reconciler started
+# define RECLAIM_FREED      4               // freed by a transaction since the reconciler started
+
+// pmemobj object or slab block known to the reconciler
+typedef struct reclaim_obj {
+    nv_ptr nv_addr;                         // 0 for an empty slot
+    uint64_t size;
+    uint32_t type;                          // registered type + 1, 0 to scan every word
+    uint32_t flags;
+} reclaim_obj_t;
+
+typedef struct reclaim_type {
+    uint64_t type_num;
+    unsigned int nb;
+    size_t *offsets;                        // nv_ptr fields of the type
+} reclaim_type_t;
+
+static struct {
+    reclaim_type_t types[RECLAIM_TYPES];
+    unsigned int types_nb;
+    pthread_spinlock_t lock;                // objs are also updated by the notes of other threads
+    reclaim_obj_t *objs;                    // open addressing on nv_addr
+    uint64_t objs_nb, objs_size;
+    reclaim_obj_t *stack;                   // marked objects to scan
+    uint64_t stack_nb, stack_size;
+    nv_ptr *addrs;                          // words read by one transaction
+    stm_word_t *values;
+    uint64_t addrs_size;
+    unsigned int batch;
+    unsigned int pause;
+    volatile int stop;
+    volatile int done;                      // the pass is over, its thread can be joined
+    int started;                            // a thread is to be joined
+    pthread_t thread;
+} reclaim;
+
+
+static inline reclaim_obj_t *reclaim_slot(reclaim_obj_t *objs, uint64_t size, nv_ptr nv_addr) {
+    uint64_t i = ((nv_addr >> 3) * 0x9E3779B97F4A7C15ULL) & (size - 1);
+
+    while (objs[i].nv_addr != 0 && objs[i].nv_addr != nv_addr) i = (i + 1) & (size - 1);
+    return &objs[i];
+}
+
+// lock held
+static reclaim_obj_t *reclaim_find(nv_ptr nv_addr) {
+    reclaim_obj_t *obj = reclaim_slot(reclaim.objs, reclaim.objs_size, nv_addr);
+
+    return obj->nv_addr == 0 ? NULL : obj;
+}
+
+// lock held, the object must not be known yet
+static reclaim_obj_t *reclaim_insert(nv_ptr nv_addr, uint64_t size, uint32_t type, uint32_t flags) {
+    reclaim_obj_t *obj, *objs;
+
+    if (2 * (reclaim.objs_nb + 1) > reclaim.objs_size) {
+        objs = (reclaim_obj_t *)calloc(2 * reclaim.objs_size, sizeof(reclaim_obj_t));
+        for (uint64_t i = 0; i < reclaim.objs_size; i++) {
+            if (reclaim.objs[i].nv_addr != 0) *reclaim_slot(objs, 2 * reclaim.objs_size, reclaim.objs[i].nv_addr) = reclaim.objs[i];
+        }
+        free(reclaim.objs);
+        reclaim.objs = objs;
+        reclaim.objs_size *= 2;
+    }
+    obj = reclaim_slot(reclaim.objs, reclaim.objs_size, nv_addr);
+    obj->nv_addr = nv_addr;
+    obj->size = size;
+    obj->type = type;
+    obj->flags = flags;
+    reclaim.objs_nb ++;
+    return obj;
+}
+
+// lock held
+static void reclaim_push(reclaim_obj_t *obj) {
+    if (reclaim.stack_nb == reclaim.stack_size) {
+        reclaim.stack_size *= 2;
+        reclaim.stack = (reclaim_obj_t *)realloc(reclaim.stack, reclaim.stack_size * sizeof(reclaim_obj_t));
+    }
+    reclaim.stack[reclaim.stack_nb++] = *obj;
+}
+
+// mark the object starting at the value read, lock held. A value is an nv_ptr if it is in an open pool
+static void reclaim_visit(stm_word_t value) {
+    reclaim_obj_t *obj;
+# ifdef NV_SLAB
+    slab_desc_t *desc;
+# endif /* NV_SLAB */
+
+    if (value == 0 || NV_POOL_ID(value) >= NV_POOL_MAX || NV_POOL(value) == NULL || NV_OFF(value) >= POOL_SIZE || (value & 7) != 0) return;
+    obj = reclaim_find(value);
+    if (obj != NULL) {
+        if (!(obj->flags & RECLAIM_MARKED)) {
+            obj->flags |= RECLAIM_MARKED;
+            reclaim_push(obj);
+        }
+        return;
+    }
+# ifdef NV_SLAB
+    // slab blocks are freed by transactions, they are only traced
+    desc = slab_find(value);
+    if (desc != NULL && (value - desc->slab - NV_SLAB_HEADER) % desc->size == 0)
+        reclaim_push(reclaim_insert(value, desc->size, 0, RECLAIM_MARKED));
+# endif /* NV_SLAB */
+}
+
+// called by transactions allocating or freeing a block while the reconciler runs
+void reclaim_note(nv_ptr nv_addr, uint64_t size, int freed) {
+    reclaim_obj_t *obj;
+
+    pthread_spin_lock(&reclaim.lock);
+    obj = reclaim_find(nv_addr);
+    if (freed) {
+        if (obj != NULL) obj->flags |= RECLAIM_FREED;
+    }
+    else if (obj == NULL) reclaim_insert(nv_addr, size, 0, 0);
+    else {
+        // the block was freed and allocated again: scan the new content once it is reached
+        obj->size = size;
+        obj->type = 0;
+        obj->flags &= ~(RECLAIM_MARKED | RECLAIM_CANDIDATE);
+    }
+    pthread_spin_unlock(&reclaim.lock);
+}
+
+// read the words to trace of up to batch objects of the stack, in the current tx if serial
+static int reclaim_scan(stm_tx_t *tx, int serial) {
+    stm_tx_attr_t attr = {{ .read_only = 1 }};
+    reclaim_type_t *type;
+    reclaim_obj_t obj;
+    sigjmp_buf *env;
+    uint64_t nb = 0, i;
+
+    pthread_spin_lock(&reclaim.lock);
+    for (unsigned int n = 0; n < reclaim.batch && reclaim.stack_nb > 0; n++) {
+        obj = reclaim.stack[--reclaim.stack_nb];
+        if (obj.size > POOL_SIZE - NV_OFF(obj.nv_addr)) obj.size = POOL_SIZE - NV_OFF(obj.nv_addr);
+        type = obj.type == 0 ? NULL : &reclaim.types[obj.type - 1];
+        while (nb + (type == NULL ? obj.size / sizeof(stm_word_t) : type->nb) > reclaim.addrs_size) {
+            reclaim.addrs_size *= 2;
+            reclaim.addrs = (nv_ptr *)realloc(reclaim.addrs, reclaim.addrs_size * sizeof(nv_ptr));
+            reclaim.values = (stm_word_t *)realloc(reclaim.values, reclaim.addrs_size * sizeof(stm_word_t));
+        }
+        if (type == NULL) {
+            // unregistered type or slab block: any word may hold a pointer
+            for (i = 0; i < obj.size / sizeof(stm_word_t); i++) reclaim.addrs[nb++] = obj.nv_addr + i * sizeof(stm_word_t);
+        }
+        else {
+            for (i = 0; i < type->nb; i++) reclaim.addrs[nb++] = obj.nv_addr + type->offsets[i];
+        }
+    }
+    pthread_spin_unlock(&reclaim.lock);
+    if (nb == 0) return 0;
+
+    if (!serial) {
+        env = stm_start_tx(tx, attr);
+        if (env != NULL) sigsetjmp(*env, 0);
+    }
+    for (i = 0; i < nb; i++) reclaim.values[i] = stm_load_tx(tx, (volatile stm_word_t *)reclaim.addrs[i]);
+    if (!serial) stm_commit_tx(tx);
+
+    pthread_spin_lock(&reclaim.lock);
+    for (i = 0; i < nb; i++) reclaim_visit(reclaim.values[i]);
+    pthread_spin_unlock(&reclaim.lock);
+    return 1;
+}
+
+// scan the stack until it is empty, pausing between transactions unless serial
+static void reclaim_drain(stm_tx_t *tx, int serial) {
+    while (!reclaim.stop && reclaim_scan(tx, serial)) {
+        if (!serial && reclaim.pause != 0) usleep(reclaim.pause);
+    }
+}
+
+// the roots are written by libpmemobj: trace the durable image and the mapped v_page, of each pool
+static void reclaim_roots() {
+    stm_pool_t *pool;
+    reclaim_obj_t obj = { 0, sizeof(pool->root->obj_root), 0, RECLAIM_MARKED };
+
+    pthread_spin_lock(&reclaim.lock);
+    for (unsigned int id = 0; id < _tinystm.addition.pool_nb; id++) {
+        pool = _tinystm.addition.pools[id];
+        if (pool == NULL) continue;
+        for (int i = 0; i < 127; i++) reclaim_visit(pool->root->obj_root[i]);
+        obj.nv_addr = NV_PTR(id, (uint64_t)pool->root->obj_root - pool->base);
+        reclaim_push(&obj);
+    }
+    pthread_spin_unlock(&reclaim.lock);
+}
+
+// commit_timestamp of each pool, 0 for an id not open
+static void reclaim_clock(uint64_t *timestamp) {
+    for (unsigned int id = 0; id < NV_POOL_MAX; id++) {
+        timestamp[id] = _tinystm.addition.pools[id] == NULL ? 0 : ATOMIC_LOAD_ACQ(&_tinystm.addition.pools[id]->nv_log->commit_timestamp);
+    }
+}
+
+// push the marked objects written after the timestamp of their pool, return their number
+static uint64_t reclaim_rescan(const uint64_t *timestamp) {
+    uint64_t nb = 0, VPN;
+    reclaim_obj_t *obj;
+
+    pthread_spin_lock(&reclaim.lock);
+    for (uint64_t i = 0; i < reclaim.objs_size; i++) {
+        obj = &reclaim.objs[i];
+        if (obj->nv_addr == 0 || !(obj->flags & RECLAIM_MARKED) || obj->size == 0) continue;
+        for (VPN = obj->nv_addr >> PAGE_LENGTH; VPN <= (obj->nv_addr + obj->size - 1) >> PAGE_LENGTH; VPN++) {
+            if (ATOMIC_LOAD(&page_entry_of(VPN << PAGE_LENGTH)->touch_id) > timestamp[NV_POOL_ID(obj->nv_addr)]) {
+                reclaim_push(obj);
+                nb ++;
+                break;
+            }
+        }
+    }
+    pthread_spin_unlock(&reclaim.lock);
+    return nb;
+}
+
+// release the state of a pass, another one can start
+static void reclaim_free() {
+    free(reclaim.objs);
+    free(reclaim.stack);
+    free(reclaim.addrs);
+    free(reclaim.values);
+    reclaim.objs = NULL;
+    reclaim.stack = NULL;
+    reclaim.addrs = NULL;
+    reclaim.values = NULL;
+    reclaim.objs_nb = reclaim.stack_nb = 0;
+}
+
+static void *reclaim_run(void *arg) {
+    stm_tx_attr_t attr = {{ .read_only = 1 }};
+    stm_tx_t *tx = int_stm_init_thread();
+    uint64_t timestamp[NV_POOL_MAX], now[NV_POOL_MAX], nb = 0, size = 0;
+    nv_ptr *sweep = NULL;
+    PMEMoid oid;
+    sigjmp_buf *env;
+
+    // concurrent marking, commits after timestamp are found by the touch_id of their pages
+    reclaim_clock(timestamp);
+    reclaim_roots();
+    reclaim_drain(tx, 0);
+    for (int round = 0; round < RECLAIM_ROUNDS && !reclaim.stop; round++) {
+        reclaim_clock(now);
+        reclaim_roots();
+        nb = reclaim_rescan(timestamp);
+        memcpy(timestamp, now, sizeof(timestamp));
+        reclaim_drain(tx, 0);
+        if (nb < reclaim.batch) break;
+    }
+
+    // last rescan alone, the other transactions wait only for the objects written meanwhile
+    stm_set_irrevocable_tx(tx, 1);
+    env = stm_start_tx(tx, attr);
+    if (env != NULL) sigsetjmp(*env, 0);
+    reclaim_roots();
+    reclaim_rescan(timestamp);
+    reclaim_drain(tx, 1);
+    nb = 0;
+    if (!reclaim.stop) {
+        for (uint64_t i = 0; i < reclaim.objs_size; i++) {
+            if ((reclaim.objs[i].flags & (RECLAIM_MARKED | RECLAIM_CANDIDATE | RECLAIM_FREED)) != RECLAIM_CANDIDATE) continue;
+            if (nb == size) {
+                size = size == 0 ? RECLAIM_INIT_SIZE : 2 * size;
+                sweep = (nv_ptr *)realloc(sweep, size * sizeof(nv_ptr));
+            }
+            sweep[nb++] = reclaim.objs[i].nv_addr;
+        }
+    }
+    ATOMIC_STORE_REL(&_tinystm.addition.reclaim, 0);
+    stm_commit_tx(tx);
+
+    // unreachable objects cannot be reached again, they are freed in batches. The pools are not
+    // closed before the pass is over
+    for (uint64_t i = 0; i < nb && !reclaim.stop; i++) {
+        oid = pmemobj_oid(nv_to_ptr(sweep[i]));
+        checkpoint_free(NV_POOL(sweep[i])->pop, oid);
+        if ((i + 1) % reclaim.batch == 0 && reclaim.pause != 0) usleep(reclaim.pause);
+    }
+    if (nb != 0 && !reclaim.stop) fprintf(stderr, "Reclaimed %lu unreachable objects\n", (unsigned long)nb);
+
+    free(sweep);
+    reclaim_free();
+    int_stm_exit_thread(tx);
+    ATOMIC_STORE_REL(&reclaim.done, 1);
+    return NULL;
+}
+
+int reclaim_type(uint64_t type_num, const size_t *offsets, unsigned int nb) {
+    reclaim_type_t *type;
+
+    if (reclaim.types_nb == RECLAIM_TYPES) return 0;
+    type = &reclaim.types[reclaim.types_nb++];
+    type->type_num = type_num;
+    type->nb = nb;
+    type->offsets = (size_t *)malloc(nb * sizeof(size_t));
+    memcpy(type->offsets, offsets, nb * sizeof(size_t));
+    return 1;
+}
+
+// list the objects of the open pools, then mark and sweep in the background
+int reclaim_start(unsigned int batch, unsigned int pause) {
+    stm_pool_t *pool;
+    uint64_t type_num;
+    uint32_t type;
+    PMEMoid Obj;
+
+    if (reclaim.types_nb == 0) return 0;
+    // the thread of the last pass is joined once the pass is over
+    if (reclaim.started) {
+        if (!ATOMIC_LOAD_ACQ(&reclaim.done)) return 0;
+        pthread_join(reclaim.thread, NULL);
+        reclaim.started = 0;
+    }
+    reclaim.batch = batch == 0 ? RECLAIM_BATCH : batch;
+    reclaim.pause = pause == 0 ? RECLAIM_PAUSE : pause;
+    reclaim.stop = 0;
+    reclaim.done = 0;
+    reclaim.objs_size = RECLAIM_INIT_SIZE;
+    reclaim.objs_nb = 0;
+    reclaim.objs = (reclaim_obj_t *)calloc(reclaim.objs_size, sizeof(reclaim_obj_t));
+    reclaim.stack_size = RECLAIM_INIT_SIZE;
+    reclaim.stack_nb = 0;
+    reclaim.stack = (reclaim_obj_t *)malloc(reclaim.stack_size * sizeof(reclaim_obj_t));
+    reclaim.addrs_size = RECLAIM_INIT_SIZE;
+    reclaim.addrs = (nv_ptr *)malloc(reclaim.addrs_size * sizeof(nv_ptr));
+    reclaim.values = (stm_word_t *)malloc(reclaim.addrs_size * sizeof(stm_word_t));
+    pthread_spin_init(&reclaim.lock, PTHREAD_PROCESS_PRIVATE);
+
+    pthread_mutex_lock(&_tinystm.addition.pool_lock);
+    for (unsigned int id = 0; id < _tinystm.addition.pool_nb; id++) {
+        if ((pool = _tinystm.addition.pools[id]) == NULL) continue;
+        for (Obj = pmemobj_first(pool->pop); !OID_IS_NULL(Obj); Obj = pmemobj_next(Obj)) {
+            type_num = pmemobj_type_num(Obj);
+            if (type_num == TYPE_NV_LOG_BLOCK) continue;
+            if (type_num == TYPE_NV_HOT) continue;
+# ifdef NV_SLAB
+            if (type_num == TYPE_NV_SLAB) continue;
+# endif
+            for (type = 0; type < reclaim.types_nb && reclaim.types[type].type_num != type_num; type++);
+            if (type == reclaim.types_nb)
+                reclaim_insert(NV_PTR(id, Obj.off), pmemobj_alloc_usable_size(Obj), 0, 0);
+            else
+                reclaim_insert(NV_PTR(id, Obj.off), pmemobj_alloc_usable_size(Obj), type + 1, RECLAIM_CANDIDATE);
+        }
+    }
+
+    ATOMIC_STORE_REL(&_tinystm.addition.reclaim, 1);
+    if (pthread_create(&reclaim.thread, NULL, reclaim_run, NULL) != 0) {
+        ATOMIC_STORE_REL(&_tinystm.addition.reclaim, 0);
+        pthread_mutex_unlock(&_tinystm.addition.pool_lock);
+        reclaim_free();
+        return 0;
+    }
+    reclaim.started = 1;
+    // no pool is closed before the pass is over
+    pthread_mutex_unlock(&_tinystm.addition.pool_lock);
+    return 1;
+}
+
+// a pass runs, its pools cannot be closed
+int reclaim_active() {
+    return reclaim.started && !ATOMIC_LOAD_ACQ(&reclaim.done);
+}
+
+// abandon the reconciler if it still runs
+void reclaim_exit() {
+    if (reclaim.started) {
+        reclaim.stop = 1;
+        pthread_join(reclaim.thread, NULL);
+        reclaim.started = 0;
+    }
+    for (unsigned int i = 0; i < reclaim.types_nb; i++) free(reclaim.types[i].offsets);
+    reclaim.types_nb = 0;
+}
+# endif /* _RECLAIM_H_ */
@@ -0,0 +1,343 @@
+# ifndef _SLAB_H_
+# define _SLAB_H_
+
+# include "stm_internal.h"
+
+# define NV_SLAB_SHIFT      16
+# define NV_SLAB_SIZE       (1 << NV_SLAB_SHIFT)                    // 64K
+# define NV_SLAB_BITMAP     64                                      // bitmap words: up to 4096 blocks
+# define NV_SLAB_HEADER     ((4 + NV_SLAB_BITMAP) * sizeof(uint64_t)) // blocks follow the header
+# define TYPE_NV_SLAB       2048                                    // pmemobj type of slabs
+
+// persistent slab header, only the bitmap changes after the slab is linked
+typedef struct nv_slab {
+    nv_ptr next;                        // next slab of the same size class
+    uint64_t size;                      // block size
+    uint64_t nb;                        // number of blocks
+    uint64_t reserved;
+    uint64_t bitmap[NV_SLAB_BITMAP];    // allocated blocks, written by transactions only
+} nv_slab_t;
+
+// volatile state of a slab
+struct slab_desc {
+    nv_ptr slab;                        // nv_ptr of the header, with the id of the pool
+    uint64_t size;
+    uint64_t nb;
+    volatile stm_word_t avail;          // estimated free blocks, the bitmap is authoritative
+    volatile stm_word_t owned;          // only the owner thread allocates from the slab
+    unsigned int hint;                  // bitmap word to look at first (owner only)
+};
+
+typedef struct slab_class {
+    pthread_mutex_t lock;               // serialize slab creation and ownership changes
+    slab_desc_t **desc;
+    unsigned int nb;
+    unsigned int size;
+} slab_class_t;
+
+// slabs of a pool, each pool has its own
+struct slab_pool {
+    slab_class_t class[NV_SLAB_CLASSES];
+    slab_desc_t **map;                  // slab starting in each NV_SLAB_SIZE area of the pool
+};
+
+static const uint64_t slab_sizes[NV_SLAB_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+
+
+static int slab_class_of(size_t size) {
+    for (int i = 0; i < NV_SLAB_CLASSES; i++) {
+        if (size <= slab_sizes[i]) return i;
+    }
+    return -1;
+}
+
+static inline volatile stm_word_t *slab_bitmap(slab_desc_t *desc, uint64_t word) {
+    return (volatile stm_word_t *)(desc->slab + offsetof(nv_slab_t, bitmap) + word * sizeof(uint64_t));
+}
+
+// slab holding the block at nv_addr, NULL if the block does not come from a slab of an open pool
+static slab_desc_t *slab_find(nv_ptr nv_addr) {
+    uint64_t area = NV_OFF(nv_addr) >> NV_SLAB_SHIFT;
+    stm_pool_t *pool = NV_POOL_ID(nv_addr) < NV_POOL_MAX ? NV_POOL(nv_addr) : NULL;
+    slab_desc_t *desc;
+
+    if (pool == NULL || pool->slab == NULL || area >= POOL_SIZE >> NV_SLAB_SHIFT) return NULL;
+    // a slab covers at most two areas, it starts in the area of the block or in the previous one
+    for (uint64_t i = 0; i < 2 && i <= area; i++) {
+        desc = pool->slab->map[area - i];
+        if (desc != NULL && nv_addr >= desc->slab + NV_SLAB_HEADER && nv_addr < desc->slab + NV_SLAB_HEADER + desc->nb * desc->size)
+            return desc;
+    }
+    return NULL;
+}
+
+// register a linked slab, class lock held
+static slab_desc_t *slab_add(stm_pool_t *pool, int cls, nv_ptr nv_addr) {
+    slab_class_t *class = &pool->slab->class[cls];
+    slab_desc_t *desc = (slab_desc_t *)malloc(sizeof(slab_desc_t));
+
+    desc->slab = nv_addr;
+    desc->size = slab_sizes[cls];
+    desc->nb = (NV_SLAB_SIZE - NV_SLAB_HEADER) / slab_sizes[cls];
+    desc->avail = desc->nb;
+    desc->owned = 0;
+    desc->hint = 0;
+
+    if (class->nb == class->size) {
+        class->size = class->size == 0 ? 16 : 2 * class->size;
+        class->desc = (slab_desc_t **)realloc(class->desc, class->size * sizeof(slab_desc_t *));
+    }
+    class->desc[class->nb++] = desc;
+    ATOMIC_STORE_REL(&pool->slab->map[NV_OFF(nv_addr) >> NV_SLAB_SHIFT], desc);
+    return desc;
+}
+
+// copy the header written to nv_page into the mapped v_pages, transactions read the v_pages
+static void slab_mirror(stm_pool_t *pool, uint64_t off, uint64_t size) {
+    struct free_page_head *free_page_head = &pool->page->free_page_head;
+    free_page_entry_t *page_entry;
+    uint64_t length;
+
+    pthread_spin_lock(&free_page_head->lock);
+    while (size > 0) {
+        length = PAGE_SIZE - (off & (PAGE_SIZE - 1));
+        if (length > size) length = size;
+        page_entry = pool->page->page_table[off >> PAGE_LENGTH].free_page;
+        if (page_entry != NULL && page_entry->page_inf.vaild && page_entry->VPN == off >> PAGE_LENGTH)
+            memcpy(addr_nv_2_v(page_entry->PPN, off), (void *)(off + pool->base), length);
+        off += length;
+        size -= length;
+    }
+    pthread_spin_unlock(&free_page_head->lock);
+}
+
+// carve a new slab from the pool and link it, class lock held
+static slab_desc_t *slab_new(stm_pool_t *pool, int cls) {
+    struct root *root = pool->root;
+    struct pobj_action act[2];
+    uint64_t commit_timestamp;
+    nv_slab_t *slab;
+    PMEMoid Slab;
+
+    Slab = pmemobj_reserve(pool->pop, &act[0], NV_SLAB_SIZE, TYPE_NV_SLAB);
+    if (OID_IS_NULL(Slab)) return NULL;
+
+    // logs written before the memory was freed must not be reproduced over the header
+    commit_timestamp = ATOMIC_LOAD_ACQ(&pool->nv_log->commit_timestamp);
+    while (root->reproduce_timestamp < commit_timestamp) {
+        nv_log_reproduce(pool);
+    }
+
+    slab = pmemobj_direct(Slab);
+    slab->next = root->slab_head[cls];
+    slab->size = slab_sizes[cls];
+    slab->nb = (NV_SLAB_SIZE - NV_SLAB_HEADER) / slab_sizes[cls];
+    slab->reserved = 0;
+    memset(slab->bitmap, 0, sizeof(slab->bitmap));
+    nv_flush(pool, slab, NV_SLAB_HEADER);
+    nv_drain(pool);
+    slab_mirror(pool, Slab.off, NV_SLAB_HEADER);
+
+    // the slab is allocated and linked at once
+    pmemobj_set_value(pool->pop, &act[1], &root->slab_head[cls], Slab.off);
+    pmemobj_publish(pool->pop, act, 2);
+    checkpoint_heap(pool->id);
+
+    return slab_add(pool, cls, NV_PTR(pool->id, Slab.off));
+}
+
+// take a slab with free blocks not owned by another thread, or a new one
+static slab_desc_t *slab_get(stm_pool_t *pool, int cls) {
+    slab_class_t *class = &pool->slab->class[cls];
+    slab_desc_t *desc = NULL;
+
+    pthread_mutex_lock(&class->lock);
+    for (unsigned int i = 0; i < class->nb; i++) {
+        if (!class->desc[i]->owned && ATOMIC_LOAD(&class->desc[i]->avail) > 0) {
+            desc = class->desc[i];
+            break;
+        }
+    }
+    if (desc == NULL) desc = slab_new(pool, cls);
+    if (desc != NULL) desc->owned = 1;
+    pthread_mutex_unlock(&class->lock);
+    return desc;
+}
+
+// bits of a bitmap word as before tx wrote it: blocks freed by tx must not be handed out again
+// before it commits, page_write_alloc() would overwrite them while an abort keeps them in use
+static uint64_t slab_bitmap_old(stm_tx_t *tx, volatile stm_word_t *addr) {
+    stm_word_t l = ATOMIC_LOAD_ACQ(GET_LOCK(addr));
+    w_entry_t *w;
+
+    if (!LOCK_GET_OWNED(l)) return 0;
+    w = (w_entry_t *)LOCK_GET_ADDR(l);
+    if (w < tx->w_set.entries || w >= tx->w_set.entries + tx->w_set.nb_entries) return 0;
+    for (; w != NULL; w = w->next) {
+        // write-through: the entry keeps the value to restore on abort
+        if (w->addr == addr) return w->mask != 0 ? w->value : 0;
+    }
+    return 0;
+}
+
+// allocate a block of the slab in tx, 0 if the slab is full
+static nv_ptr slab_alloc_block(stm_tx_t *tx, slab_desc_t *desc) {
+    uint64_t words = (desc->nb + 63) / 64, full, value, bit, i;
+
+    for (uint64_t n = 0; n < words; n++) {
+        i = (desc->hint + n) % words;
+        full = (i == words - 1 && desc->nb % 64 != 0) ? ((uint64_t)1 << (desc->nb % 64)) - 1 : ~(uint64_t)0;
+        value = int_stm_load(tx, slab_bitmap(desc, i)) | slab_bitmap_old(tx, slab_bitmap(desc, i));
+        if ((value & full) == full) continue;
+        bit = (uint64_t)1 << __builtin_ctzll(~value & full);
+        // logged as any other write: the block is allocated iff the tx commits
+        int_stm_store2(tx, slab_bitmap(desc, i), bit, bit);
+        desc->hint = i;
+        return desc->slab + NV_SLAB_HEADER + (i * 64 + __builtin_ctzll(bit)) * desc->size;
+    }
+    return 0;
+}
+
+void slab_init_thread(stm_tx_t *tx) {
+    tx->addition.slab = (slab_desc_t **)calloc(NV_POOL_MAX * NV_SLAB_CLASSES, sizeof(slab_desc_t *));
+}
+
+void slab_exit_thread(stm_tx_t *tx) {
+    for (int i = 0; i < NV_POOL_MAX * NV_SLAB_CLASSES; i++) {
+        if (tx->addition.slab[i] != NULL) ATOMIC_STORE_REL(&tx->addition.slab[i]->owned, 0);
+    }
+    free(tx->addition.slab);
+}
+
+nv_ptr slab_alloc(stm_tx_t *tx, stm_pool_t *pool, size_t size) {
+    int cls = slab_class_of(size);
+    slab_desc_t **owned;
+    slab_desc_t *desc;
+    nv_ptr nv_addr;
+
+    if (cls < 0 || pool == NULL || pool->slab == NULL) return 0;
+    owned = &tx->addition.slab[pool->id * NV_SLAB_CLASSES + cls];
+    while (1) {
+        desc = *owned;
+        if (desc == NULL) {
+            desc = slab_get(pool, cls);
+            if (desc == NULL) return 0;
+            *owned = desc;
+        }
+        nv_addr = slab_alloc_block(tx, desc);
+        if (nv_addr != 0) return nv_addr;
+
+        // look again after clearing avail: a block freed meanwhile is either seen now or counted
+        ATOMIC_STORE(&desc->avail, 0);
+        ATOMIC_MB_FULL;
+        nv_addr = slab_alloc_block(tx, desc);
+        if (nv_addr != 0) return nv_addr;
+
+        // full: the slab gets back to the class once a block is freed
+        *owned = NULL;
+        ATOMIC_STORE_REL(&desc->owned, 0);
+    }
+}
+
+// allocate a block in the same page as hint if its slab has the same size class, else as slab_alloc
+// in the pool of hint
+nv_ptr slab_alloc_near(stm_tx_t *tx, size_t size, nv_ptr hint) {
+    int cls = slab_class_of(size);
+    slab_desc_t *desc = hint == 0 ? NULL : slab_find(hint);
+    stm_pool_t *pool = NV_POOL_ID(hint) < NV_POOL_MAX ? NV_POOL(hint) : NULL;
+    uint64_t blocks, page, first, last, full, value, bit;
+
+    if (cls < 0) return 0;
+    if (desc == NULL || desc->size != slab_sizes[cls]) return slab_alloc(tx, pool, size);
+
+    // blocks starting in the page of hint
+    blocks = desc->slab + NV_SLAB_HEADER;
+    page = hint & ~(uint64_t)(PAGE_SIZE - 1);
+    first = page <= blocks ? 0 : (page - blocks + desc->size - 1) / desc->size;
+    last = (page + PAGE_SIZE - blocks + desc->size - 1) / desc->size;
+    if (last > desc->nb) last = desc->nb;
+
+    for (uint64_t i = first / 64; i * 64 < last; i++) {
+        full = ~(uint64_t)0;
+        if (i == first / 64) full &= ~(uint64_t)0 << (first % 64);
+        if (i == last / 64) full &= ((uint64_t)1 << (last % 64)) - 1;
+        value = int_stm_load(tx, slab_bitmap(desc, i)) | slab_bitmap_old(tx, slab_bitmap(desc, i));
+        if ((value & full) == full) continue;
+        bit = (uint64_t)1 << __builtin_ctzll(~value & full);
+        int_stm_store2(tx, slab_bitmap(desc, i), bit, bit);
+        return blocks + (i * 64 + __builtin_ctzll(bit)) * desc->size;
+    }
+    // the page is full: the block only stays close to the other blocks of the thread
+    return slab_alloc(tx, pool, size);
+}
+
+int slab_free(stm_tx_t *tx, nv_ptr nv_addr) {
+    slab_desc_t *desc = slab_find(nv_addr);
+    uint64_t block;
+
+    if (desc == NULL) return 0;
+    block = (nv_addr - desc->slab - NV_SLAB_HEADER) / desc->size;
+    int_stm_store2(tx, slab_bitmap(desc, block / 64), 0, (uint64_t)1 << (block % 64));
+    // counted before commit: an abort only makes the owner look at the bitmap once more
+    ATOMIC_FETCH_INC_FULL(&desc->avail);
+    return 1;
+}
+
+// rebuild the volatile state after recovery and reclaim slabs not linked to any class. The links
+// of the pool are offsets in the pool
+void nv_slab_init(stm_pool_t *pool) {
+    struct root *root = pool->root;
+    nv_slab_t *slab;
+    slab_desc_t *desc;
+    PMEMoid Slab, *leak = NULL;
+    unsigned int leak_nb = 0, leak_size = 0;
+    uint64_t used;
+
+    pool->slab = (struct slab_pool *)calloc(1, sizeof(struct slab_pool));
+    pool->slab->map = (slab_desc_t **)calloc(POOL_SIZE >> NV_SLAB_SHIFT, sizeof(slab_desc_t *));
+    for (int cls = 0; cls < NV_SLAB_CLASSES; cls++) {
+        pthread_mutex_init(&pool->slab->class[cls].lock, NULL);
+        for (nv_ptr off = root->slab_head[cls]; off != 0; off = slab->next) {
+            slab = (nv_slab_t *)(off + pool->base);
+            assert(slab->size == slab_sizes[cls]);
+            desc = slab_add(pool, cls, NV_PTR(pool->id, off));
+            used = 0;
+            for (int i = 0; i < NV_SLAB_BITMAP; i++) used += __builtin_popcountll(slab->bitmap[i]);
+            desc->avail = desc->nb - used;
+        }
+    }
+
+    // scan the pool for slabs that a crash left allocated but unlinked
+    for (Slab = pmemobj_first(pool->pop); !OID_IS_NULL(Slab); Slab = pmemobj_next(Slab)) {
+        if (pmemobj_type_num(Slab) != TYPE_NV_SLAB || slab_find(NV_PTR(pool->id, Slab.off + NV_SLAB_HEADER)) != NULL) continue;
+        if (leak_nb == leak_size) {
+            leak_size = leak_size == 0 ? 16 : 2 * leak_size;
+            leak = (PMEMoid *)realloc(leak, leak_size * sizeof(PMEMoid));
+        }
+        leak[leak_nb++] = Slab;
+    }
+    for (unsigned int i = 0; i < leak_nb; i++) pmemobj_free(&leak[i]);
+    if (leak_nb != 0) fprintf(stderr, "Reclaimed %u unlinked slabs\n", leak_nb);
+    free(leak);
+}
+
+// drop the slab state of a pool being closed, the threads give up the slabs they own in it
+void nv_slab_exit(stm_pool_t *pool) {
+    slab_class_t *class;
+
+    pthread_mutex_lock(&_tinystm.quiesce_mutex);
+    for (stm_tx_t *tx = _tinystm.threads; tx != NULL; tx = tx->next)
+        memset(&tx->addition.slab[pool->id * NV_SLAB_CLASSES], 0, NV_SLAB_CLASSES * sizeof(slab_desc_t *));
+    pthread_mutex_unlock(&_tinystm.quiesce_mutex);
+
+    for (int cls = 0; cls < NV_SLAB_CLASSES; cls++) {
+        class = &pool->slab->class[cls];
+        for (unsigned int i = 0; i < class->nb; i++) free(class->desc[i]);
+        free(class->desc);
+        pthread_mutex_destroy(&class->lock);
+    }
+    free(pool->slab->map);
+    free(pool->slab);
+    pool->slab = NULL;
+}
+# endif /* _SLAB_H_ */
@@ -34,6 +34,11 @@
 
 #include "stm.h"
 #include "stm_internal.h"
+#ifdef NV_SLAB
+# include "slab.h"
+#endif /* NV_SLAB */
+#include "checkpoint.h"
+#include "reclaim.h"
 
 #include "utils.h"
 #include "atomic.h"
@@ -81,6 +86,7 @@ global_t _tinystm =
 #ifdef IRREVOCABLE_ENABLED
     , .irrevocable = 0
 #endif /* IRREVOCABLE_ENABLED */
+    , .addition.pool_lock = PTHREAD_MUTEX_INITIALIZER
     };
 
 /* ################################################################### *
@@ -247,20 +253,103 @@ signal_catcher(int sig)
 // persist func
 _CALLCONV void *nv_to_ptr(nv_ptr nv_addr) {
   if (nv_addr == 0) return NULL;
-  return (void *)(nv_addr + _tinystm.addition.base);
+  return (void *)(NV_POOL(nv_addr)->base + NV_OFF(nv_addr));
 }
 
 _CALLCONV nv_ptr ptr_to_nv(void *ptr) {
+  stm_pool_t *pool;
+  unsigned int i;
+
   if(ptr == NULL) return 0;
-  return (nv_ptr)ptr - _tinystm.addition.base;
+  for (i = 0; i < _tinystm.addition.pool_nb; i++) {
+    pool = _tinystm.addition.pools[i];
+    if (pool != NULL && (uint64_t)ptr - pool->base < POOL_SIZE)
+      return NV_PTR(i, (uint64_t)ptr - pool->base);
+  }
+  return 0;
+}
+
+/*
+ * Create or open a pool, mapped at once if page_map_init() was called.
+ */
+_CALLCONV stm_pool_t *stm_pool_open(const char *path) {
+  stm_pool_t *pool;
+
+  pthread_mutex_lock(&_tinystm.addition.pool_lock);
+  pool = pmem_init(path);
+  if (pool != NULL) {
+    page_open(pool);
+#ifdef NV_SLAB
+    nv_slab_init(pool);
+#endif /* NV_SLAB */
+    if (!_tinystm.addition.opened) {
+      init_measure();
+      init_trace();
+      _tinystm.addition.opened = 1;
+    }
+    /* The pools that waited for this one can be mapped too */
+    if (_tinystm.addition.mapped)
+      page_map_pools();
+  }
+  pthread_mutex_unlock(&_tinystm.addition.pool_lock);
+  return pool;
+}
+
+/*
+ * Reproduce the log of a pool and close it.
+ */
+_CALLCONV int stm_pool_close(stm_pool_t *pool) {
+  pthread_mutex_lock(&_tinystm.addition.pool_lock);
+  if (reclaim_active() || checkpoint.running) {
+    pthread_mutex_unlock(&_tinystm.addition.pool_lock);
+    errno = EBUSY;
+    return -1;
+  }
+  page_hot_save(pool);
+  page_exit(pool);
+#ifdef NV_SLAB
+  nv_slab_exit(pool);
+#endif /* NV_SLAB */
+  nv_log_save(pool);
+  pthread_mutex_unlock(&_tinystm.addition.pool_lock);
+  return 0;
+}
+
+_CALLCONV PMEMobjpool *stm_pool_pmem(stm_pool_t *pool) {
+  return pool->pop;
+}
+
+_CALLCONV stm_pool_t *stm_pool_by_pmem(PMEMobjpool *pop) {
+  unsigned int i;
+
+  for (i = 0; i < _tinystm.addition.pool_nb; i++) {
+    if (_tinystm.addition.pools[i] != NULL && _tinystm.addition.pools[i]->pop == pop)
+      return _tinystm.addition.pools[i];
+  }
+  return NULL;
 }
 
 _CALLCONV PMEMobjpool *pool_init(char *pool_path) {
-  return pmem_init(pool_path);
+  stm_pool_t *pool = stm_pool_open(pool_path);
+
+  return pool == NULL ? NULL : pool->pop;
 }
 
 _CALLCONV void page_map_init() {
-  page_init();
+  stm_pool_t *pool;
+  unsigned int i;
+
+  pthread_mutex_lock(&_tinystm.addition.pool_lock);
+  for (i = 0; i < _tinystm.addition.pool_nb; i++) {
+    pool = _tinystm.addition.pools[i];
+    if (pool != NULL && pool->pending >= 0) {
+      fprintf(stderr, "Error: the log of pool %u waits for pool %d to be opened\n", i, pool->pending);
+      exit(1);
+    }
+  }
+  _tinystm.addition.mapped = 1;
+  page_map_pools();
+  pthread_mutex_unlock(&_tinystm.addition.pool_lock);
 }
 
 /*
@@ -304,6 +393,14 @@ stm_init()
   /* Set locks and clock but should be already to 0 */
   memset((void *)_tinystm.locks, 0, LOCK_ARRAY_SIZE * sizeof(stm_word_t));
   CLOCK = 0;
+#ifdef LOCK_TUNING
+  _tinystm.lock_shift = LOCK_WORD_SHIFT + LOCK_SHIFT_EXTRA;
+  _tinystm.lock_mask = LOCK_ARRAY_SIZE - 1;
+#endif /* LOCK_TUNING */
+#ifdef RW_SET_ARENA
+  _tinystm.arenas = NULL;
+  pthread_mutex_init(&_tinystm.arena_mutex, NULL);
+#endif /* RW_SET_ARENA */
 
   stm_quiesce_init();
 
@@ -331,19 +428,37 @@ stm_init()
 _CALLCONV void
 stm_exit(void)
 {
+  unsigned int i;
+
   PRINT_DEBUG("==> stm_exit()\n");
 
   if (!_tinystm.initialized)
     return;
 
-  nv_log_save(); // add for save all nv_log to nv_heap
-  result_output();
-  tls_exit();
-  stm_quiesce_exit();
-
+  /* The reconciler is a transactional thread of its own */
+  reclaim_exit();
 #ifdef EPOCH_GC
+  /* Publish pending frees before the pool is closed */
   gc_exit();
 #endif /* EPOCH_GC */
+#ifdef RW_SET_ARENA
+  while (_tinystm.arenas != NULL) {
+    rw_arena_t *arena = _tinystm.arenas;
+    _tinystm.arenas = arena->next;
+    munmap(arena, RW_ARENA_SIZE);
+  }
+#endif /* RW_SET_ARENA */
+
+  page_hot_exit();
+  /* Save all nv_logs to nv_heap */
+  for (i = _tinystm.addition.pool_nb; i > 0; i--) {
+    if (_tinystm.addition.pools[i - 1] != NULL)
+      stm_pool_close(_tinystm.addition.pools[i - 1]);
+  }
+  result_output();
+  trace_output();
+  tls_exit();
+  stm_quiesce_exit();
 
   _tinystm.initialized = 0;
 }
@@ -469,6 +584,219 @@ stm_store2_tx(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_wor
   int_stm_store2(tx, addr, value, mask);
 }
 
+/*
+ * Called by the CURRENT thread to load a range of words.
+ */
+_CALLCONV void
+stm_load_range(volatile stm_word_t *addr, void *buf, size_t size)
+{
+  TX_GET;
+  int_stm_load_range(tx, addr, buf, size);
+}
+
+_CALLCONV void
+stm_load_range_tx(stm_tx_t *tx, volatile stm_word_t *addr, void *buf, size_t size)
+{
+  int_stm_load_range(tx, addr, buf, size);
+}
+
+/*
+ * Called by the CURRENT thread to store a range of words.
+ */
+_CALLCONV void
+stm_store_range(volatile stm_word_t *addr, const void *buf, size_t size)
+{
+  TX_GET;
+  int_stm_store_range(tx, addr, buf, size);
+}
+
+_CALLCONV void
+stm_store_range_tx(stm_tx_t *tx, volatile stm_word_t *addr, const void *buf, size_t size)
+{
+  int_stm_store_range(tx, addr, buf, size);
+}
+
+/*
+ * Called by the CURRENT thread to declare a block it has just allocated.
+ */
+_CALLCONV void
+stm_alloc_range(nv_ptr addr, size_t size)
+{
+  TX_GET;
+  stm_alloc_range_tx(tx, addr, size);
+}
+
+_CALLCONV void
+stm_alloc_range_tx(stm_tx_t *tx, nv_ptr addr, size_t size)
+{
+  alloc_range_insert(tx, addr, size);
+  checkpoint_block(addr);
+}
+
+/*
+ * Called by the CURRENT thread to allocate a block from the slabs.
+ */
+_CALLCONV nv_ptr
+stm_slab_alloc(size_t size)
+{
+  TX_GET;
+  return stm_slab_alloc_tx(tx, size);
+}
+
+_CALLCONV nv_ptr
+stm_slab_alloc_tx(stm_tx_t *tx, size_t size)
+{
+  return stm_slab_alloc_pool_tx(tx, _tinystm.addition.pools[0], size);
+}
+
+/*
+ * Called by the CURRENT thread to allocate a block from the slabs of a pool.
+ */
+_CALLCONV nv_ptr
+stm_slab_alloc_pool(stm_pool_t *pool, size_t size)
+{
+  TX_GET;
+  return stm_slab_alloc_pool_tx(tx, pool, size);
+}
+
+_CALLCONV nv_ptr
+stm_slab_alloc_pool_tx(stm_tx_t *tx, stm_pool_t *pool, size_t size)
+{
+#ifdef NV_SLAB
+  return slab_alloc(tx, pool, size);
+#else /* ! NV_SLAB */
+  return 0;
+#endif /* ! NV_SLAB */
+}
+
+/*
+ * Called by the CURRENT thread to allocate a block close to another one.
+ */
+_CALLCONV nv_ptr
+stm_slab_alloc_near(size_t size, nv_ptr hint)
+{
+  TX_GET;
+  return stm_slab_alloc_near_tx(tx, size, hint);
+}
+
+_CALLCONV nv_ptr
+stm_slab_alloc_near_tx(stm_tx_t *tx, size_t size, nv_ptr hint)
+{
+#ifdef NV_SLAB
+  return slab_alloc_near(tx, size, hint);
+#else /* ! NV_SLAB */
+  return 0;
+#endif /* ! NV_SLAB */
+}
+
+/*
+ * Called by the CURRENT thread to free a block allocated from the slabs.
+ */
+_CALLCONV int
+stm_slab_free(nv_ptr addr)
+{
+  TX_GET;
+  return stm_slab_free_tx(tx, addr);
+}
+
+_CALLCONV int
+stm_slab_free_tx(stm_tx_t *tx, nv_ptr addr)
+{
+#ifdef NV_SLAB
+  return slab_free(tx, addr);
+#else /* ! NV_SLAB */
+  return 0;
+#endif /* ! NV_SLAB */
+}
+
+/*
+ * Check whether a block was allocated from the slabs.
+ */
+_CALLCONV int
+stm_slab_block(nv_ptr addr)
+{
+#ifdef NV_SLAB
+  return slab_find(addr) != NULL;
+#else /* ! NV_SLAB */
+  return 0;
+#endif /* ! NV_SLAB */
+}
+
+/*
+ * Called by the CURRENT thread to declare a block freed by the transaction.
+ */
+_CALLCONV void
+stm_free_range(nv_ptr addr)
+{
+  TX_GET;
+  stm_free_range_tx(tx, addr);
+}
+
+_CALLCONV void
+stm_free_range_tx(stm_tx_t *tx, nv_ptr addr)
+{
+  if (unlikely(_tinystm.addition.reclaim))
+    reclaim_note(addr, 0, 1);
+  checkpoint_block(addr);
+}
+
+/*
+ * Register the persistent pointers of an object type.
+ */
+_CALLCONV int
+stm_reclaim_type(uint64_t type_num, const size_t *offsets, unsigned int nb)
+{
+  return reclaim_type(type_num, offsets, nb);
+}
+
+/*
+ * Start reclaiming the unreachable objects in the background.
+ */
+_CALLCONV int
+stm_reclaim_start(unsigned int batch, unsigned int pause)
+{
+  return reclaim_start(batch, pause);
+}
+
+/*
+ * Called by the CURRENT thread to write an image of the first pool.
+ */
+_CALLCONV int
+stm_checkpoint(const char *path, uint64_t since, unsigned int rate, uint64_t *timestamp)
+{
+  TX_GET;
+  return checkpoint_run(tx, _tinystm.addition.pools[0], path, since, rate, timestamp);
+}
+
+/*
+ * Called by the CURRENT thread to write an image of a pool.
+ */
+_CALLCONV int
+stm_checkpoint_pool(stm_pool_t *pool, const char *path, uint64_t since, unsigned int rate, uint64_t *timestamp)
+{
+  TX_GET;
+  return checkpoint_run(tx, pool, path, since, rate, timestamp);
+}
+
+/*
+ * Check if a checkpoint is being written.
+ */
+_CALLCONV int
+stm_checkpoint_active(void)
+{
+  return _tinystm.addition.checkpoint;
+}
+
+/*
+ * Publish actions of libpmemobj, the deferred frees once the checkpoint
+ * being written, if any, is over.
+ */
+_CALLCONV void
+stm_checkpoint_publish(PMEMobjpool *pool, struct pobj_action *acts, size_t nb, size_t nb_free)
+{
+  checkpoint_publish(pool, acts, nb, nb_free);
+}
+
 /*
  * Called by the CURRENT thread to inquire about the status of a transaction.
  */
@@ -586,6 +914,56 @@ stm_get_stats_tx(stm_tx_t *tx, const char *name, void *val)
   return int_stm_get_stats(tx, name, val);
 }
 
+#ifdef LOCK_TUNING
+/*
+ * Change the mapping of addresses to locks.  All other threads are
+ * blocked outside of transactions while the mapping changes, so that
+ * no read or write set refers to a lock of the previous mapping.
+ * Timestamps need not be reset: a new transaction starts after all of
+ * them.
+ */
+static int
+set_lock_mapping(unsigned int shift_extra, unsigned int log_size)
+{
+  TX_GET;
+
+  if (shift_extra > LOCK_TUNING_MAX_SHIFT_EXTRA || log_size < LOCK_TUNING_MIN_LOG_SIZE || log_size > LOCK_ARRAY_LOG_SIZE)
+    return 0;
+
+  if (tx == NULL) {
+    /* Only possible before any thread uses transactions */
+    if (_tinystm.threads != NULL)
+      return 0;
+    _tinystm.lock_shift = LOCK_WORD_SHIFT + shift_extra;
+    _tinystm.lock_mask = ((stm_word_t)1 << log_size) - 1;
+    return 1;
+  }
+
+  /* Must be outside of a transaction */
+  if (IS_ACTIVE(tx->status))
+    return 0;
+  stm_quiesce(tx, 1);
+  _tinystm.lock_shift = LOCK_WORD_SHIFT + shift_extra;
+  _tinystm.lock_mask = ((stm_word_t)1 << log_size) - 1;
+  stm_quiesce_release(tx);
+
+  return 1;
+}
+
+/*
+ * Return the number of bits of the lock index currently used.
+ */
+static unsigned int
+get_lock_log_size(void)
+{
+  unsigned int i;
+
+  for (i = 0; ((stm_word_t)1 << i) <= _tinystm.lock_mask; i++)
+    ;
+  return i;
+}
+#endif /* LOCK_TUNING */
+
 /*
  * Return STM parameters.
  */
@@ -604,6 +982,29 @@ stm_get_parameter(const char *name, void *val)
     *(int *)val = RW_SET_SIZE;
     return 1;
   }
+#ifdef LOCK_TUNING
+  if (strcmp("lock_tuning", name) == 0) {
+    *(int *)val = 1;
+    return 1;
+  }
+  if (strcmp("lock_shift_extra", name) == 0) {
+    *(int *)val = (int)(_tinystm.lock_shift - LOCK_WORD_SHIFT);
+    return 1;
+  }
+  if (strcmp("lock_array_log_size", name) == 0) {
+    *(int *)val = (int)get_lock_log_size();
+    return 1;
+  }
+#else /* ! LOCK_TUNING */
+  if (strcmp("lock_shift_extra", name) == 0) {
+    *(int *)val = LOCK_SHIFT_EXTRA;
+    return 1;
+  }
+  if (strcmp("lock_array_log_size", name) == 0) {
+    *(int *)val = LOCK_ARRAY_LOG_SIZE;
+    return 1;
+  }
+#endif /* ! LOCK_TUNING */
 #if CM == CM_BACKOFF
   if (strcmp("min_backoff", name) == 0) {
     *(unsigned long *)val = MIN_BACKOFF;
@@ -620,6 +1021,21 @@ stm_get_parameter(const char *name, void *val)
     return 1;
   }
 #endif /* CM == CM_MODULAR */
+  /* Logs reproduced when the open pools were opened */
+  if (_tinystm.addition.pool_nb != 0) {
+    if (strcmp("recovery_txs", name) == 0) {
+      *(unsigned long *)val = nv_stat_pools(offsetof(nv_log_t, recovery_txs));
+      return 1;
+    }
+    if (strcmp("recovery_entries", name) == 0) {
+      *(unsigned long *)val = nv_stat_pools(offsetof(nv_log_t, recovery_entries));
+      return 1;
+    }
+    if (strcmp("recovery_ns", name) == 0) {
+      *(unsigned long *)val = nv_stat_pools(offsetof(nv_log_t, recovery_ns));
+      return 1;
+    }
+  }
 #ifdef COMPILE_FLAGS
   if (strcmp("compile_flags", name) == 0) {
     *(const char **)val = XSTR(COMPILE_FLAGS);
@@ -637,7 +1053,21 @@ stm_set_parameter(const char *name, void *val)
 {
 #if CM == CM_MODULAR
   int i;
+#endif /* CM == CM_MODULAR */
 
+#ifdef LOCK_TUNING
+  if (strcmp("lock_shift_extra", name) == 0) {
+    if (*(int *)val < 0)
+      return 0;
+    return set_lock_mapping((unsigned int)*(int *)val, get_lock_log_size());
+  }
+  if (strcmp("lock_array_log_size", name) == 0) {
+    if (*(int *)val < 0)
+      return 0;
+    return set_lock_mapping(_tinystm.lock_shift - LOCK_WORD_SHIFT, (unsigned int)*(int *)val);
+  }
+#endif /* LOCK_TUNING */
+#if CM == CM_MODULAR
   if (strcmp("cm_policy", name) == 0) {
     for (i = 0; cms[i].name != NULL; i++) {
       if (strcasecmp(cms[i].name, (const char *)val) == 0) {
@@ -27,7 +27,9 @@
 #define _STM_INTERNAL_H_
 
 #include <pthread.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <stm.h>
 #include <libpmemobj.h>
 #include "tls.h"
@@ -62,6 +64,43 @@
 # define CM                             CM_SUICIDE
 #endif /* ! CM */
 
+/* Global clock schemes */
+#define CLOCK_GV1                       0
+#define CLOCK_GV4                       1
+#define CLOCK_GV5                       2
+#define CLOCK_GV6                       3
+
+#ifndef CLOCK_SCHEME
+# define CLOCK_SCHEME                   CLOCK_GV1
+#endif /* ! CLOCK_SCHEME */
+
+#if CLOCK_SCHEME == CLOCK_GV6
+# ifndef CLOCK_GV6_PERIOD
+#  define CLOCK_GV6_PERIOD              32                  /* Commits between two clock increments */
+# endif /* ! CLOCK_GV6_PERIOD */
+#endif /* CLOCK_SCHEME == CLOCK_GV6 */
+
+#ifndef SNAPSHOT_RETRIES
+# define SNAPSHOT_RETRIES               4                   /* Restarts before a snapshot tx uses shadow pages */
+#endif /* ! SNAPSHOT_RETRIES */
+#ifndef READ_RANGE_CHUNK
+# define READ_RANGE_CHUNK               64                  /* Words whose locks a range read checks in one pass */
+#endif /* ! READ_RANGE_CHUNK */
+
+/* Pools: an nv_ptr holds the id of its pool above NV_POOL_SHIFT and the
+ * offset in the pool below, pool 0 keeping plain offsets. NV_POOL_MAX also
+ * sizes struct root of log.h, it is not a build option */
+#define NV_POOL_MAX                     16                  /* Pools open at once */
+#define NV_POOL_SHIFT                   40
+#define NV_POOL_ID(a)                   ((uint64_t)(a) >> NV_POOL_SHIFT)
+#define NV_OFF(a)                       ((uint64_t)(a) & (((uint64_t)1 << NV_POOL_SHIFT) - 1))
+#define NV_PTR(id, off)                 (((uint64_t)(id) << NV_POOL_SHIFT) | (uint64_t)(off))
+#define NV_POOL(a)                      (_tinystm.addition.pools[NV_POOL_ID(a)])
+
+#if DESIGN != WRITE_THROUGH && CLOCK_SCHEME != CLOCK_GV1
+# error "CLOCK_SCHEME other than CLOCK_GV1 can only be used with WT design"
+#endif /* DESIGN != WRITE_THROUGH && CLOCK_SCHEME != CLOCK_GV1 */
+
 #if DESIGN != WRITE_BACK_ETL && CM == CM_MODULAR
 # error "MODULAR contention manager can only be used with WB-ETL design"
 #endif /* DESIGN != WRITE_BACK_ETL && CM == CM_MODULAR */
@@ -92,6 +131,17 @@
 # define RW_SET_SIZE                    4096                /* Initial size of read/write sets */
 #endif /* ! RW_SET_SIZE */
 
+#ifdef RW_SET_ARENA
+# ifndef RW_SET_ARENA_MAX
+#  define RW_SET_ARENA_MAX              (1 << 22)           /* Maximum size of read/write sets */
+# endif /* ! RW_SET_ARENA_MAX */
+# define RW_ARENA_PAGE                  4096
+# define RW_ARENA_ROUND(s)              (((s) + RW_ARENA_PAGE - 1) & ~(size_t)(RW_ARENA_PAGE - 1))
+# if CM == CM_MODULAR
+#  error "RW_SET_ARENA cannot be used with CM_MODULAR (write set is reallocated upon kill)"
+# endif /* CM == CM_MODULAR */
+#endif /* RW_SET_ARENA */
+
 #ifndef LOCK_ARRAY_LOG_SIZE
 # define LOCK_ARRAY_LOG_SIZE            20                  /* Size of lock array: 2^20 = 1M */
 #endif /* LOCK_ARRAY_LOG_SIZE */
@@ -233,10 +283,22 @@ enum {                                  /* Transaction status */
  * We try to avoid collisions as much as possible (two addresses covered by the same lock).
  */
 #define LOCK_ARRAY_SIZE                 (1 << LOCK_ARRAY_LOG_SIZE)
-#define LOCK_MASK                       (LOCK_ARRAY_SIZE - 1)
-#define LOCK_SHIFT                      (((sizeof(stm_word_t) == 4) ? 2 : 3) + LOCK_SHIFT_EXTRA)
+#define LOCK_WORD_SHIFT                 ((sizeof(stm_word_t) == 4) ? 2 : 3)
+#ifdef LOCK_TUNING
+/* The array is allocated with its maximal size and only the first (lock_mask + 1) locks are used */
+# define LOCK_MASK                      (_tinystm.lock_mask)
+# define LOCK_SHIFT                     (_tinystm.lock_shift)
+# define LOCK_TUNING_MIN_LOG_SIZE       10                  /* Smallest lock array used: 2^10 = 1K */
+# define LOCK_TUNING_MAX_SHIFT_EXTRA    8                   /* Largest lock granularity: 2^8 words */
+#else /* ! LOCK_TUNING */
+# define LOCK_MASK                      (LOCK_ARRAY_SIZE - 1)
+# define LOCK_SHIFT                     (LOCK_WORD_SHIFT + LOCK_SHIFT_EXTRA)
+#endif /* ! LOCK_TUNING */
 #define LOCK_IDX(a)                     (((stm_word_t)(a) >> LOCK_SHIFT) & LOCK_MASK)
 #ifdef LOCK_IDX_SWAP
+# ifdef LOCK_TUNING
+#  error "LOCK_IDX_SWAP cannot be used with LOCK_TUNING"
+# endif /* LOCK_TUNING */
 # if LOCK_ARRAY_LOG_SIZE < 16
 #  error "LOCK_IDX_SWAP requires LOCK_ARRAY_LOG_SIZE to be at least 16"
 # endif /* LOCK_ARRAY_LOG_SIZE < 16 */
@@ -255,6 +317,19 @@ enum {                                  /* Transaction status */
 #define GET_CLOCK                       (ATOMIC_LOAD_ACQ(&CLOCK))
 #define FETCH_INC_CLOCK                 (ATOMIC_FETCH_INC_FULL(&CLOCK))
 
+/*
+ * CLOCK_GV1: every update transaction increments the clock.
+ * CLOCK_GV4: try once to increment the clock; on failure, share the
+ *   timestamp installed by the winner (pass on failure).
+ * CLOCK_GV5: never increment on commit; use clock + 1 and let readers
+ *   that observe a newer version move the clock forward.
+ * CLOCK_GV6: like GV5 but increment the clock (GV4-style) once every
+ *   CLOCK_GV6_PERIOD commits of a thread to bound spurious extensions.
+ * With all schemes except GV1, several transactions may share the same
+ * commit timestamp.  The persistent log does not rely on it being unique
+ * (see nv_log_record()).
+ */
+
 /* ################################################################### *
  * CALLBACKS
  * ################################################################### */
@@ -270,11 +345,40 @@ enum {                                  /* Transaction status */
 #endif /* MAX_SPECIFIC */
 
 
-#define V_LOG_COLLECT_MAX 2000
 #define GROUP_COLLECT_MAX 2000
-#define FLUSH_COLLECT_MAX 65
-#define DELAY_COLLECT_MAX 10000
-#define GROUP_COMMIT_MAX 1000
+#define MEASURE_SUB_BITS 5              /* Log-linear histograms: 2^5 sub-buckets per power of two (3% error) */
+#define MEASURE_SUB (1 << MEASURE_SUB_BITS)
+#define MEASURE_BUCKETS ((64 - MEASURE_SUB_BITS + 1) * MEASURE_SUB)
+
+enum {                                  /* Histograms, in the order of result.bin */
+  MEASURE_V_LOG_SIZE = 0,
+  MEASURE_GROUP_SIZE,
+  MEASURE_GROUP_COMMIT,
+  MEASURE_FLUSH_SIZE,
+  MEASURE_DELAY,                        /* Nanoseconds */
+  MEASURE_LOG_DELAY,                    /* Nanoseconds */
+  MEASURE_NB
+};
+
+#define TRACE_SIZE 4096                 /* Events kept by a thread, power of 2 */
+
+enum {                                  /* Tracepoints, in commit order */
+  TRACE_commit_start = 0,
+  TRACE_commit_validated,
+  TRACE_log_locked,
+  TRACE_log_flushed,
+  TRACE_log_drained,
+  TRACE_log_published,
+  TRACE_commit_logged,
+  TRACE_commit_unlocked,
+  TRACE_commit_end,
+  TRACE_reproduce_start,
+  TRACE_reproduce_end,
+  TRACE_page_map_start,
+  TRACE_page_map_copied,
+  TRACE_page_map_end,
+  TRACE_NB
+};
 
 typedef struct r_entry {                /* Read set entry */
   stm_word_t version;                   /* Version read */
@@ -327,41 +431,159 @@ typedef struct cb_entry {               /* Callback entry */
 } cb_entry_t;
 
 typedef struct nv_log nv_log_t;
-typedef struct v_log_block v_log_block_t;
+typedef struct alloc_range alloc_range_t;
+typedef struct slab_desc slab_desc_t;
 // typedef struct v_log_pool v_log_pool_t;
 
+typedef struct measure_thread {         /* Histograms of one thread, only written by the thread */
+  struct measure_thread *next;
+  uint64_t thread_nb;
+  uint64_t hist[MEASURE_NB][MEASURE_BUCKETS];
+} measure_thread_t;
+
 typedef struct global_measure {
-  uint64_t v_log_size_collect[V_LOG_COLLECT_MAX + 1];
-  uint64_t group_size_collect[GROUP_COLLECT_MAX + 1];
-  uint64_t group_commit_collect[GROUP_COMMIT_MAX + 1];
-  uint64_t flush_size_collect[FLUSH_COLLECT_MAX + 1];
-  uint64_t delay_time_collect[DELAY_COLLECT_MAX + 1];
-  uint64_t log_delay_time_collect[DELAY_COLLECT_MAX + 1];
+  pthread_mutex_t lock;
+  measure_thread_t *threads;            /* Merged when the results are written */
+  uint64_t ns_per_tick;                 /* 32.32 fixed point */
+  uint64_t start;                       /* Nanoseconds */
+  FILE *file;                           /* JSON lines */
+  unsigned int period;                  /* Milliseconds between two snapshots, 0 for none */
+  volatile int stop;
+  pthread_t snapshot;
 } global_measure_t;
 
+typedef struct trace_event {
+  uint64_t ns;
+  uint64_t arg;
+  uint64_t point;
+} trace_event_t;
+
+typedef struct trace_thread {           /* Ring of one thread, only written by the thread */
+  struct trace_thread *next;
+  uint64_t thread_nb;
+  volatile uint64_t nb;                 /* Events recorded, the last TRACE_SIZE are kept */
+  trace_event_t events[TRACE_SIZE];
+} trace_thread_t;
+
+typedef struct global_trace {
+  trace_thread_t *volatile threads;     /* Pushed without lock, read by the signal handler */
+  char file[256];
+  struct sigaction old_act;             /* Handler of the signal before ours, restored at exit */
+} global_trace_t;
+
+typedef struct global_emulate {         /* NVM emulation, delays in ticks */
+  uint64_t write_ns;                    /* Per cache line flushed, as configured */
+  uint64_t drain_ns;
+  uint64_t read_ns;                     /* Per cache line read */
+  uint64_t bandwidth;                   /* MB/s of each pool, 0 for none */
+  uint64_t write;
+  uint64_t drain;
+  uint64_t read;
+  uint64_t byte;                        /* 32.32 fixed point */
+} global_emulate_t;
+
 typedef struct tx_measure {
-  struct timeval start_time[GROUP_COLLECT_MAX];
-  struct timeval log_start_time;
+  uint64_t start_time[GROUP_COLLECT_MAX]; /* Ticks */
+  uint64_t log_start_time;
   uint64_t group_size;
   // bool in_group;
   uint64_t vlog_size;
+  measure_thread_t *measure;
 } tx_measure_t;
 
-typedef struct global_addition {
-  PMEMobjpool *pool;
+typedef struct v_log {                  // kept by the thread across txs, v_logs[i] belongs to w_set entry i
+  uint64_t num;
+  uint64_t size;
+  struct v_log_entry *v_logs;
+} v_log_t;
+
+#ifdef NV_STATISTICS
+typedef struct nv_stat {                /* Persistence statistics of a thread */
+  uint64_t log_commits;                 /* Transactions written to the log */
+  uint64_t log_bytes;                   /* Bytes appended to the log */
+  uint64_t log_stalls;                  /* Commits waiting for the log to be reproduced */
+  uint64_t page_hits;                   /* Accesses to mapped v_pages */
+  uint64_t page_misses;                 /* Accesses mapping a v_page */
+  uint64_t page_evictions;              /* Mapped v_pages given to another nv_page */
+  uint64_t page_stalls;                 /* Mappings waiting for the log to be reproduced */
+} nv_stat_t;
+# define NV_STAT_ADD(stat, field, n)    ((stat)->field += (n))
+
+/*
+ * Add the statistics of a thread to a total (the thread may be running).
+ */
+static INLINE void
+nv_stat_add(nv_stat_t *total, nv_stat_t *stat)
+{
+  total->log_commits += ATOMIC_LOAD(&stat->log_commits);
+  total->log_bytes += ATOMIC_LOAD(&stat->log_bytes);
+  total->log_stalls += ATOMIC_LOAD(&stat->log_stalls);
+  total->page_hits += ATOMIC_LOAD(&stat->page_hits);
+  total->page_misses += ATOMIC_LOAD(&stat->page_misses);
+  total->page_evictions += ATOMIC_LOAD(&stat->page_evictions);
+  total->page_stalls += ATOMIC_LOAD(&stat->page_stalls);
+}
+#else /* ! NV_STATISTICS */
+# define NV_STAT_ADD(stat, field, n)
+#endif /* ! NV_STATISTICS */
+
+struct stm_pool {                       /* Pool opened by stm_pool_open(), see log.h */
+  PMEMobjpool *pop;
   struct root *root;
-  uint64_t base;
+  uint64_t base;                        // address of offset 0 of the pool
+  uint64_t id;                          // id of the pool in its nv_ptrs
   nv_log_t *nv_log;
+  struct page_pool *page;               // page table and v_pages, NULL until the pool is mapped
+  struct slab_pool *slab;               // size classes of the slabs
+  int pending;                          // id of the pool deciding the last record of the log, -1 if none
+  volatile stm_word_t emulate_next;     // tick at which the device of the pool is done with the flushes
+};
+
+typedef struct global_addition {
+  stm_pool_t *pools[NV_POOL_MAX];       // open pools by id, NULL for a free id
+  unsigned int pool_nb;                 // highest id open + 1
+  pthread_mutex_t pool_lock;            // serialize the opening, closing and mapping of pools
+  int opened;                           // emulation, measures and trace are set up by the first open
+  int mapped;                           // page_map_init() was called: pools opened later are mapped at once
   // v_log_pool_t *v_log_pool;
   global_measure_t global_measure;
+  global_emulate_t global_emulate;
+  global_trace_t global_trace;
+  volatile int reclaim;                 // reconciler running: allocations and frees are noted
+  volatile int checkpoint;              // checkpoint running: pages are copied before their home is written
+#ifdef NV_STATISTICS
+  nv_stat_t stat_exited;                // statistics of the threads that exited, quiesce_mutex held
+#endif /* NV_STATISTICS */
 } global_addition_t;
 
 typedef struct tx_addition {
   uint64_t thread_nb;                   // thread number of all
-  v_log_block_t *v_log_block;
+  v_log_t v_log;
+  uint64_t log_timestamp;               // time_commit of the last logged tx
+  uint64_t log_pools;                   // ids of the pools written by the tx, one bit each
+  stm_pool_t *log_full;                 // pool whose log ring was full at commit
+  uint64_t snapshot_timestamp[NV_POOL_MAX]; // reproduce_timestamp of each pool read by a snapshot tx
+  unsigned int snapshot_retries;        // restarts of the snapshot tx
+  alloc_range_t *alloc_range;           // blocks allocated by the tx, written without v_log
+  unsigned int alloc_nb;
+  unsigned int alloc_size;
+  uint64_t *pin;                        // VPNs pinned by the tx with the id of their pool, released at commit or abort
+  unsigned int pin_nb;
+  unsigned int pin_size;
+  slab_desc_t **slab;                   // slab owned by the thread in each size class of each pool
   tx_measure_t tx_measure;
+  trace_thread_t *trace;
+#ifdef NV_STATISTICS
+  nv_stat_t stat;
+#endif /* NV_STATISTICS */
 } tx_addition_t;
 
+#ifdef RW_SET_ARENA
+typedef struct rw_arena {               /* Memory of a thread: header, descriptor, read set, write set */
+  struct rw_arena *next;                /* Next arena released by an exited thread */
+} rw_arena_t;
+#endif /* RW_SET_ARENA */
+
 typedef struct stm_tx {                 /* Transaction descriptor */
   JMP_BUF env;                          /* Environment for setjmp/longjmp */
   stm_tx_attr_t attr;                   /* Transaction attributes (user-specified) */
@@ -381,6 +603,9 @@ typedef struct stm_tx {                 /* Transaction descriptor */
 #if CM == CM_MODULAR
   stm_word_t timestamp;                 /* Timestamp (not changed upon restart) */
 #endif /* CM == CM_MODULAR */
+#if CLOCK_SCHEME == CLOCK_GV6
+  unsigned int clock_commits;           /* Commits since last clock increment */
+#endif /* CLOCK_SCHEME == CLOCK_GV6 */
   void *data[MAX_SPECIFIC];             /* Transaction-specific data (fixed-size array for better speed) */
   struct stm_tx *next;                  /* For keeping track of all transactional threads */
 #ifdef CONFLICT_TRACKING
@@ -419,6 +644,10 @@ typedef struct stm_tx {                 /* Transaction descriptor */
 typedef struct global_ {
   volatile stm_word_t locks[LOCK_ARRAY_SIZE] ALIGNED;
   volatile stm_word_t gclock[512 / sizeof(stm_word_t)] ALIGNED;
+#ifdef LOCK_TUNING
+  unsigned int lock_shift;              /* Shift applied to addresses to get lock index */
+  stm_word_t lock_mask;                 /* Mask applied to lock index (number of locks used - 1) */
+#endif /* LOCK_TUNING */
   unsigned int nb_specific;             /* Number of specific slots used (<= MAX_SPECIFIC) */
   unsigned int nb_init_cb;
   cb_entry_t init_cb[MAX_CB];           /* Init thread callbacks */
@@ -442,6 +671,10 @@ typedef struct global_ {
   stm_tx_t *threads;                    /* Head of linked list of threads */
   pthread_mutex_t quiesce_mutex;        /* Mutex to support quiescence */
   pthread_cond_t quiesce_cond;          /* Condition variable to support quiescence */
+#ifdef RW_SET_ARENA
+  rw_arena_t *arenas;                   /* Arenas released by exited threads */
+  pthread_mutex_t arena_mutex;          /* Mutex to protect the list of arenas */
+#endif /* RW_SET_ARENA */
 #if CM == CM_MODULAR
   int vr_threshold;                     /* Number of retries before to switch to visible reads. */
 #endif /* CM == CM_MODULAR */
@@ -473,7 +706,37 @@ void collect_before_commit(stm_tx_t *tx, int if_flush, uint64_t commit_size); //
 
 void result_output(); //write result to file
 
+void init_trace();
+
+void tx_init_trace(stm_tx_t *tx);
+
+void trace_record(stm_tx_t *tx, unsigned int point, uint64_t arg); // use through NV_TRACE_POINT()
+
+void trace_output(); // write the rings of all threads
+
+void page_touch(uint64_t nv_addr, uint64_t commit_timestamp); // raise touch id of the nv_page
+
+void page_touch_range(uint64_t nv_addr, uint64_t size, uint64_t commit_timestamp); // raise touch id of the nv_pages of a block
+
+void nv_slab_init(stm_pool_t *pool); // rebuild slab state of the pool after recovery
+
+void nv_slab_exit(stm_pool_t *pool); // drop slab state of the pool when it is closed
+
+void slab_init_thread(stm_tx_t *tx); // use when init tx thread
+
+void slab_exit_thread(stm_tx_t *tx); // give back the slabs owned by the thread
+
+void reclaim_note(nv_ptr nv_addr, uint64_t size, int freed); // use when tx allocates or frees a block while the reconciler runs
+
+void checkpoint_save(nv_ptr nv_addr, uint64_t size); // use before writing home while a checkpoint runs
+
+void checkpoint_heap(uint64_t id); // use when libpmemobj allocates or frees a block in the pool
+
+void checkpoint_publish(PMEMobjpool *pool, struct pobj_action *acts, uint64_t nb, uint64_t nb_free); // use to publish deferred frees of libpmemobj
+
 // #include "measure.h"
+#include "emulate.h"
+#include "trace.h"
 #include "log.h"
 #include "measure.h"
 #include "page.h"
@@ -588,6 +851,10 @@ stm_quiesce_exit_thread(stm_tx_t *tx)
   else
     p->next = t->next;
   _tinystm.threads_nb--;
+#ifdef NV_STATISTICS
+  /* Keep the statistics of the thread in the totals */
+  nv_stat_add(&_tinystm.addition.stat_exited, &tx->addition.stat);
+#endif /* NV_STATISTICS */
   if (_tinystm.quiesce) {
     /* Wake up someone in case other threads are waiting for us */
     pthread_cond_signal(&_tinystm.quiesce_cond);
@@ -745,6 +1012,63 @@ rollover_clock(void *arg)
 # endif /* EPOCH_GC */
 }
 
+/*
+ * Get a commit timestamp according to the clock scheme (may exceed
+ * VERSION_MAX by up to MAX_THREADS).  Set *exclusive if no other
+ * transaction can commit with the same timestamp, i.e., if validation
+ * can be skipped when no transaction has committed since tx->start.
+ */
+static INLINE stm_word_t
+stm_clock_commit(stm_tx_t *tx, int *exclusive)
+{
+#if CLOCK_SCHEME == CLOCK_GV4 || CLOCK_SCHEME == CLOCK_GV6
+  stm_word_t t;
+#endif /* CLOCK_SCHEME == CLOCK_GV4 || CLOCK_SCHEME == CLOCK_GV6 */
+
+#if CLOCK_SCHEME == CLOCK_GV1
+  *exclusive = 1;
+  return FETCH_INC_CLOCK + 1;
+#else /* CLOCK_SCHEME != CLOCK_GV1 */
+  *exclusive = 0;
+# if CLOCK_SCHEME == CLOCK_GV5
+  return GET_CLOCK + 1;
+# else /* CLOCK_SCHEME == CLOCK_GV4 || CLOCK_SCHEME == CLOCK_GV6 */
+#  if CLOCK_SCHEME == CLOCK_GV6
+  if (++tx->clock_commits < CLOCK_GV6_PERIOD)
+    return GET_CLOCK + 1;
+  tx->clock_commits = 0;
+#  endif /* CLOCK_SCHEME == CLOCK_GV6 */
+  t = GET_CLOCK;
+  if (ATOMIC_CAS_FULL(&CLOCK, t, t + 1)) {
+#  if CLOCK_SCHEME == CLOCK_GV4
+    /* (GV6 commits in-between may have used t + 1 without moving the clock) */
+    *exclusive = 1;
+#  endif /* CLOCK_SCHEME == CLOCK_GV4 */
+    return t + 1;
+  }
+  /* Pass on failure: another transaction moved the clock for us */
+  return GET_CLOCK;
+# endif /* CLOCK_SCHEME == CLOCK_GV4 || CLOCK_SCHEME == CLOCK_GV6 */
+#endif /* CLOCK_SCHEME != CLOCK_GV1 */
+}
+
+/*
+ * Make sure that the clock is not behind an observed version.  Only
+ * lazy schemes (GV5/GV6) can publish versions ahead of the clock.
+ */
+static INLINE void
+stm_clock_sync(stm_word_t version)
+{
+#if CLOCK_SCHEME == CLOCK_GV5 || CLOCK_SCHEME == CLOCK_GV6
+  stm_word_t now;
+
+  while ((now = GET_CLOCK) < version) {
+    if (ATOMIC_CAS_FULL(&CLOCK, now, version))
+      break;
+  }
+#endif /* CLOCK_SCHEME == CLOCK_GV5 || CLOCK_SCHEME == CLOCK_GV6 */
+}
+
 /*
  * Check if stripe has been read previously.
  */
@@ -809,6 +1133,16 @@ stm_allocate_rs_entries(stm_tx_t *tx, int extend)
 {
   PRINT_DEBUG("==> stm_allocate_rs_entries(%p[%lu-%lu],%d)\n", tx, (unsigned long)tx->start, (unsigned long)tx->end, extend);
 
+#ifdef RW_SET_ARENA
+  /* Entries are reserved in the arena of the thread: pages are committed on first use */
+  if (extend) {
+    if (tx->r_set.size >= RW_SET_ARENA_MAX) {
+      fprintf(stderr, "Read set exceeds RW_SET_ARENA_MAX entries\n");
+      exit(1);
+    }
+    tx->r_set.size *= 2;
+  }
+#else /* ! RW_SET_ARENA */
   if (extend) {
     /* Extend read set */
     tx->r_set.size *= 2;
@@ -817,6 +1151,7 @@ stm_allocate_rs_entries(stm_tx_t *tx, int extend)
     /* Allocate read set */
     tx->r_set.entries = (r_entry_t *)xmalloc_aligned(tx->r_set.size * sizeof(r_entry_t));
   }
+#endif /* ! RW_SET_ARENA */
 }
 
 /*
@@ -828,12 +1163,22 @@ stm_allocate_ws_entries(stm_tx_t *tx, int extend)
 #if CM == CM_MODULAR || defined(CONFLICT_TRACKING)
   int i, first = (extend ? tx->w_set.size : 0);
 #endif /* CM == CM_MODULAR || defined(CONFLICT_TRACKING) */
-#ifdef EPOCH_GC
+#if defined(EPOCH_GC) && ! defined(RW_SET_ARENA)
   void *a;
-#endif /* ! EPOCH_GC */
+#endif /* EPOCH_GC && ! RW_SET_ARENA */
 
   PRINT_DEBUG("==> stm_allocate_ws_entries(%p[%lu-%lu],%d)\n", tx, (unsigned long)tx->start, (unsigned long)tx->end, extend);
 
+#ifdef RW_SET_ARENA
+  /* Entries do not move: the write set can also grow in an active transaction */
+  if (extend) {
+    if (tx->w_set.size >= RW_SET_ARENA_MAX) {
+      fprintf(stderr, "Write set exceeds RW_SET_ARENA_MAX entries\n");
+      exit(1);
+    }
+    tx->w_set.size *= 2;
+  }
+#else /* ! RW_SET_ARENA */
   if (extend) {
     /* Extend write set */
     /* Transaction must be inactive for WRITE_THROUGH or WRITE_BACK_ETL */
@@ -850,6 +1195,7 @@ stm_allocate_ws_entries(stm_tx_t *tx, int extend)
     /* Allocate write set */
     tx->w_set.entries = (w_entry_t *)xmalloc_aligned(tx->w_set.size * sizeof(w_entry_t));
   }
+#endif /* ! RW_SET_ARENA */
   /* Ensure that memory is aligned. */
   assert((((stm_word_t)tx->w_set.entries) & OWNED_MASK) == 0);
 
@@ -860,6 +1206,90 @@ stm_allocate_ws_entries(stm_tx_t *tx, int extend)
 #endif /* CM == CM_MODULAR || defined(CONFLICT_TRACKING) */
 }
 
+/*
+ * Make room for a new entry in the write set of an active transaction.
+ */
+static INLINE void
+stm_reserve_ws_entry(stm_tx_t *tx)
+{
+  if (unlikely(tx->w_set.nb_entries == tx->w_set.size)) {
+#ifdef RW_SET_ARENA
+    stm_allocate_ws_entries(tx, 1);
+#else /* ! RW_SET_ARENA */
+    /* Entries move: transaction must be inactive for WRITE_THROUGH or WRITE_BACK_ETL */
+    stm_rollback(tx, STM_ABORT_EXTEND_WS);
+#endif /* ! RW_SET_ARENA */
+  }
+}
+
+#ifdef RW_SET_ARENA
+/*
+ * Offsets of the read and write sets in an arena, and size of an arena.
+ */
+# define RW_ARENA_OFF_R                 RW_ARENA_ROUND(CACHELINE_SIZE + sizeof(stm_tx_t))
+# define RW_ARENA_OFF_W                 (RW_ARENA_OFF_R + RW_ARENA_ROUND(RW_SET_ARENA_MAX * sizeof(r_entry_t)))
+# define RW_ARENA_SIZE                  (RW_ARENA_OFF_W + RW_ARENA_ROUND(RW_SET_ARENA_MAX * sizeof(w_entry_t)))
+
+/*
+ * Get the memory of a new thread.  An arena reserves virtual memory for
+ * the largest read and write sets; pages are only committed when first
+ * touched, by the thread itself, hence on its NUMA node.
+ */
+static stm_tx_t *
+rw_arena_get(void)
+{
+  rw_arena_t *arena;
+  stm_tx_t *tx;
+
+  pthread_mutex_lock(&_tinystm.arena_mutex);
+  arena = _tinystm.arenas;
+  if (arena != NULL)
+    _tinystm.arenas = arena->next;
+  pthread_mutex_unlock(&_tinystm.arena_mutex);
+
+  if (arena == NULL) {
+    arena = (rw_arena_t *)mmap(NULL, RW_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+      fprintf(stderr, "Error reserving read/write set arena\n");
+      exit(1);
+    }
+  }
+
+  tx = (stm_tx_t *)((char *)arena + CACHELINE_SIZE);
+  tx->r_set.entries = (r_entry_t *)((char *)arena + RW_ARENA_OFF_R);
+  tx->w_set.entries = (w_entry_t *)((char *)arena + RW_ARENA_OFF_W);
+  return tx;
+}
+
+/*
+ * Release the memory of an exiting thread.  Pages beyond the initial
+ * sizes of the sets are given back to the system, the arena is kept
+ * for the next thread (with EPOCH_GC, other threads may still read the
+ * descriptor: the arena is never reused nor unmapped).
+ */
+static void
+rw_arena_put(stm_tx_t *tx)
+{
+  size_t r = RW_ARENA_ROUND(RW_SET_SIZE * sizeof(r_entry_t));
+  size_t w = RW_ARENA_ROUND(RW_SET_SIZE * sizeof(w_entry_t));
+#ifndef EPOCH_GC
+  rw_arena_t *arena = (rw_arena_t *)((char *)tx - CACHELINE_SIZE);
+#endif /* ! EPOCH_GC */
+
+  if (tx->r_set.size > RW_SET_SIZE)
+    madvise((char *)tx->r_set.entries + r, RW_ARENA_ROUND(tx->r_set.size * sizeof(r_entry_t)) - r, MADV_DONTNEED);
+  if (tx->w_set.size > RW_SET_SIZE)
+    madvise((char *)tx->w_set.entries + w, RW_ARENA_ROUND(tx->w_set.size * sizeof(w_entry_t)) - w, MADV_DONTNEED);
+
+#ifndef EPOCH_GC
+  pthread_mutex_lock(&_tinystm.arena_mutex);
+  arena->next = _tinystm.arenas;
+  _tinystm.arenas = arena;
+  pthread_mutex_unlock(&_tinystm.arena_mutex);
+#endif /* ! EPOCH_GC */
+}
+#endif /* RW_SET_ARENA */
+
 
 #if DESIGN == WRITE_BACK_ETL
 # include "stm_wbetl.h"
@@ -959,6 +1389,8 @@ stm_drop(stm_tx_t *tx)
 static INLINE void
 int_stm_prepare(stm_tx_t *tx)
 {
+  unsigned int i;
+
 #if CM == CM_MODULAR
   if (tx->attr.visible_reads || (tx->visible_reads >= _tinystm.vr_threshold && _tinystm.vr_threshold >= 0)) {
     /* Use visible read */
@@ -990,6 +1422,14 @@ int_stm_prepare(stm_tx_t *tx)
     tx->timestamp = tx->start;
 #endif /* CM == CM_MODULAR */
 
+  /* Snapshot of the durable image: everything reproduced so far, in each pool */
+  if (tx->attr.snapshot) {
+    for (i = 0; i < _tinystm.addition.pool_nb; i++) {
+      if (_tinystm.addition.pools[i] != NULL)
+        tx->addition.snapshot_timestamp[i] = ATOMIC_LOAD_ACQ(&_tinystm.addition.pools[i]->root->reproduce_timestamp);
+    }
+  }
+
 #ifdef EPOCH_GC
   gc_set_epoch(tx->start);
 #endif /* EPOCH_GC */
@@ -1171,6 +1611,24 @@ stm_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word_t
   assert(!tx->attr.read_only);
 #endif /* DEBUG */
 
+#if DESIGN == WRITE_THROUGH
+  if (unlikely(tx->attr.snapshot)) {
+    /* Restart in read-write mode */
+    tx->attr.snapshot = 0;
+    tx->attr.read_only = 0;
+    stm_rollback(tx, STM_ABORT_RO_WRITE);
+    return NULL;
+  }
+  if (tx->addition.alloc_nb != 0) {
+    alloc_range_t *range = alloc_range_find(tx, (uint64_t)addr);
+    if (range != NULL) {
+      /* Block allocated by this transaction: no other transaction can see it */
+      page_write_alloc(tx, range, (uint64_t)addr, value, mask);
+      return NULL;
+    }
+  }
+#endif /* DESIGN == WRITE_THROUGH */
+
 #if DESIGN == WRITE_BACK_ETL
   w = stm_wbetl_write(tx, addr, value, mask);
 #elif DESIGN == WRITE_BACK_CTL
@@ -1271,7 +1729,11 @@ int_stm_init_thread(void)
 #endif /* EPOCH_GC */
 
   /* Allocate descriptor */
+#ifdef RW_SET_ARENA
+  tx = rw_arena_get();
+#else /* ! RW_SET_ARENA */
   tx = (stm_tx_t *)xmalloc_aligned(sizeof(stm_tx_t));
+#endif /* ! RW_SET_ARENA */
   /* Set attribute */
   tx->attr = (stm_tx_attr_t)0;
   /* Set status (no need for CAS or atomic op) */
@@ -1290,8 +1752,12 @@ int_stm_init_thread(void)
   tx->w_set.bloom = 0;
 #endif /* USE_BLOOM_FILTER */
   stm_allocate_ws_entries(tx, 0);
+  tx->addition.log_timestamp = 0; // descriptor is not zeroed
   v_log_init(tx); // init v_log
-  tx_init_measure(tx);
+  tx_init_page(tx);
+#ifdef NV_SLAB
+  slab_init_thread(tx);
+#endif /* NV_SLAB */
   /* Nesting level */
   tx->nesting = 0;
   /* Transaction-specific data */
@@ -1304,6 +1770,9 @@ int_stm_init_thread(void)
   /* Contented lock */
   tx->c_lock = NULL;
 #endif /* CM == CM_DELAY || CM == CM_MODULAR */
+#if CLOCK_SCHEME == CLOCK_GV6
+  tx->clock_commits = 0;
+#endif /* CLOCK_SCHEME == CLOCK_GV6 */
 #if CM == CM_BACKOFF
   /* Backoff */
   tx->backoff = MIN_BACKOFF;
@@ -1331,6 +1800,9 @@ int_stm_init_thread(void)
   tx->stat_locked_reads_failed = 0;
 # endif /* READ_LOCKED_DATA */
 #endif /* TM_STATISTICS2 */
+#ifdef NV_STATISTICS
+  memset(&tx->addition.stat, 0, sizeof(nv_stat_t));
+#endif /* NV_STATISTICS */
 #ifdef HYBRID_ASF
   tx->software = 0;
 #endif /* HYBRID_ASF */
@@ -1340,6 +1812,9 @@ int_stm_init_thread(void)
   /* Store as thread-local data */
   tls_set_tx(tx);
   stm_quiesce_enter_thread(tx);
+  /* Histograms are labelled with the thread number */
+  tx_init_measure(tx);
+  tx_init_trace(tx);
 
   /* Callbacks */
   if (likely(_tinystm.nb_init_cb != 0)) {
@@ -1354,9 +1829,9 @@ int_stm_init_thread(void)
 static INLINE void
 int_stm_exit_thread(stm_tx_t *tx)
 {
-#ifdef EPOCH_GC
+#if defined(EPOCH_GC) && ! defined(RW_SET_ARENA)
   stm_word_t t;
-#endif /* EPOCH_GC */
+#endif /* EPOCH_GC && ! RW_SET_ARENA */
 
   PRINT_DEBUG("==> stm_exit_thread(%p[%lu-%lu])\n", tx, (unsigned long)tx->start, (unsigned long)tx->end);
 
@@ -1381,19 +1856,29 @@ int_stm_exit_thread(stm_tx_t *tx)
   }
 #endif /* TM_STATISTICS */
 
+#ifdef NV_SLAB
+  slab_exit_thread(tx);
+#endif /* NV_SLAB */
+  v_log_exit(tx); // free v_log
+  tx_exit_page(tx);
   stm_quiesce_exit_thread(tx);
 
-#ifdef EPOCH_GC
+#if defined(RW_SET_ARENA)
+  rw_arena_put(tx);
+# ifdef EPOCH_GC
+  gc_exit_thread();
+# endif /* EPOCH_GC */
+#elif defined(EPOCH_GC)
   t = GET_CLOCK;
   gc_free(tx->r_set.entries, t);
   gc_free(tx->w_set.entries, t);
   gc_free(tx, t);
   gc_exit_thread();
-#else /* ! EPOCH_GC */
+#else /* ! RW_SET_ARENA && ! EPOCH_GC */
   xfree(tx->r_set.entries);
   xfree(tx->w_set.entries);
   xfree(tx);
-#endif /* ! EPOCH_GC */
+#endif /* ! RW_SET_ARENA && ! EPOCH_GC */
 
   tls_set_tx(NULL);
 }
@@ -1412,6 +1897,7 @@ int_stm_start(stm_tx_t *tx, stm_tx_attr_t attr)
 
   /* Attributes */
   tx->attr = attr;
+  tx->addition.snapshot_retries = 0;
 
   /* Initialize transaction descriptor */
   int_stm_prepare(tx);
@@ -1460,6 +1946,12 @@ int_stm_commit(stm_tx_t *tx)
   }
 #endif /* CM == CM_MODULAR */
 
+#if DESIGN == WRITE_THROUGH
+  /* Blocks initialized without log must be durable before the commit record */
+  if (tx->addition.alloc_nb != 0)
+    page_persist_alloc(tx);
+#endif /* DESIGN == WRITE_THROUGH */
+
   /* A read-only transaction can commit immediately */
   if (unlikely(tx->w_set.nb_entries == 0))
     goto end;
@@ -1481,6 +1973,10 @@ int_stm_commit(stm_tx_t *tx)
 #endif /* DESIGN == MODULAR */
 
  end:
+#if DESIGN == WRITE_THROUGH
+  /* Pages only read are released once the writes are */
+  page_unpin(tx);
+#endif /* DESIGN == WRITE_THROUGH */
 #ifdef TM_STATISTICS
   tx->stat_commits++;
 #endif /* TM_STATISTICS */
@@ -1532,6 +2028,8 @@ int_stm_load(stm_tx_t *tx, volatile stm_word_t *addr)
 #elif DESIGN == WRITE_BACK_CTL
   return stm_wbctl_read(tx, addr);
 #elif DESIGN == WRITE_THROUGH
+  if (unlikely(tx->attr.snapshot))
+    return stm_wt_snapshot_read(tx, addr);
   return stm_wt_read(tx, addr);
 #elif DESIGN == MODULAR
   if (tx->attr.id == WRITE_BACK_CTL)
@@ -1555,6 +2053,47 @@ int_stm_store2(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_wo
   stm_write(tx, addr, value, mask);
 }
 
+static INLINE void
+int_stm_load_range(stm_tx_t *tx, volatile stm_word_t *addr, void *buf, size_t size)
+{
+  stm_word_t value;
+  size_t i;
+
+  assert(((uintptr_t)addr & (sizeof(stm_word_t) - 1)) == 0 && (size & (sizeof(stm_word_t) - 1)) == 0);
+
+#if DESIGN == WRITE_THROUGH
+  if (likely(!tx->attr.snapshot)) {
+    stm_wt_read_range(tx, addr, (uint8_t *)buf, size / sizeof(stm_word_t));
+    return;
+  }
+#endif /* DESIGN == WRITE_THROUGH */
+  for (i = 0; i < size / sizeof(stm_word_t); i++) {
+    value = int_stm_load(tx, addr + i);
+    memcpy((uint8_t *)buf + i * sizeof(stm_word_t), &value, sizeof(stm_word_t));
+  }
+}
+
+static INLINE void
+int_stm_store_range(stm_tx_t *tx, volatile stm_word_t *addr, const void *buf, size_t size)
+{
+  stm_word_t value;
+  size_t i;
+
+  assert(((uintptr_t)addr & (sizeof(stm_word_t) - 1)) == 0 && (size & (sizeof(stm_word_t) - 1)) == 0);
+
+  /* Consecutive words end up in a single range record of the persistent log */
+#if DESIGN == WRITE_THROUGH
+  if (likely(!tx->attr.snapshot)) {
+    stm_wt_write_range(tx, addr, (const uint8_t *)buf, size / sizeof(stm_word_t));
+    return;
+  }
+#endif /* DESIGN == WRITE_THROUGH */
+  for (i = 0; i < size / sizeof(stm_word_t); i++) {
+    memcpy(&value, (const uint8_t *)buf + i * sizeof(stm_word_t), sizeof(stm_word_t));
+    stm_write(tx, addr + i, value, ~(stm_word_t)0);
+  }
+}
+
 static INLINE int
 int_stm_active(stm_tx_t *tx)
 {
@@ -1595,9 +2134,143 @@ int_stm_get_env(stm_tx_t *tx)
   return tx->nesting == 0 ? &tx->env : NULL;
 }
 
+/*
+ * Sum a counter of the logs of the open pools, given by its offset in
+ * nv_log_t.  Offset -1 counts the pools, -2 sums their lag.  The pools
+ * are not closed meanwhile.
+ */
+static INLINE uint64_t
+nv_stat_pools(long offset)
+{
+  stm_pool_t *pool;
+  uint64_t sum = 0;
+  unsigned int i;
+
+  pthread_mutex_lock(&_tinystm.addition.pool_lock);
+  for (i = 0; i < _tinystm.addition.pool_nb; i++) {
+    if ((pool = _tinystm.addition.pools[i]) == NULL)
+      continue;
+    if (offset == -1)
+      sum++;
+    else if (offset == -2)
+      sum += ATOMIC_LOAD(&pool->root->persist_timestamp) - ATOMIC_LOAD(&pool->root->reproduce_timestamp);
+    else
+      sum += ATOMIC_LOAD_ACQ((volatile uint64_t *)((char *)pool->nv_log + offset));
+  }
+  pthread_mutex_unlock(&_tinystm.addition.pool_lock);
+  return sum;
+}
+
+#ifdef NV_STATISTICS
+/*
+ * Persistence statistics of a thread, or their total.  They are 64-bit.
+ */
+static INLINE int
+nv_stat_get(nv_stat_t *stat, const char *name, void *val)
+{
+  if (strcmp("nv_log_commits", name) == 0) {
+    *(uint64_t *)val = stat->log_commits;
+    return 1;
+  }
+  if (strcmp("nv_log_bytes", name) == 0) {
+    *(uint64_t *)val = stat->log_bytes;
+    return 1;
+  }
+  if (strcmp("nv_log_stalls", name) == 0) {
+    *(uint64_t *)val = stat->log_stalls;
+    return 1;
+  }
+  if (strcmp("page_hits", name) == 0) {
+    *(uint64_t *)val = stat->page_hits;
+    return 1;
+  }
+  if (strcmp("page_misses", name) == 0) {
+    *(uint64_t *)val = stat->page_misses;
+    return 1;
+  }
+  if (strcmp("page_evictions", name) == 0) {
+    *(uint64_t *)val = stat->page_evictions;
+    return 1;
+  }
+  if (strcmp("page_stalls", name) == 0) {
+    *(uint64_t *)val = stat->page_stalls;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Sum the persistence statistics of all threads, running or exited.
+ */
+static INLINE void
+nv_stat_total(nv_stat_t *total)
+{
+  stm_tx_t *t;
+
+  pthread_mutex_lock(&_tinystm.quiesce_mutex);
+  *total = _tinystm.addition.stat_exited;
+  for (t = _tinystm.threads; t != NULL; t = t->next)
+    nv_stat_add(total, &t->addition.stat);
+  pthread_mutex_unlock(&_tinystm.quiesce_mutex);
+}
+
+/*
+ * Persistence statistics shared by all threads: they can be read by a
+ * thread without transaction descriptor (e.g., a monitoring thread).
+ */
+static INLINE int
+nv_stat_get_global(const char *name, void *val)
+{
+  nv_stat_t total;
+  uint64_t read;
+
+  /* Sum of the per-thread statistics, e.g. "total_nv_log_commits" */
+  if (strncmp("total_", name, 6) == 0) {
+    nv_stat_total(&total);
+    return nv_stat_get(&total, name + 6, val);
+  }
+  if (strcmp("nv_log_flushes", name) == 0) {
+    *(uint64_t *)val = nv_stat_pools(offsetof(nv_log_t, stat_flushes));
+    return 1;
+  }
+  if (strcmp("nv_log_drains", name) == 0) {
+    *(uint64_t *)val = nv_stat_pools(offsetof(nv_log_t, stat_drains));
+    return 1;
+  }
+  if (strcmp("nv_log_reproduced", name) == 0) {
+    *(uint64_t *)val = nv_stat_pools(offsetof(nv_log_t, stat_reproduced));
+    return 1;
+  }
+  if (strcmp("nv_log_entries", name) == 0) {
+    /* Entries are appended before they are read: load the read count first */
+    read = nv_stat_pools(offsetof(nv_log_t, stat_read));
+    *(uint64_t *)val = nv_stat_pools(offsetof(nv_log_t, stat_appended)) - read;
+    return 1;
+  }
+  if (strcmp("nv_log_capacity", name) == 0) {
+    *(uint64_t *)val = NV_LOG_BLOCK_NUM * NV_LOG_LENGTH * nv_stat_pools(-1);
+    return 1;
+  }
+  if (strcmp("nv_log_lag", name) == 0) {
+    *(uint64_t *)val = nv_stat_pools(-2);
+    return 1;
+  }
+  if (strcmp("page_capacity", name) == 0) {
+    *(uint64_t *)val = PPN_NUM * nv_stat_pools(-1);
+    return 1;
+  }
+  return 0;
+}
+#endif /* NV_STATISTICS */
+
 static INLINE int
 int_stm_get_stats(stm_tx_t *tx, const char *name, void *val)
 {
+#ifdef NV_STATISTICS
+  if (nv_stat_get_global(name, val))
+    return 1;
+#endif /* NV_STATISTICS */
+
   assert (tx != NULL);
 
   if (strcmp("read_set_size", name) == 0) {
@@ -1686,6 +2359,10 @@ int_stm_get_stats(stm_tx_t *tx, const char *name, void *val)
   }
 # endif /* READ_LOCKED_DATA */
 #endif /* TM_STATISTICS2 */
+#ifdef NV_STATISTICS
+  if (nv_stat_get(&tx->addition.stat, name, val))
+    return 1;
+#endif /* NV_STATISTICS */
   return 0;
 }
 
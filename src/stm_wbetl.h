@@ -525,8 +525,7 @@ stm_wbetl_read_visible(stm_tx_t *tx, volatile stm_word_t *addr)
   version = LOCK_GET_TIMESTAMP(l);
  acquire:
   /* Acquire lock (ETL) */
-  if (tx->w_set.nb_entries == tx->w_set.size)
-    stm_rollback(tx, STM_ABORT_EXTEND_WS);
+  stm_reserve_ws_entry(tx);
   w = &tx->w_set.entries[tx->w_set.nb_entries];
   w->version = version;
   value = ATOMIC_LOAD(addr);
@@ -630,8 +629,7 @@ stm_wbetl_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_w
       /* Get version from previous write set entry (all entries in linked list have same version) */
       version = prev->version;
       /* Must add to write set */
-      if (tx->w_set.nb_entries == tx->w_set.size)
-        stm_rollback(tx, STM_ABORT_EXTEND_WS);
+      stm_reserve_ws_entry(tx);
       w = &tx->w_set.entries[tx->w_set.nb_entries];
 #if CM == CM_MODULAR
       w->version = version;
@@ -739,8 +737,7 @@ stm_wbetl_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_w
 #ifdef IRREVOCABLE_ENABLED
  acquire_no_check:
 #endif /* IRREVOCABLE_ENABLED */
-  if (unlikely(tx->w_set.nb_entries == tx->w_set.size))
-    stm_rollback(tx, STM_ABORT_EXTEND_WS);
+  stm_reserve_ws_entry(tx);
   w = &tx->w_set.entries[tx->w_set.nb_entries];
 #if CM == CM_MODULAR
   w->version = version;
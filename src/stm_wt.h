@@ -109,7 +109,7 @@ stm_wt_extend(stm_tx_t *tx)
 static INLINE void
 stm_wt_rollback(stm_tx_t *tx)
 {
-  int i;
+  int i, exclusive;
   w_entry_t *w;
   stm_word_t t;
 
@@ -122,10 +122,10 @@ stm_wt_rollback(stm_tx_t *tx)
   w = tx->w_set.entries;
   for (i = tx->w_set.nb_entries; i > 0; i--, w++) {
     stm_word_t j;
-    page_free(tx, (uint64_t)w->addr, 0);
     /* Restore previous value */
     if (w->mask != 0)
-      ATOMIC_STORE(w->addr, w->value);
+      ATOMIC_STORE(page_use(tx, (uint64_t)w->addr), w->value); // page map
+    page_free(tx, (uint64_t)w->addr, 0);
     if (w->next != NULL)
       continue;
     /* Incarnation numbers allow readers to detect dirty reads */
@@ -134,7 +134,7 @@ stm_wt_rollback(stm_tx_t *tx)
       /* Simple approach: write new version (might trigger unnecessary aborts) */
       if (t == 0) {
         /* Get new version (may exceed VERSION_MAX by up to MAX_THREADS) */
-        t = FETCH_INC_CLOCK + 1;
+        t = stm_clock_commit(tx, &exclusive);
       }
       ATOMIC_STORE_REL(w->lock, LOCK_SET_TIMESTAMP(t));
     } else {
@@ -142,6 +142,7 @@ stm_wt_rollback(stm_tx_t *tx)
       ATOMIC_STORE_REL(w->lock, LOCK_UPD_INCARNATION(w->version, j));
     }
   }
+  page_unpin(tx);
   // add for persist
   v_log_reset(tx); // reset v_log
   /* Make sure that all lock releases become visible */
@@ -213,6 +214,7 @@ stm_wt_read(stm_tx_t *tx, volatile stm_word_t *addr)
 
     /* Valid version? */
     if (unlikely(version > tx->end)) {
+      stm_clock_sync(version);
       /* No: try to extend first (except for read-only transactions: no read set) */
       if (tx->attr.read_only || !stm_wt_extend(tx)) {
         /* Not much we can do: abort */
@@ -282,6 +284,101 @@ stm_wt_read(stm_tx_t *tx, volatile stm_word_t *addr)
   }
 }
 
+/*
+ * Read from the durable image as of the last reproduced commit.  No lock,
+ * no shadow page and no read set: the snapshot stays consistent as long
+ * as the page was not touched by a more recent commit.
+ */
+static INLINE stm_word_t
+stm_wt_snapshot_read(stm_tx_t *tx, volatile stm_word_t *addr)
+{
+  uint64_t value;
+
+  PRINT_DEBUG2("==> stm_wt_snapshot_read(t=%p[%lu],a=%p)\n", tx, (unsigned long)tx->addition.snapshot_timestamp[NV_POOL_ID(addr)], addr);
+
+  if (likely(page_read_home((uint64_t)addr, tx->addition.snapshot_timestamp[NV_POOL_ID(addr)], &value) == 0))
+    return (stm_word_t)value;
+
+  /* Page is more recent than the snapshot: restart on a fresher one */
+  nv_log_reproduce(NV_POOL(addr));
+  if (++tx->addition.snapshot_retries > SNAPSHOT_RETRIES) {
+    /* Hot page: read it from the shadow cache like other transactions */
+    tx->attr.snapshot = 0;
+  }
+  stm_rollback(tx, STM_ABORT_VAL_READ);
+  return 0;
+}
+
+/*
+ * Read a range of words.  The range is split at page boundaries and in
+ * chunks of READ_RANGE_CHUNK words; each chunk is translated once and
+ * copied at once between two passes over the locks.  Falls back to word
+ * reads when a word is locked by another transaction or too recent.
+ */
+static INLINE void
+stm_wt_read_range(stm_tx_t *tx, volatile stm_word_t *addr, uint8_t *buf, size_t nb)
+{
+  stm_word_t l[READ_RANGE_CHUNK];
+  volatile stm_word_t *lock, *prev;
+  stm_word_t value;
+  w_entry_t *w;
+  size_t i, n;
+
+  PRINT_DEBUG2("==> stm_wt_read_range(t=%p[%lu-%lu],a=%p,n=%lu)\n", tx, (unsigned long)tx->start, (unsigned long)tx->end, addr, (unsigned long)nb);
+
+  assert(IS_ACTIVE(tx->status));
+
+  while (nb > 0) {
+    /* Words left in the page */
+    n = (PAGE_SIZE - ((uintptr_t)addr & (PAGE_SIZE - 1))) / sizeof(stm_word_t);
+    if (n > nb)
+      n = nb;
+    if (n > READ_RANGE_CHUNK)
+      n = READ_RANGE_CHUNK;
+
+    /* Read locks, values, locks */
+    for (i = 0; i < n; i++) {
+      l[i] = ATOMIC_LOAD_ACQ(GET_LOCK(addr + i));
+      if (LOCK_GET_WRITE(l[i])) {
+        /* Only our own writes can be copied */
+        w = (w_entry_t *)LOCK_GET_ADDR(l[i]);
+        if (!(tx->w_set.entries <= w && w < tx->w_set.entries + tx->w_set.nb_entries))
+          goto read_words;
+      } else if (LOCK_GET_TIMESTAMP(l[i]) > tx->end) {
+        goto read_words;
+      }
+    }
+    memcpy(buf, page_use(tx, (uint64_t)addr), n * sizeof(stm_word_t)); // page map
+    ATOMIC_MB_READ;
+    for (i = 0; i < n; i++) {
+      if (ATOMIC_LOAD_ACQ(GET_LOCK(addr + i)) != l[i])
+        goto read_words;
+    }
+
+    /* Add to read set once per lock */
+    prev = NULL;
+    for (i = 0; i < n; i++) {
+      lock = GET_LOCK(addr + i);
+      if (!LOCK_GET_WRITE(l[i]) && lock != prev) {
+        stm_wt_add_to_rs(tx, LOCK_GET_TIMESTAMP(l[i]), lock);
+        prev = lock;
+      }
+    }
+    goto next_page;
+
+ read_words:
+    for (i = 0; i < n; i++) {
+      value = stm_wt_read(tx, addr + i);
+      memcpy(buf + i * sizeof(stm_word_t), &value, sizeof(stm_word_t));
+    }
+
+ next_page:
+    addr += n;
+    buf += n * sizeof(stm_word_t);
+    nb -= n;
+  }
+}
+
 static INLINE w_entry_t *
 stm_wt_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word_t mask)
 {
@@ -322,10 +419,10 @@ stm_wt_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word
       /* Did we previously write the same address? */
       while (1) {
         if (addr == prev->addr) {
-          if (w->mask == 0) {
+          if (prev->mask == 0) {
             /* Remember old value */
-            w->value = ATOMIC_LOAD(page_use(tx, (uint64_t)addr)); // page map
-            w->mask = mask;
+            prev->value = ATOMIC_LOAD(page_use(tx, (uint64_t)addr)); // page map
+            prev->mask = mask;
           }
           /* Yes: only write to memory */
           if (mask != ~(stm_word_t)0)
@@ -342,8 +439,7 @@ stm_wt_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word
         prev = prev->next;
       }
       /* Must add to write set */
-      if (tx->w_set.nb_entries == tx->w_set.size)
-        stm_rollback(tx, STM_ABORT_EXTEND_WS);
+      stm_reserve_ws_entry(tx);
       w = &tx->w_set.entries[tx->w_set.nb_entries];
       /* Get version from previous write set entry (all entries in linked list have same version) */
       w->version = prev->version;
@@ -392,6 +488,8 @@ stm_wt_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word
 #endif /* IRREVOCABLE_ENABLED */
  acquire:
   if (unlikely(version > tx->end)) {
+    /* Our commit timestamp must be newer than the version we overwrite */
+    stm_clock_sync(version);
     /* We might have read an older version previously */
 #ifdef UNIT_TX
     if (tx->attr.no_extend) {
@@ -410,8 +508,7 @@ stm_wt_write(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word
 #ifdef IRREVOCABLE_ENABLED
  acquire_no_check:
 #endif /* IRREVOCABLE_ENABLED */
-  if (tx->w_set.nb_entries == tx->w_set.size)
-    stm_rollback(tx, STM_ABORT_EXTEND_WS);
+  stm_reserve_ws_entry(tx);
   w = &tx->w_set.entries[tx->w_set.nb_entries];
   if (ATOMIC_CAS_FULL(lock, l, LOCK_SET_ADDR_WRITE((stm_word_t)w)) == 0)
     goto restart;
@@ -428,6 +525,7 @@ do_write:
 #ifndef NDEBUG
     w->value = 0;
 #endif /* ! NDEBUG */
+    v_log_insert(tx, V_LOG_HOLE, 0); // keep v_log in step with w_set, filled if the entry is written later
   } else {
     /* Remember old value */
     w->value = ATOMIC_LOAD(page_use(tx, (uint64_t)addr)); // page map
@@ -448,6 +546,127 @@ do_write:
   return w;
 }
 
+/*
+ * Write a range of words.  The range is split at page boundaries; each
+ * page is translated once, each lock is acquired once for the words it
+ * covers and the new values are copied at once.  Falls back to word
+ * writes for blocks allocated by the transaction, and to stm_wt_write()
+ * for a lock held by another transaction or too recent.
+ */
+static INLINE void
+stm_wt_write_range(stm_tx_t *tx, volatile stm_word_t *addr, const uint8_t *buf, size_t nb)
+{
+  volatile stm_word_t *lock;
+  stm_word_t l, value;
+  alloc_range_t *range;
+  w_entry_t *w, *prev;
+  stm_word_t *v;
+  size_t i, j, k, n;
+  unsigned int r;
+
+  PRINT_DEBUG2("==> stm_wt_write_range(t=%p[%lu-%lu],a=%p,n=%lu)\n", tx, (unsigned long)tx->start, (unsigned long)tx->end, addr, (unsigned long)nb);
+
+  assert(IS_ACTIVE(tx->status));
+
+  while (nb > 0) {
+    /* Words left in the page */
+    n = (PAGE_SIZE - ((uintptr_t)addr & (PAGE_SIZE - 1))) / sizeof(stm_word_t);
+    if (n > nb)
+      n = nb;
+
+    /* Blocks allocated by the transaction are written without locks */
+    for (r = 0; r < tx->addition.alloc_nb; r++) {
+      range = &tx->addition.alloc_range[r];
+      if (range->nv_addr < (uint64_t)(addr + n) && (uint64_t)addr < range->nv_addr + range->size)
+        goto write_words;
+    }
+
+    v = (stm_word_t *)page_use(tx, (uint64_t)addr); // page map
+    for (i = 0; i < n; i = j) {
+      /* Words covered by the same lock */
+      lock = GET_LOCK(addr + i);
+      for (j = i + 1; j < n && GET_LOCK(addr + j) == lock; j++)
+        ;
+      l = ATOMIC_LOAD_ACQ(lock);
+      if (!LOCK_GET_OWNED(l) && LOCK_GET_TIMESTAMP(l) <= tx->end) {
+        /* Not locked and valid: acquire once for all the words (ETL) */
+        stm_reserve_ws_entry(tx);
+        w = &tx->w_set.entries[tx->w_set.nb_entries];
+        if (ATOMIC_CAS_FULL(lock, l, LOCK_SET_ADDR_WRITE((stm_word_t)w)) == 0) {
+          j = i;
+          continue;
+        }
+        prev = NULL;
+      } else if (LOCK_GET_OWNED(l) && (w = (w_entry_t *)LOCK_GET_ADDR(l)) >= tx->w_set.entries
+                 && w < tx->w_set.entries + tx->w_set.nb_entries) {
+        /* Locked by us: update the entries of the words already written */
+        for (prev = w; prev->next != NULL; prev = prev->next)
+          ;
+        l = prev->version;
+      } else {
+        /* Conflict or too recent: let the word write decide */
+        memcpy(&value, buf + i * sizeof(stm_word_t), sizeof(stm_word_t));
+        if (stm_wt_write(tx, addr + i, value, ~(stm_word_t)0) == NULL)
+          return;
+        j = i + 1;
+        continue;
+      }
+      for (k = i; k < j; k++) {
+        memcpy(&value, buf + k * sizeof(stm_word_t), sizeof(stm_word_t));
+        if (prev != NULL) {
+          /* Did we previously write the same address? */
+          for (w = (w_entry_t *)LOCK_GET_ADDR(ATOMIC_LOAD(lock)); w != NULL && w->addr != addr + k; w = w->next)
+            ;
+          if (w != NULL) {
+            if (w->mask == 0) {
+              /* Remember old value */
+              w->value = v[k];
+              w->mask = ~(stm_word_t)0;
+            }
+            v_log_insert_exist(tx, (uint64_t)(addr + k), value, ((uint64_t)w - (uint64_t)tx->w_set.entries) / sizeof(w_entry_t)); // insert exist v_log
+            continue;
+          }
+          /* Must add to write set */
+          stm_reserve_ws_entry(tx);
+          w = &tx->w_set.entries[tx->w_set.nb_entries];
+        }
+        /* All entries in linked list have same version */
+        w->version = l;
+        w->addr = addr + k;
+        w->mask = ~(stm_word_t)0;
+        w->lock = lock;
+        /* Remember old value */
+        w->value = v[k];
+        v_log_insert(tx, (uint64_t)(addr + k), value); // insert v_log
+        w->next = NULL;
+        if (prev != NULL) {
+          /* Link new entry in list */
+          prev->next = w;
+        }
+        prev = w;
+        tx->w_set.nb_entries++;
+      }
+    }
+    memcpy(v, buf, n * sizeof(stm_word_t)); // page map
+    goto next_page;
+
+ write_words:
+    for (i = 0; i < n; i++) {
+      memcpy(&value, buf + i * sizeof(stm_word_t), sizeof(stm_word_t));
+      range = alloc_range_find(tx, (uint64_t)(addr + i));
+      if (range != NULL)
+        page_write_alloc(tx, range, (uint64_t)(addr + i), value, ~(stm_word_t)0);
+      else if (stm_wt_write(tx, addr + i, value, ~(stm_word_t)0) == NULL)
+        return;
+    }
+
+ next_page:
+    addr += n;
+    buf += n * sizeof(stm_word_t);
+    nb -= n;
+  }
+}
+
 static INLINE stm_word_t
 stm_wt_RaR(stm_tx_t *tx, volatile stm_word_t *addr)
 {
@@ -492,7 +711,6 @@ stm_wt_WaR(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word_t
 static INLINE void
 stm_wt_WaW(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word_t mask)
 {
-#ifndef NDEBUG
   stm_word_t l;
   w_entry_t *w;
   l = ATOMIC_LOAD_ACQ(GET_LOCK(addr));
@@ -503,14 +721,14 @@ stm_wt_WaW(stm_tx_t *tx, volatile stm_word_t *addr, stm_word_t value, stm_word_t
   assert(tx->w_set.entries <= w && w < tx->w_set.entries + tx->w_set.nb_entries);
   /* in WaW, mask can never be 0 */
   assert(mask != 0);
-#endif /* ! NDEBUG */
+  /* The lock may cover several addresses: find the entry of addr */
+  while (w->addr != addr)
+    w = w->next;
   if (mask != ~(stm_word_t)0) {
     value = (ATOMIC_LOAD(page_use(tx, (uint64_t)addr)) & ~mask) | (value & mask); // page map
   }
   ATOMIC_STORE(page_use(tx, (uint64_t)addr), value); // page map
-#ifndef NDEBUG
   v_log_insert_exist(tx, (uint64_t)addr, value, ((uint64_t)w - (uint64_t)tx->w_set.entries) / sizeof(w_entry_t)); // insert exist v_log
-#endif /* ! NDEBUG */
 }
 
 static INLINE int
@@ -518,9 +736,10 @@ stm_wt_commit(stm_tx_t *tx)
 {
   w_entry_t *w;
   stm_word_t t;
-  int i;
+  int i, exclusive;
 
   PRINT_DEBUG("==> stm_wt_commit(%p[%lu-%lu])\n", tx, (unsigned long)tx->start, (unsigned long)tx->end);
+  NV_TRACE_POINT(tx, commit_start, tx->w_set.nb_entries);
 
   /* Update transaction */
 #ifdef IRREVOCABLE_ENABLED
@@ -546,15 +765,15 @@ stm_wt_commit(stm_tx_t *tx)
 #endif /* IRREVOCABLE_ENABLED */
 
   /* Get commit timestamp (may exceed VERSION_MAX by up to MAX_THREADS) */
-  t = FETCH_INC_CLOCK + 1;
+  t = stm_clock_commit(tx, &exclusive);
 
 #ifdef IRREVOCABLE_ENABLED
   if (unlikely(tx->irrevocable))
     goto release_locks;
 #endif /* IRREVOCABLE_ENABLED */
 
-  /* Try to validate (only if a concurrent transaction has committed since tx->start) */
-  if (unlikely(tx->start != t - 1 && !stm_wt_validate(tx))) {
+  /* Try to validate (only if a concurrent transaction may have committed since tx->start) */
+  if (unlikely((!exclusive || tx->start != t - 1) && !stm_wt_validate(tx))) {
     /* Cannot commit */
     stm_rollback(tx, STM_ABORT_VALIDATE);
     return 0;
@@ -563,6 +782,19 @@ stm_wt_commit(stm_tx_t *tx)
 #ifdef IRREVOCABLE_ENABLED
   release_locks:
 #endif /* IRREVOCABLE_ENABLED */
+  NV_TRACE_POINT(tx, commit_validated, t);
+
+  tx->addition.log_timestamp = 0;
+  if(!tx->attr.read_only) {
+    collect_before_log_combine(tx);
+    collect_before_log_start(tx);
+    // add for persist (before dropping locks so that dependent txs are logged after us)
+    while (nv_log_record(tx, t) < 0) {
+      nv_log_reproduce(tx->addition.log_full);
+    }
+    collect_before_commit(tx, 1, tx->addition.v_log.num);
+    NV_TRACE_POINT(tx, commit_logged, tx->addition.log_timestamp);
+  }
 
   /* Make sure that the updates become visible before releasing locks */
   ATOMIC_MB_WRITE;
@@ -572,24 +804,18 @@ stm_wt_commit(stm_tx_t *tx)
     if (w->next == NULL) {
       /* No need for CAS (can only be modified by owner transaction) */
       ATOMIC_STORE(w->lock, LOCK_SET_TIMESTAMP(t));
-      page_free(tx, (uint64_t)w->addr, t); // free page lock and add touch id
-    }
-  }
-  if(!tx->attr.read_only) {
-    collect_before_log_combine(tx);
-    collect_before_log_start(tx);
-    // add for persist
-    while (nv_log_record(tx, t) < 0) {
-      nv_log_reproduce();
     }
-    collect_before_commit(tx, 1, tx->addition.v_log_block->num);
-    nv_log_reproduce();
+    page_free(tx, (uint64_t)w->addr, tx->addition.log_timestamp); // free page lock and add touch id
   }
+  NV_TRACE_POINT(tx, commit_unlocked, tx->w_set.nb_entries);
+  if(!tx->attr.read_only)
+    nv_log_reproduce_pools(tx->addition.log_pools);
   // v_log_reset(tx); // reset v_log
 
   /* Make sure that all lock releases become visible */
   /* TODO: is ATOMIC_MB_WRITE required? */
   ATOMIC_MB_WRITE;
+  NV_TRACE_POINT(tx, commit_end, t);
 end:
   return 1;
 }
@@ -0,0 +1,173 @@
+# ifndef _TRACE_H_
+# define _TRACE_H_
+
+# include "stm_internal.h"
+# include <fcntl.h>
+# include <signal.h>
+# include <unistd.h>
+
+// With NV_TRACE, the phase boundaries of a commit, of the log reproduction and of a page map are
+// recorded in a ring per thread, written to $NV_TRACE_FILE on TRACE_SIGNAL and at exit. Where
+// <sys/sdt.h> exists they are also USDT probes tinystm:<point> (thread number, argument) for
+// perf and bpftrace. Without NV_TRACE, NV_TRACE_POINT() is empty
+# define TRACE_FILE          "NV_TRACE_FILE"    // environment: path of the dump
+# define TRACE_FILE_DEFAULT  "./trace.txt"
+# define TRACE_SIGNAL        SIGUSR2            // dump the rings of all threads
+
+# ifdef NV_TRACE
+#  if defined(__has_include)
+#   if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define TRACE_SDT
+#   endif
+#  endif
+#  ifdef TRACE_SDT
+#   define NV_TRACE_POINT(tx, point, arg)  do { \
+        trace_record(tx, TRACE_##point, arg); \
+        DTRACE_PROBE2(tinystm, point, (tx) == NULL ? -1 : (long)(tx)->addition.thread_nb, (arg)); \
+    } while (0)
+#  else
+#   define NV_TRACE_POINT(tx, point, arg)  trace_record(tx, TRACE_##point, arg)
+#  endif
+# else
+#  define NV_TRACE_POINT(tx, point, arg)
+# endif
+
+
+
+void init_trace();
+
+void tx_init_trace(stm_tx_t *tx);
+
+void trace_record(stm_tx_t *tx, unsigned int point, uint64_t arg);
+
+void trace_output();
+
+# ifndef NV_DECLARE_ONLY
+# ifdef NV_TRACE
+static const char *trace_names[TRACE_NB] = {"commit_start", "commit_validated", "log_locked", "log_flushed", "log_drained",
+    "log_published", "commit_logged", "commit_unlocked", "commit_end", "reproduce_start", "reproduce_end",
+    "page_map_start", "page_map_copied", "page_map_end"};
+
+static inline uint64_t trace_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the dump runs in a signal handler: no stdio, no allocation
+static char *trace_put(char *p, const char *s) {
+    while (*s != '\0') *p++ = *s++;
+    return p;
+}
+
+static char *trace_put_u64(char *p, uint64_t value) {
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (n > 0) *p++ = digits[--n];
+    return p;
+}
+
+// "thread ns point arg" per event, oldest first in each thread
+static void trace_write(int fd) {
+    trace_thread_t *trace;
+    trace_event_t *e;
+    uint64_t nb, first;
+    char line[128], *p;
+
+    for (trace = _tinystm.addition.global_trace.threads; trace != NULL; trace = trace->next) {
+        nb = ATOMIC_LOAD_ACQ(&trace->nb);
+        first = nb > TRACE_SIZE ? nb - TRACE_SIZE : 0;
+        for (uint64_t i = first; i < nb; i++) {
+            e = &trace->events[i & (TRACE_SIZE - 1)];
+            p = trace_put_u64(line, trace->thread_nb);
+            *p++ = ' ';
+            p = trace_put_u64(p, e->ns);
+            *p++ = ' ';
+            p = trace_put(p, e->point < TRACE_NB ? trace_names[e->point] : "?");
+            *p++ = ' ';
+            p = trace_put_u64(p, e->arg);
+            *p++ = '\n';
+            if (write(fd, line, p - line) < 0) return;
+        }
+    }
+}
+
+static void trace_signal(int sig) {
+    int fd = open(_tinystm.addition.global_trace.file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) return;
+    trace_write(fd);
+    close(fd);
+}
+# endif /* NV_TRACE */
+
+void init_trace() {
+    #ifdef NV_TRACE
+    global_trace_t *global = &_tinystm.addition.global_trace;
+    struct sigaction act;
+    char *s = getenv(TRACE_FILE);
+
+    global->threads = NULL;
+    strncpy(global->file, s != NULL ? s : TRACE_FILE_DEFAULT, sizeof(global->file) - 1);
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = trace_signal;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    sigaction(TRACE_SIGNAL, &act, &global->old_act);
+    #endif
+}
+
+void tx_init_trace(stm_tx_t *tx) {
+    #ifdef NV_TRACE
+    global_trace_t *global = &_tinystm.addition.global_trace;
+    trace_thread_t *trace = (trace_thread_t *)calloc(1, sizeof(trace_thread_t));
+
+    trace->thread_nb = tx->addition.thread_nb;
+    tx->addition.trace = trace;
+    // kept after the thread exits, until the rings are written
+    do {
+        trace->next = global->threads;
+    } while (ATOMIC_CAS_FULL((volatile stm_word_t *)&global->threads, (stm_word_t)trace->next, (stm_word_t)trace) == 0);
+    #else
+    tx->addition.trace = NULL;
+    #endif
+}
+
+void trace_record(stm_tx_t *tx, unsigned int point, uint64_t arg) {
+    #ifdef NV_TRACE
+    trace_thread_t *trace;
+    trace_event_t *e;
+
+    if (tx == NULL || (trace = tx->addition.trace) == NULL) return;
+    e = &trace->events[trace->nb & (TRACE_SIZE - 1)];
+    e->ns = trace_ns();
+    e->arg = arg;
+    e->point = point;
+    ATOMIC_STORE_REL(&trace->nb, trace->nb + 1);
+    #endif
+}
+
+// last dump, then release the rings of all threads
+void trace_output() {
+    #ifdef NV_TRACE
+    global_trace_t *global = &_tinystm.addition.global_trace;
+    trace_thread_t *trace;
+
+    // the rings are freed below: give the signal back to the previous handler first
+    sigaction(TRACE_SIGNAL, &global->old_act, NULL);
+    trace_signal(TRACE_SIGNAL);
+    while ((trace = global->threads) != NULL) {
+        global->threads = trace->next;
+        free(trace);
+    }
+    #endif
+}
+# endif /* NV_DECLARE_ONLY */
+
+# endif /* _TRACE_H_ */
@@ -26,6 +26,8 @@
 #include <assert.h>
 
 #include "utils.h"
+/* The persistence layer is defined in stm.o, only declare it here */
+#define NV_DECLARE_ONLY
 #include "stm_internal.h"
 #include "wrappers.h"
 
@@ -269,6 +271,9 @@ _CALLCONV void stm_load_bytes(volatile uint8_t *addr, uint8_t *buf, size_t size)
   convert_t val;
   unsigned int i;
   stm_word_t *a;
+#ifndef HYBRID_ASF
+  size_t n;
+#endif /* ! HYBRID_ASF */
 
   if (size == 0)
     return;
@@ -282,6 +287,13 @@ _CALLCONV void stm_load_bytes(volatile uint8_t *addr, uint8_t *buf, size_t size)
   } else
     a = (stm_word_t *)addr;
   /* Full words */
+#ifndef HYBRID_ASF
+  n = size & ~(size_t)(sizeof(stm_word_t) - 1);
+  int_stm_load_range(tx, a, buf, n);
+  a += n / sizeof(stm_word_t);
+  buf += n;
+  size -= n;
+#endif /* ! HYBRID_ASF */
   while (size >= sizeof(stm_word_t)) {
 #ifdef ALLOW_MISALIGNED_ACCESSES
     *((stm_word_t *)buf) = TM_LOAD(a++);
@@ -489,6 +501,9 @@ _CALLCONV void stm_store_bytes(volatile uint8_t *addr, uint8_t *buf, size_t size
   convert_t val, mask;
   unsigned int i;
   stm_word_t *a;
+#ifndef HYBRID_ASF
+  size_t n;
+#endif /* ! HYBRID_ASF */
 
   if (size == 0)
     return;
@@ -505,6 +520,13 @@ _CALLCONV void stm_store_bytes(volatile uint8_t *addr, uint8_t *buf, size_t size
   } else
     a = (stm_word_t *)addr;
   /* Full words */
+#ifndef HYBRID_ASF
+  n = size & ~(size_t)(sizeof(stm_word_t) - 1);
+  int_stm_store_range(tx, a, buf, n);
+  a += n / sizeof(stm_word_t);
+  buf += n;
+  size -= n;
+#endif /* ! HYBRID_ASF */
   while (size >= sizeof(stm_word_t)) {
 #ifdef ALLOW_MISALIGNED_ACCESSES
     TM_STORE(a++, *((stm_word_t *)buf));
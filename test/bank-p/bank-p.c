@@ -24,6 +24,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
@@ -41,6 +42,7 @@
 
 #define RO                              1
 #define RW                              0
+#define SNAPSHOT                        2
 
 #if defined(TM_GCC) 
 # include "../../abi/gcc/tm_macros.h"
@@ -70,9 +72,9 @@ void perror(const char *s);
  * stm_get_env() and only call sigsetjmp() if it is not null.
  */
 
-#define TM_START(tid, ro)               { stm_tx_attr_t _a = {{.id = tid, .read_only = ro}}; sigjmp_buf *_e = stm_start(_a); if (_e != NULL) sigsetjmp(*_e, 0)
-#define TM_LOAD(addr)                   stm_load((stm_word_t *)addr)
-#define TM_STORE(addr, value)           stm_store((stm_word_t *)addr, (stm_word_t)value)
+#define TM_START(tid, ro)               { stm_tx_attr_t _a = {{.id = tid, .read_only = (ro) != RW, .snapshot = (ro) == SNAPSHOT}}; sigjmp_buf *_e = stm_start(_a); if (_e != NULL) sigsetjmp(*_e, 0)
+#define TM_LOAD(addr)                   stm_load((stm_word_t *)(addr))
+#define TM_STORE(addr, value)           stm_store((stm_word_t *)(addr), (stm_word_t)(value))
 #define TM_COMMIT                       stm_commit(); }
 
 #define TM_INIT                         stm_init("bank-p.pool", &obj_init); mod_ab_init(0, NULL)
@@ -91,6 +93,8 @@ void perror(const char *s);
 #define DEFAULT_READ_THREADS            0
 #define DEFAULT_WRITE_THREADS           0
 #define DEFAULT_DISJOINT                0
+#define DEFAULT_SNAPSHOT                0
+#define DEFAULT_NB_POOLS                1
 
 #define XSTR(s)                         STR(s)
 #define STR(s)                          #s
@@ -100,6 +104,7 @@ void perror(const char *s);
  * ################################################################### */
 
 static volatile int stop;
+static int snapshot = DEFAULT_SNAPSHOT;
 
 /* ################################################################### *
  * BANK ACCOUNTS
@@ -116,8 +121,8 @@ typedef struct account {
 } account_t;
 
 typedef struct bank {
-  nv_ptr accounts[2048];
   long size;
+  nv_ptr accounts[];
 } bank_t;
 
 struct root {
@@ -133,23 +138,45 @@ struct root {
 TOID_DECLARE(struct bank, TYPE_BANK);
 TOID_DECLARE(struct account, TYPE_ACCOUNT);
 
-bank_t *obj_init(long size) {
-  PMEMobjpool *pool = pool_init("bank.pool");
-  PMEMoid Root = pmemobj_root(pool, sizeof(struct root));
+/*
+ * The bank is in bank.pool, account i in pool i % nb_pools (bank.pool,
+ * bank-1.pool, ...): a transfer between accounts of two pools writes
+ * both.
+ */
+bank_t *obj_init(long size, int nb_pools) {
+  PMEMobjpool *pool[nb_pools];
+  char path[32];
+  for (int p = 0; p < nb_pools; p ++) {
+    if (p == 0) sprintf(path, "bank.pool");
+    else sprintf(path, "bank-%d.pool", p);
+    pool[p] = pool_init(path);
+    if (pool[p] == NULL) {
+      perror(path);
+      exit(1);
+    }
+  }
+  PMEMoid Root = pmemobj_root(pool[0], sizeof(struct root));
   struct root *root = pmemobj_direct(Root);
   bank_t *bank;
   if (root->obj_root[0] != 0) return (bank_t *)nv_to_ptr(root->obj_root[0]);
-  TX_BEGIN(pool) {
-    PMEMoid Bank = pmemobj_tx_alloc(sizeof(bank_t), TYPE_BANK);
+  TX_BEGIN(pool[0]) {
+    PMEMoid Bank = pmemobj_tx_alloc(sizeof(bank_t) + size * sizeof(nv_ptr), TYPE_BANK);
     pmemobj_tx_add_range_direct(&root->obj_root[0], sizeof(nv_ptr));
-    root->obj_root[0] = Bank.off;
+    root->obj_root[0] = ptr_to_nv(pmemobj_direct(Bank));
     bank = pmemobj_direct(Bank);
     for (long i = 0; i < size; i ++) {
-      PMEMoid Account = pmemobj_tx_alloc(sizeof(account_t), TYPE_ACCOUNT);
+      PMEMoid Account;
+      if (i % nb_pools == 0) {
+        Account = pmemobj_tx_alloc(sizeof(account_t), TYPE_ACCOUNT);
+      } else if (pmemobj_alloc(pool[i % nb_pools], &Account, sizeof(account_t), TYPE_ACCOUNT, NULL, NULL) != 0) {
+        /* Accounts of the other pools are not part of the transaction: a crash leaks them */
+        pmemobj_tx_abort(ENOMEM);
+      }
       account_t *account = pmemobj_direct(Account);
-      bank->accounts[i] = Account.off;
+      bank->accounts[i] = ptr_to_nv(account);
       account->balance = 0;
       account->number = i;
+      if (i % nb_pools != 0) pmemobj_persist(pool[i % nb_pools], account, sizeof(account_t));
     }
     bank->size = size;
   }TX_END
@@ -183,7 +210,7 @@ static int total(bank_t *bank, int transactional)
       total += ((account_t *)nv_to_ptr(bank->accounts[i]))->balance;
     }
   } else {
-    TM_START(1, RO);
+    TM_START(1, snapshot ? SNAPSHOT : RO);
     total = 0;
     for (i = 0; i < bank->size; i++) {
       total += TM_LOAD(bank->accounts[i] + sizeof(long));
@@ -264,6 +291,10 @@ typedef struct thread_data {
   unsigned long locked_reads_ok;
   unsigned long locked_reads_failed;
   unsigned long max_retries;
+  uint64_t nv_log_bytes;
+  uint64_t nv_log_stalls;
+  uint64_t page_misses;
+  uint64_t page_stalls;
 #endif /* ! TM_COMPILER */
   unsigned int seed;
   int id;
@@ -350,6 +381,11 @@ static void *test(void *data)
   stm_get_stats("locked_reads_ok", &d->locked_reads_ok);
   stm_get_stats("locked_reads_failed", &d->locked_reads_failed);
   stm_get_stats("max_retries", &d->max_retries);
+  /* Left to 0 without NV_STATISTICS */
+  stm_get_stats("nv_log_bytes", &d->nv_log_bytes);
+  stm_get_stats("nv_log_stalls", &d->nv_log_stalls);
+  stm_get_stats("page_misses", &d->page_misses);
+  stm_get_stats("page_stalls", &d->page_stalls);
 #endif /* ! TM_COMPILER */
   /* Free transaction */
   TM_EXIT_THREAD;
@@ -380,6 +416,8 @@ int main(int argc, char **argv)
     {"write-all-rate",            required_argument, NULL, 'w'},
     {"write-threads",             required_argument, NULL, 'W'},
     {"disjoint",                  no_argument,       NULL, 'j'},
+    {"snapshot",                  no_argument,       NULL, 'S'},
+    {"pools",                     required_argument, NULL, 'p'},
     {NULL, 0, NULL, 0}
   };
 
@@ -393,6 +431,8 @@ int main(int argc, char **argv)
     aborts_validate_read, aborts_validate_write, aborts_validate_commit,
     aborts_invalid_memory, aborts_killed,
     locked_reads_ok, locked_reads_failed, max_retries;
+  uint64_t log_bytes, log_stalls, page_misses, page_stalls;
+  unsigned long recovery_txs, recovery_entries, recovery_ns;
   stm_ab_stats_t ab_stats;
   char *cm = NULL;
 #endif /* ! TM_COMPILER */
@@ -411,11 +451,12 @@ int main(int argc, char **argv)
   int write_all = DEFAULT_WRITE_ALL;
   int write_threads = DEFAULT_WRITE_THREADS;
   int disjoint = DEFAULT_DISJOINT;
+  int nb_pools = DEFAULT_NB_POOLS;
   sigset_t block_set;
 
   while(1) {
     i = 0;
-    c = getopt_long(argc, argv, "ha:c:d:n:r:R:s:w:W:j", long_options, &i);
+    c = getopt_long(argc, argv, "ha:c:d:n:p:r:R:s:w:W:jS", long_options, &i);
 
     if(c == -1)
       break;
@@ -446,6 +487,8 @@ int main(int argc, char **argv)
               "        Test duration in milliseconds (0=infinite, default=" XSTR(DEFAULT_DURATION) ")\n"
               "  -n, --num-threads <int>\n"
               "        Number of threads (default=" XSTR(DEFAULT_NB_THREADS) ")\n"
+              "  -p, --pools <int>\n"
+              "        Number of pools the accounts are spread over (default=" XSTR(DEFAULT_NB_POOLS) ")\n"
               "  -r, --read-all-rate <int>\n"
               "        Percentage of read-all transactions (default=" XSTR(DEFAULT_READ_ALL) ")\n"
               "  -R, --read-threads <int>\n"
@@ -456,6 +499,8 @@ int main(int argc, char **argv)
               "        Percentage of write-all transactions (default=" XSTR(DEFAULT_WRITE_ALL) ")\n"
               "  -W, --write-threads <int>\n"
               "        Number of threads issuing only write-all transactions (default=" XSTR(DEFAULT_WRITE_THREADS) ")\n"
+              "  -S, --snapshot\n"
+              "        Read-all transactions read a snapshot of the durable image\n"
          );
        exit(0);
      case 'a':
@@ -472,6 +517,9 @@ int main(int argc, char **argv)
      case 'n':
        nb_threads = atoi(optarg);
        break;
+     case 'p':
+       nb_pools = atoi(optarg);
+       break;
      case 'r':
        read_all = atoi(optarg);
        break;
@@ -490,6 +538,9 @@ int main(int argc, char **argv)
      case 'j':
        disjoint = 1;
        break;
+     case 'S':
+       snapshot = 1;
+       break;
      case '?':
        printf("Use -h or --help for help\n");
        exit(0);
@@ -501,6 +552,7 @@ int main(int argc, char **argv)
   assert(duration >= 0);
   assert(nb_accounts >= 2);
   assert(nb_threads > 0);
+  assert(nb_pools > 0);
   assert(read_all >= 0 && write_all >= 0 && read_all + write_all <= 100);
   assert(read_threads + write_threads <= nb_threads);
 
@@ -510,11 +562,13 @@ int main(int argc, char **argv)
 #endif /* ! TM_COMPILER */
   printf("Duration       : %d\n", duration);
   printf("Nb threads     : %d\n", nb_threads);
+  printf("Nb pools       : %d\n", nb_pools);
   printf("Read-all rate  : %d\n", read_all);
   printf("Read threads   : %d\n", read_threads);
   printf("Seed           : %d\n", seed);
   printf("Write-all rate : %d\n", write_all);
   printf("Write threads  : %d\n", write_threads);
+  printf("Snapshot       : %d\n", snapshot);
   printf("Type sizes     : int=%d/long=%d/ptr=%d/word=%d\n",
          (int)sizeof(int),
          (int)sizeof(long),
@@ -545,7 +599,7 @@ int main(int argc, char **argv)
     bank->accounts[i].number = i;
     bank->accounts[i].balance = 0;
   } */
-  bank = obj_init(nb_accounts);
+  bank = obj_init(nb_accounts, nb_pools);
   page_map_init();
   stop = 0;
 
@@ -556,6 +610,11 @@ int main(int argc, char **argv)
 #ifndef TM_COMPILER
   if (stm_get_parameter("compile_flags", &s))
     printf("STM flags      : %s\n", s);
+  if (stm_get_parameter("recovery_txs", &recovery_txs)) {
+    stm_get_parameter("recovery_entries", &recovery_entries);
+    stm_get_parameter("recovery_ns", &recovery_ns);
+    printf("Recovered      : %lu txs, %lu entries (%lu ns)\n", recovery_txs, recovery_entries, recovery_ns);
+  }
 
   if (cm != NULL) {
     if (stm_set_parameter("cm_policy", cm) == 0)
@@ -593,6 +652,10 @@ int main(int argc, char **argv)
     data[i].locked_reads_ok = 0;
     data[i].locked_reads_failed = 0;
     data[i].max_retries = 0;
+    data[i].nv_log_bytes = 0;
+    data[i].nv_log_stalls = 0;
+    data[i].page_misses = 0;
+    data[i].page_stalls = 0;
 #endif /* ! TM_COMPILER */
     data[i].seed = rand();
     data[i].bank = bank;
@@ -650,6 +713,7 @@ int main(int argc, char **argv)
   locked_reads_ok = 0;
   locked_reads_failed = 0;
   max_retries = 0;
+  log_bytes = log_stalls = page_misses = page_stalls = 0;
 #endif /* ! TM_COMPILER */
   reads = 0;
   writes = 0;
@@ -687,6 +751,10 @@ int main(int argc, char **argv)
     locked_reads_failed += data[i].locked_reads_failed;
     if (max_retries < data[i].max_retries)
       max_retries = data[i].max_retries;
+    log_bytes += data[i].nv_log_bytes;
+    log_stalls += data[i].nv_log_stalls;
+    page_misses += data[i].page_misses;
+    page_stalls += data[i].page_stalls;
 #endif /* ! TM_COMPILER */
     updates += data[i].nb_transfer;
     reads += data[i].nb_read_all;
@@ -714,6 +782,10 @@ int main(int argc, char **argv)
   printf("#lr-ok        : %lu (%f / s)\n", locked_reads_ok, locked_reads_ok * 1000.0 / duration);
   printf("#lr-failed    : %lu (%f / s)\n", locked_reads_failed, locked_reads_failed * 1000.0 / duration);
   printf("Max retries   : %lu\n", max_retries);
+  printf("#log bytes    : %lu (%f / s)\n", (unsigned long)log_bytes, log_bytes * 1000.0 / duration);
+  printf("#log stalls   : %lu (%f / s)\n", (unsigned long)log_stalls, log_stalls * 1000.0 / duration);
+  printf("#page misses  : %lu (%f / s)\n", (unsigned long)page_misses, page_misses * 1000.0 / duration);
+  printf("#page stalls  : %lu (%f / s)\n", (unsigned long)page_stalls, page_stalls * 1000.0 / duration);
 
   for (i = 0; stm_get_ab_stats(i, &ab_stats) != 0; i++) {
     printf("Atomic block  : %d\n", i);
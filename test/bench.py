@@ -0,0 +1,185 @@
+import argparse
+import csv
+import glob
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# Runs the persistent benchmarks over a grid of parameters and writes one
+# row per run.  Pool files are removed before every run so that each run
+# starts from an empty pool.  Latency percentiles need a MEASURE=yes build.
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+WORKLOADS = {
+    'intset-ll': 'test/intset-p/intset-ll',
+    'intset-rb': 'test/intset-p/intset-rb',
+    'intset-sl': 'test/intset-p/intset-sl',
+    'intset-hs': 'test/intset-p/intset-hs',
+    'bank': 'test/bank-p/bank-p',
+    'kv-a': 'test/kv-p/kv-p',
+    'kv-b': 'test/kv-p/kv-p',
+    'kv-c': 'test/kv-p/kv-p',
+    'kv-e': 'test/kv-p/kv-p',
+    'kv-f': 'test/kv-p/kv-p',
+}
+
+FIELDS = ['workload', 'size', 'threads', 'update', 'range', 'run', 'duration_ms',
+          'txs', 'txs_per_s', 'aborts', 'abort_rate', 'p50_ns', 'p99_ns',
+          'log_bytes', 'log_stalls', 'page_misses', 'page_stalls', 'ok']
+
+# summary line -> column
+SUMMARY = {
+    '#txs': 'txs',
+    '#aborts': 'aborts',
+    '#log bytes': 'log_bytes',
+    '#log stalls': 'log_stalls',
+    '#page misses': 'page_misses',
+    '#page stalls': 'page_stalls',
+}
+
+
+def int_list(s):
+    return [int(v) for v in s.split(',') if v != '']
+
+
+def command(workload, args, tree, threads, update, range_):
+    binary = os.path.join(tree, WORKLOADS[workload])
+    cmd = [binary, '-n', str(threads), '-d', str(args.duration)]
+    if workload == 'bank':
+        # transfers are the updates, the other transactions read all accounts
+        cmd += ['-a', str(range_), '-r', str(100 - update)]
+    elif workload.startswith('kv-'):
+        # the mix fixes the updates, the range is the number of records
+        cmd += ['-r', str(range_), '-w', workload[3:]]
+    else:
+        cmd += ['-r', str(range_), '-i', str(range_ // 2), '-u', str(update)]
+    return cmd
+
+
+def percentile(buckets, p):
+    total = sum(n for _, n in buckets)
+    if total == 0:
+        return ''
+    seen = 0
+    for value, n in sorted(buckets):
+        seen += n
+        if seen * 100 >= total * p:
+            return value
+    return buckets[-1][0]
+
+
+def parse(out, measure_file):
+    row = {}
+    for line in out.splitlines():
+        m = re.match(r'^(#[a-z ]+?)\s*: (\d+)', line)
+        if m and m.group(1) in SUMMARY:
+            row[SUMMARY[m.group(1)]] = int(m.group(2))
+        m = re.match(r'^(Set size|Bank total|Records)\s*: (-?\d+) \(expected: (-?\d+)\)', line)
+        if m:
+            row['ok'] = int(m.group(2) == m.group(3))
+    txs = row.get('txs', 0)
+    aborts = row.get('aborts', 0)
+    if txs + aborts != 0:
+        row['abort_rate'] = '%.6f' % (aborts / (txs + aborts))
+    # the last line is the final total of a MEASURE=yes build
+    if os.path.exists(measure_file):
+        with open(measure_file) as f:
+            lines = [json.loads(l) for l in f if l.strip()]
+        totals = [l for l in lines if l['type'] == 'total' and l['final']]
+        if totals:
+            row['p50_ns'] = percentile(totals[-1]['delay_ns'], 50)
+            row['p99_ns'] = percentile(totals[-1]['delay_ns'], 99)
+    return row
+
+
+def run(workload, args, tree, workdir, threads, update, range_):
+    for pool in glob.glob(os.path.join(workdir, '*.pool')):
+        os.remove(pool)
+    measure_file = os.path.join(workdir, 'result.json')
+    if os.path.exists(measure_file):
+        os.remove(measure_file)
+    env = dict(os.environ, MEASURE_FILE=measure_file)
+    env.pop('MEASURE_PERIOD', None)
+    p = subprocess.run(command(workload, args, tree, threads, update, range_), cwd=workdir, env=env,
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    row = parse(p.stdout, measure_file)
+    row['txs_per_s'] = '%.1f' % (row.get('txs', 0) * 1000.0 / args.duration)
+    if p.returncode != 0 and 'ok' not in row:
+        row['ok'] = 0
+    return row
+
+
+def build(size):
+    # the pool size is fixed at compile time (SIZE=small or default): build
+    # in a copy of the tree so that the build of the user is left as it is
+    tree = os.path.join(tempfile.mkdtemp(prefix='stm-build-'), 'tinystm')
+    shutil.copytree(ROOT, tree, ignore=shutil.ignore_patterns('.git', '*.o', '*.a', '*.pool'))
+    make = ['make', 'SIZE=' + ('' if size == 'default' else size)]
+    for d in ['.', 'test/intset-p', 'test/bank-p', 'test/kv-p']:
+        subprocess.check_call(['make', 'clean'], cwd=os.path.join(tree, d), stdout=subprocess.DEVNULL)
+    for d in ['.', 'test/intset-p', 'test/bank-p', 'test/kv-p']:
+        subprocess.check_call(make, cwd=os.path.join(tree, d), stdout=subprocess.DEVNULL)
+    return tree
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Persistent STM benchmark driver')
+    parser.add_argument('-w', '--workloads', default='intset-ll,intset-rb,intset-sl,intset-hs,bank')
+    parser.add_argument('-n', '--threads', type=int_list, default='1,2,4,8')
+    parser.add_argument('-u', '--updates', type=int_list, default='20,100')
+    parser.add_argument('-r', '--ranges', type=int_list, default='256,4096')
+    parser.add_argument('-s', '--sizes', default='',
+                        help='pool sizes to build with (small,default) in a copy of the tree, current build if empty')
+    parser.add_argument('-d', '--duration', type=int, default=2000, help='milliseconds per run')
+    parser.add_argument('-R', '--repeat', type=int, default=3)
+    parser.add_argument('-f', '--format', choices=['csv', 'json'], default='csv')
+    parser.add_argument('-o', '--output', default='-')
+    parser.add_argument('--workdir', default=None, help='directory of the pool files')
+    args = parser.parse_args()
+
+    workloads = args.workloads.split(',')
+    for w in workloads:
+        if w not in WORKLOADS:
+            parser.error('unknown workload %s' % w)
+    sizes = args.sizes.split(',') if args.sizes else ['current']
+    workdir = args.workdir or tempfile.mkdtemp(prefix='stm-bench-')
+    os.makedirs(workdir, exist_ok=True)
+
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    writer = None
+    if args.format == 'csv':
+        writer = csv.DictWriter(out, fieldnames=FIELDS)
+        writer.writeheader()
+
+    for size in sizes:
+        tree = ROOT if size == 'current' else build(size)
+        for w in workloads:
+            for threads in args.threads:
+                for update in args.updates:
+                    for range_ in args.ranges:
+                        for i in range(args.repeat):
+                            row = {f: '' for f in FIELDS}
+                            row.update(workload=w, size=size, threads=threads, update=update,
+                                       range=range_, run=i, duration_ms=args.duration)
+                            row.update(run(w, args, tree, workdir, threads, update, range_))
+                            if writer:
+                                writer.writerow(row)
+                            else:
+                                out.write(json.dumps(row) + '\n')
+                            out.flush()
+        if tree != ROOT:
+            shutil.rmtree(os.path.dirname(tree))
+
+    for pool in glob.glob(os.path.join(workdir, '*.pool')):
+        os.remove(pool)
+    if out is not sys.stdout:
+        out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,231 @@
+import argparse
+import csv
+import glob
+import json
+import os
+import random
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+# Kills the persistent benchmarks while they run, restarts them on the same
+# pool and checks their invariants after recovery.  SIGKILL stops the process
+# at any point, the crash points of a CRASH=yes build stop it at a chosen step
+# of the log (NV_CRASH=point:n crashes on the n-th time the point is reached).
+# Killing the process loses the volatile state only: the pool file is still
+# written by the kernel, so this checks the ordering of the log, not flushes.
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+WORKLOADS = {
+    'intset-ll': 'test/intset-p/intset-ll',
+    'intset-rb': 'test/intset-p/intset-rb',
+    'intset-sl': 'test/intset-p/intset-sl',
+    'intset-hs': 'test/intset-p/intset-hs',
+    'bank': 'test/bank-p/bank-p',
+    'bank-pools': 'test/bank-p/bank-p',
+    'kv-a': 'test/kv-p/kv-p',
+    'kv-e': 'test/kv-p/kv-p',
+}
+
+POINTS = ['log_flush', 'log_drain', 'log_publish', 'reproduce', 'recovery']
+
+FIELDS = ['workload', 'iteration', 'crash', 'at', 'crashed', 'recovered_txs',
+          'recovered_entries', 'recovery_ns', 'ok']
+
+
+def command(workload, args, restart):
+    # runs until killed, the restart runs a single thread for 1 ms
+    binary = os.path.join(args.tree, WORKLOADS[workload])
+    if restart:
+        cmd = [binary, '-n', '1', '-d', '1']
+    else:
+        cmd = [binary, '-n', str(args.threads), '-d', '0']
+    if workload == 'bank':
+        cmd += ['-a', str(args.range)]
+    elif workload == 'bank-pools':
+        # transfers between accounts of 3 pools
+        cmd += ['-a', str(args.range), '-p', '3']
+    elif workload.startswith('kv-'):
+        cmd += ['-r', str(args.range), '-w', workload[3:]]
+    else:
+        # -k keeps the number of elements in the pool, the restart adds none
+        initial = 0 if restart else args.range // 2
+        cmd += ['-r', str(args.range), '-i', str(initial), '-u', '100', '-k']
+    return cmd
+
+
+def start(workload, args, workdir, env):
+    # line buffered output shows when the threads are started
+    cmd = command(workload, args, False)
+    if shutil.which('stdbuf'):
+        cmd = ['stdbuf', '-oL'] + cmd
+    p = subprocess.Popen(cmd, cwd=workdir, env=env, stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT, universal_newlines=True)
+    if shutil.which('stdbuf'):
+        for line in p.stdout:
+            if line.startswith('STARTING'):
+                break
+    return p
+
+
+def crash(workload, args, workdir, mode):
+    env = dict(os.environ)
+    env.pop('NV_CRASH', None)
+    if mode == 'kill' or mode == 'recovery':
+        at = random.randint(0, args.kill)
+        p = start(workload, args, workdir, env)
+        time.sleep(at / 1000.0)
+        p.send_signal(signal.SIGKILL)
+    else:
+        at = random.randint(1, args.count)
+        env['NV_CRASH'] = '%s:%d' % (mode, at)
+        p = start(workload, args, workdir, env)
+        try:
+            p.wait(args.timeout)
+        except subprocess.TimeoutExpired:
+            # the point was not reached often enough
+            p.send_signal(signal.SIGKILL)
+    p.stdout.read()
+    p.wait()
+    return at, int(p.returncode == -signal.SIGKILL)
+
+
+def parse(out):
+    row = {'ok': 1}
+    for line in out.splitlines():
+        m = re.match(r'^Recovered\s*: (\d+) txs, (\d+) entries \((\d+) ns\)', line)
+        if m:
+            row['recovered_txs'] = int(m.group(1))
+            row['recovered_entries'] = int(m.group(2))
+            row['recovery_ns'] = int(m.group(3))
+        m = re.match(r'^(Recovered size|Set size|Bank total|Records)\s*: (-?\d+) \(expected: (-?\d+)\)', line)
+        if m and m.group(2) != m.group(3):
+            row['ok'] = 0
+        m = re.match(r'^(Corrupted\s*: |Restarting with \d+ records \()(\d+)', line)
+        if m and m.group(2) != '0':
+            row['ok'] = 0
+    return row
+
+
+def verify(workload, args, workdir, mode):
+    env = dict(os.environ)
+    env.pop('NV_CRASH', None)
+    ok = 1
+    if mode == 'recovery':
+        # crash while replaying the log, the next restart recovers again
+        p = subprocess.run(command(workload, args, True), cwd=workdir, env=dict(env, NV_CRASH='recovery:1'),
+                           stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+        if p.returncode != -signal.SIGKILL:
+            ok = parse(p.stdout)['ok'] if p.returncode == 0 else 0
+    p = subprocess.run(command(workload, args, True), cwd=workdir, env=env, stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT, universal_newlines=True)
+    row = parse(p.stdout)
+    if p.returncode != 0 or 'recovery_ns' not in row:
+        row['ok'] = 0
+    row['ok'] &= ok
+    return row
+
+
+def fit(rows):
+    # recovery time = a + b * entries, least squares
+    xs = [r['recovered_entries'] for r in rows if r.get('recovered_entries', '') != '']
+    ys = [r['recovery_ns'] for r in rows if r.get('recovered_entries', '') != '']
+    n = len(xs)
+    if n < 2 or len(set(xs)) < 2:
+        return None
+    mx, my = sum(xs) / n, sum(ys) / n
+    b = sum((x - mx) * (y - my) for x, y in zip(xs, ys)) / sum((x - mx) ** 2 for x in xs)
+    return my - b * mx, b
+
+
+def build():
+    # build in a copy of the tree so that the build of the user is left as it is
+    tree = os.path.join(tempfile.mkdtemp(prefix='stm-build-'), 'tinystm')
+    shutil.copytree(ROOT, tree, ignore=shutil.ignore_patterns('.git', '*.o', '*.a', '*.pool'))
+    for d in ['.', 'test/intset-p', 'test/bank-p', 'test/kv-p']:
+        subprocess.check_call(['make', 'clean'], cwd=os.path.join(tree, d), stdout=subprocess.DEVNULL)
+    for d in ['.', 'test/intset-p', 'test/bank-p', 'test/kv-p']:
+        subprocess.check_call(['make', 'CRASH=yes', 'SIZE=small'], cwd=os.path.join(tree, d), stdout=subprocess.DEVNULL)
+    return tree
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Persistent STM crash-injection driver')
+    parser.add_argument('-w', '--workloads', default='intset-ll,intset-rb,intset-sl,intset-hs,bank,kv-a')
+    parser.add_argument('-i', '--iterations', type=int, default=10, help='crashes per workload')
+    parser.add_argument('-n', '--threads', type=int, default=4)
+    parser.add_argument('-r', '--range', type=int, default=1024,
+                        help='intset range, bank accounts or kv records')
+    parser.add_argument('-k', '--kill', type=int, default=500, help='maximum milliseconds before SIGKILL')
+    parser.add_argument('-p', '--points', default='',
+                        help='crash points to use besides SIGKILL (%s or all), needs CRASH=yes' % ','.join(POINTS))
+    parser.add_argument('-c', '--count', type=int, default=10000, help='maximum n of NV_CRASH=point:n')
+    parser.add_argument('-t', '--timeout', type=float, default=10, help='seconds to reach a crash point')
+    parser.add_argument('-b', '--build', action='store_true', help='build with CRASH=yes SIZE=small in a copy of the tree')
+    parser.add_argument('-s', '--seed', type=int, default=None)
+    parser.add_argument('-f', '--format', choices=['csv', 'json'], default='csv')
+    parser.add_argument('-o', '--output', default='-')
+    parser.add_argument('--workdir', default=None, help='directory of the pool files')
+    args = parser.parse_args()
+
+    workloads = args.workloads.split(',')
+    for w in workloads:
+        if w not in WORKLOADS:
+            parser.error('unknown workload %s' % w)
+    points = POINTS if args.points == 'all' else [p for p in args.points.split(',') if p != '']
+    for p in points:
+        if p not in POINTS:
+            parser.error('unknown crash point %s' % p)
+    modes = ['kill'] + points
+    random.seed(args.seed)
+    args.tree = build() if args.build else ROOT
+    workdir = args.workdir or tempfile.mkdtemp(prefix='stm-crash-')
+    os.makedirs(workdir, exist_ok=True)
+
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    writer = None
+    if args.format == 'csv':
+        writer = csv.DictWriter(out, fieldnames=FIELDS)
+        writer.writeheader()
+
+    failed = 0
+    for w in workloads:
+        rows = []
+        for i in range(args.iterations):
+            # every iteration starts from an empty pool
+            for pool in glob.glob(os.path.join(workdir, '*.pool')):
+                os.remove(pool)
+            mode = modes[i % len(modes)]
+            row = {f: '' for f in FIELDS}
+            at, crashed = crash(w, args, workdir, mode)
+            row.update(workload=w, iteration=i, crash=mode, at=at, crashed=crashed)
+            row.update(verify(w, args, workdir, mode))
+            rows.append(row)
+            failed += 1 - row['ok']
+            if writer:
+                writer.writerow(row)
+            else:
+                out.write(json.dumps(row) + '\n')
+            out.flush()
+        line = fit(rows)
+        sys.stderr.write('%s: %d/%d ok' % (w, sum(r['ok'] for r in rows), len(rows)))
+        if line:
+            sys.stderr.write(', recovery %.0f ns + %.1f ns/entry' % line)
+        sys.stderr.write('\n')
+
+    for pool in glob.glob(os.path.join(workdir, '*.pool')):
+        os.remove(pool)
+    if args.tree != ROOT:
+        shutil.rmtree(os.path.dirname(args.tree))
+    if out is not sys.stdout:
+        out.close()
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
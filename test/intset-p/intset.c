@@ -86,6 +86,7 @@ void perror(const char *s);
 # define TM_UNIT_STORE(addr, value, ts)     stm_unit_store((stm_word_t *)ptr_to_nv(addr), (stm_word_t)value, ts)
 # define TM_COMMIT                          stm_commit(); }
 # define TM_MALLOC(size, type_num)          stm_malloc(size, type_num, pool)
+# define TM_MALLOC_NEAR(size, type_num, hint) stm_malloc_near(size, type_num, pool, ptr_to_nv(hint))
 # define TM_FREE(addr)                      stm_free(addr, sizeof(*addr), pool)
 # define TM_FREE2(addr, size)               stm_free(addr, size, pool)
 
@@ -100,6 +101,9 @@ void perror(const char *s);
 
 #endif /* Compile with explicit calls to tinySTM */
 
+/* With -k, each thread counts in the pool the elements its transactions add and remove */
+#define TM_COUNT(td, n)                     if ((td)->count != NULL && (n) != 0) TM_STORE((td)->count, TM_LOAD((td)->count) + (n))
+
 #ifdef DEBUG
 # define IO_FLUSH                       fflush(NULL)
 /* Note: stdio is thread-safe */
@@ -117,6 +121,10 @@ void perror(const char *s);
 #define DEFAULT_SEED                    0
 #define DEFAULT_UPDATE                  20
 
+#define COUNT_SLOTS                     64
+#define COUNT_STRIDE                    8       /* Longs per slot: one cache line */
+#define TYPE_COUNT                      16
+
 #define XSTR(s)                         STR(s)
 #define STR(s)                          #s
 
@@ -175,9 +183,14 @@ typedef struct thread_data {
   unsigned long locked_reads_ok;
   unsigned long locked_reads_failed;
   unsigned long max_retries;
+  uint64_t nv_log_bytes;
+  uint64_t nv_log_stalls;
+  uint64_t page_misses;
+  uint64_t page_stalls;
 #endif /* ! TM_COMPILER */
   unsigned short seed[3];
   int diff;
+  long *count;
   int range;
   int update;
   int alternate;
@@ -223,7 +236,8 @@ static node_t *new_node(val_t val, node_t *next, int transactional)
     node->val = val;
     node->next = ptr_to_nv(next);
   } else {
-    node = (node_t *)TM_MALLOC(sizeof(node_t), TYPE_NODE);
+    /* Share a page with the next node: traversals map fewer pages */
+    node = (node_t *)TM_MALLOC_NEAR(sizeof(node_t), TYPE_NODE, next);
     TM_STORE(&node->val, val);
     TM_STORE(&node->next, ptr_to_nv(next));
   }
@@ -415,6 +429,7 @@ static int set_add(intset_t *set, val_t val, thread_data_t *td)
     if (result) {
       TM_STORE(&prev->next, ptr_to_nv(new_node(val, next, 1)));
     }
+    TM_COUNT(td, (result != 0));
     TM_COMMIT;
   } 
 #ifndef TM_COMPILER
@@ -519,6 +534,7 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
       /* Free memory (delayed until commit) */
       TM_FREE2(next, sizeof(node_t));
     }
+    TM_COUNT(td, -(result != 0));
     TM_COMMIT;
   } 
 #ifndef TM_COMPILER
@@ -606,7 +622,12 @@ static intset_t *set_new()
   pool = pool_init("intset-rb.pool");
   PMEMoid Root = pmemobj_root(pool, sizeof(struct root));
   root = pmemobj_direct(Root);
-  if (root->obj_root[0] != 0) return (intset_t *)nv_to_ptr(root->obj_root[0]);
+  if (root->obj_root[0] != 0) {
+    set = (intset_t *)nv_to_ptr(root->obj_root[0]);
+    /* The function moves from one run to the other */
+    ((rbtree_t *)set)->compare = &compare;
+    return set;
+  }
 
   TX_BEGIN(pool) {
     set = (intset_t *)rbtree_alloc(&compare);
@@ -680,6 +701,7 @@ static int set_add(intset_t *set, val_t val, thread_data_t *td)
   } else {
     TM_START(1, RW);
     result = TMrbtree_insert((rbtree_t *)set, (void *)val, (void *)val);
+    TM_COUNT(td, (result != 0));
     TM_COMMIT;
   }
 
@@ -702,6 +724,7 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
   } else {
     TM_START(2, RW);
     result = TMrbtree_delete((rbtree_t *)set, (void *)val);
+    TM_COUNT(td, -(result != 0));
     TM_COMMIT;
   }
 
@@ -723,15 +746,20 @@ typedef intptr_t level_t;
 # define VAL_MIN                        INT_MIN
 # define VAL_MAX                        INT_MAX
 
+enum {
+  TYPE_NODE = 2,
+  TYPE_INTSET
+};
+
 typedef struct node {
   val_t val;
   level_t level;
-  struct node *forward[1];
+  nv_ptr forward[1];
 } node_t;
 
 typedef struct intset {
-  node_t *head;
-  node_t *tail;
+  nv_ptr head;
+  nv_ptr tail;
   level_t level;
   int prob;
   int max_level;
@@ -752,17 +780,22 @@ static node_t *new_node(val_t val, level_t level, int transactional)
   node_t *node;
 
   if (!transactional) {
-    node = (node_t *)malloc(sizeof(node_t) + level * sizeof(node_t *));
+    node = (node_t *)pmemobj_direct(pmemobj_tx_zalloc(sizeof(node_t) + level * sizeof(nv_ptr), TYPE_NODE));
   } else {
-    node = (node_t *)TM_MALLOC(sizeof(node_t) + level * sizeof(node_t *));
+    node = (node_t *)TM_MALLOC(sizeof(node_t) + level * sizeof(nv_ptr), TYPE_NODE);
   }
   if (node == NULL) {
     perror("malloc");
     exit(1);
   }
 
-  node->val = val;
-  node->level = level;
+  if (!transactional) {
+    node->val = val;
+    node->level = level;
+  } else {
+    TM_STORE(&node->val, val);
+    TM_STORE(&node->level, level);
+  }
 
   return node;
 }
@@ -770,25 +803,35 @@ static node_t *new_node(val_t val, level_t level, int transactional)
 static intset_t *set_new(level_t max_level, int prob)
 {
   intset_t *set;
+  node_t *head, *tail;
   int i;
 
   assert(max_level <= MAX_LEVEL);
   assert(prob >= 0 && prob <= 100);
 
-  if ((set = (intset_t *)malloc(sizeof(intset_t))) == NULL) {
-    perror("malloc");
-    exit(1);
-  }
-  set->max_level = max_level;
-  set->prob = prob;
-  set->level = 0;
-  /* Set head and tail are immutable */
-  set->tail = new_node(VAL_MAX, max_level, 0);
-  set->head = new_node(VAL_MIN, max_level, 0);
-  for (i = 0; i <= max_level; i++) {
-    set->head->forward[i] = set->tail;
-    set->tail->forward[i] = NULL;
-  }
+  pool = pool_init("intset-sl.pool");
+  PMEMoid Root = pmemobj_root(pool, sizeof(struct root));
+  root = pmemobj_direct(Root);
+  if (root->obj_root[0] != 0) return (intset_t *)nv_to_ptr(root->obj_root[0]);
+
+  TX_BEGIN(pool) {
+    set = (intset_t *)pmemobj_direct(pmemobj_tx_zalloc(sizeof(intset_t), TYPE_INTSET));
+    set->max_level = max_level;
+    set->prob = prob;
+    set->level = 0;
+    /* Set head and tail are immutable */
+    tail = new_node(VAL_MAX, max_level, 0);
+    head = new_node(VAL_MIN, max_level, 0);
+    for (i = 0; i <= max_level; i++) {
+      head->forward[i] = ptr_to_nv(tail);
+      tail->forward[i] = 0;
+    }
+    set->head = ptr_to_nv(head);
+    set->tail = ptr_to_nv(tail);
+
+    pmemobj_tx_add_range_direct(&root->obj_root[0], sizeof(nv_ptr));
+    root->obj_root[0] = ptr_to_nv(set);
+  }TX_END
 
   return set;
 }
@@ -797,13 +840,18 @@ static void set_delete(intset_t *set)
 {
   node_t *node, *next;
 
-  node = set->head;
-  while (node != NULL) {
-    next = node->forward[0];
-    free(node);
-    node = next;
-  }
-  free(set);
+  TX_BEGIN(pool) {
+    node = (node_t *)nv_to_ptr(set->head);
+    while (node != NULL) {
+      next = (node_t *)nv_to_ptr(node->forward[0]);
+      pmemobj_tx_free(pmemobj_oid(node));
+      node = next;
+    }
+    pmemobj_tx_free(pmemobj_oid(set));
+
+    pmemobj_tx_add_range_direct(&root->obj_root[0], sizeof(nv_ptr));
+    root->obj_root[0] = 0;
+  }TX_END
 }
 
 static int set_size(intset_t *set)
@@ -812,10 +860,10 @@ static int set_size(intset_t *set)
   node_t *node;
 
   /* We have at least 2 elements */
-  node = set->head->forward[0];
-  while (node->forward[0] != NULL) {
+  node = (node_t *)nv_to_ptr(((node_t *)nv_to_ptr(set->head))->forward[0]);
+  while (node->forward[0] != 0) {
     size++;
-    node = node->forward[0];
+    node = (node_t *)nv_to_ptr(node->forward[0]);
   }
 
   return size;
@@ -833,28 +881,28 @@ static int set_contains(intset_t *set, val_t val, thread_data_t *td)
 # endif
 
   if (!td) {
-    node = set->head;
+    node = (node_t *)nv_to_ptr(set->head);
     for (i = set->level; i >= 0; i--) {
-      next = node->forward[i];
+      next = (node_t *)nv_to_ptr(node->forward[i]);
       while (next->val < val) {
         node = next;
-        next = node->forward[i];
+        next = (node_t *)nv_to_ptr(node->forward[i]);
       }
     }
-    node = node->forward[0];
+    node = (node_t *)nv_to_ptr(node->forward[0]);
     result = (node->val == val);
   } else {
     TM_START(0, RO);
     v = VAL_MIN; /* Avoid compiler warning (should not be necessary) */
-    node = set->head;
+    node = (node_t *)nv_to_ptr(set->head);
     for (i = TM_LOAD(&set->level); i >= 0; i--) {
-      next = (node_t *)TM_LOAD(&node->forward[i]);
+      next = (node_t *)nv_to_ptr(TM_LOAD(&node->forward[i]));
       while (1) {
         v = TM_LOAD(&next->val);
         if (v >= val)
           break;
         node = next;
-        next = (node_t *)TM_LOAD(&node->forward[i]);
+        next = (node_t *)nv_to_ptr(TM_LOAD(&node->forward[i]));
       }
     }
     result = (v == val);
@@ -868,7 +916,7 @@ static int set_add(intset_t *set, val_t val, thread_data_t *td)
 {
   int result, i;
   node_t *update[MAX_LEVEL + 1];
-  node_t *node, *next;
+  node_t *head, *node, *next;
   level_t level, l;
   val_t v;
 
@@ -877,47 +925,53 @@ static int set_add(intset_t *set, val_t val, thread_data_t *td)
   IO_FLUSH;
 # endif
 
+  /* Head is never removed */
+  head = (node_t *)nv_to_ptr(set->head);
   if (!td) {
-    node = set->head;
+    node = head;
     for (i = set->level; i >= 0; i--) {
-      next = node->forward[i];
+      next = (node_t *)nv_to_ptr(node->forward[i]);
       while (next->val < val) {
         node = next;
-        next = node->forward[i];
+        next = (node_t *)nv_to_ptr(node->forward[i]);
       }
       update[i] = node;
     }
-    node = node->forward[0];
+    node = (node_t *)nv_to_ptr(node->forward[0]);
 
     if (node->val == val) {
       result = 0;
     } else {
       l = random_level(set, main_seed);
-      if (l > set->level) {
-        for (i = set->level + 1; i <= l; i++)
-          update[i] = set->head;
-        set->level = l;
-      }
-      node = new_node(val, l, 0);
-      for (i = 0; i <= l; i++) {
-        node->forward[i] = update[i]->forward[i];
-        update[i]->forward[i] = node;
-      }
+      TX_BEGIN(pool) {
+        if (l > set->level) {
+          for (i = set->level + 1; i <= l; i++)
+            update[i] = head;
+          pmemobj_tx_add_range_direct(&set->level, sizeof(level_t));
+          set->level = l;
+        }
+        node = new_node(val, l, 0);
+        for (i = 0; i <= l; i++) {
+          node->forward[i] = update[i]->forward[i];
+          pmemobj_tx_add_range_direct(&update[i]->forward[i], sizeof(nv_ptr));
+          update[i]->forward[i] = ptr_to_nv(node);
+        }
+      }TX_END
       result = 1;
     }
   } else {
     TM_START(1, RW);
     v = VAL_MIN; /* Avoid compiler warning (should not be necessary) */
-    node = set->head;
+    node = head;
     level = TM_LOAD(&set->level);
     for (i = level; i >= 0; i--) {
-      next = (node_t *)TM_LOAD(&node->forward[i]);
+      next = (node_t *)nv_to_ptr(TM_LOAD(&node->forward[i]));
       while (1) {
         v = TM_LOAD(&next->val);
         if (v >= val)
           break;
         node = next;
-        next = (node_t *)TM_LOAD(&node->forward[i]);
+        next = (node_t *)nv_to_ptr(TM_LOAD(&node->forward[i]));
       }
       update[i] = node;
     }
@@ -928,16 +982,17 @@ static int set_add(intset_t *set, val_t val, thread_data_t *td)
       l = random_level(set, td->seed);
       if (l > level) {
         for (i = level + 1; i <= l; i++)
-          update[i] = set->head;
+          update[i] = head;
         TM_STORE(&set->level, l);
       }
       node = new_node(val, l, 1);
       for (i = 0; i <= l; i++) {
-        node->forward[i] = (node_t *)TM_LOAD(&update[i]->forward[i]);
-        TM_STORE(&update[i]->forward[i], node);
+        TM_STORE(&node->forward[i], TM_LOAD(&update[i]->forward[i]));
+        TM_STORE(&update[i]->forward[i], ptr_to_nv(node));
       }
       result = 1;
     }
+    TM_COUNT(td, (result != 0));
     TM_COMMIT;
   }
 
@@ -948,7 +1003,7 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
 {
   int result, i;
   node_t *update[MAX_LEVEL + 1];
-  node_t *node, *next;
+  node_t *head, *node, *next;
   level_t level;
   val_t v;
 
@@ -957,64 +1012,75 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
   IO_FLUSH;
 # endif
 
+  head = (node_t *)nv_to_ptr(set->head);
   if (!td) {
-    node = set->head;
+    node = head;
     for (i = set->level; i >= 0; i--) {
-      next = node->forward[i];
+      next = (node_t *)nv_to_ptr(node->forward[i]);
       while (next->val < val) {
         node = next;
-        next = node->forward[i];
+        next = (node_t *)nv_to_ptr(node->forward[i]);
       }
       update[i] = node;
     }
-    node = node->forward[0];
+    node = (node_t *)nv_to_ptr(node->forward[0]);
 
     if (node->val != val) {
       result = 0;
     } else {
-      for (i = 0; i <= set->level; i++) {
-        if (update[i]->forward[i] == node)
-          update[i]->forward[i] = node->forward[i];
-      }
-      while (set->level > 0 && set->head->forward[set->level]->forward[0] == NULL)
-        set->level--;
-      free(node);
+      TX_BEGIN(pool) {
+        for (i = 0; i <= set->level; i++) {
+          if (update[i]->forward[i] == ptr_to_nv(node)) {
+            pmemobj_tx_add_range_direct(&update[i]->forward[i], sizeof(nv_ptr));
+            update[i]->forward[i] = node->forward[i];
+          }
+        }
+        level = set->level;
+        while (level > 0 && head->forward[level] == set->tail)
+          level--;
+        if (level != set->level) {
+          pmemobj_tx_add_range_direct(&set->level, sizeof(level_t));
+          set->level = level;
+        }
+        pmemobj_tx_free(pmemobj_oid(node));
+      }TX_END
       result = 1;
     }
   } else {
     TM_START(2, RW);
     v = VAL_MIN; /* Avoid compiler warning (should not be necessary) */
-    node = set->head;
+    node = head;
     level = TM_LOAD(&set->level);
     for (i = level; i >= 0; i--) {
-      next = (node_t *)TM_LOAD(&node->forward[i]);
+      next = (node_t *)nv_to_ptr(TM_LOAD(&node->forward[i]));
       while (1) {
         v = TM_LOAD(&next->val);
         if (v >= val)
           break;
         node = next;
-        next = (node_t *)TM_LOAD(&node->forward[i]);
+        next = (node_t *)nv_to_ptr(TM_LOAD(&node->forward[i]));
       }
       update[i] = node;
     }
-    node = (node_t *)TM_LOAD(&node->forward[0]);
+    node = (node_t *)nv_to_ptr(TM_LOAD(&node->forward[0]));
 
     if (v != val) {
       result = 0;
     } else {
       for (i = 0; i <= level; i++) {
-        if ((node_t *)TM_LOAD(&update[i]->forward[i]) == node)
-          TM_STORE(&update[i]->forward[i], (node_t *)TM_LOAD(&node->forward[i]));
+        if ((nv_ptr)TM_LOAD(&update[i]->forward[i]) == ptr_to_nv(node))
+          TM_STORE(&update[i]->forward[i], TM_LOAD(&node->forward[i]));
       }
       i = level;
-      while (i > 0 && (node_t *)TM_LOAD(&set->head->forward[i]) == set->tail)
+      while (i > 0 && (nv_ptr)TM_LOAD(&head->forward[i]) == set->tail)
         i--;
       if (i != level)
         TM_STORE(&set->level, i);
       /* Free memory (delayed until commit) */
-      TM_FREE2(node, sizeof(node_t) + node->level * sizeof(node_t *));
+      TM_FREE2(node, sizeof(node_t) + TM_LOAD(&node->level) * sizeof(nv_ptr));
       result = 1;
     }
+    TM_COUNT(td, -(result != 0));
     TM_COMMIT;
   }
 
@@ -1035,13 +1101,19 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
 
 typedef intptr_t val_t;
 
+enum {
+  TYPE_NODE = 2,
+  TYPE_INTSET,
+  TYPE_BUCKETS
+};
+
 typedef struct bucket {
   val_t val;
-  struct bucket *next;
+  nv_ptr next;
 } bucket_t;
 
 typedef struct intset {
-  bucket_t **buckets;
+  nv_ptr buckets;
 } intset_t;
 
 TM_PURE
@@ -1058,17 +1130,23 @@ static bucket_t *new_entry(val_t val, bucket_t *next, int transactional)
   bucket_t *b;
 
   if (!transactional) {
-    b = (bucket_t *)malloc(sizeof(bucket_t));
+    b = (bucket_t *)pmemobj_direct(pmemobj_tx_zalloc(sizeof(bucket_t), TYPE_NODE));
   } else {
-    b = (bucket_t *)TM_MALLOC(sizeof(bucket_t));
+    /* Not placed near the next entry: buckets stay scattered over pages */
+    b = (bucket_t *)TM_MALLOC(sizeof(bucket_t), TYPE_NODE);
   }
   if (b == NULL) {
     perror("malloc");
     exit(1);
   }
 
-  b->val = val;
-  b->next = next;
+  if (!transactional) {
+    b->val = val;
+    b->next = ptr_to_nv(next);
+  } else {
+    TM_STORE(&b->val, val);
+    TM_STORE(&b->next, ptr_to_nv(next));
+  }
 
   return b;
 }
@@ -1077,14 +1155,19 @@ static intset_t *set_new()
 {
   intset_t *set;
 
-  if ((set = (intset_t *)malloc(sizeof(intset_t))) == NULL) {
-    perror("malloc");
-    exit(1);
-  }
-  if ((set->buckets = (bucket_t **)calloc(NB_BUCKETS, sizeof(bucket_t *))) == NULL) {
-    perror("calloc");
-    exit(1);
-  }
+  pool = pool_init("intset-hs.pool");
+  PMEMoid Root = pmemobj_root(pool, sizeof(struct root));
+  root = pmemobj_direct(Root);
+  if (root->obj_root[0] != 0) return (intset_t *)nv_to_ptr(root->obj_root[0]);
+
+  TX_BEGIN(pool) {
+    set = (intset_t *)pmemobj_direct(pmemobj_tx_zalloc(sizeof(intset_t), TYPE_INTSET));
+    /* Array of bucket heads, immutable once allocated */
+    set->buckets = ptr_to_nv(pmemobj_direct(pmemobj_tx_zalloc(NB_BUCKETS * sizeof(nv_ptr), TYPE_BUCKETS)));
+
+    pmemobj_tx_add_range_direct(&root->obj_root[0], sizeof(nv_ptr));
+    root->obj_root[0] = ptr_to_nv(set);
+  }TX_END
 
   return set;
 }
@@ -1092,31 +1175,38 @@ static intset_t *set_new()
 static void set_delete(intset_t *set)
 {
   unsigned int i;
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(set->buckets);
   bucket_t *b, *next;
 
-  for (i = 0; i < NB_BUCKETS; i++) {
-    b = set->buckets[i];
-    while (b != NULL) {
-      next = b->next;
-      free(b);
-      b = next;
+  TX_BEGIN(pool) {
+    for (i = 0; i < NB_BUCKETS; i++) {
+      b = (bucket_t *)nv_to_ptr(buckets[i]);
+      while (b != NULL) {
+        next = (bucket_t *)nv_to_ptr(b->next);
+        pmemobj_tx_free(pmemobj_oid(b));
+        b = next;
+      }
     }
-  }
-  free(set->buckets);
-  free(set);
+    pmemobj_tx_free(pmemobj_oid(buckets));
+    pmemobj_tx_free(pmemobj_oid(set));
+
+    pmemobj_tx_add_range_direct(&root->obj_root[0], sizeof(nv_ptr));
+    root->obj_root[0] = 0;
+  }TX_END
 }
 
 static int set_size(intset_t *set)
 {
   int size = 0;
   unsigned int i;
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(set->buckets);
   bucket_t *b;
 
   for (i = 0; i < NB_BUCKETS; i++) {
-    b = set->buckets[i];
+    b = (bucket_t *)nv_to_ptr(buckets[i]);
     while (b != NULL) {
       size++;
-      b = b->next;
+      b = (bucket_t *)nv_to_ptr(b->next);
     }
   }
 
@@ -1126,6 +1216,7 @@ static int set_size(intset_t *set)
 static int set_contains(intset_t *set, val_t val, thread_data_t *td)
 {
   int result, i;
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(set->buckets);
   bucket_t *b;
 
 # ifdef DEBUG
@@ -1135,26 +1226,26 @@ static int set_contains(intset_t *set, val_t val, thread_data_t *td)
 
   if (!td) {
     i = HASH(val);
-    b = set->buckets[i];
+    b = (bucket_t *)nv_to_ptr(buckets[i]);
     result = 0;
     while (b != NULL) {
       if (b->val == val) {
         result = 1;
         break;
       }
-      b = b->next;
+      b = (bucket_t *)nv_to_ptr(b->next);
     }
   } else {
     TM_START(0, RO);
     i = HASH(val);
-    b = (bucket_t *)TM_LOAD(&set->buckets[i]);
+    b = (bucket_t *)nv_to_ptr(TM_LOAD(&buckets[i]));
     result = 0;
     while (b != NULL) {
       if (TM_LOAD(&b->val) == val) {
         result = 1;
         break;
       }
-      b = (bucket_t *)TM_LOAD(&b->next);
+      b = (bucket_t *)nv_to_ptr(TM_LOAD(&b->next));
     }
     TM_COMMIT;
   }
@@ -1165,6 +1256,7 @@ static int set_contains(intset_t *set, val_t val, thread_data_t *td)
 static int set_add(intset_t *set, val_t val, thread_data_t *td)
 {
   int result, i;
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(set->buckets);
   bucket_t *b, *first;
 
 # ifdef DEBUG
@@ -1174,33 +1266,37 @@ static int set_add(intset_t *set, val_t val, thread_data_t *td)
 
   if (!td) {
     i = HASH(val);
-    first = b = set->buckets[i];
+    first = b = (bucket_t *)nv_to_ptr(buckets[i]);
     result = 1;
     while (b != NULL) {
       if (b->val == val) {
         result = 0;
         break;
       }
-      b = b->next;
+      b = (bucket_t *)nv_to_ptr(b->next);
     }
     if (result) {
-      set->buckets[i] = new_entry(val, first, 0);
+      TX_BEGIN(pool) {
+        pmemobj_tx_add_range_direct(&buckets[i], sizeof(nv_ptr));
+        buckets[i] = ptr_to_nv(new_entry(val, first, 0));
+      }TX_END
     }
   } else {
-    TM_START(0, RW);
+    TM_START(1, RW);
     i = HASH(val);
-    first = b = (bucket_t *)TM_LOAD(&set->buckets[i]);
+    first = b = (bucket_t *)nv_to_ptr(TM_LOAD(&buckets[i]));
     result = 1;
     while (b != NULL) {
       if (TM_LOAD(&b->val) == val) {
         result = 0;
         break;
       }
-      b = (bucket_t *)TM_LOAD(&b->next);
+      b = (bucket_t *)nv_to_ptr(TM_LOAD(&b->next));
     }
     if (result) {
-      TM_STORE(&set->buckets[i], new_entry(val, first, 1));
+      TM_STORE(&buckets[i], ptr_to_nv(new_entry(val, first, 1)));
     }
+    TM_COUNT(td, (result != 0));
     TM_COMMIT;
   }
 
@@ -1210,6 +1306,7 @@ static int set_add(intset_t *set, val_t val, thread_data_t *td)
 static int set_remove(intset_t *set, val_t val, thread_data_t *td)
 {
   int result, i;
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(set->buckets);
   bucket_t *b, *prev;
 
 # ifdef DEBUG
@@ -1219,7 +1316,7 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
 
   if (!td) {
     i = HASH(val);
-    prev = b = set->buckets[i];
+    prev = b = (bucket_t *)nv_to_ptr(buckets[i]);
     result = 0;
     while (b != NULL) {
       if (b->val == val) {
@@ -1227,21 +1324,25 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
         break;
       }
       prev = b;
-      b = b->next;
+      b = (bucket_t *)nv_to_ptr(b->next);
     }
     if (result) {
-      if (prev == b) {
-        /* First element of bucket */
-        set->buckets[i] = b->next;
-      } else {
-        prev->next = b->next;
-      }
-      free(b);
+      TX_BEGIN(pool) {
+        if (prev == b) {
+          /* First element of bucket */
+          pmemobj_tx_add_range_direct(&buckets[i], sizeof(nv_ptr));
+          buckets[i] = b->next;
+        } else {
+          pmemobj_tx_add_range_direct(&prev->next, sizeof(nv_ptr));
+          prev->next = b->next;
+        }
+        pmemobj_tx_free(pmemobj_oid(b));
+      }TX_END
     }
   } else {
-    TM_START(0, RW);
+    TM_START(2, RW);
     i = HASH(val);
-    prev = b = (bucket_t *)TM_LOAD(&set->buckets[i]);
+    prev = b = (bucket_t *)nv_to_ptr(TM_LOAD(&buckets[i]));
     result = 0;
     while (b != NULL) {
       if (TM_LOAD(&b->val) == val) {
@@ -1249,18 +1350,19 @@ static int set_remove(intset_t *set, val_t val, thread_data_t *td)
         break;
       }
       prev = b;
-      b = (bucket_t *)TM_LOAD(&b->next);
+      b = (bucket_t *)nv_to_ptr(TM_LOAD(&b->next));
     }
     if (result) {
       if (prev == b) {
         /* First element of bucket */
-        TM_STORE(&set->buckets[i], TM_LOAD(&b->next));
+        TM_STORE(&buckets[i], TM_LOAD(&b->next));
       } else {
         TM_STORE(&prev->next, TM_LOAD(&b->next));
       }
       /* Free memory (delayed until commit) */
       TM_FREE2(b, sizeof(bucket_t));
     }
+    TM_COUNT(td, -(result != 0));
     TM_COMMIT;
   }
 
@@ -1304,6 +1406,41 @@ static void barrier_cross(barrier_t *b)
   pthread_mutex_unlock(&b->mutex);
 }
 
+/* ################################################################### *
+ * COUNTS
+ * ################################################################### */
+
+/* Slots of the counts of -k in the pool, their sum is the set size even after a crash */
+static long *count_open()
+{
+  if (root->obj_root[1] == 0) {
+    TX_BEGIN(pool) {
+      pmemobj_tx_add_range_direct(&root->obj_root[1], sizeof(nv_ptr));
+      root->obj_root[1] = pmemobj_tx_zalloc(COUNT_SLOTS * COUNT_STRIDE * sizeof(long), TYPE_COUNT).off;
+    }TX_END
+  }
+  return (long *)nv_to_ptr(root->obj_root[1]);
+}
+
+static long count_sum(long *count)
+{
+  long sum = 0;
+
+  for (int i = 0; i < COUNT_SLOTS; i++)
+    sum += count[i * COUNT_STRIDE];
+  return sum;
+}
+
+/* Written in the pool by PMDK: no transaction may run */
+static void count_reset(long *count, long size)
+{
+  TX_BEGIN(pool) {
+    pmemobj_tx_add_range_direct(count, COUNT_SLOTS * COUNT_STRIDE * sizeof(long));
+    memset(count, 0, COUNT_SLOTS * COUNT_STRIDE * sizeof(long));
+    count[0] = size;
+  }TX_END
+}
+
 /* ################################################################### *
  * STRESS TEST
  * ################################################################### */
@@ -1395,6 +1532,11 @@ static void *test(void *data)
   stm_get_stats("locked_reads_ok", &d->locked_reads_ok);
   stm_get_stats("locked_reads_failed", &d->locked_reads_failed);
   stm_get_stats("max_retries", &d->max_retries);
+  /* Left to 0 without NV_STATISTICS */
+  stm_get_stats("nv_log_bytes", &d->nv_log_bytes);
+  stm_get_stats("nv_log_stalls", &d->nv_log_stalls);
+  stm_get_stats("page_misses", &d->page_misses);
+  stm_get_stats("page_stalls", &d->page_stalls);
 #endif /* ! TM_COMPILER */
   /* Free transaction */
   TM_EXIT_THREAD;
@@ -1417,6 +1559,7 @@ int main(int argc, char **argv)
     {"range",                     required_argument, NULL, 'r'},
     {"seed",                      required_argument, NULL, 's'},
     {"update-rate",               required_argument, NULL, 'u'},
+    {"keep-count",                no_argument,       NULL, 'k'},
 #ifdef USE_LINKEDLIST
     {"unit-tx",                   no_argument,       NULL, 'x'},
 #endif /* LINKEDLIST */
@@ -1433,6 +1576,7 @@ int main(int argc, char **argv)
     aborts_validate_read, aborts_validate_write, aborts_validate_commit,
     aborts_invalid_memory, aborts_killed,
     locked_reads_ok, locked_reads_failed, max_retries;
+  uint64_t log_bytes, log_stalls, page_misses, page_stalls;
   stm_ab_stats_t ab_stats;
 #endif /* ! TM_COMPILER */
   thread_data_t *data;
@@ -1448,8 +1592,12 @@ int main(int argc, char **argv)
   int seed = DEFAULT_SEED;
   int update = DEFAULT_UPDATE;
   int alternate = 1;
+  int keep_count = 0;
+  long *count = NULL;
+  int recovered = 0;
 #ifndef TM_COMPILER
   char *cm = NULL;
+  unsigned long recovery_txs, recovery_entries, recovery_ns;
 #endif /* ! TM_COMPILER */
 #ifdef USE_LINKEDLIST
   int unit_tx = 0;
@@ -1462,7 +1610,7 @@ int main(int argc, char **argv)
 #ifndef TM_COMPILER
                     "c:"
 #endif /* ! TM_COMPILER */
-                    "d:i:n:r:s:u:"
+                    "d:i:kn:r:s:u:"
 #ifdef USE_LINKEDLIST
                     "x"
 #endif /* LINKEDLIST */
@@ -1506,6 +1654,8 @@ int main(int argc, char **argv)
               "        Test duration in milliseconds (0=infinite, default=" XSTR(DEFAULT_DURATION) ")\n"
               "  -i, --initial-size <int>\n"
               "        Number of elements to insert before test (default=" XSTR(DEFAULT_INITIAL) ")\n"
+              "  -k, --keep-count\n"
+              "        Count the elements in the pool and check the count after a crash\n"
               "  -n, --num-threads <int>\n"
               "        Number of threads (default=" XSTR(DEFAULT_NB_THREADS) ")\n"
               "  -r, --range <int>\n"
@@ -1534,6 +1684,9 @@ int main(int argc, char **argv)
      case 'i':
        initial = atoi(optarg);
        break;
+     case 'k':
+       keep_count = 1;
+       break;
      case 'n':
        nb_threads = atoi(optarg);
        break;
@@ -1624,6 +1777,11 @@ int main(int argc, char **argv)
 #ifndef TM_COMPILER
   if (stm_get_parameter("compile_flags", &s))
     printf("STM flags    : %s\n", s);
+  if (stm_get_parameter("recovery_txs", &recovery_txs)) {
+    stm_get_parameter("recovery_entries", &recovery_entries);
+    stm_get_parameter("recovery_ns", &recovery_ns);
+    printf("Recovered    : %lu txs, %lu entries (%lu ns)\n", recovery_txs, recovery_entries, recovery_ns);
+  }
 
   if (cm != NULL) {
     if (stm_set_parameter("cm_policy", cm) == 0)
@@ -1633,6 +1791,13 @@ int main(int argc, char **argv)
   if (alternate == 0 && range != initial * 2)
     printf("WARNING: range is not twice the initial set size\n");
 
+  if (keep_count) {
+    count = count_open();
+    size = set_size(set);
+    printf("Recovered size : %d (expected: %ld)\n", size, count_sum(count));
+    recovered = (size != count_sum(count));
+  }
+
   /* Populate set */
   printf("Adding %d entries to set\n", initial);
   i = 0;
@@ -1641,6 +1806,9 @@ int main(int argc, char **argv)
     if (set_add(set, val, 0))
       i++;
   }
+  /* Before the pool is copied into v_pages */
+  if (count != NULL)
+    count_reset(count, set_size(set));
   page_map_init();
   size = set_size(set);
   printf("Set size     : %d\n", size);
@@ -1675,8 +1843,13 @@ int main(int argc, char **argv)
     data[i].locked_reads_ok = 0;
     data[i].locked_reads_failed = 0;
     data[i].max_retries = 0;
+    data[i].nv_log_bytes = 0;
+    data[i].nv_log_stalls = 0;
+    data[i].page_misses = 0;
+    data[i].page_stalls = 0;
 #endif /* ! TM_COMPILER */
     data[i].diff = 0;
+    data[i].count = (count == NULL ? NULL : &count[(i % COUNT_SLOTS) * COUNT_STRIDE]);
     rand_init(data[i].seed);
     data[i].set = set;
     data[i].barrier = &barrier;
@@ -1725,6 +1898,7 @@ int main(int argc, char **argv)
   locked_reads_ok = 0;
   locked_reads_failed = 0;
   max_retries = 0;
+  log_bytes = log_stalls = page_misses = page_stalls = 0;
 #endif /* ! TM_COMPILER */
   reads = 0;
   updates = 0;
@@ -1762,13 +1936,17 @@ int main(int argc, char **argv)
     locked_reads_failed += data[i].locked_reads_failed;
     if (max_retries < data[i].max_retries)
       max_retries = data[i].max_retries;
+    log_bytes += data[i].nv_log_bytes;
+    log_stalls += data[i].nv_log_stalls;
+    page_misses += data[i].page_misses;
+    page_stalls += data[i].page_stalls;
 #endif /* ! TM_COMPILER */
     reads += data[i].nb_contains;
     updates += (data[i].nb_add + data[i].nb_remove);
     size += data[i].diff;
   }
   printf("Set size      : %d (expected: %d)\n", set_size(set), size);
-  ret = (set_size(set) != size);
+  ret = (set_size(set) != size) || recovered;
   printf("Duration      : %d (ms)\n", duration);
   printf("#txs          : %lu (%f / s)\n", reads + updates, (reads + updates) * 1000.0 / duration);
   printf("#read txs     : %lu (%f / s)\n", reads, reads * 1000.0 / duration);
@@ -1787,6 +1965,10 @@ int main(int argc, char **argv)
   printf("#lr-ok        : %lu (%f / s)\n", locked_reads_ok, locked_reads_ok * 1000.0 / duration);
   printf("#lr-failed    : %lu (%f / s)\n", locked_reads_failed, locked_reads_failed * 1000.0 / duration);
   printf("Max retries   : %lu\n", max_retries);
+  printf("#log bytes    : %lu (%f / s)\n", (unsigned long)log_bytes, log_bytes * 1000.0 / duration);
+  printf("#log stalls   : %lu (%f / s)\n", (unsigned long)log_stalls, log_stalls * 1000.0 / duration);
+  printf("#page misses  : %lu (%f / s)\n", (unsigned long)page_misses, page_misses * 1000.0 / duration);
+  printf("#page stalls  : %lu (%f / s)\n", (unsigned long)page_stalls, page_stalls * 1000.0 / duration);
 
   for (i = 0; stm_get_ab_stats(i, &ab_stats) != 0; i++) {
     printf("Atomic block  : %d\n", i);
@@ -1803,6 +1985,8 @@ int main(int argc, char **argv)
 
   /* Delete set */
   set_delete(set);
+  if (root->obj_root[1] != 0)
+    count_reset((long *)nv_to_ptr(root->obj_root[1]), 0);
 
   /* Cleanup STM */
   TM_EXIT;
@@ -1,50 +1,52 @@
-import array
+import json
+import sys
 
 
-def get_inf(a):
+def get_inf(buckets, scale=1):
     sum = num = 0
     min_ = float('inf')
     max_ = float('-inf')
-    for i, num_ in enumerate(a):
+    for value, num_ in buckets:
+        value = value / scale
         num += num_
-        sum += i * num_
-        if num_ != 0 and i < min_:
-            min_ = i
-        if num_ != 0 and i > max_:
-            max_ = i
+        sum += value * num_
+        min_ = min(min_, value)
+        max_ = max(max_, value)
     return sum / num, sum, min_, max_
 
 
-v_log_max = 2000 + 1
-group_size_max = 2000 + 1
-group_commit_max = 1000 + 1
-flush_max = 65 + 1
-delay_max = 10000 + 1
+# JSON lines: config, then per-thread and total snapshots, the last ones are final
+path = sys.argv[1] if len(sys.argv) > 1 else './result.json'
+with open(path) as f:
+    lines = [json.loads(line) for line in f]
 
-v_log_collect = array.array('Q')
-group_size_collect = array.array('Q')
-group_commit_collect = array.array('Q')
-flush_size_collect = array.array('Q')
-delay_time_collect = array.array('Q')
-log_delay_time_collect = array.array('Q')
+config = lines[0]
+assert config['type'] == 'config' and config['version'] == 1
+total = [l for l in lines if l['type'] == 'total' and l['final']][-1]
 
-with open('./result.bin', 'rb') as f:
-    v_log_collect.fromfile(f, v_log_max)
-    group_size_collect.fromfile(f, group_size_max)
-    group_commit_collect.fromfile(f, group_commit_max)
-    flush_size_collect.fromfile(f, flush_max)
-    delay_time_collect.fromfile(f, delay_max)
-    log_delay_time_collect.fromfile(f, delay_max)
+v_log_collect = total['v_log_size']
+group_size_collect = total['group_size']
+group_commit_collect = total['group_commit']
+flush_size_collect = total['flush_size']
+delay_time_collect = total['delay_ns']
+log_delay_time_collect = total['log_delay_ns']
 
 print(get_inf(v_log_collect))
 print(get_inf(group_size_collect))
 print(get_inf(group_commit_collect))
 print(get_inf(flush_size_collect))
-print(get_inf(delay_time_collect))
-print(get_inf(log_delay_time_collect))
+# delays are recorded in nanoseconds and printed in microseconds
+print(get_inf(delay_time_collect, 1000))
+print(get_inf(log_delay_time_collect, 1000))
 
 _, v_log_sum, _, _ = get_inf(v_log_collect)
 _, flush_sum, _, _ = get_inf(flush_size_collect)
-_, log_delay_sum, _, _ = get_inf(log_delay_time_collect)
+_, log_delay_sum, _, _ = get_inf(log_delay_time_collect, 1000)
 print(flush_sum / v_log_sum)
-print(flush_sum / log_delay_sum * 16 * 1000000 / pow(1024, 2))
\ No newline at end of file
+print(flush_sum / log_delay_sum * 16 * 1000000 / pow(1024, 2))
+
+# commits per second between snapshots
+snapshots = [l for l in lines if l['type'] == 'total']
+for prev, cur in zip(snapshots, snapshots[1:]):
+    commits = sum(n for _, n in cur['delay_ns']) - sum(n for _, n in prev['delay_ns'])
+    print('%.0f ms: %.0f commits/s' % (cur['time_ms'], commits * 1000 / (cur['time_ms'] - prev['time_ms'])))
@@ -0,0 +1,1005 @@
+/*
+ * File:
+ *   kv-p.c
+ * Description:
+ *   Persistent key-value store stress test with YCSB-style workloads.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This program has a dual license and can also be distributed
+ * under the terms of the MIT license.
+ */
+
+#include <assert.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "stm.h"
+#include "wrappers.h"
+#include "mod_mem.h"
+#include "mod_ab.h"
+
+#define RO                              1
+#define RW                              0
+
+/*
+ * Useful macros to work with transactions. Note that, to use nested
+ * transactions, one should check the environment returned by
+ * stm_get_env() and only call sigsetjmp() if it is not null.
+ */
+#define TM_START(tid, ro)               { stm_tx_attr_t _a = {{.id = tid, .read_only = ro}}; \
+                                          sigjmp_buf *_e = stm_start(_a); \
+                                          if (_e != NULL) sigsetjmp(*_e, 0);
+#define TM_LOAD(addr)                   stm_load((stm_word_t *)ptr_to_nv(addr))
+#define TM_STORE(addr, value)           stm_store((stm_word_t *)ptr_to_nv(addr), (stm_word_t)value)
+#define TM_LOAD_BYTES(addr, buf, size)  stm_load_bytes((volatile uint8_t *)ptr_to_nv(addr), buf, size)
+#define TM_STORE_BYTES(addr, buf, size) stm_store_bytes((volatile uint8_t *)ptr_to_nv(addr), buf, size)
+#define TM_COMMIT                       stm_commit(); }
+#define TM_MALLOC(size, type_num)       stm_malloc(size, type_num, pool)
+#define TM_FREE2(addr, size)            stm_free(addr, size, pool)
+
+#define TM_INIT                         stm_init(); mod_mem_init(0); mod_ab_init(0, NULL)
+#define TM_EXIT                         stm_exit()
+#define TM_INIT_THREAD                  stm_init_thread()
+#define TM_EXIT_THREAD                  stm_exit_thread()
+
+#ifdef DEBUG
+# define IO_FLUSH                       fflush(NULL)
+/* Note: stdio is thread-safe */
+#endif
+
+#define DEFAULT_DURATION                10000
+#define DEFAULT_RECORDS                 10000
+#define DEFAULT_BUCKETS_LOG             16
+#define DEFAULT_NB_THREADS              1
+#define DEFAULT_SCAN_LENGTH             100
+#define DEFAULT_SEED                    0
+#define DEFAULT_VALUE_SIZE              256
+#define DEFAULT_WORKLOAD                'a'
+#define DEFAULT_ZIPF                    0.99
+#define DEFAULT_CHECKPOINT              0
+#define DEFAULT_CHECKPOINT_RATE         0
+
+#define CHECKPOINT_FILE                 "kv-p.ckpt"
+
+#define MAX_VALUE_SIZE                  65536
+
+#define XSTR(s)                         STR(s)
+#define STR(s)                          #s
+
+/* ################################################################### *
+ * GLOBALS
+ * ################################################################### */
+
+static volatile int stop;
+static unsigned short main_seed[3];
+static PMEMobjpool *pool;
+
+struct root {
+  nv_ptr obj_root[127];
+  uint64_t root_num;
+
+  nv_ptr persist_block;
+  nv_ptr reproduce_block;
+  uint64_t persist_timestamp;
+  uint64_t reproduce_timestamp;
+};
+
+struct root *root;
+
+/* Next key to insert, shared by all threads */
+static volatile long next_key;
+
+/* Checkpoints written while the threads run */
+typedef struct checkpoint_data {
+  int period;
+  unsigned int rate;
+  unsigned long nb;
+  unsigned long pages;
+  unsigned long ms;
+} checkpoint_data_t;
+
+static inline void rand_init(unsigned short *seed)
+{
+  seed[0] = (unsigned short)rand();
+  seed[1] = (unsigned short)rand();
+  seed[2] = (unsigned short)rand();
+}
+
+static inline int rand_range(int n, unsigned short *seed)
+{
+  /* Return a random number in range [0;n) */
+  int v = (int)(erand48(seed) * n);
+  assert (v >= 0 && v < n);
+  return v;
+}
+
+/* ################################################################### *
+ * ZIPF
+ * ################################################################### */
+
+/* YCSB zipfian generator (Gray et al., "Quickly generating billion-record
+ * synthetic databases"), rank 0 is the most popular item */
+typedef struct zipf {
+  long items;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+} zipf_t;
+
+static double zeta(long n, double theta)
+{
+  double sum = 0;
+  long i;
+
+  for (i = 1; i <= n; i++)
+    sum += 1.0 / pow((double)i, theta);
+  return sum;
+}
+
+static void zipf_init(zipf_t *z, long items, double theta)
+{
+  z->items = items;
+  z->theta = theta;
+  if (theta == 0)
+    return;
+  z->zetan = zeta(items, theta);
+  z->alpha = 1.0 / (1.0 - theta);
+  z->eta = (1.0 - pow(2.0 / items, 1.0 - theta)) / (1.0 - zeta(2, theta) / z->zetan);
+}
+
+static long zipf_next(zipf_t *z, unsigned short *seed)
+{
+  double u, uz;
+  long v;
+
+  if (z->theta == 0)
+    return rand_range(z->items, seed);
+  u = erand48(seed);
+  uz = u * z->zetan;
+  if (uz < 1.0)
+    return 0;
+  if (uz < 1.0 + pow(0.5, z->theta))
+    return 1;
+  v = (long)(z->items * pow(z->eta * u - z->eta + 1.0, z->alpha));
+  return v < z->items ? v : z->items - 1;
+}
+
+/* ################################################################### *
+ * LATENCY
+ * ################################################################### */
+
+/* Log-linear buckets: values below LAT_SUB are exact, larger ones keep
+ * LAT_SUB_BITS bits after the leading one */
+#define LAT_SUB_BITS                    4
+#define LAT_SUB                         (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS                     ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+enum {
+  OP_READ,
+  OP_UPDATE,
+  OP_INSERT,
+  OP_SCAN,
+  OP_RMW,
+  OP_NB
+};
+
+static const char *op_names[OP_NB] = {"read", "update", "insert", "scan", "rmw"};
+
+static inline uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline unsigned int lat_index(uint64_t value)
+{
+  unsigned int shift;
+
+  if (value < LAT_SUB)
+    return value;
+  shift = 63 - __builtin_clzll(value) - LAT_SUB_BITS;
+  return (shift + 1) * LAT_SUB + (value >> shift) - LAT_SUB;
+}
+
+static inline uint64_t lat_value(unsigned int index)
+{
+  if (index < LAT_SUB)
+    return index;
+  return (uint64_t)(LAT_SUB + index % LAT_SUB) << (index / LAT_SUB - 1);
+}
+
+static uint64_t lat_percentile(const uint64_t *hist, unsigned long count, int p)
+{
+  unsigned long seen = 0;
+  unsigned int i;
+
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen * 100 >= count * p && seen > 0)
+      return lat_value(i);
+  }
+  return 0;
+}
+
+/* ################################################################### *
+ * KEY-VALUE STORE
+ * ################################################################### */
+
+enum {
+  TYPE_TABLE = 2,
+  TYPE_BUCKETS,
+  TYPE_ENTRY,
+  TYPE_VALUE
+};
+
+/* Chained hash table, the value blob is a separate object so that its
+ * size can change on update */
+typedef struct entry {
+  long key;
+  nv_ptr next;
+  nv_ptr value;
+  long size;
+} entry_t;
+
+typedef struct kv {
+  nv_ptr buckets;
+  long nb_buckets;
+} kv_t;
+
+static inline long kv_hash(kv_t *kv, long key)
+{
+  /* Knuth's multiplicative hash function */
+  return ((uint64_t)key * 11400714819323198485ULL) >> (64 - __builtin_ctzl(kv->nb_buckets));
+}
+
+static kv_t *kv_new(int buckets_log)
+{
+  kv_t *kv;
+
+  pool = pool_init("kv-p.pool");
+  PMEMoid Root = pmemobj_root(pool, sizeof(struct root));
+  root = pmemobj_direct(Root);
+  if (root->obj_root[0] != 0) return (kv_t *)nv_to_ptr(root->obj_root[0]);
+
+  TX_BEGIN(pool) {
+    kv = (kv_t *)pmemobj_direct(pmemobj_tx_zalloc(sizeof(kv_t), TYPE_TABLE));
+    kv->nb_buckets = 1L << buckets_log;
+    /* Array of bucket heads, immutable once allocated */
+    kv->buckets = ptr_to_nv(pmemobj_direct(pmemobj_tx_zalloc(kv->nb_buckets * sizeof(nv_ptr), TYPE_BUCKETS)));
+
+    pmemobj_tx_add_range_direct(&root->obj_root[0], sizeof(nv_ptr));
+    root->obj_root[0] = ptr_to_nv(kv);
+  }TX_END
+
+  return kv;
+}
+
+/* Value of a record: the key, a version and a filler derived from both */
+static void value_fill(uint8_t *buf, long key, long version, long size)
+{
+  long i;
+
+  ((long *)buf)[0] = key;
+  ((long *)buf)[1] = version;
+  for (i = 2 * sizeof(long); i < size; i++)
+    buf[i] = (uint8_t)(key + version + i);
+}
+
+static inline long value_size(long max, unsigned short *seed)
+{
+  /* Word multiple in [2 words;max] */
+  long words = max / sizeof(long);
+  return (2 + rand_range(words - 1, seed)) * sizeof(long);
+}
+
+/* Load phase, before the STM maps the pool */
+static void kv_load(kv_t *kv, long key, long size)
+{
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(kv->buckets);
+  long i = kv_hash(kv, key);
+  entry_t *e;
+  uint8_t *v;
+
+  TX_BEGIN(pool) {
+    e = (entry_t *)pmemobj_direct(pmemobj_tx_zalloc(sizeof(entry_t), TYPE_ENTRY));
+    v = (uint8_t *)pmemobj_direct(pmemobj_tx_alloc(size, TYPE_VALUE));
+    value_fill(v, key, 0, size);
+    e->key = key;
+    e->size = size;
+    e->value = ptr_to_nv(v);
+    e->next = buckets[i];
+    pmemobj_tx_add_range_direct(&buckets[i], sizeof(nv_ptr));
+    buckets[i] = ptr_to_nv(e);
+  }TX_END
+}
+
+/* Number of records and first free key, walking the whole table */
+static long kv_count(kv_t *kv, long *max_key, long *bad)
+{
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(kv->buckets);
+  long i, count = 0;
+  entry_t *e;
+
+  *max_key = -1;
+  *bad = 0;
+  for (i = 0; i < kv->nb_buckets; i++) {
+    for (e = (entry_t *)nv_to_ptr(buckets[i]); e != NULL; e = (entry_t *)nv_to_ptr(e->next)) {
+      count++;
+      if (e->key > *max_key)
+        *max_key = e->key;
+      if (*(long *)nv_to_ptr(e->value) != e->key)
+        (*bad)++;
+    }
+  }
+
+  return count;
+}
+
+/* Must be called in a transaction */
+static entry_t *kv_lookup(kv_t *kv, long key)
+{
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(kv->buckets);
+  entry_t *e;
+
+  e = (entry_t *)nv_to_ptr(TM_LOAD(&buckets[kv_hash(kv, key)]));
+  while (e != NULL && TM_LOAD(&e->key) != key)
+    e = (entry_t *)nv_to_ptr(TM_LOAD(&e->next));
+  return e;
+}
+
+static int kv_read(kv_t *kv, long key, uint8_t *buf)
+{
+  entry_t *e;
+  long size;
+  int result;
+
+  TM_START(OP_READ, RO);
+  result = 0;
+  if ((e = kv_lookup(kv, key)) != NULL) {
+    size = TM_LOAD(&e->size);
+    TM_LOAD_BYTES(nv_to_ptr(TM_LOAD(&e->value)), buf, size);
+    result = 1;
+  }
+  TM_COMMIT;
+
+  return result && ((long *)buf)[0] == key;
+}
+
+static int kv_update(kv_t *kv, long key, uint8_t *buf, long size)
+{
+  entry_t *e;
+  uint8_t *v;
+  long old;
+  int result;
+
+  TM_START(OP_UPDATE, RW);
+  result = 0;
+  if ((e = kv_lookup(kv, key)) != NULL) {
+    v = (uint8_t *)nv_to_ptr(TM_LOAD(&e->value));
+    old = TM_LOAD(&e->size);
+    if (old != size) {
+      /* Free memory (delayed until commit) */
+      TM_FREE2(v, old);
+      v = (uint8_t *)TM_MALLOC(size, TYPE_VALUE);
+      TM_STORE(&e->value, ptr_to_nv(v));
+      TM_STORE(&e->size, size);
+    }
+    TM_STORE_BYTES(v, buf, size);
+    result = 1;
+  }
+  TM_COMMIT;
+
+  return result;
+}
+
+static int kv_insert(kv_t *kv, long key, uint8_t *buf, long size)
+{
+  nv_ptr *buckets = (nv_ptr *)nv_to_ptr(kv->buckets);
+  long i = kv_hash(kv, key);
+  entry_t *e;
+  uint8_t *v;
+
+  TM_START(OP_INSERT, RW);
+  e = (entry_t *)TM_MALLOC(sizeof(entry_t), TYPE_ENTRY);
+  v = (uint8_t *)TM_MALLOC(size, TYPE_VALUE);
+  TM_STORE_BYTES(v, buf, size);
+  TM_STORE(&e->key, key);
+  TM_STORE(&e->size, size);
+  TM_STORE(&e->value, ptr_to_nv(v));
+  TM_STORE(&e->next, TM_LOAD(&buckets[i]));
+  TM_STORE(&buckets[i], ptr_to_nv(e));
+  TM_COMMIT;
+
+  return 1;
+}
+
+static int kv_scan(kv_t *kv, long key, long length, uint8_t *buf)
+{
+  entry_t *e;
+  long k, size;
+  int found;
+
+  /* Consecutive keys in one transaction, the table is not ordered */
+  TM_START(OP_SCAN, RO);
+  found = 0;
+  for (k = key; k < key + length; k++) {
+    if ((e = kv_lookup(kv, k)) != NULL) {
+      size = TM_LOAD(&e->size);
+      TM_LOAD_BYTES(nv_to_ptr(TM_LOAD(&e->value)), buf, size);
+      found++;
+    }
+  }
+  TM_COMMIT;
+
+  return found;
+}
+
+static int kv_rmw(kv_t *kv, long key, uint8_t *buf)
+{
+  entry_t *e;
+  uint8_t *v;
+  long size;
+  int result;
+
+  TM_START(OP_RMW, RW);
+  result = 0;
+  if ((e = kv_lookup(kv, key)) != NULL) {
+    v = (uint8_t *)nv_to_ptr(TM_LOAD(&e->value));
+    size = TM_LOAD(&e->size);
+    TM_LOAD_BYTES(v, buf, size);
+    /* Bump the version only */
+    ((long *)buf)[1]++;
+    TM_STORE(&((long *)v)[1], ((long *)buf)[1]);
+    result = 1;
+  }
+  TM_COMMIT;
+
+  return result;
+}
+
+/* ################################################################### *
+ * BARRIER
+ * ################################################################### */
+
+typedef struct barrier {
+  pthread_cond_t complete;
+  pthread_mutex_t mutex;
+  int count;
+  int crossing;
+} barrier_t;
+
+static void barrier_init(barrier_t *b, int n)
+{
+  pthread_cond_init(&b->complete, NULL);
+  pthread_mutex_init(&b->mutex, NULL);
+  b->count = n;
+  b->crossing = 0;
+}
+
+static void barrier_cross(barrier_t *b)
+{
+  pthread_mutex_lock(&b->mutex);
+  /* One more thread through */
+  b->crossing++;
+  /* If not all here, wait */
+  if (b->crossing < b->count) {
+    pthread_cond_wait(&b->complete, &b->mutex);
+  } else {
+    pthread_cond_broadcast(&b->complete);
+    /* Reset for next time */
+    b->crossing = 0;
+  }
+  pthread_mutex_unlock(&b->mutex);
+}
+
+/* ################################################################### *
+ * STRESS TEST
+ * ################################################################### */
+
+/* Percentage of each operation in a YCSB workload */
+typedef struct mix {
+  char name;
+  int pct[OP_NB];
+} mix_t;
+
+static const mix_t mixes[] = {
+  /*        read update insert scan rmw */
+  { 'a', {  50,  50,    0,     0,   0 } },
+  { 'b', {  95,   5,    0,     0,   0 } },
+  { 'c', { 100,   0,    0,     0,   0 } },
+  { 'e', {   0,   0,    5,    95,   0 } },
+  { 'f', {  50,   0,    0,     0,  50 } },
+};
+
+typedef struct thread_data {
+  kv_t *kv;
+  zipf_t *zipf;
+  const mix_t *mix;
+  struct barrier *barrier;
+  long value_size;
+  long scan_length;
+  unsigned long nb_ops[OP_NB];
+  unsigned long nb_failed;
+  unsigned long nb_aborts;
+  uint64_t nv_log_bytes;
+  uint64_t nv_log_stalls;
+  uint64_t page_misses;
+  uint64_t page_stalls;
+  uint64_t hist[OP_NB][LAT_BUCKETS];
+  uint64_t lat_sum[OP_NB];
+  uint64_t lat_max[OP_NB];
+  unsigned short seed[3];
+  char padding[64];
+} thread_data_t;
+
+static void *test(void *data)
+{
+  thread_data_t *d = (thread_data_t *)data;
+  uint8_t *buf;
+  uint64_t start, lat;
+  long key, size;
+  int op, r, ok;
+
+  if ((buf = (uint8_t *)malloc(MAX_VALUE_SIZE)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  /* Create transaction */
+  TM_INIT_THREAD;
+  /* Wait on barrier */
+  barrier_cross(d->barrier);
+
+  while (stop == 0) {
+    r = rand_range(100, d->seed);
+    for (op = 0; op < OP_NB - 1 && r >= d->mix->pct[op]; op++)
+      r -= d->mix->pct[op];
+    key = zipf_next(d->zipf, d->seed);
+    start = now_ns();
+    switch (op) {
+      case OP_READ:
+        ok = kv_read(d->kv, key, buf);
+        break;
+      case OP_UPDATE:
+        size = value_size(d->value_size, d->seed);
+        value_fill(buf, key, 0, size);
+        ok = kv_update(d->kv, key, buf, size);
+        break;
+      case OP_INSERT:
+        key = __sync_fetch_and_add(&next_key, 1);
+        size = value_size(d->value_size, d->seed);
+        value_fill(buf, key, 0, size);
+        ok = kv_insert(d->kv, key, buf, size);
+        break;
+      case OP_SCAN:
+        ok = kv_scan(d->kv, key, 1 + rand_range(d->scan_length, d->seed), buf) > 0;
+        break;
+      default:
+        ok = kv_rmw(d->kv, key, buf);
+        break;
+    }
+    lat = now_ns() - start;
+    d->hist[op][lat_index(lat)]++;
+    d->lat_sum[op] += lat;
+    if (lat > d->lat_max[op])
+      d->lat_max[op] = lat;
+    d->nb_ops[op]++;
+    if (!ok)
+      d->nb_failed++;
+  }
+  stm_get_stats("nb_aborts", &d->nb_aborts);
+  /* Left to 0 without NV_STATISTICS */
+  stm_get_stats("nv_log_bytes", &d->nv_log_bytes);
+  stm_get_stats("nv_log_stalls", &d->nv_log_stalls);
+  stm_get_stats("page_misses", &d->page_misses);
+  stm_get_stats("page_stalls", &d->page_stalls);
+  /* Free transaction */
+  TM_EXIT_THREAD;
+
+  free(buf);
+  return NULL;
+}
+
+/* Incremental images of the pool to CHECKPOINT_FILE every period */
+static void *checkpoint(void *arg)
+{
+  checkpoint_data_t *d = (checkpoint_data_t *)arg;
+  struct timespec period, start, end;
+  uint64_t since = 0, timestamp;
+  int pages;
+
+  period.tv_sec = d->period / 1000;
+  period.tv_nsec = (d->period % 1000) * 1000000;
+  TM_INIT_THREAD;
+  while (!stop) {
+    nanosleep(&period, NULL);
+    if (stop)
+      break;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pages = stm_checkpoint(CHECKPOINT_FILE, since, d->rate, &timestamp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (pages < 0) {
+      perror("stm_checkpoint");
+      break;
+    }
+    d->nb++;
+    d->pages += pages;
+    d->ms += (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    since = timestamp;
+  }
+  TM_EXIT_THREAD;
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  struct option long_options[] = {
+    // These options don't set a flag
+    {"help",                      no_argument,       NULL, 'h'},
+    {"buckets",                   required_argument, NULL, 'b'},
+    {"contention-manager",        required_argument, NULL, 'c'},
+    {"duration",                  required_argument, NULL, 'd'},
+    {"checkpoint",                required_argument, NULL, 'k'},
+    {"checkpoint-rate",           required_argument, NULL, 'K'},
+    {"scan-length",               required_argument, NULL, 'l'},
+    {"num-threads",               required_argument, NULL, 'n'},
+    {"records",                   required_argument, NULL, 'r'},
+    {"seed",                      required_argument, NULL, 's'},
+    {"value-size",                required_argument, NULL, 'v'},
+    {"workload",                  required_argument, NULL, 'w'},
+    {"zipf",                      required_argument, NULL, 'z'},
+    {NULL, 0, NULL, 0}
+  };
+
+  kv_t *kv;
+  zipf_t zipf;
+  const mix_t *mix;
+  int i, j, c, ret;
+  long records, loaded, inserts, max_key, bad;
+  unsigned long ops, failed, aborts, count;
+  uint64_t log_bytes, log_stalls, page_misses, page_stalls, sum, max;
+  uint64_t *hist;
+  unsigned long recovery_txs, recovery_entries, recovery_ns;
+  char *cm = NULL;
+  const char *s;
+  thread_data_t *data;
+  pthread_t *threads, checkpointer;
+  checkpoint_data_t ckpt;
+  pthread_attr_t attr;
+  barrier_t barrier;
+  struct timeval start, end;
+  struct timespec timeout;
+  int buckets_log = DEFAULT_BUCKETS_LOG;
+  int duration = DEFAULT_DURATION;
+  int nb_threads = DEFAULT_NB_THREADS;
+  long nb_records = DEFAULT_RECORDS;
+  long scan_length = DEFAULT_SCAN_LENGTH;
+  int seed = DEFAULT_SEED;
+  long value_max = DEFAULT_VALUE_SIZE;
+  char workload = DEFAULT_WORKLOAD;
+  double theta = DEFAULT_ZIPF;
+  int checkpoint_period = DEFAULT_CHECKPOINT;
+  unsigned int checkpoint_rate = DEFAULT_CHECKPOINT_RATE;
+  sigset_t block_set;
+
+  while(1) {
+    i = 0;
+    c = getopt_long(argc, argv, "hb:c:d:k:K:l:n:r:s:v:w:z:", long_options, &i);
+
+    if(c == -1)
+      break;
+
+    if(c == 0 && long_options[i].flag == 0)
+      c = long_options[i].val;
+
+    switch(c) {
+     case 0:
+       /* Flag is automatically set */
+       break;
+     case 'h':
+       printf("kv-p -- persistent key-value stress test\n"
+              "\n"
+              "Usage:\n"
+              "  kv-p [options...]\n"
+              "\n"
+              "Options:\n"
+              "  -h, --help\n"
+              "        Print this message\n"
+              "  -b, --buckets <int>\n"
+              "        Log2 of the number of hash buckets (default=" XSTR(DEFAULT_BUCKETS_LOG) ")\n"
+              "  -c, --contention-manager <string>\n"
+              "        Contention manager for resolving conflicts (default=suicide)\n"
+              "  -d, --duration <int>\n"
+              "        Test duration in milliseconds (0=infinite, default=" XSTR(DEFAULT_DURATION) ")\n"
+              "  -k, --checkpoint <int>\n"
+              "        Milliseconds between incremental images of the pool to " CHECKPOINT_FILE " (0=none, default=" XSTR(DEFAULT_CHECKPOINT) ")\n"
+              "  -K, --checkpoint-rate <int>\n"
+              "        Bandwidth of the image in MB/s (0=unlimited, default=" XSTR(DEFAULT_CHECKPOINT_RATE) ")\n"
+              "  -l, --scan-length <int>\n"
+              "        Maximum number of records read by a scan (default=" XSTR(DEFAULT_SCAN_LENGTH) ")\n"
+              "  -n, --num-threads <int>\n"
+              "        Number of threads (default=" XSTR(DEFAULT_NB_THREADS) ")\n"
+              "  -r, --records <int>\n"
+              "        Number of records loaded in an empty pool (default=" XSTR(DEFAULT_RECORDS) ")\n"
+              "  -s, --seed <int>\n"
+              "        RNG seed (0=time-based, default=" XSTR(DEFAULT_SEED) ")\n"
+              "  -v, --value-size <int>\n"
+              "        Maximum value size in bytes, sizes are uniform from 16 (default=" XSTR(DEFAULT_VALUE_SIZE) ")\n"
+              "  -w, --workload <a|b|c|e|f>\n"
+              "        YCSB mix: a=50/50 read/update, b=95/5 read/update, c=read only,\n"
+              "        e=95/5 scan/insert, f=50/50 read/read-modify-write (default=a)\n"
+              "  -z, --zipf <double>\n"
+              "        Zipfian constant of key popularity (0=uniform, default=" XSTR(DEFAULT_ZIPF) ")\n"
+         );
+       exit(0);
+     case 'b':
+       buckets_log = atoi(optarg);
+       break;
+     case 'c':
+       cm = optarg;
+       break;
+     case 'd':
+       duration = atoi(optarg);
+       break;
+     case 'k':
+       checkpoint_period = atoi(optarg);
+       break;
+     case 'K':
+       checkpoint_rate = atoi(optarg);
+       break;
+     case 'l':
+       scan_length = atol(optarg);
+       break;
+     case 'n':
+       nb_threads = atoi(optarg);
+       break;
+     case 'r':
+       nb_records = atol(optarg);
+       break;
+     case 's':
+       seed = atoi(optarg);
+       break;
+     case 'v':
+       value_max = atol(optarg);
+       break;
+     case 'w':
+       workload = optarg[0];
+       break;
+     case 'z':
+       theta = atof(optarg);
+       break;
+     case '?':
+       printf("Use -h or --help for help\n");
+       exit(0);
+     default:
+       exit(1);
+    }
+  }
+
+  mix = NULL;
+  for (i = 0; i < (int)(sizeof(mixes) / sizeof(mixes[0])); i++) {
+    if (mixes[i].name == workload)
+      mix = &mixes[i];
+  }
+  assert(mix != NULL);
+  assert(duration >= 0);
+  assert(nb_threads > 0);
+  assert(nb_records > 1);
+  assert(buckets_log > 0 && buckets_log < 32);
+  assert(scan_length > 0);
+  assert(value_max >= 2 * (long)sizeof(long) && value_max <= MAX_VALUE_SIZE);
+  assert(theta >= 0 && theta < 1);
+  assert(checkpoint_period >= 0);
+
+  printf("Workload     : %c\n", workload);
+  printf("CM           : %s\n", (cm == NULL ? "DEFAULT" : cm));
+  printf("Duration     : %d\n", duration);
+  printf("Nb threads   : %d\n", nb_threads);
+  printf("Records      : %ld\n", nb_records);
+  printf("Buckets      : %ld\n", 1L << buckets_log);
+  printf("Value size   : %ld\n", value_max);
+  printf("Scan length  : %ld\n", scan_length);
+  printf("Zipf         : %f\n", theta);
+  printf("Seed         : %d\n", seed);
+  printf("Checkpoint   : %d\n", checkpoint_period);
+
+  timeout.tv_sec = duration / 1000;
+  timeout.tv_nsec = (duration % 1000) * 1000000;
+
+  if ((data = (thread_data_t *)calloc(nb_threads, sizeof(thread_data_t))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  if ((threads = (pthread_t *)malloc(nb_threads * sizeof(pthread_t))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  if (seed == 0)
+    srand((int)time(NULL));
+  else
+    srand(seed);
+
+  kv = kv_new(buckets_log);
+
+  stop = 0;
+
+  /* Thread-local seed for main thread */
+  rand_init(main_seed);
+
+  /* Init STM */
+  printf("Initializing STM\n");
+  TM_INIT;
+
+  if (stm_get_parameter("compile_flags", &s))
+    printf("STM flags    : %s\n", s);
+  if (stm_get_parameter("recovery_txs", &recovery_txs)) {
+    stm_get_parameter("recovery_entries", &recovery_entries);
+    stm_get_parameter("recovery_ns", &recovery_ns);
+    printf("Recovered    : %lu txs, %lu entries (%lu ns)\n", recovery_txs, recovery_entries, recovery_ns);
+  }
+
+  if (cm != NULL) {
+    if (stm_set_parameter("cm_policy", cm) == 0)
+      printf("WARNING: cannot set contention manager \"%s\"\n", cm);
+  }
+
+  /* Load records in an empty pool, reuse the records of an existing one */
+  records = kv_count(kv, &max_key, &bad);
+  if (records == 0) {
+    printf("Loading %ld records\n", nb_records);
+    for (i = 0; i < nb_records; i++)
+      kv_load(kv, i, value_size(value_max, main_seed));
+    records = nb_records;
+    max_key = nb_records - 1;
+  } else {
+    printf("Restarting with %ld records (%ld corrupted)\n", records, bad);
+  }
+  /* Pages of the last run first, copied before any transaction */
+  gettimeofday(&start, NULL);
+  page_map_init();
+  gettimeofday(&end, NULL);
+  printf("Page map     : %ld (ms)\n", (end.tv_sec * 1000 + end.tv_usec / 1000) - (start.tv_sec * 1000 + start.tv_usec / 1000));
+  next_key = max_key + 1;
+  loaded = records;
+
+  /* Popularity over the keys present at start */
+  printf("Computing zipf constants\n");
+  zipf_init(&zipf, next_key, theta);
+
+  /* Access store from all threads */
+  barrier_init(&barrier, nb_threads + 1);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  for (i = 0; i < nb_threads; i++) {
+    printf("Creating thread %d\n", i);
+    data[i].kv = kv;
+    data[i].zipf = &zipf;
+    data[i].mix = mix;
+    data[i].value_size = value_max;
+    data[i].scan_length = scan_length;
+    rand_init(data[i].seed);
+    data[i].barrier = &barrier;
+    if (pthread_create(&threads[i], &attr, test, (void *)(&data[i])) != 0) {
+      fprintf(stderr, "Error creating thread\n");
+      exit(1);
+    }
+  }
+  memset(&ckpt, 0, sizeof(ckpt));
+  ckpt.period = checkpoint_period;
+  ckpt.rate = checkpoint_rate;
+  if (checkpoint_period > 0 && pthread_create(&checkpointer, &attr, checkpoint, (void *)&ckpt) != 0) {
+    fprintf(stderr, "Error creating thread\n");
+    exit(1);
+  }
+  pthread_attr_destroy(&attr);
+
+  /* Start threads */
+  barrier_cross(&barrier);
+
+  printf("STARTING...\n");
+  gettimeofday(&start, NULL);
+  if (duration > 0) {
+    nanosleep(&timeout, NULL);
+  } else {
+    sigemptyset(&block_set);
+    sigsuspend(&block_set);
+  }
+  stop = 1;
+  gettimeofday(&end, NULL);
+  printf("STOPPING...\n");
+
+  /* Wait for thread completion */
+  for (i = 0; i < nb_threads; i++) {
+    if (pthread_join(threads[i], NULL) != 0) {
+      fprintf(stderr, "Error waiting for thread completion\n");
+      exit(1);
+    }
+  }
+  if (checkpoint_period > 0 && pthread_join(checkpointer, NULL) != 0) {
+    fprintf(stderr, "Error waiting for thread completion\n");
+    exit(1);
+  }
+
+  duration = (end.tv_sec * 1000 + end.tv_usec / 1000) - (start.tv_sec * 1000 + start.tv_usec / 1000);
+  ops = failed = aborts = 0;
+  log_bytes = log_stalls = page_misses = page_stalls = 0;
+  for (i = 0; i < nb_threads; i++) {
+    for (j = 0; j < OP_NB; j++)
+      ops += data[i].nb_ops[j];
+    failed += data[i].nb_failed;
+    aborts += data[i].nb_aborts;
+    log_bytes += data[i].nv_log_bytes;
+    log_stalls += data[i].nv_log_stalls;
+    page_misses += data[i].page_misses;
+    page_stalls += data[i].page_stalls;
+  }
+  inserts = next_key - (max_key + 1);
+
+  /* Sanity check */
+  records = kv_count(kv, &max_key, &bad);
+  printf("Records       : %ld (expected: %ld)\n", records, loaded + inserts);
+  printf("Corrupted     : %ld\n", bad);
+  ret = (records != loaded + inserts || bad != 0);
+  printf("Duration      : %d (ms)\n", duration);
+  printf("#txs          : %lu (%f / s)\n", ops, ops * 1000.0 / duration);
+  printf("#failed       : %lu (%f / s)\n", failed, failed * 1000.0 / duration);
+  printf("#aborts       : %lu (%f / s)\n", aborts, aborts * 1000.0 / duration);
+  printf("#log bytes    : %lu (%f / s)\n", (unsigned long)log_bytes, log_bytes * 1000.0 / duration);
+  printf("#log stalls   : %lu (%f / s)\n", (unsigned long)log_stalls, log_stalls * 1000.0 / duration);
+  printf("#page misses  : %lu (%f / s)\n", (unsigned long)page_misses, page_misses * 1000.0 / duration);
+  printf("#page stalls  : %lu (%f / s)\n", (unsigned long)page_stalls, page_stalls * 1000.0 / duration);
+  if (ckpt.nb > 0)
+    printf("#checkpoints  : %lu (%lu pages, %lu ms each)\n", ckpt.nb, ckpt.pages / ckpt.nb, ckpt.ms / ckpt.nb);
+
+  /* Latencies per operation, all threads merged in the first one */
+  for (j = 0; j < OP_NB; j++) {
+    count = data[0].nb_ops[j];
+    sum = data[0].lat_sum[j];
+    max = data[0].lat_max[j];
+    for (i = 1; i < nb_threads; i++) {
+      for (c = 0; c < LAT_BUCKETS; c++)
+        data[0].hist[j][c] += data[i].hist[j][c];
+      count += data[i].nb_ops[j];
+      sum += data[i].lat_sum[j];
+      if (max < data[i].lat_max[j])
+        max = data[i].lat_max[j];
+    }
+    if (count == 0)
+      continue;
+    hist = data[0].hist[j];
+    printf("Op %-10s : %lu (%f / s)\n", op_names[j], count, count * 1000.0 / duration);
+    printf("  Mean        : %lu (ns)\n", (unsigned long)(sum / count));
+    printf("  50th perc.  : %lu (ns)\n", (unsigned long)lat_percentile(hist, count, 50));
+    printf("  99th perc.  : %lu (ns)\n", (unsigned long)lat_percentile(hist, count, 99));
+    printf("  Max         : %lu (ns)\n", (unsigned long)max);
+  }
+
+  /* Cleanup STM */
+  TM_EXIT;
+
+  free(threads);
+  free(data);
+
+  return ret;
+}
@@ -5,7 +5,9 @@
  *   Pascal Felber <pascal.felber@unine.ch>
  *   Patrick Marlier <patrick.marlier@unine.ch>
  * Description:
- *   Performance regression test.
+ *   Performance regression test: transactional loads and stores on the
+ *   pool, and the persistent primitives in isolation (page mapping, log
+ *   record and reproduction, allocation, address translation).
  *
  * Copyright (c) 2007-2014.
  *
@@ -25,18 +27,33 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
+/* The primitives are internal to the library: the layout of its
+ * structures depends on its DEFINES, that "make perf" passes along */
+#ifndef DESIGN
+# error "perf is built by make perf from the root directory"
+#endif /* ! DESIGN */
+#define NV_DECLARE_ONLY
 #include "stm.h"
 #include "mod_mem.h"
+#include "stm_internal.h"
 
 /* Increment the value of the global clock (used for timestamps).
  * Hidden to tinySTM users. */
 void stm_inc_clock(void);
 
-__attribute__((aligned(64)))
-stm_word_t global_ctr[1000] = {0};
+#define SAMPLES                         1000
+#define WORDS                           1000    /* Words of the pool read and written by the tx tests */
+#define PAGES                           64      /* Pages of the pool mapped in and out */
+#define BATCH                           64      /* Operations timed together when one is too short */
+#define POOL_FILE                       "perf.pool"
 
-#define MEASURE_NB 1000
+static PMEMobjpool *pool;
+static stm_pool_t *stm_pool;            /* Its page table, v_page ring and log */
+static nv_ptr words;                    /* WORDS words, on pages of their own */
+static nv_ptr pages;                    /* PAGES pages */
+static uint64_t timestamp;              /* Commit timestamps given to nv_log_record() */
 
 static inline uint64_t
 rdtsc(void)
@@ -48,300 +65,296 @@ rdtsc(void)
 
 static int compar(const void *a, const void *b)
 {
-  return *((uint64_t *)a) - *((uint64_t *)b);
+  uint64_t x = *((uint64_t *)a), y = *((uint64_t *)b);
+  return x < y ? -1 : x > y;
 }
 
-static void remove_cst_cost(uint64_t *m, size_t size, uint64_t cost)
+static uint64_t rdtsc_cost(void)
 {
-  size_t i;
-  for (i = 0; i < size; i++) {
-    m[i] -= cost;
+  uint64_t start, cost = ~0UL;
+  unsigned long i;
+
+  for (i = 0; i < SAMPLES; i++) {
+    start = rdtsc();
+    start = rdtsc() - start;
+    if (start < cost)
+      cost = start;
   }
+  return cost;
 }
 
-static void stats(uint64_t *m, size_t size, uint64_t *min, double *avg, uint64_t *median)
+/* Samples are in cycles for div operations, printed per operation */
+static void print_stats(const char *name, uint64_t *m, size_t size, size_t div)
 {
+  uint64_t cost = rdtsc_cost();
   size_t i;
-  /* Find median value */
+
+  for (i = 0; i < size; i++)
+    m[i] = m[i] > cost ? m[i] - cost : 0;
   qsort(m, size, sizeof(uint64_t), compar);
-  *median = m[(size/2)-1];
-  /* Find minimal and calculate average */
-  *min = ~0UL;
-  *avg = 0.0;
-  for (i = 0; i < size; i++) {
-    *avg += m[i];
-    if (m[i] < *min)
-      *min = m[i];
-  }
-  *avg = *avg / size;
+  printf("%20s %12.1f %12.1f %12.1f\n", name, (double)m[0] / div, (double)m[size / 2] / div,
+         (double)m[(size * 99) / 100] / div);
 }
 
-static void test1load(int ro)
+static void print_header(const char *title)
 {
-  uint64_t m_s[MEASURE_NB];
-  uint64_t m_r[MEASURE_NB];
-  uint64_t m_c[MEASURE_NB];
-  uint64_t m_rdtsc;
+  printf("%s\n", title);
+  printf("%20s %12s %12s %12s\n", "", "min", "med", "p99");
+}
+
+/* ################################################################### *
+ * TRANSACTIONS
+ * ################################################################### */
+
+static void testnloadnstore(int ro, size_t load_nb, size_t store_nb)
+{
+  uint64_t m_s[SAMPLES];
+  uint64_t m_r[SAMPLES];
+  uint64_t m_w[SAMPLES];
+  uint64_t m_c[SAMPLES];
   uint64_t start;
-  uint64_t min;
-  double avg;
-  uint64_t med;
+  stm_word_t *w = (stm_word_t *)words;
   unsigned long i;
+  size_t j;
+  char name[64];
   stm_tx_attr_t _a = {{.read_only = ro}};
 
-  m_rdtsc = ~0UL;
-  for (i = 0; i < MEASURE_NB; i++) {
-    start = rdtsc();
-    start = rdtsc() - start;
-    if (start < m_rdtsc)
-      m_rdtsc = start;
-  } 
-
-  for (i = 0; i < MEASURE_NB; i++) {
+  for (i = 0; i < SAMPLES; i++) {
     sigjmp_buf *_e;
     start = rdtsc();
     _e = stm_start(_a);
     m_s[i] = rdtsc() - start;
-    sigsetjmp(*_e, 0); 
-    stm_load(&global_ctr[0]);
-    stm_inc_clock();
-    stm_commit();
-  }
-
-  for (i = 0; i < MEASURE_NB; i++) {
-    sigjmp_buf *_e = stm_start(_a);
-    sigsetjmp(*_e, 0); 
+    sigsetjmp(*_e, 0);
     start = rdtsc();
-    stm_load(&global_ctr[0]);
+    for (j = 0; j < load_nb; j++)
+      stm_load(&w[j]);
     m_r[i] = rdtsc() - start;
-    stm_inc_clock();
-    stm_commit();
-  }
-  
-  for (i = 0; i < MEASURE_NB; i++) {
-    sigjmp_buf *_e = stm_start(_a);
-    sigsetjmp(*_e, 0); 
-    stm_load(&global_ctr[0]);
+    start = rdtsc();
+    for (j = 0; j < store_nb; j++)
+      stm_store(&w[j], (stm_word_t)i);
+    m_w[i] = rdtsc() - start;
+    /* Avoid the commit fast path */
     stm_inc_clock();
     start = rdtsc();
     stm_commit();
     m_c[i] = rdtsc() - start;
   }
- 
-  remove_cst_cost(m_s, MEASURE_NB, m_rdtsc);
-  remove_cst_cost(m_r, MEASURE_NB, m_rdtsc);
-  remove_cst_cost(m_c, MEASURE_NB, m_rdtsc);
 
-  if (ro) 
-    printf("RO transaction - 1 load\n");
+  if (store_nb)
+    snprintf(name, sizeof(name), "RW transaction - %lu load - %lu store", (unsigned long)load_nb, (unsigned long)store_nb);
   else
-    printf("RW transaction - 1 load\n");
-
-  printf("%12s %12s %12s %12s\n", "", "min", "avg", "med");
-  stats(m_s, MEASURE_NB, &min, &avg, &med); 
-  printf("%12s %12lu %12.2f %12lu\n", "start", (unsigned long)min, avg, (unsigned long)med);
-  stats(m_r, MEASURE_NB, &min, &avg, &med); 
-  printf("%12s %12lu %12.2f %12lu\n", "load", (unsigned long)min, avg, (unsigned long)med);
-  stats(m_c, MEASURE_NB, &min, &avg, &med); 
-  printf("%12s %12lu %12.2f %12lu\n", "commit", (unsigned long)min, avg, (unsigned long)med);
+    snprintf(name, sizeof(name), "%s transaction - %lu load", ro ? "RO" : "RW", (unsigned long)load_nb);
+  print_header(name);
+  print_stats("start", m_s, SAMPLES, 1);
+  if (load_nb)
+    print_stats("load", m_r, SAMPLES, load_nb);
+  if (store_nb)
+    print_stats("store", m_w, SAMPLES, store_nb);
+  print_stats("commit", m_c, SAMPLES, 1);
 }
 
-static void testnload(int ro, size_t load_nb)
+/* ################################################################### *
+ * PERSISTENT PRIMITIVES
+ * ################################################################### */
+
+static void testptr(void)
 {
-  uint64_t m_s[MEASURE_NB];
-  uint64_t m_r[MEASURE_NB];
-  uint64_t m_c[MEASURE_NB];
-  uint64_t m_rdtsc;
+  uint64_t m_p[SAMPLES];
+  uint64_t m_n[SAMPLES];
   uint64_t start;
-  uint64_t min;
-  double avg;
-  uint64_t med;
+  volatile nv_ptr nv = words;
+  void *volatile ptr = nv_to_ptr(words);
   unsigned long i;
-  size_t j;
-  stm_tx_attr_t _a = {{.read_only = ro}};
+  int j;
 
-  m_rdtsc = ~0UL;
-  for (i = 0; i < MEASURE_NB; i++) {
+  for (i = 0; i < SAMPLES; i++) {
     start = rdtsc();
-    start = rdtsc() - start;
-    if (start < m_rdtsc)
-      m_rdtsc = start;
-  } 
-
-  for (i = 0; i < MEASURE_NB; i++) {
-    sigjmp_buf *_e;
+    for (j = 0; j < BATCH; j++)
+      ptr = nv_to_ptr(nv);
+    m_p[i] = rdtsc() - start;
     start = rdtsc();
-    _e = stm_start(_a);
-    m_s[i] = rdtsc() - start;
-    sigsetjmp(*_e, 0); 
-    for (j = 0; j < load_nb; j++)
-      stm_load(&global_ctr[j]);
-    stm_inc_clock();
-    stm_commit();
+    for (j = 0; j < BATCH; j++)
+      nv = ptr_to_nv(ptr);
+    m_n[i] = rdtsc() - start;
   }
 
-  for (i = 0; i < MEASURE_NB; i++) {
-    sigjmp_buf *_e = stm_start(_a);
-    sigsetjmp(*_e, 0); 
+  print_header("Address translation");
+  print_stats("nv_to_ptr", m_p, SAMPLES, BATCH);
+  print_stats("ptr_to_nv", m_n, SAMPLES, BATCH);
+}
+
+/* Give the v_page of the nv_page back, as an eviction would: the next
+ * page_use() maps it again on the same v_page.  MAP_INIT code expects all
+ * pages to be mapped, so no other page may be evicted instead */
+static void unmap(nv_ptr nv_addr)
+{
+  page_entry_t *entry = &stm_pool->page->page_table[NV_OFF(nv_addr) >> PAGE_LENGTH];
+
+  if (entry->free_page == NULL)
+    return;
+  entry->free_page->page_inf.vaild = 0;
+  stm_pool->page->free_page_head.head = entry->free_page;
+  entry->free_page = NULL;
+}
+
+/* Log one word of the nv_page without reproducing it, as a committed tx
+ * waiting for nv_log_reproduce() */
+static void dirty(stm_tx_t *tx, nv_ptr nv_addr)
+{
+  v_log_insert(tx, nv_addr, *page_use(tx, nv_addr));
+  page_free(tx, nv_addr, 0);
+  while (nv_log_record(tx, ++timestamp) < 0)
+    nv_log_reproduce(stm_pool);
+  v_log_reset(tx);
+}
+
+static void testpage(void)
+{
+  uint64_t m_h[SAMPLES];
+  uint64_t m_c[SAMPLES];
+  uint64_t m_d[SAMPLES];
+  uint64_t start;
+  stm_tx_t *tx = stm_current_tx();
+  nv_ptr nv_addr;
+  unsigned long i;
+
+  for (i = 0; i < SAMPLES; i++) {
+    nv_addr = pages + (i % PAGES) * PAGE_SIZE;
+    /* Hit: the page is mapped */
     start = rdtsc();
-    for (j = 0; j < load_nb; j++)
-      stm_load(&global_ctr[j]);
-    m_r[i] = rdtsc() - start;
-    stm_inc_clock();
-    stm_commit();
-  }
-  
-  for (i = 0; i < MEASURE_NB; i++) {
-    sigjmp_buf *_e = stm_start(_a);
-    sigsetjmp(*_e, 0); 
-    for (j = 0; j < load_nb; j++)
-      stm_load(&global_ctr[j]);
-    stm_inc_clock();
+    page_use(tx, nv_addr);
+    m_h[i] = rdtsc() - start;
+    page_free(tx, nv_addr, 0);
+    /* Miss, clean: the nv_page is up to date, it is copied */
+    unmap(nv_addr);
     start = rdtsc();
-    stm_commit();
+    page_use(tx, nv_addr);
     m_c[i] = rdtsc() - start;
+    page_free(tx, nv_addr, 0);
+    /* Miss, dirty: the log of the nv_page is reproduced before the copy */
+    dirty(tx, nv_addr);
+    unmap(nv_addr);
+    start = rdtsc();
+    page_use(tx, nv_addr);
+    m_d[i] = rdtsc() - start;
+    page_free(tx, nv_addr, 0);
   }
- 
-  remove_cst_cost(m_s, MEASURE_NB, m_rdtsc);
-  remove_cst_cost(m_r, MEASURE_NB, m_rdtsc);
-  remove_cst_cost(m_c, MEASURE_NB, m_rdtsc);
 
-  if (ro) 
-    printf("RO transaction - %lu load\n", (unsigned long)load_nb);
-  else
-    printf("RW transaction - %lu load\n", (unsigned long)load_nb);
-
-  printf("%12s %12s %12s %12s\n", "", "min", "avg", "med");
-  stats(m_s, MEASURE_NB, &min, &avg, &med); 
-  printf("%12s %12lu %12.2f %12lu\n", "start", (unsigned long)min, avg, (unsigned long)med);
-  stats(m_r, MEASURE_NB, &min, &avg, &med); 
-  if (load_nb)
-    printf("%12s %12lu %12.2f %12lu\n", "load", (unsigned long)min/load_nb, avg/load_nb, (unsigned long)med/load_nb);
-  stats(m_c, MEASURE_NB, &min, &avg, &med); 
-  printf("%12s %12lu %12.2f %12lu\n", "commit", (unsigned long)min, avg, (unsigned long)med);
+  print_header("Page mapping");
+  print_stats("page_use hit", m_h, SAMPLES, 1);
+  print_stats("page_use miss clean", m_c, SAMPLES, 1);
+  print_stats("page_use miss dirty", m_d, SAMPLES, 1);
 }
 
-static void testnloadnstore(size_t load_nb, size_t store_nb)
+/* One word per cache line of the pages: no range records */
+static void testlog(size_t entries)
 {
-  uint64_t m_s[MEASURE_NB];
-  uint64_t m_r[MEASURE_NB];
-  uint64_t m_w[MEASURE_NB];
-  uint64_t m_c[MEASURE_NB];
-  uint64_t m_rdtsc;
+  uint64_t m_l[SAMPLES];
+  uint64_t m_r[SAMPLES];
   uint64_t start;
-  uint64_t min;
-  double avg;
-  uint64_t med;
+  stm_tx_t *tx = stm_current_tx();
+  nv_ptr nv_addr;
   unsigned long i;
   size_t j;
-  stm_tx_attr_t _a = {{.read_only = 0}};
+  char name[32];
 
-  m_rdtsc = ~0UL;
-  for (i = 0; i < MEASURE_NB; i++) {
+  for (i = 0; i < SAMPLES; i++) {
+    for (j = 0; j < entries; j++) {
+      nv_addr = pages + (j * CACHELINE_SIZE) % (PAGES * PAGE_SIZE);
+      v_log_insert(tx, nv_addr, (uint64_t)i);
+    }
     start = rdtsc();
-    start = rdtsc() - start;
-    if (start < m_rdtsc)
-      m_rdtsc = start;
-  } 
-
-  for (i = 0; i < MEASURE_NB; i++) {
-    sigjmp_buf *_e;
+    while (nv_log_record(tx, ++timestamp) < 0)
+      nv_log_reproduce(stm_pool);
+    m_l[i] = rdtsc() - start;
+    v_log_reset(tx);
     start = rdtsc();
-    _e = stm_start(_a);
-    m_s[i] = rdtsc() - start;
-    sigsetjmp(*_e, 0); 
-    for (j = 0; j < load_nb; j++)
-      stm_load(&global_ctr[j]);
-    for (j = 0; j < store_nb; j++)
-      stm_store(&global_ctr[j], (stm_word_t)0);
-    stm_inc_clock();
-    stm_commit();
+    nv_log_reproduce(stm_pool);
+    m_r[i] = rdtsc() - start;
   }
 
-  for (i = 0; i < MEASURE_NB; i++) {
+  snprintf(name, sizeof(name), "Log - %lu entries", (unsigned long)entries);
+  print_header(name);
+  print_stats("nv_log_record", m_l, SAMPLES, 1);
+  print_stats("reproduce / entry", m_r, SAMPLES, entries);
+}
+
+/* Allocation in a tx, then the commit that publishes it */
+static void testmalloc(size_t size)
+{
+  uint64_t m_m[SAMPLES];
+  uint64_t m_c[SAMPLES];
+  uint64_t start;
+  void *addr[SAMPLES];
+  unsigned long i;
+  char name[32];
+  stm_tx_attr_t _a = {{.read_only = 0}};
+
+  for (i = 0; i < SAMPLES; i++) {
     sigjmp_buf *_e = stm_start(_a);
-    sigsetjmp(*_e, 0); 
+    sigsetjmp(*_e, 0);
     start = rdtsc();
-    for (j = 0; j < load_nb; j++)
-      stm_load(&global_ctr[j]);
-    m_r[i] = rdtsc() - start;
-    for (j = 0; j < store_nb; j++)
-      stm_store(&global_ctr[j], (stm_word_t)0);
-    stm_inc_clock();
-    stm_commit();
-  }
-  
-  for (i = 0; i < MEASURE_NB; i++) {
-    sigjmp_buf *_e = stm_start(_a);
-    sigsetjmp(*_e, 0); 
-    for (j = 0; j < load_nb; j++)
-      stm_load(&global_ctr[j]);
+    addr[i] = stm_malloc(size, 0, pool);
+    m_m[i] = rdtsc() - start;
+    stm_store((stm_word_t *)ptr_to_nv(addr[i]), (stm_word_t)i);
     start = rdtsc();
-    for (j = 0; j < store_nb; j++)
-      stm_store(&global_ctr[j], (stm_word_t)0);
-    m_w[i] = rdtsc() - start;
-    stm_inc_clock();
     stm_commit();
+    m_c[i] = rdtsc() - start;
   }
-  
-  for (i = 0; i < MEASURE_NB; i++) {
+  for (i = 0; i < SAMPLES; i++) {
     sigjmp_buf *_e = stm_start(_a);
-    sigsetjmp(*_e, 0); 
-    for (j = 0; j < load_nb; j++)
-      stm_load(&global_ctr[j]);
-    for (j = 0; j < store_nb; j++)
-      stm_store(&global_ctr[j], (stm_word_t)0);
-    stm_inc_clock();
-    start = rdtsc();
+    sigsetjmp(*_e, 0);
+    stm_free(addr[i], size, pool);
     stm_commit();
-    m_c[i] = rdtsc() - start;
   }
- 
-  remove_cst_cost(m_s, MEASURE_NB, m_rdtsc);
-  remove_cst_cost(m_r, MEASURE_NB, m_rdtsc);
-  remove_cst_cost(m_w, MEASURE_NB, m_rdtsc);
-  remove_cst_cost(m_c, MEASURE_NB, m_rdtsc);
-
-  printf("RW transaction - %lu load - %lu store\n", (unsigned long)load_nb, (unsigned long)store_nb);
-
-  printf("%12s %12s %12s %12s\n", "", "min", "avg", "med");
-  stats(m_s, MEASURE_NB, &min, &avg, &med); 
-  printf("%12s %12lu %12.2f %12lu\n", "start", (unsigned long)min, avg, (unsigned long)med);
-  stats(m_r, MEASURE_NB, &min, &avg, &med); 
-  if (load_nb)
-    printf("%12s %12lu %12.2f %12lu\n", "load", (unsigned long)min/load_nb, avg/load_nb, (unsigned long)med/load_nb);
-  stats(m_w, MEASURE_NB, &min, &avg, &med); 
-  if (store_nb)
-    printf("%12s %12lu %12.2f %12lu\n", "store", (unsigned long)min/store_nb, avg/store_nb, (unsigned long)med/store_nb);
-  stats(m_c, MEASURE_NB, &min, &avg, &med); 
-  printf("%12s %12lu %12.2f %12lu\n", "commit", (unsigned long)min, avg, (unsigned long)med);
-}
 
-/* TODO
- *  Add clock perturbation to avoid fast commit
- *  Add write after write / load after write measurements
- *  Add stm_malloc/stm_free measurements
- */
+  snprintf(name, sizeof(name), "Allocation - %lu bytes", (unsigned long)size);
+  print_header(name);
+  print_stats("stm_malloc", m_m, SAMPLES, 1);
+  print_stats("commit + publish", m_c, SAMPLES, 1);
+}
 
 int main(int argc, char **argv)
 {
+  PMEMoid oid;
+
+  /* Each run starts from an empty pool */
+  unlink(POOL_FILE);
+  stm_pool = stm_pool_open(POOL_FILE);
+  pool = stm_pool_pmem(stm_pool);
+  if (pmemobj_alloc(pool, &oid, (WORDS * sizeof(stm_word_t) + PAGE_SIZE) + (PAGES + 1) * PAGE_SIZE, 0, NULL, NULL) != 0) {
+    perror("pmemobj_alloc");
+    exit(1);
+  }
+  words = (oid.off + PAGE_SIZE - 1) & ~(nv_ptr)(PAGE_SIZE - 1);
+  pages = (words + WORDS * sizeof(stm_word_t) + PAGE_SIZE - 1) & ~(nv_ptr)(PAGE_SIZE - 1);
+
   /* Init STM */
   stm_init();
   mod_mem_init(0);
+  page_map_init();
   /* Create transaction */
   stm_init_thread();
 
   /* Testing */
-  test1load(1);
-  test1load(0);
-  testnload(1, 100);
-  testnload(0, 100);
-  testnloadnstore(100, 20);
-  testnloadnstore(100, 20);
+  testnloadnstore(1, 1, 0);
+  testnloadnstore(0, 1, 0);
+  testnloadnstore(1, 100, 0);
+  testnloadnstore(0, 100, 0);
+  testnloadnstore(0, 100, 20);
+  testptr();
+  testpage();
+  testlog(1);
+  testlog(8);
+  testlog(64);
+  testlog(512);
+  testmalloc(64);
+  testmalloc(4096);
 
   /* Free transaction */
   stm_exit_thread();
   /* Cleanup STM */
   stm_exit();
+  unlink(POOL_FILE);
   return 0;
 }
@@ -0,0 +1,64 @@
+import argparse
+import collections
+
+# Splits the commits of a TRACE=yes dump ("thread ns point arg" lines) into
+# phases, each phase ending at a tracepoint, and compares the time of each
+# phase in all commits with the time in the slowest ones.
+
+
+def commits(path):
+    # events of a thread are in order, a commit runs from commit_start to commit_end
+    threads = collections.defaultdict(list)
+    with open(path) as f:
+        for line in f:
+            thread, ns, point, arg = line.split()
+            threads[thread].append((int(ns), point))
+    for events in threads.values():
+        current = None
+        for ns, point in events:
+            if point == 'commit_start':
+                current = [(ns, point)]
+            elif current is not None:
+                current.append((ns, point))
+                if point == 'commit_end':
+                    yield current
+                    current = None
+
+
+def phases(commit):
+    total = collections.Counter()
+    for (prev, _), (ns, point) in zip(commit, commit[1:]):
+        total[point] += ns - prev
+    return total
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Commit latency breakdown of a trace dump')
+    parser.add_argument('path', nargs='?', default='./trace.txt')
+    parser.add_argument('-p', '--percentile', type=float, default=99, help='slow commits are above it')
+    args = parser.parse_args()
+
+    rows = [(c[-1][0] - c[0][0], phases(c)) for c in commits(args.path)]
+    if not rows:
+        print('no complete commit')
+        return
+    rows.sort(key=lambda r: r[0])
+    cut = rows[min(len(rows) - 1, int(len(rows) * args.percentile / 100))][0]
+    slow = [r for r in rows if r[0] >= cut]
+    print('%d commits, p50 %d ns, p%g %d ns, max %d ns' % (len(rows), rows[len(rows) // 2][0],
+                                                          args.percentile, cut, rows[-1][0]))
+
+    names = []
+    for _, p in rows:
+        names += [n for n in p if n not in names]
+    print('%-18s %12s %12s %8s' % ('phase (ending at)', 'all ns', 'slow ns', 'slow %'))
+    slow_total = sum(r[0] for r in slow)
+    for n in names:
+        mean_all = sum(p[n] for _, p in rows) / len(rows)
+        mean_slow = sum(p[n] for _, p in slow) / len(slow)
+        share = 100.0 * sum(p[n] for _, p in slow) / slow_total if slow_total else 0
+        print('%-18s %12.0f %12.0f %8.1f' % (n, mean_all, mean_slow, share))
+
+
+if __name__ == '__main__':
+    main()